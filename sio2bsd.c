@@ -1,10 +1,65 @@
 # define VERSION "1"
-# define REVISION "19"
+# define REVISION "20"
 
 /* SIO2BSD, (c) 2005-2012 KMK <drac030@krap.pl>
  *
  * CHANGES:
  *
+ * rev. 20:
+ * - binary SIO trace capture (-w fname) and the siotrace tool to dump
+ *   and replay traces
+ * - Prometheus metrics on a UNIX socket (-M path)
+ * - HS index calibration (-k) and per-port speed profile (-K fname)
+ * - framing errors and BREAKs are marked (PARMRK) and switch the speed
+ *   on the first bad frame
+ * - real-time mode: SCHED_FIFO (-r prio), mlockall, CPU pinning (-a cpu)
+ * - several serial ports in one process, a thread per port (-s ... -s);
+ *   the instance lock is per serial port now
+ * - disk and file I/O on a storage thread per port, the Atari gets an
+ *   error instead of a stall when the disk is too slow
+ * - an image mounted on several drives or ports is opened once and
+ *   cached in memory, within a budget (-C kbytes)
+ * - control socket (-S path) and the sio2ctl tool: mount, unmount, swap,
+ *   write protection and drive stats while running
+ * - printer spooler: a writer thread per port, table-driven ATASCII
+ *   translation, -p |command, one file or command run per job (-j secs)
+ * - commands are dispatched through device classes with a table per
+ *   class, PCLink functions through a table by fno
+ * - per-drive profiles (-e 1050/usdoubler/xf551/happy); XF551 high speed
+ *   commands (bit 7 set) are answered at 38400 bits/sec.
+ * - burst read of up to 32 sectors for one command frame (-x)
+ * - an Atari executable given as a drive boots through a loader disk
+ *   made up for it, which reads at the HSINDEX with its own SIO routine
+ * - overlay mode (-o): the images are only read, the writes are kept in
+ *   memory until SIGUSR1 or sio2ctl reset drops them
+ * - format and mkatr leave the sectors as a hole in the file, which is
+ *   instant at any size; the format delay is optional now (-F)
+ * - the holes of an image are mapped: they read without I/O, writes of
+ *   zeros punch them out again, and mkatr -z compacts an old image
+ * - gzipped images (.atr.gz) are mounted as they are, through a seek
+ *   index; the writes are deflated back into the file at unmount
+ * - ATX images of protected originals: sector reads are timed by a model
+ *   of the spinning disk, with duplicate, missing, bad and weak sectors
+ * - XFD images are served and written as they are, PRO images through
+ *   the ATX engine; DCM archives are expanded at mount, and the changes
+ *   go to fname.atr
+ * - image catalogue (-L): a directory tree of images is listed on $70
+ *   for a menu program, which mounts the titles on demand; the images
+ *   taken out stay open and cached for a while
+ * - the cached images can share their equal data in a store of chunks
+ *   (-D), found by hash and replaced, not changed, by the writes
+ * - RAM disks (ram:720x256), served from memory on the port thread,
+ *   optionally loaded from a file and saved back to it
+ * - write journal (-J, -g): the sectors go to fname.jnl with a CRC and
+ *   into the image after one sync for the group, and are written again
+ *   at the next mount after a crash
+ * - the sectors written are tracked; SIGUSR2 or sio2ctl delta writes
+ *   the changed ones to a delta file, sio2ctl merge writes them back;
+ *   -H keeps a digest of the image in the ATR header, updated per write
+ *   in memory and written to the header at unmount or with a delta
+ * - fixed com_write() resending from the start of the buffer after a
+ *   short write
+ *
  * rev. 19:
  * - added an option for additional delay to support communication via 
  *   Bluetooth
@@ -106,30 +161,51 @@
  * - file locking to prevent opening the same disk image twice
  */
 
+# ifdef __linux__
+#  define _GNU_SOURCE		/* posix_openpt(), SEEK_HOLE, fallocate() */
+# endif
+
 # include <math.h>		/* lround */
+# include <stdint.h>
 # include <stdio.h>
 # include <ctype.h>		/* toupper */
 # include <errno.h>
 # include <fcntl.h>
 # include <poll.h>
+# include <pthread.h>
 # include <signal.h>
+# include <stdarg.h>
 # include <stdlib.h>
 # include <string.h>		/* strcmp */
+# include <strings.h>		/* strcasecmp */
 # include <termios.h>
 # include <time.h>
 # include <unistd.h>
 # include <dirent.h>
 
+# include <sched.h>		/* sched_setscheduler */
+
 # include <sys/ioctl.h>
+# include <sys/mman.h>		/* mlockall */
 # include <sys/resource.h>	/* setpriority */
+# include <sys/socket.h>
 # include <sys/stat.h>
 # include <sys/time.h>
 # include <sys/types.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+
+# include <zlib.h>
 
 # ifdef __linux__
 # include <linux/serial.h>
 # endif
 
+# ifndef NOT_FBSD
+# include <sys/param.h>
+# include <sys/cpuset.h>
+# endif
+
 # define SIOTRACE
 
 # include "sio2bsd.h"
@@ -143,17 +219,21 @@
 # define POKEY_AVG_HZ ((POKEY_NTSC_HZ+POKEY_PAL_HZ)/2)
 # define POKEY_CONST 7.1861
 
-static DEVICE device[8][16];	/* 8 devices, 16 units each */
+/* Variables declared __thread belong to one serial port: each port
+ * is served by a thread of its own, see port_main(). The big ones only
+ * point to the port's memory, see port_mem().
+ */
+static __thread DEVICE (*device)[16];	/* 8 devices, 16 units each */
 
 # ifdef ULTRA
-static ushort turbo_on = 0;
-static ushort turbo_ix = ULTRA;	/* SIO speed multiplier (baudrate=ULTRAx19200) */
-static ushort hs_ix = HSIDX;	/* HS_INDEX */
+static __thread ushort turbo_on = 0;
+static __thread ushort turbo_ix = ULTRA;	/* SIO speed multiplier (baudrate=ULTRAx19200) */
+static __thread ushort hs_ix = HSIDX;	/* HS_INDEX */
 static ushort bt_delay = 1;
 static double pokey_hz = POKEY_AVG_HZ;	/* POKEY quartz frequency (PAL/NTSC average by default) */
 static double pokey_const = POKEY_CONST;  /* POKEY nonlinearity constant */
 # endif
-static SIOSPEED siospeed[8];
+static __thread SIOSPEED siospeed[8];
 
 static uchar percom_ed[8] = { 0x28, 0x03, 0x00, 0x1a, 0x00, 0x04, 0x00, 0x80 };
 static uchar percom_qd[8] = { 0x28, 0x03, 0x00, 0x12, 0x01, 0x04, 0x01, 0x00 };
@@ -163,10 +243,8 @@ static uchar percom_hd32[8] = { 0x01, 0x03, 0xff, 0xfe, 0x00, 0x04, 0x02, 0x00 }
 static const char *pcs[] = { "B7", "B6", "B5", "B4", "LARGE", "MFM", "8INCH", "RSVD" };  
 static const char *pcc[] = { "", "", "", "", "SMALL", "FM", "5.25INCH", "" };
 
-static uchar outbuf[1026];
-static uchar inpbuf[1026];
-
-static char dpath[1024];
+static __thread uchar outbuf[1026];
+static __thread uchar inpbuf[1026];
 
 # ifdef SIOTRACE
 static int log_flag = 0;		/* enable more SIO messages, if 1 */
@@ -174,17 +252,40 @@ static int log_flag = 0;		/* enable more SIO messages, if 1 */
 
 static int block_percom = 0;
 static int use_command = 0;
+static int burst_read = 0;			/* -x, serve the burst read commands */
+static int overlay_mode = 0;			/* -o, keep the writes in memory */
+
+static __thread int serial_fd = -1;
+static __thread SPOOL *spool = NULL;		/* the printer, if any */
+static long spool_idle = 0;			/* -j, seconds which end a print job */
+static __thread int trace_fd = -1;
+static int metrics_fd = -1;
+static int ctl_fd = -1;
+static char ctl_path[1024];
 
-static int serial_fd = -1;
-static int printer_fd = -1;
+static __thread METRICS *metrics;
+static char metrics_path[1024];
 
-static struct termios dflt;
+static __thread ushort line_ix = 1;		/* siospeed[] slot the port is set to */
+static __thread ulong line_errors = 0;		/* marked bytes since the last good frame */
+static __thread int line_marks = 0;		/* the driver honours PARMRK */
 
-static int pclcnt = 1;
-static int drvcnt = 1;
+static __thread struct termios dflt;
+
+static __thread int pclcnt = 1;
+static __thread int drvcnt = 1;
 
 static uid_t our_uid = 0;
 
+static PORT ports[MAX_PORTS];
+static int nports = 0;
+static int ports_live = 0;			/* the ports not ended yet */
+static int port_quit = 0;			/* the program is ending */
+static int sig_pipe[2] = { -1, -1 };		/* the signals for the main thread */
+static pthread_mutex_t quit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t quit_cond = PTHREAD_COND_INITIALIZER;
+static __thread PORT *port_self = NULL;		/* the port this thread serves */
+
 /* Helpers */
 
 static void
@@ -198,19 +299,33 @@ sio2bsd_usage(void)
 {
 	sio2bsd_itsme();
 
-	printf("\nsio2bsd [opts] [-f] drive [-f] drive ...\n");
+	printf("\nsio2bsd [opts] [-f] drive [-f] drive ... [-s port [-f] drive ...] ...\n");
 	printf("\nWhere 'opts' are:\n");
 
 	printf("-m        - use COMMAND line\n");
 # ifdef SIOTRACE	
 	printf("-l        - extended log messages\n");
 # endif
-	printf("-s fname  - serial device (\"" SERIAL "\" by default)\n");
+	printf("-s fname  - serial device (\"" SERIAL "\" by default), each next one adds a port\n");
 # ifdef ULTRA
 	printf("-b n      - set turbo to 19200*n (n<8)\n");
 # endif
 	printf("-d n      - additional delay required for Bluetooth communication\n");
-	printf("-p fname  - printer file\n");
+	printf("-p fname  - printer file, or |command to pipe the printout to\n");
+	printf("-j secs   - a print job ends after secs of silence, each to its own\n");
+	printf("            file (fname.1, fname.2, ...) or run of the command\n");
+	printf("-w fname  - write a binary SIO trace (see siotrace)\n");
+	printf("-M path   - serve Prometheus metrics on UNIX socket path\n");
+	printf("-S path   - accept sio2ctl commands on UNIX socket path\n");
+	printf("-r prio   - real-time mode: SCHED_FIFO at prio, memory locked\n");
+	printf("-a cpu    - pin to the given CPU\n");
+	printf("-C kbytes - memory for cached images (8192 by default, 0 - none)\n");
+	printf("-D        - cache the images in a store of shared chunks, keeping\n");
+	printf("            the data they have in common once\n");
+	printf("-J ms     - journal the writes to fname.jnl, commit after ms of quiet\n");
+	printf("-g n      - or once n sectors wait (16 by default, 1 - every write)\n");
+	printf("-L dir    - list the images under dir for a menu program on $70,\n");
+	printf("            mounted in a drive when picked\n");
 	printf("-t        - enable ATASCII->ASCII translation for printer\n");
 # if UPPER_DIR==0
 # ifndef __CYGWIN__
@@ -226,11 +341,26 @@ sio2bsd_usage(void)
 # endif
 # endif
 	printf("-8        - block PERCOM commands\n");
-
-	printf("\n-f drive  - first 3 sectors of new formatted DD disk have full size in ATR\n\n");
+	printf("-x        - serve the burst read commands 'B' and 'b'\n");
+	printf("-F prof   - format timing: none (default), sio2bsd, 1050, xf551, or ms per track\n");
+	printf("-o        - leave the images as they are, keep the writes in memory;\n");
+	printf("            SIGUSR1 drops them\n");
+	printf("-H        - keep a digest of each ATR image in its header (the CRC)\n");
+	printf("SIGUSR2   - write the sectors changed since the last time, of each\n");
+	printf("            drive, to fname.YYYYMMDD-hhmmss.delta\n");
+
+	printf("\n-f drive  - first 3 sectors of new formatted DD disk have full size in ATR\n");
+	printf("-e prof   - the next drive acts as the given kind of drive: usdoubler\n");
+	printf("            (default), 1050, xf551 or happy\n\n");
 	printf("and 'drive' can be one of the following:\n\n");
 
-	printf("ATR file  - the image file will be mounted for sector I/O\n");
+	printf("ATR file  - the image file will be mounted for sector I/O; it may be\n");
+	printf("            gzipped, the changes are then written back at unmount\n");
+	printf("ATX, PRO  - a copy-protected original, read-only\n");
+	printf("XFD file  - a raw image, without a header\n");
+	printf("DCM file  - a DiskComm archive; the changes go to fname.atr\n");
+	printf("ram:SxB   - a RAM disk of S sectors of B bytes (128, 256, 512);\n");
+	printf("            ram:SxB:fname loads it from fname and saves it there\n");
 	printf("directory - the directory will be mounted as PCLink drive\n");
 	printf("-         - none, this drive will remain unassinged\n\n");
 	
@@ -245,6 +375,9 @@ sio2bsd_usage(void)
 	printf("            \"ntscf\" set %.1f Hz as of FREDDY NTSC machines\n", POKEY_NTSC_FREDDY_HZ);
 	printf("            by default average PAL/NTSC frequency (%.3f Hz) is using\n", POKEY_AVG_HZ);
 	printf("-c x      - set POKEY nonlinearity constant to x (%f is being used by default)\n", POKEY_CONST);
+	printf("\n-k        - calibrate the fastest stable HSINDEX and store it in the profile\n");
+	printf("-K fname  - speed profile file (\"$HOME/.sio2bsd.profile\" by default),\n");
+	printf("            read at startup when neither -b nor -i is given\n");
 # endif
 
 }
@@ -263,18 +396,58 @@ mkatr_usage(void)
 	printf("-h heads   - number of heads (1)\n");
 	printf("-b bps     - bytes per sector (128)\n\n");
 	
-	printf("-f         - first 3 sectors of DD disk have full size in ATR\n\n");
+	printf("-f         - first 3 sectors of DD disk have full size in ATR\n");
+	printf("-z         - compact an existing image: its all-zero blocks become\n");
+	printf("             holes in the file\n\n");
 			
 	printf("fname      - the ATR image file name\n\n");
 }
 
+/* The canonical name of a directory, as chdir() and getcwd() would
+ * give, but without touching the working directory: the ports share it.
+ */
+static int
+dir_realpath(const char *path, char *out, size_t size)
+{
+	struct stat sb;
+	char *r;
+
+	r = realpath(path, NULL);
+
+	if (r == NULL)
+		return -1;
+
+	if ((strlen(r) >= size) || (stat(r, &sb) < 0) || (access(r, X_OK) < 0))
+	{
+		free(r);
+		return -1;
+	}
+
+	if (!S_ISDIR(sb.st_mode))
+	{
+		free(r);
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	strcpy(out, r);
+	free(r);
+
+	return 0;
+}
+
+/* One lock file per serial port and uid, so that several instances,
+ * or ports, never share a line.
+ */
 static int
-serlock(void)
+serlock(PORT *p)
 {
 	long r;
 	struct stat sb;
 	const char *tmpdir = "/tmp";
 	const char *vars[4] = { "TMP", "TEMP", "HOME", NULL };
+	char *c;
+	int fd;
 
 	r = stat(tmpdir, &sb);
 
@@ -292,32 +465,31 @@ serlock(void)
 		};
 	}
 
-	sprintf(dpath, "%s/sio2bsd.%ld", tmpdir, (ulong)our_uid);
-
-	(void)mkdir(dpath, S_IRUSR|S_IWUSR|S_IXUSR);
+	snprintf(p->lock, sizeof(p->lock), "%s/sio2bsd.%ld", tmpdir, (ulong)our_uid);
 
-	strcat(dpath, "/");
-	strcat(dpath, SERLOCK);
-
-	if (stat(dpath, &sb) < 0)
-	{
-		int fd;
+	(void)mkdir(p->lock, S_IRUSR|S_IWUSR|S_IXUSR);
 
-		fd = creat(dpath, S_IRUSR|S_IWUSR);
+	r = strlen(p->lock);
+	snprintf(p->lock + r, sizeof(p->lock) - r, "/" SERLOCK ".%s", p->serial);
 
-		if (fd < 0)
-		{
-			printf("Cannot create '%s', %s (%d)\n", dpath, strerror(errno), errno);
+	for (c = p->lock + r + 1; *c; c++)
+		if (*c == '/')
+			*c = '_';
 
-			return fd;
-		}
+	fd = open(p->lock, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
 
-		close(fd);
+	if (fd < 0)
+	{
+		if (errno != EEXIST)
+			printf("Cannot create '%s', %s (%d)\n", p->lock, strerror(errno), errno);
+		p->lock[0] = 0;
 
-		return 0;
+		return -1;
 	}
 
-	return -1;
+	close(fd);
+
+	return 0;
 }
 
 static void
@@ -524,7 +696,10 @@ drive_setup(ushort d, ulong size, ushort bps)
 static void
 setup_status(ushort d)
 {
-	device[3][d].status.stat &= ~0xa0;
+	device[3][d].status.stat &= ~0xa8;
+
+	if (device[3][d].wp)
+		device[3][d].status.stat |= 0x08;
 
 	/* Seems that bit 5 indicates 256-byte sector,
 	 * and not MFM density.
@@ -578,6 +753,181 @@ get_sdx_time(uchar *ob)
 	ob[0] = 0xff;
 }
 
+/* ============== SIO trace ================= */
+
+static __thread uchar *trace_buf = NULL;	/* TRACE_BUF bytes, with -w only */
+static __thread ulong trace_len = 0;
+static __thread uint64_t trace_last = 0;
+
+static uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static ulong
+put_varint(uchar *p, uint64_t v)
+{
+	ulong n = 0;
+
+	while (v >= 0x80)
+	{
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uchar)v;
+
+	return n;
+}
+
+static ulong
+get_varint(const uchar *p, ulong avail, uint64_t *v)
+{
+	ulong n = 0;
+	ushort shift = 0;
+
+	*v = 0;
+
+	while (n < avail && shift < 64)
+	{
+		*v |= (uint64_t)(p[n] & 0x7f) << shift;
+		if ((p[n++] & 0x80) == 0)
+			return n;
+		shift += 7;
+	}
+
+	return 0;	/* truncated */
+}
+
+/* The buffer is written out when full and whenever the main loop
+ * goes idle waiting for a command frame, so the serial timing never
+ * pays for the write().
+ */
+static void
+trace_flush(void)
+{
+	ulong i = 0;
+	long r;
+
+	if (trace_fd < 0)
+		return;
+
+	while (i < trace_len)
+	{
+		r = write(trace_fd, trace_buf + i, trace_len - i);
+		if (r <= 0)
+		{
+			printf("Error: trace write failed, %s (%d), tracing disabled\n", strerror(errno), errno);
+			close(trace_fd);
+			trace_fd = -1;
+			break;
+		}
+		i += r;
+	}
+
+	trace_len = 0;
+}
+
+static void
+trace_record(uchar type, const uchar *buf, ulong len)
+{
+	uint64_t now;
+
+	if (trace_fd < 0)
+		return;
+
+	now = mono_ns();
+
+	if ((trace_len + len + 21) > TRACE_BUF)
+		trace_flush();
+
+	if ((trace_fd < 0) || ((len + 21) > TRACE_BUF))
+		return;
+
+	trace_buf[trace_len++] = type;
+	trace_len += put_varint(trace_buf + trace_len, now - trace_last);
+	trace_len += put_varint(trace_buf + trace_len, len);
+	memcpy(trace_buf + trace_len, buf, len);
+	trace_len += len;
+
+	trace_last = now;
+}
+
+static void
+trace_line(int state)
+{
+	uchar b[4];
+
+	b[0] = state & 0xff;
+	b[1] = (state >> 8) & 0xff;
+	b[2] = (state >> 16) & 0xff;
+	b[3] = (state >> 24) & 0xff;
+
+	trace_record(TRACE_LINE, b, sizeof(b));
+}
+
+static void
+trace_speed(ulong baud, ushort idx)
+{
+	uchar b[6];
+
+	b[0] = baud & 0xff;
+	b[1] = (baud >> 8) & 0xff;
+	b[2] = (baud >> 16) & 0xff;
+	b[3] = (baud >> 24) & 0xff;
+	b[4] = idx & 0xff;
+	b[5] = (idx >> 8) & 0xff;
+
+	trace_record(TRACE_SPEED, b, sizeof(b));
+}
+
+static int
+trace_open(const char *fname)
+{
+	uchar hdr[TRACE_HDRSIZE];
+	time_t now = time(NULL);
+	int i;
+
+	if ((trace_buf == NULL) && ((trace_buf = malloc(TRACE_BUF)) == NULL))
+	{
+		printf("Cannot allocate the trace buffer\n");
+		return -1;
+	}
+
+	trace_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+
+	if (trace_fd < 0)
+	{
+		printf("Cannot create trace '%s', %s (%d)\n", fname, strerror(errno), errno);
+		return -1;
+	}
+
+	bzero(hdr, sizeof(hdr));
+	memcpy(hdr, TRACE_MAGIC, 8);
+	hdr[8] = TRACE_VERSION;
+
+	for (i = 0; i < 4; i++)
+		hdr[12 + i] = ((ulong)now >> (i * 8)) & 0xff;
+
+	if (write(trace_fd, hdr, sizeof(hdr)) != sizeof(hdr))
+	{
+		printf("Cannot write trace '%s', %s (%d)\n", fname, strerror(errno), errno);
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+
+	trace_last = mono_ns();
+
+	printf("SIO trace: %s\n", fname);
+
+	return 0;
+}
+
 /* ============== SIO low level ================= */
 
 static void
@@ -596,6 +946,8 @@ wait_for_command_drop(void)
 		}
 		while (c_state == n_state);
 
+		trace_line(n_state);
+
 		c_mask = c_state ^ n_state;
 
 		if (log_flag)
@@ -685,43 +1037,105 @@ calc_checksum(uchar *buf, int how_much)
 #  define COM_DATA 1
 
 # ifdef COMMAND_LINE
-static int comstate = 0;
-static int cmd_mask = 0;
-static int cmd_line_valid = -1;
+static __thread int comstate = 0;
+static __thread int cmd_mask = 0;
+static __thread int cmd_line_valid = -1;
 # endif
 
-static void
+/* Read one byte. The port runs with PARMRK, so the driver passes a byte
+ * received with a framing or parity error as $FF $00 byte, a BREAK as
+ * $FF $00 $00, and a real $FF as $FF $FF. A marked byte is dropped, but
+ * counted for the speed it came at: it means that the Atari talks at
+ * another speed. Returns 1 if a byte was stored, 0 if it was dropped.
+ */
+static int
+com_getc(uchar *c)
+{
+	uchar m;
+	int r;
+
+	r = read(serial_fd, c, 1);
+
+	if (line_marks && (r == 1) && (*c == 0xff))
+	{
+		r = read(serial_fd, &m, 1);
+
+		if ((r == 1) && (m == 0x00))
+		{
+			r = read(serial_fd, &m, 1);
+
+			if (r == 1)
+			{
+				if (m == 0x00)
+					metrics->line_break[siospeed[line_ix].idx & 0xff]++;
+				else
+					metrics->line_ferr[siospeed[line_ix].idx & 0xff]++;
+				line_errors++;
+
+				return 0;
+			}
+		}
+	}
+
+	if (r < 0)
+	{
+		printf("FATAL: %s(): %s (%d)\n", __extension__ __FUNCTION__, strerror(errno), errno);
+		port_exit();
+	}
+
+	if (r == 0)
+		return 0;
+
+	trace_record(TRACE_IN, c, 1);
+	metrics->bytes_in++;
+
+	return 1;
+}
+
+/* Returns -1 when a command frame was cut short by a marked byte */
+static int
 com_read(uchar *buf, int size, const ushort type)
 {
 	int r, i = 0;
 # ifndef COMMAND_LINE
-	(void)type;
+	if (type == COM_COMD)
+	{
+		trace_flush();
+		ctl_wait(-1);
+	}
 # else
 	int cmd_state = 0;
 
+	if (type == COM_COMD)
+	{
+		trace_flush();
+		if (cmd_line_valid <= 0)
+			ctl_wait(-1);
+	}
+
 	if ((type == COM_COMD) && (cmd_line_valid > 0))
 	{
 		int new_state;
 
 		do
 		{
+			ctl_wait(0);
 			(void)ioctl(serial_fd, TIOCMGET, &new_state);
 			cmd_state = new_state & cmd_mask;
 		} while (cmd_state == 0);
 
+		trace_line(new_state);
+
 		while (size)
 		{
-			r = read(serial_fd, buf+i, 1);
-			if (r < 0)
-			{
-				printf("FATAL: %s(): %s (%d)\n", __extension__ __FUNCTION__, strerror(errno), errno);
-				sig(0);
-			}
+			r = com_getc(buf+i);
+			if ((r == 0) && line_errors)
+				return -1;
 			i += r;
 			size -= r;
 		}
 
-		return;
+		return 0;
 	}
 	else
 	{
@@ -729,18 +1143,15 @@ com_read(uchar *buf, int size, const ushort type)
 # endif
 		while (size)
 		{
-			r = read(serial_fd, buf+i, 1);
-			if (r < 0)
-			{
-				printf("FATAL: %s(): %s (%d)\n", __extension__ __FUNCTION__, strerror(errno), errno);
-				sig(0);
-			}
+			r = com_getc(buf+i);
+			if ((r == 0) && line_errors && (type == COM_COMD))
+				return -1;
 # ifdef COMMAND_LINE
 			if ((type == COM_COMD) && (cmd_line_valid < 0))
 				if (ioctl(serial_fd, TIOCMGET, &n_state) >= 0)
 					cmd_state |= n_state;
 # endif
-			if ((type == COM_COMD) && (i == 0) && (buf[i] == 0xff))		/* ignore $FF the OS sends at reset time */
+			if ((type == COM_COMD) && (i == 0) && (r == 1) && (buf[i] == 0xff))		/* ignore $FF the OS sends at reset time */
 				continue;
 
 			i += r;
@@ -822,6 +1233,8 @@ com_read(uchar *buf, int size, const ushort type)
 		}
 	}
 # endif
+
+	return 0;
 }
 
 static void
@@ -831,12 +1244,14 @@ com_write(uchar *buf, int size)
 
 	while (size)
 	{
-		r = write(serial_fd, buf, size);
+		r = write(serial_fd, buf+i, size);
 		if (r < 0)
 		{
 			printf("FATAL: %s(): %s (%d)\n", __extension__ __FUNCTION__, strerror(errno), errno);
-			sig(0);
+			port_exit();
 		}
+		trace_record(TRACE_OUT, buf+i, r);
+		metrics->bytes_out += r;
 		i += r;
 		size -= r;
 	}
@@ -909,6 +1324,7 @@ sio_setspeed(struct termios *com, ushort ix)
 			cfsetospeed(com, siospeed[3].speed);
 			if (log_flag)
 				printf("Can\'t set %d bits/sec - fallback to default %d bits/sec.\n", siospeed[ix].baud, siospeed[3].baud);
+			ix = 3;
 		}
 		else
 		{
@@ -927,13 +1343,20 @@ sio_setspeed(struct termios *com, ushort ix)
 	cfsetospeed(com, siospeed[ix].speed);
 # endif
 	(void)tcsetattr(serial_fd, TCSANOW, com);
+
+	line_ix = ix;
+	metrics->line_idx = siospeed[ix].idx;
+	trace_speed(siospeed[ix].baud, siospeed[ix].idx);
 }
 
 # ifdef ULTRA
 static void
 turbo(struct termios *com, const ushort enable)
 {
+	if (turbo_on != enable)
+		metrics->turbo_toggles++;
 	turbo_on = enable;
+	metrics->turbo = enable;
 	sio_setspeed(com, enable ? turbo_ix : 1);
 # ifdef SIOTRACE
 	if (log_flag)
@@ -951,2966 +1374,10552 @@ sio_send_data_byte(ushort devno, ushort d, uchar what)
 
 	com_write(outbuf, 2);
 }
-# endif /* ULTRA */
 
-/* ================ ATR file ================= */
-static void
-atr_close(ushort d)
+/* ============== HS index calibration ================= */
+
+# define CAL_FRAMES	200	/* turbo command frames to pass a candidate */
+# define CAL_ERRORS	3	/* errors in either direction to fail it */
+# define CAL_RETRY_NS	200000000ULL	/* a repeated read within this is a retry */
+
+/* Candidate HS indices, slowest first */
+static const uchar cal_idx[] = { 0x10, 0x0a, 0x08, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x00 };
+
+static __thread struct
 {
-	if (device[3][d].fd > -1)
-		close(device[3][d].fd);
+	int on;			/* calibration running */
+	ushort cand;		/* current candidate, index into cal_idx[] */
+	int best;		/* fastest stable HS index so far, -1 if none */
+	ulong frames;		/* good turbo frames at the candidate */
+	ulong err_in;		/* Atari -> PC: bad command and data frames */
+	ulong err_out;		/* PC -> Atari: reads retried by the Atari */
+	ulong pending;		/* desyncs at turbo, counted if turbo holds */
+	ulong cksum_seen;	/* metrics->cksum_err total at the last frame */
+	uchar last[4];		/* the last command frame */
+	uint64_t last_t;
+	int last_turbo;
+	char serial[128];
+} cal;
+
+static char profile_path[1024];	/* the speed profile, shared by all ports */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	device_reset(3, d);
+static ulong
+cal_cksum_total(void)
+{
+	ulong t = 0;
+	int x;
+
+	for (x = 0; x < CK_MAX; x++)
+		t += metrics->cksum_err[x];
+
+	return t;
 }
 
-/* Open the silly ATR file */
-static int
-atr_create(ushort d, const char *fname)
+static void
+set_custom_speed(ushort idx)
 {
-	int fd;
-
-	fd = creat(fname, S_IRUSR|S_IWUSR);
+	hs_ix = idx;
+	siospeed[0].idx = idx;
+	siospeed[0].speed = siospeed[0].baud = make_baudrate(idx);
+}
 
-	if (fd < 0)
-		return fd;
+/* The profile holds one line per serial device: the device name as
+ * given with -s, the HS index and the bitrate it gives (for humans).
+ */
+static int
+profile_load(const char *fname, const char *serial)
+{
+	FILE *pf;
+	char line[1280], name[1024];
+	int idx, r = -1;
+	ulong baud;
 
-	close(fd);
+	pf = fopen(fname, "r");
 
-	fd = open(fname, O_RDWR|O_EXCL);
+	if (pf == NULL)
+		return -1;
 
-	if (fd < 0)
-		return fd;
+	while (fgets(line, sizeof(line), pf))
+	{
+		if (sscanf(line, "%1023s %d %lu", name, &idx, &baud) < 2)
+			continue;
+		if (strcmp(name, serial) == 0)
+			r = idx;
+	}
 
-	device[3][d].fd = fd;
-	device[3][d].atr.sig = SSWAP(0x0296);
+	fclose(pf);
 
-	return fd;
+	return r;
 }
 
-static int
-atr_open(char *fname, int full13force)
+static void
+profile_save(const char *fname, const char *serial, ushort idx, ulong baud)
 {
-	int fd, r;
-	ushort d = drvcnt;
-	ulong size;
-	long sl;
-	ATR atr;
-	struct stat sb;
+	FILE *pf, *nf;
+	char line[1280], name[1024], tmp[1040];
 
-	bzero(&atr, sizeof(ATR));
+	snprintf(tmp, sizeof(tmp), "%s.new", fname);
 
-	atr_close(d);
+	pthread_mutex_lock(&profile_lock);
 
-	sl = strlen(fname);
+	nf = fopen(tmp, "w");
 
-	if (fname[sl - 1] == '/')
-		fname[sl - 1] = 0;
+	if (nf == NULL)
+	{
+		printf("Calibration: cannot write '%s', %s (%d)\n", tmp, strerror(errno), errno);
+		pthread_mutex_unlock(&profile_lock);
+		return;
+	}
 
-	if ((r = stat(fname, &sb)) < 0)
+	pf = fopen(fname, "r");
+
+	if (pf)
 	{
-		printf("Error: %s() cannot stat() '%s', %s (%d)\n", __extension__ __FUNCTION__, fname, strerror(errno), errno);
-		return -1;
+		while (fgets(line, sizeof(line), pf))
+		{
+			if ((sscanf(line, "%1023s", name) == 1) && (strcmp(name, serial) == 0))
+				continue;
+			fputs(line, nf);
+		}
+		fclose(pf);
 	}
 
-	if ((sb.st_mode & S_IFMT) == S_IFREG)
+	fprintf(nf, "%s %d %lu\n", serial, idx, baud);
+
+	if ((fclose(nf) != 0) || (rename(tmp, fname) < 0))
 	{
-		if (drvcnt > 15)
-			return -1;
+		printf("Calibration: cannot write '%s', %s (%d)\n", fname, strerror(errno), errno);
+		(void)unlink(tmp);
+		pthread_mutex_unlock(&profile_lock);
+		return;
+	}
 
-		if ((fd = open(fname, O_RDWR)) < 0 &&
-			( (errno != EACCES && errno != EROFS) ||
-			  (fd = open(fname, O_RDONLY)) < 0 ) )
-			return -1;
+	pthread_mutex_unlock(&profile_lock);
 
-# if 0
-		if (flock(fd, LOCK_EX|LOCK_NB) < 0)
-			goto error;
-# endif
+	printf("Calibration: HSINDEX=%d (%lu bits/sec.) stored for %s in %s\n", idx, baud, serial, fname);
+}
 
-		device[3][d].fd = fd;
-		device[3][d].full13force = full13force;
-		if (log_flag)
-			printf("Disk %ld will be forced to %s after format\n", (long)d, full13force? "FULL13": "NORMAL");
+/* Offer the next candidate: answer '?' with it from now on, and drop
+ * to the standard speed, so that the Atari fails at the old index and
+ * asks again.
+ */
+static void
+cal_set(struct termios *com, ushort cand)
+{
+	cal.cand = cand;
+	cal.frames = cal.err_in = cal.err_out = cal.pending = 0;
 
-		if ((read(fd, &atr, sizeof(ATR)) < (int)sizeof(ATR)) || (atr.sig != SSWAP(0x0296)))
-			goto error;
+	turbo_ix = 0;
+	set_custom_speed(cal_idx[cand]);
 
-		if ((atr.bps != SSWAP(0x0080)) && \
-			(atr.bps != SSWAP(0x0100)) && \
-				(atr.bps != SSWAP(0x0200)) && \
-					(atr.bps != SSWAP(0x0400)))
-		{
-			goto error;
-		}
+	printf("Calibration: trying HSINDEX=%d (%d bits/sec.)\n", siospeed[0].idx, siospeed[0].baud);
 
-		device[3][d].atr.sig = SSWAP(atr.sig);
-		device[3][d].atr.wpars = SSWAP(atr.wpars);
-		device[3][d].atr.bps = SSWAP(atr.bps);
-		device[3][d].atr.hipars = atr.hipars;
-		device[3][d].atr.crc = LSWAP(atr.crc);
-		device[3][d].atr.costam = LSWAP(atr.costam);
-		device[3][d].atr.prot = atr.prot;
+	if (turbo_on)
+		turbo(com, 0);
+}
 
-		size = device[3][d].atr.wpars + (device[3][d].atr.hipars * 65536);
-		size *= 16;
+static void
+cal_finish(struct termios *com)
+{
+	cal.on = 0;
 
-		if (drive_setup(d, size, device[3][d].atr.bps) < 0)
-			goto error;
+	if (cal.best < 0)
+	{
+		printf("Calibration: no stable turbo speed, staying at 19200\n");
+		turbo_ix = 1;
+		if (turbo_on)
+			turbo(com, 0);
+		if (profile_path[0])
+			profile_save(profile_path, cal.serial, siospeed[1].idx, siospeed[1].baud);
+		return;
+	}
 
-		printf("D%d: %ld sectors, %ld bytes total, mounted on %s\n", d, device[3][d].maxsec, size, fname);
+	if (siospeed[0].idx != cal.best)
+	{
+		set_custom_speed(cal.best);
+		if (turbo_on)
+			turbo(com, 0);
+	}
 
-		report_percom(d);
+	printf("Calibration: done, HSINDEX=%d (%d bits/sec.)\n", siospeed[0].idx, siospeed[0].baud);
 
-		setup_status(d);
+	if (profile_path[0])
+		profile_save(profile_path, cal.serial, siospeed[0].idx, siospeed[0].baud);
+}
 
-		drvcnt++;
-	}
-	else
+/* A command frame was rejected; it only counts against the candidate
+ * if the next good frame comes at turbo speed too, otherwise the Atari
+ * simply changed speed (e.g. reset).
+ */
+static void
+cal_desync(void)
+{
+	if (cal.on && turbo_on)
+		cal.pending++;
+}
+
+/* Account a good command frame, before it's executed */
+static void
+cal_frame(uchar *cmd)
+{
+	ulong ck = cal_cksum_total();
+	uint64_t now = mono_ns();
+
+	if (cal.on == 0)
+		return;
+
+	if (turbo_on)
+		cal.err_in += cal.pending;
+	cal.pending = 0;
+
+	/* data frames of the previous command */
+	if (cal.last_turbo)
+		cal.err_in += ck - cal.cksum_seen;
+	cal.cksum_seen = ck;
+
+	/* the Atari repeats a read at once when the data it got was bad;
+	 * DOS polls the status twice and reads the VTOC again on its own,
+	 * so only a sector read which follows itself right away counts
+	 */
+	if (turbo_on && cal.last_turbo && (memcmp(cmd, cal.last, 4) == 0) && \
+		((now - cal.last_t) < CAL_RETRY_NS) && (cmd[1] == 'R'))
 	{
-		char newpath[1024];
+		cal.err_out++;
+	}
 
-		if ((sb.st_mode & S_IFMT) == S_IFDIR)
-		{
-			char oldpath[1024];
+	if (turbo_on)
+		cal.frames++;
 
-			if (pclcnt > 15)
-				return -1;
+	memcpy(cal.last, cmd, 4);
+	cal.last_t = now;
+	cal.last_turbo = turbo_on;
+}
 
-			(void)getcwd(oldpath, sizeof(oldpath));
-			if (chdir(fname) < 0)
-				return -1;
-			(void)getcwd(newpath, sizeof(newpath));
-			(void)chdir(oldpath);
+/* Decide about the candidate, after the command was served */
+static void
+cal_step(struct termios *com)
+{
+	if (cal.on == 0)
+		return;
 
-# if 0
-			sl = strlen(newpath);
+	if ((cal.err_in >= CAL_ERRORS) || (cal.err_out >= CAL_ERRORS))
+	{
+		printf("Calibration: HSINDEX=%d unstable after %lu frames, errors in %lu, out %lu\n", \
+			siospeed[0].idx, cal.frames, cal.err_in, cal.err_out);
+		cal_finish(com);
+		return;
+	}
 
-			if (sl && (newpath[sl-1] != '/'))
-				strcat(newpath, "/");
-# endif
+	if (cal.frames >= CAL_FRAMES)
+	{
+		printf("Calibration: HSINDEX=%d stable, %lu frames, errors in %lu, out %lu\n", \
+			siospeed[0].idx, cal.frames, cal.err_in, cal.err_out);
 
-			strcpy(device[6][pclcnt].dirname, newpath);
-			device[6][pclcnt].on = 1;
-		}
-		else
-			return -1;
+		cal.best = siospeed[0].idx;
 
-		printf("PCL%d: mounted on %s\n", pclcnt, newpath);
-		pclcnt++;
+		if ((ulong)(cal.cand + 1) < sizeof(cal_idx))
+			cal_set(com, cal.cand + 1);
+		else
+			cal_finish(com);
 	}
+}
+# endif /* ULTRA */
 
-	return 0;
+/* ============== Compressed images ================= */
 
-error:	atr_close(d);
+/* A gzipped image is read where it is. At mount the stream is inflated
+ * once to build a seek index, as zlib's zran.c does: every GZ_SPAN bytes
+ * or so, at a deflate block boundary, the place in the file and the 32 KB
+ * window before it are kept. A read then inflates only the span holding
+ * the sector, from the access point before it, and the latest GZ_CACHE
+ * spans are kept. The writes go to an overlay, and are deflated into the
+ * file when the disk is unmounted (see atr_commit()).
+ */
 
-	printf("Error: %s is not a valid ATR file\n", fname);
+/* True if fd holds gzip data */
+static int
+gz_probe(int fd)
+{
+	uchar h[2];
 
-	return -1;
+	return ((pread(fd, h, 2, 0) == 2) && (h[0] == 0x1f) && (h[1] == 0x8b));
 }
 
-static int
-atr_seek(ushort i, long sector)
+static void
+gz_free(GZINDEX *gz)
 {
-	long r, off;
-	ushort bps = device[3][i].bps;
+	ulong i;
 
-	/* See the info about boot sectors in DD above.
-	 */
-	off = (sector - 1) * bps;
+	if (gz == NULL)
+		return;
 
-	if (bps == 256)
+	for (i = 0; i < gz->npts; i++)
+		free(gz->pts[i].window);
+	for (i = 0; i < GZ_CACHE; i++)
+		free(gz->span[i]);
+	free(gz->pts);
+	pthread_mutex_destroy(&gz->lock);
+	free(gz);
+}
+
+/* Add an access point. The window is a ring: the left bytes at its end
+ * are the older ones.
+ */
+static int
+gz_point(GZINDEX *gz, off_t out, off_t in, int bits, const uchar *win, ulong left)
+{
+	GZPOINT *pt;
+
+	if ((gz->npts % 64) == 0)
 	{
-		if (device[3][i].full13)
-		{
-			if (sector < 4)
-				off = (sector - 1) * 128;
-		}
-		else
-		{
-			if (sector < 4)
-				off = (sector - 1) * 128;
-			else
-				off = ((sector - 4) * bps) + 384;
-		}
+		pt = realloc(gz->pts, (gz->npts + 64) * sizeof(GZPOINT));
+		if (pt == NULL)
+			return -1;
+		gz->pts = pt;
 	}
 
-	off += 16;
-
-	r = lseek(device[3][i].fd, off, SEEK_SET);
+	pt = &gz->pts[gz->npts];
+	pt->out = out;
+	pt->in = in;
+	pt->bits = bits;
+	pt->window = NULL;
 
-	if (r != off)
+	/* at the start there is nothing to refer back to */
+	if (out)
 	{
-		printf("Error: lseek() failed newpos = %ld, r = %ld\n", off, r);
-
-		return -1;
+		if ((pt->window = malloc(GZ_WIN)) == NULL)
+			return -1;
+		memcpy(pt->window, win + GZ_WIN - left, left);
+		memcpy(pt->window + left, win, GZ_WIN - left);
 	}
 
+	gz->npts++;
+
 	return 0;
 }
 
-/* Format */
-static void
-format_atr(ushort d, int no_delay)
+static GZINDEX *
+gz_index(int fd)
 {
-	int r, pars, cs, s, i;
-	ushort spt = device[3][d].percom.spt_hi * 256 + device[3][d].percom.spt_lo;
-	ushort trk = device[3][d].percom.trk, bps = device[3][d].bps;
-	uchar ck;
-	ATR atr;
+	uchar in[16384], win[GZ_WIN];
+	off_t totin = 0, totout = 0, last = 0;
+	GZINDEX *gz;
+	z_stream zs;
+	long n;
+	int r = Z_OK;
 
-	/* these should be suppressed when calling from make_atr() */
-	if (d)
+	if ((gz = calloc(1, sizeof(GZINDEX))) == NULL)
+		return NULL;
+
+	pthread_mutex_init(&gz->lock, NULL);
+
+	bzero(&zs, sizeof(zs));
+	bzero(win, sizeof(win));
+
+	if (inflateInit2(&zs, 15 + 16) != Z_OK)
 	{
-		if (device[3][d].percom.trk == 1)
-		{
-			sio_ack(3, d, 'N');
-			return;
-		}
-		sio_ack(3, d, 'A');
+		gz_free(gz);
+		return NULL;
 	}
-	
-	bzero(outbuf, sizeof(outbuf));
 
-	if (device[3][d].percom.flags & 0x08)
-		spt += (device[3][d].percom.heads * 65536);
-	else
+	zs.avail_out = 0;
+
+	do
 	{
-		if (trk == 40 || trk == 80 || trk == 77)
-			trk *= (device[3][d].percom.heads + 1);
-	}
+		if ((n = pread(fd, in, sizeof(in), totin)) <= 0)
+		{
+			r = Z_DATA_ERROR;	/* cut short */
+			break;
+		}
 
-	device[3][d].full13 = device[3][d].full13force;
+		zs.next_in = in;
+		zs.avail_in = n;
 
-	pars = !device[3][d].full13force && device[3][d].bps == 256?
-		device[3][d].maxsec * device[3][d].bps - 3 * 128:
-		device[3][d].maxsec * device[3][d].bps;
+		do
+		{
+			if (zs.avail_out == 0)
+			{
+				zs.next_out = win;
+				zs.avail_out = GZ_WIN;
+			}
 
-	pars /= 16;
+			totin += zs.avail_in;
+			totout += zs.avail_out;
+			r = inflate(&zs, Z_BLOCK);
+			totin -= zs.avail_in;
+			totout -= zs.avail_out;
 
-	device[3][d].atr.wpars = pars % 65536;
-	device[3][d].atr.bps = device[3][d].bps;
-	device[3][d].atr.hipars = pars / 65536;
-	device[3][d].atr.crc = 0;			/* XXX */
+			if ((r != Z_OK) && (r != Z_STREAM_END))
+				break;
 
-	r = lseek(device[3][d].fd, 0, SEEK_SET);
+			if (r == Z_STREAM_END)
+				break;
 
-	if (r < 0)
-		goto error;
+			/* at the end of a block header, but not of the last one */
+			if ((zs.data_type & 128) && !(zs.data_type & 64) && \
+				((totout == 0) || ((totout - last) > GZ_SPAN)))
+			{
+				if (gz_point(gz, totout, totin, zs.data_type & 7, win, zs.avail_out) < 0)
+				{
+					r = Z_MEM_ERROR;
+					break;
+				}
+				last = totout;
+			}
+		} while (zs.avail_in);
+	} while (r == Z_OK);
 
-	r = ftruncate(device[3][d].fd, 0);
-	
-	if (r < 0)
-		goto error;
+	inflateEnd(&zs);
 
-	bzero(&atr, sizeof(ATR));
+	if ((r != Z_STREAM_END) || (gz->npts == 0))
+	{
+		gz_free(gz);
+		return NULL;
+	}
 
-	atr.sig = SSWAP(device[3][d].atr.sig);
-	atr.wpars = SSWAP(device[3][d].atr.wpars);
-	atr.bps = SSWAP(device[3][d].atr.bps);
-	atr.hipars = device[3][d].atr.hipars;
-	atr.crc = LSWAP(device[3][d].atr.crc);
-	atr.costam = LSWAP(device[3][d].atr.costam);
-	atr.prot = device[3][d].atr.prot;
+	gz->size = totout;
 
-	r = write(device[3][d].fd, &atr, sizeof(ATR));
+	return gz;
+}
 
-	if (r < 0)
-		goto error;
+/* Inflate the span from point ix up to the next one */
+static uchar *
+gz_inflate(GZINDEX *gz, int fd, ulong ix)
+{
+	GZPOINT *pt = &gz->pts[ix];
+	off_t end = ((ix + 1) < gz->npts) ? gz->pts[ix + 1].out : gz->size;
+	uchar in[16384], *buf;
+	off_t pos = pt->in;
+	z_stream zs;
+	long n;
+	int r = Z_OK;
 
-	atr_seek(d, 1);
+	if ((buf = malloc(end - pt->out)) == NULL)
+		return NULL;
 
-	for (i = 0; i < trk; i++)
+	bzero(&zs, sizeof(zs));
+
+	if (inflateInit2(&zs, -15) != Z_OK)
 	{
-		for (s = 1; s <= spt; s++)
-		{
-			bps = device[3][d].bps;
+		free(buf);
+		return NULL;
+	}
 
-			if ((i == 0) && (s < 4) && (bps == 256) && !device[3][d].full13force)
-				bps = 128;
+	/* the point may be in the middle of a byte */
+	if (pt->bits)
+	{
+		if (pread(fd, in, 1, pos - 1) == 1)
+			r = inflatePrime(&zs, pt->bits, in[0] >> (8 - pt->bits));
+		else
+			r = Z_ERRNO;
+	}
 
-			/* seek taking into account the physical size of the bootsectors */ 
-			cs = (i * spt) + s;
-			r = atr_seek(d, cs);
-			if (r < 0)
-				goto fterror;
+	if ((r == Z_OK) && pt->window)
+		r = inflateSetDictionary(&zs, pt->window, GZ_WIN);
 
-			r = write(device[3][d].fd, outbuf, bps);
+	zs.next_out = buf;
+	zs.avail_out = end - pt->out;
 
-			if (r < bps)
-				goto fterror;
-		}
-		if (no_delay == 0)
+	while ((r == Z_OK) && zs.avail_out)
+	{
+		if (zs.avail_in == 0)
 		{
-			usleep(12500);			/* ;-) */
-			printf("\x7"); fflush(stdout);
+			if ((n = pread(fd, in, sizeof(in), pos)) <= 0)
+				break;
+			pos += n;
+			zs.next_in = in;
+			zs.avail_in = n;
 		}
+
+		r = inflate(&zs, Z_NO_FLUSH);
 	}
 
-	setup_status(d);
+	if (zs.avail_out)
+	{
+		free(buf);
+		buf = NULL;
+	}
 
-	outbuf[0] = 0xff;
-	outbuf[1] = 0xff;
+	inflateEnd(&zs);
 
-	ck = calc_checksum(outbuf, bps);
+	return buf;
+}
 
-	if (d)
+static long
+gz_read(GZINDEX *gz, int fd, uchar *buf, ulong len, off_t off)
+{
+	ulong lo, hi, mid, i, v, n;
+	off_t end;
+	long r = 0;
+
+	pthread_mutex_lock(&gz->lock);
+
+	while (((ulong)r < len) && (off < gz->size))
 	{
-		sio_ack(3, d, 'C');
-		com_write(outbuf, bps);
-		com_write(&ck, 1);
-	}
+		/* the last point at or before off */
+		for (lo = 0, hi = gz->npts; (hi - lo) > 1; )
+		{
+			mid = (lo + hi) / 2;
+			if (gz->pts[mid].out <= off)
+				lo = mid;
+			else
+				hi = mid;
+		}
 
-	return;
+		for (i = 0, v = 0; i < GZ_CACHE; i++)
+		{
+			if (gz->sused[i] && (gz->spix[i] == lo))
+				break;
+			if (gz->sused[i] < gz->sused[v])
+				v = i;
+		}
 
-fterror:
-	
-	if (d)
-		sio_ack(3, d, 'E');
+		if (i == GZ_CACHE)
+		{
+			i = v;
+			free(gz->span[i]);
+			gz->sused[i] = 0;
 
-	printf("SIO write error: format failed, track %d, sector %d\n", trk, s + 1);
+			if ((gz->span[i] = gz_inflate(gz, fd, lo)) == NULL)
+			{
+				errno = EIO;
+				r = -1;
+				break;
+			}
 
-	return;
+			gz->spix[i] = lo;
+		}
 
-error:
-	
-	if (d)
-		sio_ack(3, d, 'E');
+		gz->sused[i] = ++gz->clock;
 
-	printf("Error: %s() failed\n", __extension__ __FUNCTION__);
+		end = ((lo + 1) < gz->npts) ? gz->pts[lo + 1].out : gz->size;
+		n = end - off;
+		if (n > (len - r))
+			n = len - r;
+
+		memcpy(buf + r, gz->span[i] + (off - gz->pts[lo].out), n);
+		r += n;
+		off += n;
+	}
+
+	pthread_mutex_unlock(&gz->lock);
+
+	return r;
 }
 
+/* ============== ATX images ================= */
+
+/* An ATX file describes each track as the drive sees it: the sector
+ * headers in the order they pass under the head, where on the turn they
+ * are, and the FDC status reading them gives: CRC errors, missing data,
+ * sectors longer than they should be, and bytes which read differently
+ * every time. Copy protections check just that, so the image is served
+ * by a model of the spinning disk: a read steps the head to the track,
+ * waits for the first copy of the sector to come round, and answers
+ * with its data and status when a 1050 would.
+ *
+ * At mount the headers of all tracks go to one array, and a table by
+ * track and sector number points at the first copy of each sector, the
+ * copies being chained; a read looks at the copies of one sector only.
+ */
+
+# define ATX_STEP_US	20000	/* track to track, about as a 1050 */
+# define ATX_SETTLE_US	10000	/* head settle after a step */
+# define ATX_REV_US	208333	/* one turn at 288 rpm */
+# define ATX_RETRY_REVS	4	/* the turns a 1050 takes to give up */
+# define ATX_FDC_ERR	0x1c	/* lost data, CRC error, record not found */
+
+# define LE16(p)	((ulong)(p)[0] | ((ulong)(p)[1] << 8))
+# define LE32(p)	(LE16(p) | (LE16((p) + 2) << 16))
+
+/* True if fd holds an ATX image */
 static int
-make_atr(char *newname, int ch, int trk, int spt, int hds, int bps, int full13force)
+atx_probe(int fd)
 {
-	int r;
-	uchar lpc[8];
+	uchar h[4];
 
-	bzero(lpc, sizeof(lpc));
+	return ((pread(fd, h, 4, 0) == 4) && (memcmp(h, "AT8X", 4) == 0));
+}
 
-	printf("\nCreating an ATR image `%s'\n\n", newname);
+static void
+atx_free(ATXDISK *ax)
+{
+	if (ax == NULL)
+		return;
 
-	device_reset(3, 0);
-	device[3][0].full13force = full13force;
+	free(ax->sec);
+	free(ax->file);
+	free(ax);
+}
 
-	r = atr_create(0, newname);
-	if (r < 0)
-		return r;
+/* Chain the copies of each sector, the first one on the track heads it */
+static void
+atx_chain(ATXDISK *ax)
+{
+	ATXSECTOR *sp;
+	ulong i;
+	long s;
 
-	memcpy(lpc, percom_ed, 8UL);
+	for (i = 0; i < (ATX_TRACKS * ATX_SPT); i++)
+		ax->first[i] = -1;
 
-	if (ch == 1)
+	for (s = ax->nsec - 1; s >= 0; s--)
 	{
-		lpc[3] = 0x12;
-		lpc[5] = 0x00;
+		sp = &ax->sec[s];
+
+		if ((sp->track >= ATX_TRACKS) || (sp->num == 0) || (sp->num > ax->spt))
+			continue;
+
+		i = sp->track * ax->spt + sp->num - 1;
+		sp->next = ax->first[i];
+		ax->first[i] = s;
 	}
-	//else if (ch == 2)
-	//	;
-	else if (ch == 3)
-	{
-		memcpy(lpc, percom_qd, 8);
-		lpc[4] = 0x00;
-	}
-	else if (ch == 4)
-		memcpy(lpc, percom_qd, 8);
-	else if (ch == 5)
-	{
-		memcpy(lpc, percom_qd, 8);
-		lpc[0] = 80;
-	}
-	else if (ch == 6)
-	{
-		memcpy(lpc, percom_qd, 8);
-		lpc[0] = 80;
-		lpc[3] = 36;
-	}
-	else if (ch == 7)
-		memcpy(lpc, percom_hd, 8);
-	else if (ch == 8)
-		memcpy(lpc, percom_hd32, 8);
-	else if (ch == 9)
-	{
-		long flg = 0;
 
-		lpc[1] = 3;
+	ax->spin = mono_ns();
+	ax->seed = (unsigned int)ax->spin;
+}
 
-		if (spt < 65536)
-		{
-			if (hds > 0)
-				hds--;
-		}
-		else
-		{
-			hds = (spt * trk) / 65536;
-			spt -= (hds * 65536);
-			flg = 0x0c;
-		}
+/* Index the sectors of the track record at off, rsize bytes long */
+static int
+atx_track(ATXDISK *ax, ulong off, ulong rsize)
+{
+	uchar *t = ax->file + off, *c, *e;
+	ulong base = ax->nsec, cnt = 0, n, csize, pass;
+	ATXSECTOR *sp;
+	uchar trk = t[8];
 
-		if (bps > 128 || spt > 18)
-			flg |= 0x04;			
+	if ((rsize < 32) || (LE32(t + 20) > rsize))
+		return -1;
 
-		if (bps != 128)
+	/* the sector list first, then the chunks about its entries */
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (c = t + LE32(t + 20); (c + 8) <= (t + rsize); c += csize)
 		{
-			if (bps & 0x00ff || bps > 0x8000)
-			{
-				printf("Invalid BPS value %ld\n", (long)bps);
+			if ((csize = LE32(c)) == 0)
+				break;
+			if ((csize < 8) || ((c + csize) > (t + rsize)))
 				return -1;
-			}
-		}
 
-		lpc[0] = trk;
-		lpc[2] = spt / 256;
-		lpc[3] = spt % 256;
-		lpc[4] = hds;
-		lpc[5] = flg;
-		lpc[6] = bps / 256;
-		lpc[7] = bps % 256;
-	}
+			if ((pass == 0) && (c[4] == 0x01))
+			{
+				cnt = LE16(t + 10);
+				if (cnt > ((csize - 8) / 8))
+					cnt = (csize - 8) / 8;
 
-	setup_percom(0, lpc);
+				sp = realloc(ax->sec, (ax->nsec + cnt + 1) * sizeof(ATXSECTOR));
+				if (sp == NULL)
+					return -1;
+				ax->sec = sp;
 
-	format_atr(0, 1);
+				for (n = 0, e = c + 8; n < cnt; n++, e += 8)
+				{
+					sp = &ax->sec[ax->nsec++];
+					sp->track = trk;
+					sp->num = e[0];
+					sp->fdc = e[1];
+					sp->pos = LE16(e + 2) % ATX_REV;
+					sp->len = ax->bps;
+					sp->weak = ATX_STRONG;
+					sp->data = (e[1] & 0x10) ? 0 : off + LE32(e + 4);
+					sp->next = -1;
+					if ((sp->data + ax->bps) > (off + rsize))
+						sp->data = 0;
+				}
+			}
+			else if ((pass == 1) && (c[5] < cnt))
+			{
+				sp = &ax->sec[base + c[5]];
 
-	atr_close(0);
+				if (c[4] == 0x10)		/* weak bits */
+					sp->weak = LE16(c + 6);
+				else if (c[4] == 0x11)		/* long sector */
+					sp->len = 128 << (c[6] & 3);
+			}
+		}
+	}
 
 	return 0;
 }
 
+/* Read in and index the ATX image in fd */
+static ATXDISK *
+atx_load(int fd)
+{
+	ATXDISK *ax;
+	struct stat sb;
+	ulong off, rsize;
 
-/* ============= SIO COMMANDS =============== */
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < 48) || (sb.st_size > 0x400000))
+		return NULL;
 
-/* Status */
-static void
-sio_send_status(ushort devno, ushort d)
-{
-	usleep((BASIC_DELAY*1000)/((useconds_t)(POKEY_AVG_HZ/1000)));
+	if ((ax = calloc(1, sizeof(ATXDISK))) == NULL)
+		return NULL;
 
-	sio_ack(devno, d, 'A');
+	ax->size = sb.st_size;
 
-	setup_status(d);
+	if (((ax->file = malloc(ax->size)) == NULL) || \
+		(pread(fd, ax->file, ax->size, 0) != (long)ax->size))
+		goto error;
 
-	outbuf[0] = device[devno][d].status.stat;
-	outbuf[1] = device[devno][d].status.err;
-	outbuf[2] = device[devno][d].status.tmot;
-	outbuf[3] = device[devno][d].status.none;
-	outbuf[4] = calc_checksum(outbuf, 4);
+	/* density: 0 is SD, 1 ED, 2 DD */
+	ax->spt = (ax->file[18] == 1) ? 26 : 18;
+	ax->bps = (ax->file[18] == 2) ? 256 : 128;
+	ax->byte_us = ax->file[18] ? 32 : 64;
 
-	usleep((BASIC_DELAY*1000)/((useconds_t)(POKEY_AVG_HZ/1000)));
+	for (off = LE32(ax->file + 28); (off + 32) <= ax->size; off += rsize)
+	{
+		rsize = LE32(ax->file + off);
 
-	sio_ack(devno, d, 'C');
+		if ((rsize < 8) || ((off + rsize) > ax->size))
+			goto error;
 
-	usleep((BASIC_DELAY*1000)/((useconds_t)(POKEY_AVG_HZ/1000)));
+		if ((LE16(ax->file + off + 4) == 0) && (atx_track(ax, off, rsize) < 0))
+			goto error;
+	}
 
-	com_write(outbuf, 5);
-# ifdef SIOTRACE
-	if (log_flag)
-		printf("<- STATUS $%02x $%02x $%02x $%02x\n", outbuf[0], outbuf[1], outbuf[2], outbuf[3]);
-# endif
-}
+	atx_chain(ax);
 
-/* PERCOM block */
-static void
-send_percom(ushort d)
-{
-	sio_ack(3, d, 'A');
+	return ax;
 
-	outbuf[0] = device[3][d].percom.trk;
-	outbuf[1] = device[3][d].percom.step;
-	outbuf[2] = device[3][d].percom.spt_hi;
-	outbuf[3] = device[3][d].percom.spt_lo;
-	outbuf[4] = device[3][d].percom.heads;
-	outbuf[5] = device[3][d].percom.flags;
-	outbuf[6] = device[3][d].percom.bps_hi;
-	outbuf[7] = device[3][d].percom.bps_lo;
-	outbuf[8] = 0xff;
-	outbuf[9] = 0x00;
-	outbuf[10] = 0x00;
-	outbuf[11] = 0x00;
+error:
+	atx_free(ax);
 
-	outbuf[12] = calc_checksum(outbuf, 12);
+	return NULL;
+}
 
-	sio_ack(3, d, 'C');
+/* A PRO image (APE) holds the status the drive gave for every sector,
+ * and up to five phantom copies of a sector which read in turn. It has
+ * no timing, so it goes into the ATX index: the sectors spread evenly
+ * over the track, the phantoms of one sector over the rest of the turn.
+ *
+ * Header: the entry count (big endian), 'P', the version '2' or '3'.
+ * Entry: the 4-byte status frame, a spare byte, the phantom count, a
+ * spare byte, the phantom numbers (entry 720 + n), then 128 bytes.
+ */
 
-	com_write(outbuf, 13);
-# ifdef SIOTRACE
-	if (log_flag)
-		printf("<- PERCOM\n");
-# endif
+# define PRO_ENTRY	140
+
+/* True if fd holds a PRO image */
+static int
+pro_probe(int fd)
+{
+	struct stat sb;
+	uchar h[4];
+
+	return ((pread(fd, h, 4, 0) == 4) && (h[2] == 'P') && ((h[3] == '2') || (h[3] == '3')) && \
+		(fstat(fd, &sb) == 0) && (sb.st_size > 16) && (((sb.st_size - 16) % PRO_ENTRY) == 0));
 }
 
 static void
-receive_percom(ushort d)
+pro_sector(ATXDISK *ax, ulong s, ulong ent, ushort pos)
 {
-	uchar ck;
-	int r;
+	ATXSECTOR *sp = &ax->sec[ax->nsec++];
+	ulong off = 16 + (ent - 1) * PRO_ENTRY;
+
+	sp->track = (s - 1) / ax->spt;
+	sp->num = ((s - 1) % ax->spt) + 1;
+	sp->fdc = ~ax->file[off + 1];		/* the status frame has it inverted */
+	sp->pos = pos % ATX_REV;
+	sp->len = 128;
+	sp->weak = ATX_STRONG;
+	sp->data = off + 12;
+	sp->next = -1;
+}
 
-# if 0
-	if (device[3][d].percom.trk == 1)
-	{
-		sio_ack(3, d, 'N');
-		return;
-	}
-# endif
-	
-	sio_ack(3, d, 'A');
+static ATXDISK *
+pro_load(int fd)
+{
+	ATXDISK *ax;
+	struct stat sb;
+	ulong n, s, k, np, ph;
+	ushort pos;
+	uchar *e;
 
-	device[3][d].status.stat &= ~0x02;
+	if ((fstat(fd, &sb) < 0) || (sb.st_size > 0x400000))
+		return NULL;
 
-	com_read(inpbuf, 13, COM_DATA);
+	if ((ax = calloc(1, sizeof(ATXDISK))) == NULL)
+		return NULL;
 
-	ck = calc_checksum(inpbuf, 12);
+	ax->size = sb.st_size;
+	n = (ax->size - 16) / PRO_ENTRY;
 
-	if (ck != inpbuf[12])
+	if (((ax->file = malloc(ax->size)) == NULL) || \
+		(pread(fd, ax->file, ax->size, 0) != (long)ax->size) || \
+			((ax->sec = calloc(720 * 6, sizeof(ATXSECTOR))) == NULL))
 	{
-		device[3][d].status.stat |= 0x02;
-		return;
+		atx_free(ax);
+		return NULL;
 	}
 
-	if (device[3][d].percom.trk == 1)
-		r = 0;
-	else
-		r = setup_percom(d, inpbuf);
+	ax->spt = 18;
+	ax->bps = 128;
+	ax->byte_us = 64;
 
-	if (r == 0)
+	for (s = 1; (s <= n) && (s <= 720); s++)
 	{
-		sio_ack(3, d, 'A');
-
-		setup_status(d);
+		e = ax->file + 16 + (s - 1) * PRO_ENTRY;
+		pos = ((s - 1) % ax->spt) * ATX_REV / ax->spt;
+		np = (e[5] > 5) ? 5 : e[5];
 
-		sio_ack(3, d, 'C');
+		pro_sector(ax, s, s, pos);
 
-# ifdef SIOTRACE
-		if (log_flag)
+		for (k = 0; k < np; k++)
 		{
-			printf("-> PERCOM: %02x, %02x, %02x, %02x, %02x, %02x, %02x, %02x\n", \
-				device[3][d].percom.trk, device[3][d].percom.step,
-				device[3][d].percom.spt_hi, device[3][d].percom.spt_lo,
-				device[3][d].percom.heads, device[3][d].percom.flags,
-				device[3][d].percom.bps_hi, device[3][d].percom.bps_lo);
+			ph = 720 + e[7 + k];
+			if ((e[7 + k] == 0) || (ph > n))
+				continue;
+			pro_sector(ax, s, ph, pos + (k + 1) * ATX_REV / (np + 1));
 		}
-# endif
 	}
-	else
-		sio_ack(3, d, 'E');
+
+	atx_chain(ax);
+
+	return ax;
 }
 
-/* Sectors */
-static void
-send_sector(uchar devno, int i, uchar ccom, long sector)
+/* Read the sector as the drive would find it on the disk. Sleeps for as
+ * long as that takes; returns 'C' or 'E', and the FDC status in fdc.
+ */
+static uchar
+atx_read(ATXDISK *ax, ulong sector, uchar *buf, ushort bps, uchar *fdc)
 {
-	uchar ck = 0;
-	ushort bps = device[devno][i].bps;
+	ulong trk = (sector - 1) / ax->spt, at, wait, best = 0, n;
+	uint64_t t = mono_ns(), now;
+	long s, pick = -1;
+	ATXSECTOR *sp;
 
-	if ((devno == 3) && ((sector == 0) || (sector > (long)device[3][i].maxsec)))
+	if (trk != ax->track)
 	{
-		sio_ack(devno, i, 'N');
-		return;
+		t += (uint64_t)((trk > ax->track) ? (trk - ax->track) : (ax->track - trk)) * ATX_STEP_US * 1000ULL;
+		t += ATX_SETTLE_US * 1000ULL;
+		ax->track = trk;
 	}
 
-	sio_ack(devno, i, 'A');
+	/* where the disk is when the head gets there */
+	at = ((t - ax->spin) / 8000ULL) % ATX_REV;
 
-	if ((devno == 3) && (bps == 256) && (sector < 4))
-		bps = 128;
+	s = (trk < ATX_TRACKS) ? ax->first[sector - 1] : -1;
 
-	if (devno == 3)
-		if (atr_seek(i, sector) < 0)
-			goto error;
-	if (read(device[devno][i].fd, outbuf, bps) < bps)
-		goto error;
+	for (; s >= 0; s = ax->sec[s].next)
+	{
+		wait = (ax->sec[s].pos + ATX_REV - at) % ATX_REV;
+		if ((pick < 0) || (wait < best))
+		{
+			pick = s;
+			best = wait;
+		}
+	}
 
-	sio_ack(devno, i, 'C');
+	bzero(buf, bps);
 
-	if (ccom != 'V')
+	if (pick < 0)
 	{
-		ck = outbuf[bps] = calc_checksum(outbuf, bps);
-		com_write(outbuf, (bps + 1));
+		t += (uint64_t)ATX_RETRY_REVS * ATX_REV_US * 1000ULL;
+		*fdc = 0x10;
 	}
+	else
+	{
+		sp = &ax->sec[pick];
 
-# ifdef SIOTRACE
-	if (log_flag)
-		printf("<- SECTOR $%04lx (%5ld), bps: %d, CRC: $%02x\n", sector, sector, bps, ck);
-# endif
+		t += (uint64_t)best * 8000ULL + (uint64_t)sp->len * ax->byte_us * 1000ULL;
+		*fdc = sp->fdc & 0x3c;
 
-	return;
+		if (sp->data)
+			memcpy(buf, ax->file + sp->data, bps);
 
-error:
-	sio_ack(devno, i, 'E');
+		for (n = sp->weak; n < bps; n++)
+			buf[n] = rand_r(&ax->seed);
+	}
 
-	/* SIO expects the transfer even after Error was signalized */
+	now = mono_ns();
+	if (t > now)
+		usleep((t - now) / 1000);
 
-	if (ccom != 'V')
+	return (*fdc & ATX_FDC_ERR) ? 'E' : 'C';
+}
+
+/* ============== Image registry ================= */
+
+/* Every image file is opened once per process, however many drives on
+ * however many ports mount it; the entry is found by device and inode.
+ * The file is read into memory on first access, while the cached images
+ * fit in the budget (-C), and the least recently used ones not being
+ * written are dropped to make room. A write holds the image alone and
+ * goes to the file and the copy, so all drives read the same data.
+ * Unmounted images stay open and cached for a while (IMAGE_IDLE), so a
+ * title swapped out and back in doesn't start cold.
+ *
+ * Lock order: image first, then image_lock; the other way round only
+ * with a trylock.
+ */
+
+static IMAGE images[MAX_IMAGES];
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+static ulong image_budget = 8192 * 1024UL;	/* bytes of image data in memory */
+static ulong image_bytes = 0;			/* cached now */
+static ulong image_clock = 0;
+static ulong image_hits = 0;			/* reads served from memory */
+static ulong image_misses = 0;			/* and those which were not */
+static ulong image_evictions = 0;		/* copies dropped to make room */
+static int image_idle = 0;			/* images open, but not mounted */
+
+/* The all-zero stretches of an image are kept as holes in the file: they
+ * take no room on the disk, read as zeros without any I/O, and their
+ * checksum is known to be 0. The map comes from SEEK_HOLE when the image
+ * is opened and is kept up by the writes, which punch out the blocks
+ * they leave zeroed.
+ */
+
+static const uchar zero_page[HOLE_BLOCK];
+
+# define HOLE_BIT(img, b)	((img)->holes[(b) >> 3] & (1 << ((b) & 7)))
+
+static int
+is_zero(const uchar *buf, ulong len)
+{
+	ulong n, l;
+
+	for (n = 0; n < len; n += l)
 	{
-		outbuf[bps] = calc_checksum(outbuf, bps);
-		com_write(outbuf, (bps + 1));
+		l = ((len - n) < HOLE_BLOCK) ? (len - n) : HOLE_BLOCK;
+		if (memcmp(buf + n, zero_page, l))
+			return 0;
 	}
 
-	printf("SIO read error: D%d:, sector $%04lx (%5ld), bps: %d\n", i, sector, sector, bps);
+	return 1;
 }
 
-static void
-receive_sector(ushort devno, ushort i, long sector)
+/* Deallocate len bytes at off. Returns 0 if they are a hole now */
+static int
+hole_punch(int fd, off_t off, off_t len)
 {
-	ushort bps = device[devno][i].bps;
-	uchar ck, sck;
+# if defined(FALLOC_FL_PUNCH_HOLE)
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+# elif defined(SPACECTL_DEALLOC)
+	struct spacectl_range sr;
 
-	if ((devno == 3) && i && ((sector == 0) || (sector > (long)device[3][i].maxsec)))
-	{
-		sio_ack(devno, i, 'N');
-		return;
-	}
+	sr.r_offset = off;
+	sr.r_len = len;
 
-	sio_ack(devno, i, 'A');
+	return fspacectl(fd, SPACECTL_DEALLOC, &sr, 0, NULL);
+# else
+	(void)fd;
+	(void)off;
+	(void)len;
 
-	if ((devno == 3) && (bps == 256) && (sector < 4))
-		bps = 128;
+	return -1;
+# endif
+}
 
-	com_read(inpbuf, bps, COM_DATA);
+static void
+hole_mark(IMAGE *img, ulong b, int hole)
+{
+	if (hole)
+		img->holes[b >> 3] |= (1 << (b & 7));
+	else
+		img->holes[b >> 3] &= ~(1 << (b & 7));
+}
 
-	ck = calc_checksum(inpbuf, bps);
+/* Map the holes of the file; the image is held alone, or not shared yet */
+static void
+image_holes(IMAGE *img)
+{
+# ifdef SEEK_HOLE
+	off_t hole, data;
+	ulong b, last;
+# endif
 
-	device[devno][i].status.stat &= ~0x02;
+	free(img->holes);
 
-	com_read(&sck, 1, COM_DATA);
+	img->nblk = (img->size + HOLE_BLOCK - 1) / HOLE_BLOCK;
+	img->holes = calloc((img->nblk / 8) + 1, 1);
 
-	if (ck != sck)
+	if (img->holes == NULL)
 	{
-		device[devno][i].status.stat |= 0x02;
-		printf("SIO write: CRC fail, Atari: $%02x, PC: $%02x\n", sck, ck);
-		goto error;
+		img->nblk = 0;
+		return;
 	}
 
-# ifdef SIOTRACE
-	if (log_flag)
-		printf("-> SECTOR $%04lx (%5ld), bps: %d, CRC: $%02x\n", sector, sector, bps, ck);
-# endif
-
-	sio_ack(devno, i, 'A');
-
-	if (devno == 3)
-		if (atr_seek(i, sector) < 0)
-			goto error;
-	if (device[devno][i].fd > -1)
-		if (write(device[devno][i].fd, inpbuf, bps) != bps)
-			goto error;
+# ifdef SEEK_HOLE
+	for (data = 0; data < img->size; )
+	{
+		hole = lseek(img->fd, data, SEEK_HOLE);
+		if ((hole < 0) || (hole >= img->size))
+			break;
 
-	sio_ack(devno, i, 'C');
+		/* ENXIO if the hole runs to the end */
+		data = lseek(img->fd, hole, SEEK_DATA);
+		if ((data < 0) || (data > img->size))
+			data = img->size;
 
-	return;
+		last = (data == img->size) ? img->nblk : (ulong)(data / HOLE_BLOCK);
 
-error:	sio_ack(devno, i, 'E');
+		for (b = (hole + HOLE_BLOCK - 1) / HOLE_BLOCK; b < last; b++)
+			hole_mark(img, b, 1);
+	}
 
-	printf("SIO write error: D%d:, sector $%04lx (%5ld), bps: %d\n", i, sector, sector, bps);
+	lseek(img->fd, 0, SEEK_SET);
+# endif
 }
 
-static void
-sig(int s)
+/* All of [off, off + len) lies in holes */
+static int
+image_in_hole(IMAGE *img, off_t off, ulong len)
 {
-	int i;
+	ulong b, last;
 
-	if (s)
+	if ((img->holes == NULL) || (len == 0) || ((off + (off_t)len) > img->size))
+		return 0;
+
+	last = (off + len - 1) / HOLE_BLOCK;
+
+	for (b = off / HOLE_BLOCK; b <= last; b++)
 	{
-# ifdef __CYGWIN__
-		printf("Caught signal %d\n", s);
-# else
-		psignal(s, NULL);
-# endif
+		if (!HOLE_BIT(img, b))
+			return 0;
 	}
 
-	if (printer_fd > -1)
-		close(printer_fd);
-	
-	if (serial_fd > -1)
+	return 1;
+}
+
+/* With -D the cached images don't keep a copy each: an image is a map of
+ * CHUNK_SIZE pieces, aligned to its sectors, into a store shared by all of
+ * them, where equal data is kept once and found by its hash. The boot
+ * sectors, DOS and the empty sectors most images have take the memory
+ * of one, and stay cached while any image holding them is. A write
+ * never changes a chunk, it makes or finds the one with the new data.
+ * The store is kept under image_lock; a map is read under its image's
+ * lock only, its chunks stay while it holds them.
+ */
+
+static int image_dedup = 0;			/* -D */
+static CHUNK *chunk_tab[CHUNK_HASH];
+static ulong chunk_count = 0;			/* distinct chunks */
+static ulong chunk_refs = 0;			/* and the places holding them */
+
+/* FNV-1a */
+static uint64_t
+chunk_hash(const uchar *data)
+{
+	uint64_t h = 14695981039346656037ULL;
+	ulong i;
+
+	for (i = 0; i < CHUNK_SIZE; i++)
 	{
-		(void)tcsetattr(serial_fd, TCSANOW, &dflt);
-		close(serial_fd);
+		h ^= data[i];
+		h *= 1099511628211ULL;
 	}
-	
-	for (i = 0; i < 15; i++)
-		atr_close(i);
 
-	(void)unlink(dpath);
-	
-	exit(s);
+	return h;
 }
 
-/* PCLink part */
+/* The chunk holding data, one more reference to it; image_lock held */
+static CHUNK *
+chunk_get(const uchar *data)
+{
+	uint64_t h = chunk_hash(data);
+	CHUNK *c;
 
-# define SDX_MAXLEN 16777215L
+	for (c = chunk_tab[h & (CHUNK_HASH - 1)]; c; c = c->next)
+	{
+		if ((c->hash == h) && (memcmp(c->data, data, CHUNK_SIZE) == 0))
+		{
+			c->refs++;
+			chunk_refs++;
+			return c;
+		}
+	}
 
-/* SDX required attribute mask */
-# define RA_PROTECT	0x01
-# define RA_HIDDEN	0x02
-# define RA_ARCHIVED	0x04
-# define RA_SUBDIR	0x08
-# define RA_NO_PROTECT	0x10
-# define RA_NO_HIDDEN	0x20
-# define RA_NO_ARCHIVED	0x40
-# define RA_NO_SUBDIR	0x80
+	if ((c = malloc(sizeof(CHUNK))) == NULL)
+		return NULL;
 
-/* SDX set attribute mask */
-# define SA_PROTECT	0x01
-# define SA_UNPROTECT	0x10
-# define SA_HIDE	0x02
-# define SA_UNHIDE	0x20
-# define SA_ARCHIVE	0x04
-# define SA_UNARCHIVE	0x40
-# define SA_SUBDIR	0x08	/* illegal mode */
-# define SA_UNSUBDIR	0x80	/* illegal mode */
+	memcpy(c->data, data, CHUNK_SIZE);
+	c->hash = h;
+	c->refs = 1;
+	c->next = chunk_tab[h & (CHUNK_HASH - 1)];
+	chunk_tab[h & (CHUNK_HASH - 1)] = c;
 
-# define DEVICE_LABEL	".PCLINK.VOLUME.LABEL"
+	image_bytes += sizeof(CHUNK);
+	chunk_count++;
+	chunk_refs++;
 
-# define PCL_MAX_FNO	0x14
+	return c;
+}
 
-static const char *fun[] =
+/* image_lock held */
+static void
+chunk_put(CHUNK *c)
 {
-	"FREAD", "FWRITE", "FSEEK", "FTELL", "FLEN", "(none)", "FNEXT", "FCLOSE",
-	"INIT", "FOPEN", "FFIRST", "RENAME", "REMOVE", "CHMOD", "MKDIR", "RMDIR",
-	"CHDIR", "GETCWD", "SETBOOT", "DFREE", "CHVOL"
-};
+	CHUNK **pp;
 
-typedef struct
-{
-	uchar status;
-	uchar map_l, map_h;
-	uchar len_l, len_m, len_h;
-	char fname[11];
-	uchar stamp[6];
-} DIRENTRY;
+	chunk_refs--;
 
-static struct
-{
-	union
-	{
-		FILE *file;
-		DIR *dir;
-	} fps;
+	if (--c->refs)
+		return;
 
-	DIRENTRY *dir_cache;	/* used only for directories */
+	for (pp = &chunk_tab[c->hash & (CHUNK_HASH - 1)]; *pp != c; pp = &(*pp)->next)
+		;
+	*pp = c->next;
 
-	uchar devno;
-	uchar cunit;
-	uchar fpmode;
-	uchar fatr1;
-	uchar fatr2;
-	uchar t1,t2,t3;
-	uchar d1,d2,d3;
-	struct stat fpstat;
-	char fpname[12];
-	long fppos;
-	long fpread;
-	int eof;
-	char pathname[1024];
-} iodesc[16];
+	free(c);
+	image_bytes -= sizeof(CHUNK);
+	chunk_count--;
+}
 
-static struct
+/* Map the file in data onto the store; 0 if done. image_lock held */
+static int
+image_chunk(IMAGE *img, const uchar *data)
 {
-	uchar handle;
-	uchar dirbuf[23];
-} pcl_dbf;
+	uchar blk[CHUNK_SIZE];
+	ulong i, off, n;
 
-static ulong upper_dir = UPPER_DIR;
+	img->base = img->size % CHUNK_SIZE;
+	img->nchunk = (img->size - img->base + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
-static long
-dos_2_allowed(uchar c)
-{
-# ifndef __CYGWIN__
-	if (upper_dir)
-		return (isupper(c) || isdigit(c) || (c == '_') || (c == '@'));
+	if ((img->map = calloc(img->nchunk + 1, sizeof(CHUNK *))) == NULL)
+		return -1;
 
-	return (islower(c) || isdigit(c) || (c == '_') || (c == '@'));
-# else
-	return (isalpha(c) || isdigit(c) || (c == '_') || (c == '@'));
-# endif
-}
+	memcpy(img->head, data, img->base);
 
-static long
-dos_2_term(uchar c)
-{
-	return ((c == 0) || (c == 0x20));
+	for (i = 0; i < img->nchunk; i++)
+	{
+		off = img->base + (i * CHUNK_SIZE);
+		n = ((img->size - off) < CHUNK_SIZE) ? (ulong)(img->size - off) : CHUNK_SIZE;
+
+		bzero(blk, sizeof(blk));
+		memcpy(blk, data + off, n);
+
+		if ((img->map[i] = chunk_get(blk)) == NULL)
+			return -1;
+	}
+
+	img->held = (img->nchunk + 1) * sizeof(CHUNK *);
+	image_bytes += img->held;
+
+	return 0;
 }
 
-static long
-validate_fn(uchar *name, int len)
+/* Forget the cached copy, with image_lock held */
+static void
+image_uncache(IMAGE *img)
 {
-	int x;
+	ulong i;
 
-	for (x = 0; x < len; x++)
+	free(img->data);
+	img->data = NULL;
+
+	if (img->map)
 	{
-		if (dos_2_term(name[x]))
-			return (x != 0);
-		if (name[x] == '.')
-			return 1;
-		if (!dos_2_allowed(name[x]))
-			return 0;
+		for (i = 0; (i < img->nchunk) && img->map[i]; i++)
+			chunk_put(img->map[i]);
+		free(img->map);
+		img->map = NULL;
 	}
 
-	return 1;
+	image_bytes -= img->held;
+	img->held = 0;
 }
 
+/* Copy [off, off + len) of the cached image to buf */
 static void
-ugefina(char *src, char *out)
+image_copy(IMAGE *img, uchar *buf, off_t off, ulong len)
 {
-	char *dot;
-	ushort i;
-
-	memset(out, 0x20, 8+3);
+	ulong n, i, o;
 
-	dot = strchr(src, '.');
-
-	if (dot)
+	if (img->data)
 	{
-		i = 1;
-		while (dot[i] && (i < 4))
-		{
-			out[i+7] = toupper((uchar)dot[i]);
-			i++;
-		}
+		memcpy(buf, img->data + off, len);
+		return;
 	}
 
-	i = 0;
-	while ((src[i] != '.') && !dos_2_term(src[i]) && (i < 8))
+	for (; len; buf += n, off += n, len -= n)
 	{
-		out[i] = toupper((uchar)src[i]);
-		i++;
+		if ((ulong)off < img->base)
+		{
+			n = img->base - off;
+			if (n > len)
+				n = len;
+			memcpy(buf, img->head + off, n);
+		}
+		else
+		{
+			i = (off - img->base) / CHUNK_SIZE;
+			o = (off - img->base) % CHUNK_SIZE;
+			n = CHUNK_SIZE - o;
+			if (n > len)
+				n = len;
+			memcpy(buf, img->map[i]->data + o, n);
+		}
 	}
 }
 
+/* Put buf at off into the cached image, which is held for writing. The
+ * chunks it touches are replaced, not changed: others may hold them.
+ */
 static void
-uexpand(uchar *rawname, char *name83)
+image_patch(IMAGE *img, const uchar *buf, off_t off, ulong len)
 {
-	ushort x, y;
-	uchar t;
-
-	name83[0] = 0;
+	uchar blk[CHUNK_SIZE];
+	ulong n, i, o;
+	CHUNK *c;
 
-	for (x = 0; x < 8; x++)
+	if (img->data)
 	{
-		t = rawname[x];
-		if (t && (t != 0x20))
-			name83[x] = upper_dir ? toupper(t) : tolower(t);
-		else
-			break;
+		memcpy(img->data + off, buf, len);
+		return;
 	}
 
-	y = 8;
+	if (img->map == NULL)
+		return;
 
-	if (rawname[y] && (rawname[y] != 0x20))
+	pthread_mutex_lock(&image_lock);
+
+	for (; len; buf += n, off += n, len -= n)
 	{
-		name83[x] = '.';
-		x++;
+		if ((ulong)off < img->base)
+		{
+			n = img->base - off;
+			if (n > len)
+				n = len;
+			memcpy(img->head + off, buf, n);
+			continue;
+		}
 
-		while ((y < 11) && rawname[y] && (rawname[y] != 0x20))
+		i = (off - img->base) / CHUNK_SIZE;
+		o = (off - img->base) % CHUNK_SIZE;
+		n = CHUNK_SIZE - o;
+		if (n > len)
+			n = len;
+
+		memcpy(blk, img->map[i]->data, CHUNK_SIZE);
+		memcpy(blk + o, buf, n);
+
+		/* no memory: the image goes back to the file */
+		if ((c = chunk_get(blk)) == NULL)
 		{
-			name83[x] = upper_dir ? toupper(rawname[y]) : tolower(rawname[y]);
-			x++;
-			y++;
+			image_uncache(img);
+			break;
 		}
+
+		chunk_put(img->map[i]);
+		img->map[i] = c;
 	}
 
-	name83[x] = 0;
+	pthread_mutex_unlock(&image_lock);
 }
 
-static int
-match_dos_names(char *name, char *mask, uchar fatr1, struct stat *sb)
+/* After a write: the blocks it touched hold data now, unless they are
+ * all zeros, and then they are punched out again.
+ */
+static void
+image_rehole(IMAGE *img, const uchar *buf, off_t off, ulong len)
 {
-	ushort i;
+	uchar blk[HOLE_BLOCK];
+	const uchar *p;
+	off_t start, from, to;
+	ulong b, last, n;
 
-	if (log_flag)
-	{
-		printf("match: %c%c%c%c%c%c%c%c%c%c%c with %c%c%c%c%c%c%c%c%c%c%c: ",
-		name[0], name[1], name[2], name[3], name[4], name[5], name[6], name[7], \
-		name[8], name[9], name[10], \
-		mask[0], mask[1], mask[2], mask[3], mask[4], mask[5], mask[6], mask[7], \
-		mask[8], mask[9], mask[10]);
-	}
+	if ((img->holes == NULL) || (len == 0))
+		return;
 
-	for (i = 0; i < 11; i++)
+	last = (off + len - 1) / HOLE_BLOCK;
+
+	for (b = off / HOLE_BLOCK; (b <= last) && (b < img->nblk); b++)
 	{
-		if (mask[i] != '?')
-			if (toupper((uchar)name[i]) != toupper((uchar)mask[i]))
-			{
-				if (log_flag)
-					printf("no match\n");
-				return 1;
-			}
-	}
+		hole_mark(img, b, 0);
 
-	/* There are no such attributes in Unix */
-	fatr1 &= ~(RA_NO_HIDDEN|RA_NO_ARCHIVED);
+		start = (off_t)b * HOLE_BLOCK;
+		from = (start > off) ? start : off;
+		to = ((start + HOLE_BLOCK) < (off_t)(off + len)) ? (start + HOLE_BLOCK) : (off_t)(off + len);
 
-	/* Now check the attributes */
-	if (fatr1 & (RA_HIDDEN | RA_ARCHIVED))
-	{
-		if (log_flag)
-			printf("atr mismatch: not HIDDEN or ARCHIVED\n");
-		return 1;
-	}
+		if (!is_zero(buf + (from - off), to - from))
+			continue;
 
-	if (fatr1 & RA_PROTECT)
-	{
-		if (sb->st_mode & S_IWUSR)
-		{
-			if (log_flag)
-				printf("atr mismatch: not PROTECTED\n");
+		n = ((img->size - start) < HOLE_BLOCK) ? (ulong)(img->size - start) : HOLE_BLOCK;
 
-			return 1;
+		if (img->data || img->map)
+		{
+			image_copy(img, blk, start, n);
+			p = blk;
 		}
+		else if (pread(img->fd, blk, n, start) == (long)n)
+			p = blk;
+		else
+			continue;
+
+		if (is_zero(p, n) && (hole_punch(img->fd, start, n) == 0))
+			hole_mark(img, b, 1);
 	}
+}
 
-	if (fatr1 & RA_NO_PROTECT)
-	{
-		if ((sb->st_mode & S_IWUSR) == 0)
-		{
-			if (log_flag)
-				printf("atr mismatch: not UNPROTECTED\n");
+/* The write journal (-J). Each sector written goes to fname.jnl first,
+ * as a record with its offset and a CRC, and waits in memory; the reads
+ * see it from there. A commit syncs the journal once for all the writes
+ * waiting, JNL_GROUP_MAX at most (-g), and only then are they written to
+ * the image, so a power cut never leaves a sector half written: what the
+ * journal holds is written again when the image is opened next time, a
+ * record cut short is ignored. The worker commits when the port has been
+ * quiet for the time given to -J. Once the journal grows to JNL_MAX the
+ * image is synced and the journal starts over.
+ *
+ * Record: "SJNL", sequence number (4 bytes), offset (8), length (4), CRC-32
+ * of all that and the data (4), the data. Little endian.
+ */
 
-			return 1;
-		}
-	}
+static long journal_ms = 0;		/* -J, 0: no journal */
+static ulong journal_group = 16;	/* -g */
+static int jnl_dirty = 0;		/* images with writes waiting */
 
-	if (fatr1 & RA_SUBDIR)
-	{
-		if (!S_ISDIR(sb->st_mode))
-		{
-			if (log_flag)
-				printf("atr mismatch: not SUBDIR\n");
+static void
+jnl_put(uchar *p, uint64_t v, int n)
+{
+	int i;
 
-			return 1;
-		}
-	}
+	for (i = 0; i < n; i++)
+		p[i] = (v >> (i * 8)) & 0xff;
+}
 
-	if (fatr1 & RA_NO_SUBDIR)
-	{
-		if (S_ISDIR(sb->st_mode))
-		{
-			if (log_flag)
-				printf("atr mismatch: not FILE\n");
+static uint64_t
+jnl_get(const uchar *p, int n)
+{
+	uint64_t v = 0;
+	int i;
 
-			return 1;
-		}
-	}
+	for (i = n - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
 
-	if (log_flag)
-		printf("match\n");
+	return v;
+}
 
-	return 0;
+static ulong
+jnl_crc(const uchar *h, const uchar *data, ulong len)
+{
+	ulong crc = crc32(0L, Z_NULL, 0);
+
+	crc = crc32(crc, h, JNL_HDRSIZE - 4);
+
+	return crc32(crc, data, len);
+}
+
+/* Put the writes waiting over [off, off + len) of buf */
+static void
+jnl_overlay(IMAGE *img, uchar *buf, off_t off, ulong len)
+{
+	JNLPEND *jp;
+	off_t from, to;
+	ulong i;
+
+	for (i = 0; i < img->npend; i++)
+	{
+		jp = &img->jpend[i];
+		from = (jp->off > off) ? jp->off : off;
+		to = ((jp->off + (off_t)jp->len) < (off + (off_t)len)) ? (jp->off + (off_t)jp->len) : (off + (off_t)len);
+
+		if (from < to)
+			memcpy(buf + (from - off), jp->data + (from - jp->off), to - from);
+	}
 }
 
+/* Sync the journal and write what waits into the image; the image is
+ * held for writing. Returns -1 if the journal can't be synced, the
+ * writes are made anyway.
+ */
 static int
-validate_dos_name(char *fname)
+jnl_commit(IMAGE *img)
 {
-	char *dot = strchr(fname, '.');
-	long valid_fn, valid_xx;
-			
-	if ((dot == NULL) && (strlen(fname) > 8))
-		return 1;
-	if (dot)
+	JNLPEND *jp;
+	ulong i;
+	int r = 0;
+
+	if (img->npend == 0)
+		return 0;
+
+	if (fdatasync(img->jfd) < 0)
 	{
-		long dd = strlen(dot);
+		printf("Journal: cannot sync %s, %s (%d)\n", img->jpath, strerror(errno), errno);
+		r = -1;
+	}
 
-		if (dd > 4)
-			return 1;
-		if ((dot - fname) > 8)
-			return 1;
-		if ((dot == fname) && (dd == 1))
-			return 1;
-		if ((dd == 2) && (dot[1] == '.'))
-			return 1;
-		if ((dd == 3) && ((dot[1] == '.') || (dot[2] == '.')))
-			return 1;
-		if ((dd == 4) && ((dot[1] == '.') || (dot[2] == '.') || (dot[3] == '.')))
-			return 1;
+	for (i = 0; i < img->npend; i++)
+	{
+		jp = &img->jpend[i];
+		if (pwrite(img->fd, jp->data, jp->len, jp->off) == (long)jp->len)
+			image_rehole(img, jp->data, jp->off, jp->len);
+		else
+			printf("Journal: cannot write %s at %ld, %s (%d)\n", img->jpath, (long)jp->off, strerror(errno), errno);
+		free(jp->data);
 	}
 
-	valid_fn = validate_fn((uchar *)fname, 8);
-	if (dot != NULL)
-		valid_xx = validate_fn((uchar *)(dot + 1), 3);
-	else
-		valid_xx = 1;
+	img->npend = 0;
+	__atomic_sub_fetch(&jnl_dirty, 1, __ATOMIC_RELAXED);
 
-	if (!valid_fn || !valid_xx)
-		return 1;
+	/* the image is safe on the disk, the journal can start over */
+	if ((img->jbytes >= JNL_MAX) && (fdatasync(img->fd) == 0) && (ftruncate(img->jfd, 0) == 0))
+		img->jbytes = 0;
 
-	return 0;
+	return r;
 }
 
+/* Journal the write of len bytes at off; 0 if it waits for the commit */
 static int
-check_dos_name(char *newpath, struct dirent *dp, struct stat *sb)
+jnl_write(IMAGE *img, const uchar *buf, ulong len, off_t off)
 {
-	char temp_fspec[1024], fname[256];
-
-	strcpy(fname, dp->d_name);
-
-	if (log_flag)
-		printf("%s: got fname '%s'\n", __extension__ __FUNCTION__, fname); 
-
-	if (validate_dos_name(fname))
-		return 1;
+	uchar rec[JNL_HDRSIZE + 1024];
+	JNLPEND *jp;
 
-	/* stat() the file (fetches the length) */
-	sprintf(temp_fspec, "%s/%s", newpath, fname);
+	if ((len > 1024) || ((img->npend == 0) && (img->jpend == NULL) && \
+		((img->jpend = calloc(JNL_GROUP_MAX, sizeof(JNLPEND))) == NULL)))
+		return -1;
 
-	if (log_flag)
-		printf("%s: stat '%s'\n", __extension__ __FUNCTION__, temp_fspec);
+	memcpy(rec, "SJNL", 4);
+	jnl_put(rec + 4, img->jseq++, 4);
+	jnl_put(rec + 8, off, 8);
+	jnl_put(rec + 16, len, 4);
+	memcpy(rec + JNL_HDRSIZE, buf, len);
+	jnl_put(rec + 20, jnl_crc(rec, buf, len), 4);
 
-	if (stat(temp_fspec, sb))
-		return 1;
+	jp = &img->jpend[img->npend];
+	if ((jp->data = malloc(len)) == NULL)
+		return -1;
 
-	if (!S_ISREG(sb->st_mode) && !S_ISDIR(sb->st_mode))
-		return 1;
+	if (write(img->jfd, rec, JNL_HDRSIZE + len) != (long)(JNL_HDRSIZE + len))
+	{
+		free(jp->data);
+		return -1;
+	}
 
-	if (sb->st_uid != our_uid)		/* belongs to us? */
-		return 1;
+	memcpy(jp->data, buf, len);
+	jp->off = off;
+	jp->len = len;
 
-	if ((sb->st_mode & S_IRUSR) == 0)	/* unreadable? */
-		return 1;
+	if (img->npend++ == 0)
+		__atomic_add_fetch(&jnl_dirty, 1, __ATOMIC_RELAXED);
+	img->jbytes += JNL_HDRSIZE + len;
 
-	if (S_ISDIR(sb->st_mode) && ((sb->st_mode & S_IXUSR) == 0))
-		return 1;
+	if (img->npend >= journal_group)
+		jnl_commit(img);
 
 	return 0;
 }
 
+/* Close the journal: the image is synced, and it goes */
 static void
-fps_close(int i)
+jnl_close(IMAGE *img)
 {
-	if (iodesc[i].fps.file != NULL)
-	{
-		if (iodesc[i].fpmode & 0x10)
-			closedir(iodesc[i].fps.dir);
-		else
-			fclose(iodesc[i].fps.file);
-	}
+	if (img->jpath == NULL)
+		return;
 
-	if (iodesc[i].dir_cache != NULL)
-	{
-		free(iodesc[i].dir_cache);
-		iodesc[i].dir_cache = NULL;
-	}
+	jnl_commit(img);
 
-	iodesc[i].fps.file = NULL;
+	if (fdatasync(img->fd) == 0)
+		(void)unlink(img->jpath);
 
-	iodesc[i].devno = 0;
-	iodesc[i].cunit = 0;
-	iodesc[i].fpmode = 0;
-	iodesc[i].fatr1 = 0;
-	iodesc[i].fatr2 = 0;
-	iodesc[i].t1 = 0;
-	iodesc[i].t2 = 0;
-	iodesc[i].t3 = 0;
-	iodesc[i].d1 = 0;
-	iodesc[i].d2 = 0;
-	iodesc[i].d3 = 0;
-	iodesc[i].fpname[0] = 0;
-	iodesc[i].fppos = 0;
-	iodesc[i].fpread = 0;
-	iodesc[i].eof = 0;
-	iodesc[i].pathname[0] = 0;
-	bzero(&iodesc[i].fpstat, sizeof(struct stat));
+	close(img->jfd);
+	free(img->jpath);
+	free(img->jpend);
+	img->jpath = NULL;
+	img->jpend = NULL;
 }
 
-static ulong
-get_file_len(uchar handle)
+/* Commit the writes waiting in all images, on the timer; at exit the
+ * journals are closed as well
+ */
+static void
+jnl_flush(int fin)
 {
-	ulong filelen;
-	struct dirent *dp;
-	struct stat sb;
+	int i;
 
-	if (iodesc[handle].fpmode & 0x10)	/* directory */
-	{
-		rewinddir(iodesc[handle].fps.dir);
-		filelen = sizeof(DIRENTRY);
+	if (!fin && (__atomic_load_n(&jnl_dirty, __ATOMIC_RELAXED) == 0))
+		return;
 
-		while ((dp = readdir(iodesc[handle].fps.dir)) != NULL)
+	pthread_mutex_lock(&image_lock);
+
+	for (i = 0; i < MAX_IMAGES; i++)
+	{
+		if (images[i].jpath && (images[i].npend || fin) && (pthread_rwlock_trywrlock(&images[i].lock) == 0))
 		{
-			if (check_dos_name(iodesc[handle].pathname, dp, &sb))
-				continue;
-			filelen += sizeof(DIRENTRY);
+			if (fin)
+				jnl_close(&images[i]);
+			else
+				jnl_commit(&images[i]);
+			pthread_rwlock_unlock(&images[i].lock);
 		}
-		rewinddir(iodesc[handle].fps.dir);
 	}
-	else
-		filelen = iodesc[handle].fpstat.st_size;
 
-	if (filelen > SDX_MAXLEN)
-		filelen = SDX_MAXLEN;
+	pthread_mutex_unlock(&image_lock);
+}
 
-	return filelen;
+/* Close the image for good, with image_lock held */
+static void
+image_free(IMAGE *img)
+{
+	jnl_close(img);
+	image_uncache(img);
+	if (img->idle)
+		image_idle--;
+	free(img->holes);
+	gz_free(img->gz);
+	close(img->fd);
+	pthread_rwlock_destroy(&img->lock);
+	bzero(img, sizeof(IMAGE));
 }
 
-static DIRENTRY *
-cache_dir(uchar handle)
+/* The idle image used least recently, with image_lock held */
+static IMAGE *
+image_oldest_idle(void)
 {
-	char *bs, *cwd;
-	uchar dirnode = 0x00;
-	ushort node;
-	ulong dlen, flen, sl, dirlen = iodesc[handle].fpstat.st_size;
-	DIRENTRY *dbuf, *dir;
-	struct dirent *dp;
-	struct stat sb;
+	IMAGE *v = NULL;
+	int i;
 
-	if (iodesc[handle].dir_cache != NULL)
+	for (i = 0; i < MAX_IMAGES; i++)
 	{
-		printf("Internal error: dir_cache should be NULL!\n");
-		sig(0);
+		if (images[i].idle && ((v == NULL) || (images[i].used < v->used)))
+			v = &images[i];
 	}
 
-	dir = dbuf = malloc(dirlen + sizeof(DIRENTRY));
-	bzero(dbuf, dirlen + sizeof(DIRENTRY));
-
-	dir->status = 0x28;
-	dir->map_l = 0x00;			/* low 11 bits: file number, high 5 bits: dir number */
-	dir->map_h = dirnode;
-	dir->len_l = dirlen & 0x000000ffL;
-	dir->len_m = (dirlen & 0x0000ff00L) >> 8;
-	dir->len_h = (dirlen & 0x00ff0000L) >> 16;
-
-	memset(dir->fname, 0x20, 11);
+	return v;
+}
 
-	sl = strlen(device[iodesc[handle].devno][iodesc[handle].cunit].dirname);
+/* The fd is the caller's; it is closed if the image is already open */
+static IMAGE *
+image_get(int fd)
+{
+	struct stat sb;
+	IMAGE *img = NULL;
+	int i;
 
-	cwd = iodesc[handle].pathname + sl;
+	if (fstat(fd, &sb) < 0)
+		return NULL;
 
-	bs = strrchr(cwd, '/');
+	pthread_mutex_lock(&image_lock);
 
-	if (bs == NULL)
-		memcpy(dir->fname, "MAIN", 4);
-	else
+	for (i = 0; i < MAX_IMAGES; i++)
 	{
-		char *cp = cwd;
+		if ((images[i].refs || images[i].idle) && (images[i].dev == sb.st_dev) && (images[i].ino == sb.st_ino))
+		{
+			img = &images[i];
 
-		ugefina(bs+1, (char *)dir->fname);
+			/* an idle one is taken back as it was, unless the file
+			 * was changed meanwhile
+			 */
+			if (img->idle)
+			{
+				if ((img->mtime.tv_sec != sb.st_mtim.tv_sec) || (img->mtime.tv_nsec != sb.st_mtim.tv_nsec) || \
+					(img->fsize != sb.st_size))
+				{
+					image_free(img);
+					img = NULL;
+					break;
+				}
+				img->idle = 0;
+				image_idle--;
+			}
 
-		node = 0;
+			img->refs++;
+			close(fd);
+			break;
+		}
+	}
 
-		while (cp <= bs)
+	for (i = 0; (img == NULL) && (i <= MAX_IMAGES); i++)
+	{
+		/* all taken: the oldest idle image makes room */
+		if (i == MAX_IMAGES)
 		{
-			if (*cp == '/')
-				dirnode++;
-			cp++;
+			if ((img = image_oldest_idle()) == NULL)
+				break;
+			image_free(img);
 		}
+		else if ((images[i].refs == 0) && !images[i].idle)
+			img = &images[i];
+		else
+			continue;
 
-		dir->map_h = (dirnode & 0x1f) << 3;
+		bzero(img, sizeof(IMAGE));
+		img->dev = sb.st_dev;
+		img->ino = sb.st_ino;
+		img->fd = fd;
+		img->size = sb.st_size;
+		img->refs = 1;
+		pthread_rwlock_init(&img->lock, NULL);
+		image_holes(img);
 	}
 
-	unix_time_2_sdx(&iodesc[handle].fpstat.st_mtime, dir->stamp);
+	pthread_mutex_unlock(&image_lock);
 
-	dir++;
-	flen = sizeof(DIRENTRY);
+	return img;
+}
 
-	node = 1;
+/* Forget the cached copy, the image is held for writing */
+static void
+image_drop(IMAGE *img)
+{
+	if ((img->data == NULL) && (img->map == NULL))
+		return;
 
-	while ((dp = readdir(iodesc[handle].fps.dir)) != NULL)
-	{
-		ushort map;
+	pthread_mutex_lock(&image_lock);
+	image_uncache(img);
+	pthread_mutex_unlock(&image_lock);
+}
 
-		if (check_dos_name(iodesc[handle].pathname, dp, &sb))
-			continue;
+/* The last drive let go: the image stays open and cached, idle, for the
+ * next mount of the title, while IMAGE_IDLE of them are kept. A file
+ * which is gone (a temporary disk) is closed at once.
+ */
+static void
+image_put(IMAGE *img)
+{
+	struct stat sb;
+	IMAGE *v;
 
-		dlen = sb.st_size;
-		if (dlen > SDX_MAXLEN)
-			dlen = SDX_MAXLEN;
-
-		dir->status = (sb.st_mode & S_IWUSR) ? 0x08 : 0x09;
+	pthread_mutex_lock(&image_lock);
 
-		if (S_ISDIR(sb.st_mode))
+	if (--img->refs == 0)
+	{
+		if ((IMAGE_IDLE == 0) || (fstat(img->fd, &sb) < 0) || (sb.st_nlink == 0))
+			image_free(img);
+		else
 		{
-			dir->status |= 0x20;		/* directory */
-			dlen = sizeof(DIRENTRY);
-		}
-
-		map = dirnode << 11;
-		map |= (node & 0x07ff);
-
-		dir->map_l = map & 0x00ff;
-		dir->map_h = ((map & 0xff00) >> 8);
-		dir->len_l = dlen & 0x000000ffL;
-		dir->len_m = (dlen & 0x0000ff00L) >> 8;
-		dir->len_h = (dlen & 0x00ff0000L) >> 16;
-
-		ugefina(dp->d_name, (char *)dir->fname);
-
-		unix_time_2_sdx(&sb.st_mtime, dir->stamp);
-
-		node++;
-		dir++;
-		flen += sizeof(DIRENTRY);
+			if ((image_idle >= IMAGE_IDLE) && ((v = image_oldest_idle()) != NULL))
+				image_free(v);
 
-		if (flen >= dirlen)
-			break;
+			img->idle = 1;
+			img->mtime = sb.st_mtim;
+			img->fsize = sb.st_size;
+			image_idle++;
+		}
 	}
 
-	return dbuf;
+	pthread_mutex_unlock(&image_lock);
 }
 
-static ulong
-dir_read(uchar *mem, ulong blk_size, uchar handle, int *eof_sig)
+/* Open the journal of the image in fname, after writing again what an
+ * earlier run left in it. Returns the sectors replayed, -1 if there's no
+ * journal.
+ */
+static long
+jnl_open(IMAGE *img, const char *fname)
 {
-	uchar *db = (uchar *)iodesc[handle].dir_cache;
-	ulong dirlen = iodesc[handle].fpstat.st_size, newblk;
+	uchar h[JNL_HDRSIZE], data[1024];
+	char path[1024 + 4];
+	ulong len, n = 0;
+	off_t off;
+	FILE *f;
 
-	eof_sig[0] = 0;
+	if (!journal_ms || img->gz || ((fcntl(img->fd, F_GETFL) & O_ACCMODE) == O_RDONLY))
+		return -1;
 
-	newblk = dirlen - iodesc[handle].fppos;
+	pthread_rwlock_wrlock(&img->lock);
 
-	if (newblk < blk_size)
+	/* another drive has it open already */
+	if (img->jpath)
 	{
-		blk_size = newblk; 
-		eof_sig[0] = 1;
+		pthread_rwlock_unlock(&img->lock);
+		return -1;
 	}
 
-	if (blk_size)
-		memcpy(mem, db+iodesc[handle].fppos, blk_size);
+	snprintf(path, sizeof(path), "%s.jnl", fname);
 
-	return blk_size;
-}
+	if ((f = fopen(path, "rb")) != NULL)
+	{
+		while (fread(h, JNL_HDRSIZE, 1, f) == 1)
+		{
+			len = jnl_get(h + 16, 4);
+			off = jnl_get(h + 8, 8);
 
-static void
-do_pclink_init(int force)
-{
-	uchar handle;
+			if ((memcmp(h, "SJNL", 4) != 0) || (len > sizeof(data)) || (fread(data, len, 1, f) != 1) || \
+				(jnl_crc(h, data, len) != jnl_get(h + 20, 4)))
+				break;		/* cut short by the crash */
 
-	if (force == 0)
-		printf("closing all files\n");
+			if (((off + (off_t)len) <= img->size) && (pwrite(img->fd, data, len, off) == (long)len))
+				n++;
+		}
+		fclose(f);
 
-	for (handle = 0; handle < 16; handle++)
-	{
-		if (force)
-			iodesc[handle].fps.file = NULL;
-		fps_close(handle);
-		bzero(&device[6][handle].parbuf, sizeof(PARBUF));
+		/* the journal goes only once its writes are safe */
+		if (n && (fdatasync(img->fd) < 0))
+		{
+			pthread_rwlock_unlock(&img->lock);
+			return -1;
+		}
+
+		image_drop(img);
+		image_holes(img);
 	}
-}
 
-static void
-set_status_size(uchar devno, uchar cunit, ushort size)
-{
-	device[devno][cunit].status.tmot = (size & 0x00ff);
-	device[devno][cunit].status.none = (size & 0xff00) >> 8;
+	if ((img->jfd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_APPEND, S_IRUSR|S_IWUSR)) < 0)
+		printf("Journal: cannot open %s, %s (%d)\n", path, strerror(errno), errno);
+	else if ((img->jpath = strdup(path)) == NULL)
+		close(img->jfd);
+
+	pthread_rwlock_unlock(&img->lock);
+
+	return img->jpath ? (long)n : -1;
 }
 
+/* Index the image as a compressed one: 0 if done, -1 if it won't inflate */
 static int
-validate_user_path(char *defwd, char *newpath)
+image_gz(IMAGE *img)
 {
-	char *d, oldwd[1024], newwd[1024];
+	int r = 0;
 
-	(void)getcwd(oldwd, sizeof(oldwd));
-	if (chdir(newpath) < 0)
-		return 0;
-	(void)getcwd(newwd, sizeof(newwd));
-	(void)chdir(oldwd);
+	pthread_rwlock_wrlock(&img->lock);
 
-	d = strstr(newwd, defwd);
+	if (img->gz == NULL)
+	{
+		if ((img->gz = gz_index(img->fd)) == NULL)
+			r = -1;
+		else
+		{
+			img->size = img->gz->size;
+			free(img->holes);
+			img->holes = NULL;
+			img->nblk = 0;
+		}
+	}
 
-	if (d == NULL)
-		return 0;
-	if (d != newwd)
-		return 0;
+	pthread_rwlock_unlock(&img->lock);
 
-	return 1;
+	return r;
 }
 
+/* Make room for need more bytes, with image_lock held. Returns 0 if the
+ * budget can't be met.
+ */
 static int
-ispathsep(uchar c)
+image_evict(IMAGE *keep, ulong need)
 {
-	return ((c == '>') || (c == '\\'));
-}
+	uchar busy[MAX_IMAGES];
+	IMAGE *v;
+	int i;
 
-static void
-path_copy(uchar *dst, uchar *src)
-{
-	uchar a;
+	bzero(busy, sizeof(busy));
 
-	while (*src)
+	while ((image_bytes + need) > image_budget)
 	{
-		a = *src;
-		if (ispathsep(a))
+		v = NULL;
+
+		for (i = 0; i < MAX_IMAGES; i++)
 		{
-			while (ispathsep(*src))
-				src++;
-			src--;
+			if (images[i].held && !busy[i] && (&images[i] != keep))
+			{
+				if ((v == NULL) || (__atomic_load_n(&images[i].used, __ATOMIC_RELAXED) < __atomic_load_n(&v->used, __ATOMIC_RELAXED)))
+					v = &images[i];
+			}
 		}
-		*dst = a;
-		src++;
-		dst++;
+
+		if (v == NULL)
+			return 0;
+
+		if (pthread_rwlock_trywrlock(&v->lock))
+		{
+			busy[v - images] = 1;
+			continue;
+		}
+
+		image_uncache(v);
+		image_evictions++;
+
+		pthread_rwlock_unlock(&v->lock);
 	}
 
-	*dst = 0;
+	return 1;
 }
 
+/* Read the whole file into memory, if it fits; with -D into the store,
+ * where it may take much less
+ */
 static void
-path2unix(uchar *out, uchar *path)
+image_load(IMAGE *img)
 {
-	int i, y = 0;
+	uchar *data;
+	ulong size, n;
+	long r;
 
-	for (i = 0; path[i] && (i < 64); i++)
-	{
-		char a;
+	pthread_rwlock_wrlock(&img->lock);
 
-		a = upper_dir ? toupper(path[i]) : tolower(path[i]);
+	size = img->size;
 
-		if (ispathsep(a))
-			a = '/';
-		else if (a == '<')
-		{
-			a = '.';
-			out[y++] = '.';
-		}
-		out[y++] = a;
-	}
+	if (img->data || img->map || (size == 0) || (size > image_budget))
+		goto done;
 
-	if (y && (out[y-1] != '/'))
-		out[y++] = '/';
+	pthread_mutex_lock(&image_lock);
+	r = image_evict(img, size);
+	if (r)
+		image_bytes += size;
+	pthread_mutex_unlock(&image_lock);
 
-	out[y] = 0;
-}
+	if (r == 0)
+		goto done;
 
-static void
-create_user_path(uchar devno, uchar cunit, char *newpath)
-{
-	long sl, cwdo = 0;
-	uchar lpath[128], upath[128];
+	data = malloc(size);
 
-	strcpy(newpath, device[devno][cunit].dirname);
+	for (n = 0; data && (n < size); n += r)
+	{
+		r = pread(img->fd, data + n, size - n, n);
 
-	/* this is user-requested new path */
-	path_copy(lpath, device[devno][cunit].parbuf.path);
-	path2unix(upath, lpath);
+		if (r <= 0)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
 
-	if (upath[0] != '/')
+	if (data)
+		jnl_overlay(img, data, 0, size);
+
+	pthread_mutex_lock(&image_lock);
+	if (data && image_dedup)
 	{
-		sl = strlen(newpath);
-		if (sl && (newpath[sl-1] != '/'))
-			strcat(newpath, "/");
-		if (device[devno][cunit].cwd[0] == '/')
-			cwdo++;
-		strcat(newpath, (char *)device[devno][cunit].cwd + cwdo);
-		sl = strlen(newpath);
-		if (sl && (newpath[sl-1] != '/'))
-			strcat(newpath, "/");
+		image_bytes -= size;
+		if (image_chunk(img, data) < 0)
+			image_uncache(img);
+		free(data);
+		data = NULL;
 	}
-	strcat(newpath, (char *)upath);
-	sl = strlen(newpath);
-	if (sl && (newpath[sl-1] == '/'))
-		newpath[sl-1] = 0;
+	else if (data)
+		img->held = size;
+	else
+		image_bytes -= size;
+	pthread_mutex_unlock(&image_lock);
+
+	img->data = data;
+
+done:
+	pthread_rwlock_unlock(&img->lock);
 }
 
-static time_t
-timestamp2mtime(uchar *stamp)
+/* zero is set if the data came from a hole */
+static long
+image_read(IMAGE *img, uchar *buf, ulong len, off_t off, int *zero)
 {
-	struct tm sdx_tm;
+	long r;
 
-	bzero(&sdx_tm, sizeof(struct tm));
+	__atomic_store_n(&img->used, __atomic_add_fetch(&image_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
 
-	sdx_tm.tm_sec = stamp[5];
-	sdx_tm.tm_min = stamp[4];
-	sdx_tm.tm_hour = stamp[3];
-	sdx_tm.tm_mday = stamp[0];
-	sdx_tm.tm_mon = stamp[1];
-	sdx_tm.tm_year = stamp[2];
+	pthread_rwlock_rdlock(&img->lock);
 
-	if ((sdx_tm.tm_mday == 0) || (sdx_tm.tm_mon == 0))
-		return 0;
+	/* a compressed image has a cache of its own */
+	if (img->gz)
+	{
+		r = gz_read(img->gz, img->fd, buf, len, off);
+		*zero = 0;
+		goto done;
+	}
 
-	if (sdx_tm.tm_mon)
-		sdx_tm.tm_mon--;
+	if ((img->data == NULL) && (img->map == NULL))
+	{
+		__atomic_add_fetch(&image_misses, 1, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&img->lock);
+		image_load(img);
+		pthread_rwlock_rdlock(&img->lock);
+	}
+	else
+		__atomic_add_fetch(&image_hits, 1, __ATOMIC_RELAXED);
 
-	if (sdx_tm.tm_year < 80)
-		sdx_tm.tm_year += 2000;
+	*zero = image_in_hole(img, off, len);
+
+	if (img->data || img->map)
+	{
+		r = 0;
+		if (off < img->size)
+		{
+			r = img->size - off;
+			if ((ulong)r > len)
+				r = len;
+			image_copy(img, buf, off, r);
+		}
+	}
+	else if (*zero)
+	{
+		bzero(buf, len);
+		r = len;
+	}
 	else
-		sdx_tm.tm_year += 1900;
+		r = pread(img->fd, buf, len, off);
 
-	sdx_tm.tm_year -= 1900;
+	/* the file hasn't got the writes waiting in the journal yet */
+	if (img->npend && (r > 0) && !img->data && !img->map)
+	{
+		jnl_overlay(img, buf, off, r);
+		*zero = 0;
+	}
 
-	return mktime(&sdx_tm);
-}
+done:
+	pthread_rwlock_unlock(&img->lock);
 
-/* Command: DDEVIC+DUNIT-1 = $6f, DAUX1 = parbuf size, DAUX2 = %vvvvuuuu
- * where: v - protocol version number (0), u - unit number
- */
+	return r;
+}
 
-static void
-do_pclink(uchar devno, uchar ccom, uchar caux1, uchar caux2)
+static long
+image_write(IMAGE *img, const uchar *buf, ulong len, off_t off)
 {
-	uchar ck, sck, fno, ob[7], handle;
-	ushort cunit = caux2 & 0x0f, parsize;
-	ulong faux;
-	struct stat sb;
-	struct dirent *dp;
-	static uchar old_ccom = 0;
+	long r;
 
-	parsize = caux1 ? caux1 : 256;
+	pthread_rwlock_wrlock(&img->lock);
 
-	if (caux2 & 0xf0)	/* protocol version number must be 0 */
+	/* compressed images are written back as a whole */
+	if (img->gz)
 	{
-		sio_ack(devno, cunit, 'N');
-		return;
+		errno = EROFS;
+		r = -1;
+		goto done;
 	}
 
-	if (parsize > sizeof(PARBUF))	/* and not more than fits in parbuf */
+	/* zeros over a hole are there already */
+	if ((img->npend == 0) && image_in_hole(img, off, len) && is_zero(buf, len))
 	{
-		sio_ack(devno, cunit, 'N');
-		return;
+		r = len;
+		goto done;
 	}
 
-	if (ccom == 'P')
+	/* journaled, it waits for the commit; the cached copy has it now, and
+	 * the blocks are no holes until the commit looks at them again
+	 */
+	if (img->jpath && ((off + (off_t)len) <= img->size) && (jnl_write(img, buf, len, off) == 0))
 	{
-		PARBUF pbuf;
+		ulong b;
 
-		sio_ack(devno, cunit, 'A');	/* ack the command */
+		image_patch(img, buf, off, len);
+		for (b = off / HOLE_BLOCK; img->holes && (b <= (off + len - 1) / HOLE_BLOCK) && (b < img->nblk); b++)
+			hole_mark(img, b, 0);
+		r = len;
+		goto done;
+	}
 
-		bzero(&pbuf, sizeof(PARBUF));
+	if (img->jpath)
+		jnl_commit(img);
 
-		com_read((uchar *)&pbuf, parsize, COM_DATA);
-		com_read(&sck, 1, COM_DATA);
+	r = pwrite(img->fd, buf, len, off);
 
-		ck = calc_checksum((uchar *)&pbuf, parsize);
+	if (r > 0)
+	{
+		if ((off + r) > img->size)
+		{
+			image_drop(img);
+			img->size = off + r;
+			image_holes(img);
+		}
+		else
+		{
+			image_patch(img, buf, off, r);
+			image_rehole(img, buf, off, r);
+		}
+	}
 
-		device[devno][cunit].status.stat &= ~0x02;
+done:
+	pthread_rwlock_unlock(&img->lock);
 
-		sio_ack(devno, cunit, 'A');	/* ack the received block */
+	return r;
+}
 
-		if (ck != sck)
-		{
-			device[devno][cunit].status.stat |= 0x02;
-			printf("PARBLK CRC error, Atari: $%02x, PC: $%02x\n", sck, ck);
-			device[devno][cunit].status.err = 143;
-			goto complete;
-		}
+/* ============== Overlays ================= */
 
-		device[devno][cunit].status.stat &= ~0x04;
+/* With -o the image files are only read: the sectors the Atari writes
+ * are kept in memory per drive, and read back from there. Each write is
+ * tagged with the drive's generation, and a reset only starts a new one,
+ * so the old sectors drop out at once whatever their number; their
+ * memory is reused as the sectors are written again. SIGUSR1 resets the
+ * overlays of all drives, the control socket those of one drive.
+ */
 
-# if 0
-		/* True if Atari didn't catch the ACK above and retried the command */
-		if (pbuf.fno > PCL_MAX_FNO)
-		{
-			device[devno][cunit].status.stat |= 0x04;
-			printf("PARBLK error, invalid fno $%02x\n", pbuf.fno);
-			device[devno][cunit].status.err = 144;
-			goto complete;
-		}
-# endif
-
-		if (memcmp(&pbuf, &device[devno][cunit].parbuf, sizeof(PARBUF)) == 0)
-		{
-			/* this is a retry of P-block. Most commands don't like that */
-			if ((pbuf.fno != 0x00) && (pbuf.fno != 0x01) && (pbuf.fno != 0x03) \
-				&& (pbuf.fno != 0x04) && (pbuf.fno != 0x06) && \
-					(pbuf.fno != 0x11) && (pbuf.fno != 0x13))
-			{
-				printf("PARBLK retry, ignored\n");
-				goto complete;
-			}
-		}
-
-		memcpy(&device[devno][cunit].parbuf, &pbuf, sizeof(PARBUF));
-	}
+static volatile sig_atomic_t ovl_epoch = 0;	/* bumped by SIGUSR1 */
 
-//	device[devno][cunit].status.err = 1;
-//	set_status_size(devno, cunit, 0);
+static void
+ovl_signal(int s)
+{
+	(void)s;
 
-	fno = device[devno][cunit].parbuf.fno;
-	faux = device[devno][cunit].parbuf.f1 + device[devno][cunit].parbuf.f2 * 256 + \
-		device[devno][cunit].parbuf.f3 * 65536;
+	ovl_epoch++;
+}
 
-	if (fno < (PCL_MAX_FNO+1))
-		printf("%s (fno $%02x): ", fun[fno], fno);
+static OVERLAY *
+ovl_new(ushort d, ulong size)
+{
+	OVERLAY *o = calloc(1, sizeof(OVERLAY));
 
-	handle = device[devno][cunit].parbuf.handle;
+	if (o == NULL)
+		return NULL;
 
-	if (fno == 0x00)	/* FREAD */
+	o->nsec = device[3][d].maxsec + 1;
+	o->sgen = calloc(o->nsec, sizeof(ulong));
+	o->data = calloc(o->nsec, sizeof(uchar *));
+	if ((o->sgen == NULL) || (o->data == NULL))
 	{
-		uchar *mem;
-		ulong blk_size = (faux & 0x0000FFFFL), buffer;
+		free(o->sgen);
+		free(o->data);
+		free(o);
+		return NULL;
+	}
 
-		if (ccom == 'P')
-		{
-			if ((handle > 15) || (iodesc[handle].fps.file == NULL))
-			{
-				printf("bad handle %d\n", handle);
-				device[devno][cunit].status.err = 134;	/* bad file handle */
-				goto complete;
-			}
+	o->gen = 1;
+	o->epoch = ovl_epoch;
+	o->size = size;
+	o->maxsec = device[3][d].maxsec;
+	o->bps = device[3][d].bps;
+	o->full13 = device[3][d].full13;
 
-			if (blk_size == 0)
-			{
-				printf("bad size $0000 (0)\n");
-				device[devno][cunit].status.err = 176;
-				set_status_size(devno, cunit, 0);
-				goto complete;
-			}
+	return o;
+}
 
-			device[devno][cunit].status.err = 1;
-			iodesc[handle].eof = 0;
+static void
+ovl_free(OVERLAY *o)
+{
+	ulong s;
 
-			buffer = iodesc[handle].fpstat.st_size - iodesc[handle].fppos;
+	if (o == NULL)
+		return;
 
-			if (buffer < blk_size)
-			{
-				blk_size = buffer;
-				device[devno][cunit].parbuf.f1 = (buffer & 0x00ff);
-				device[devno][cunit].parbuf.f2 = (buffer & 0xff00) >> 8;
-				iodesc[handle].eof = 1;
-				if (blk_size == 0)
-					device[devno][cunit].status.err = 136;
-			}
+	for (s = 0; s < o->nsec; s++)
+		free(o->data[s]);
+	free(o->data);
+	free(o->sgen);
+	free(o);
+}
 
-			printf("size $%04lx (%ld), buffer $%04lx (%ld)\n", blk_size, blk_size, buffer, buffer);
+/* The current generation, a new one if SIGUSR1 came meanwhile */
+static ulong
+ovl_gen(OVERLAY *o)
+{
+	sig_atomic_t e = ovl_epoch;
 
-			set_status_size(devno, cunit, (ushort)blk_size);
-			goto complete;
-		}
+	if (!o->keep && (o->epoch != (ulong)e))
+	{
+		o->epoch = e;
+		o->gen++;
+		o->held = 0;
+	}
 
-		if ((ccom == 'R') && (old_ccom == 'R'))
-		{
-			sio_ack(devno, cunit, 'N');
-			printf("serial communication error, abort\n");
-			return;
-		}
+	return o->gen;
+}
 
-		sio_ack(devno, cunit, 'A');	/* ack the command */
+static void
+ovl_reset(OVERLAY *o)
+{
+	o->gen++;
+	o->held = 0;
+}
 
-		printf("handle %d\n", handle);
+/* Copy the sector into buf if the overlay has it: 1 if so, else 0 and
+ * it comes from the image file.
+ */
+static int
+ovl_read(OVERLAY *o, ulong sector, uchar *buf, ushort len)
+{
+	ulong g = ovl_gen(o);
 
-		mem = malloc(blk_size + 1);
+	if (sector >= o->nsec)
+		return 0;
 
-		if ((device[devno][cunit].status.err == 1))
-		{
-			iodesc[handle].fpread = blk_size;
+	if (o->sgen[sector] == g)
+		memcpy(buf, o->data[sector], len);
+	else if (o->fmt == g)
+		bzero(buf, len);		/* formatted in this generation */
+	else
+		return 0;
 
-			if (iodesc[handle].fpmode & 0x10)
-			{
-				ulong rdata;
-				int eof_sig;
+	return 1;
+}
 
-				rdata = dir_read(mem, blk_size, handle, &eof_sig);
+static int
+ovl_write(OVERLAY *o, ulong sector, const uchar *buf, ushort len)
+{
+	ulong g = ovl_gen(o);
 
-				if (rdata != blk_size)
-				{
-					printf("FREAD: cannot read %ld bytes from dir\n", blk_size);
-					if (eof_sig)
-					{
-						iodesc[handle].fpread = rdata;
-						device[devno][cunit].status.err = 136;
-					}
-					else
-					{
-						iodesc[handle].fpread = 0;
-						device[devno][cunit].status.err = 255;
-					}
-				}
-			}
-			else
-			{
-				if (fseek(iodesc[handle].fps.file, iodesc[handle].fppos, SEEK_SET))
-				{
-					printf("FREAD: cannot seek to $%04lx (%ld)\n", iodesc[handle].fppos, iodesc[handle].fppos);
-					device[devno][cunit].status.err = 166;
-				}
-				else
-				{
-					long fdata = fread(mem, sizeof(char), blk_size, iodesc[handle].fps.file);
+	if (sector >= o->nsec)
+		return -1;
 
-					if ((ulong)fdata != blk_size)
-					{
-						printf("FREAD: cannot read %ld bytes from file\n", blk_size);
-						if (feof(iodesc[handle].fps.file))
-						{
-							iodesc[handle].fpread = fdata;
-							device[devno][cunit].status.err = 136;
-						}
-						else
-						{
-							iodesc[handle].fpread = 0;
-							device[devno][cunit].status.err = 255;
-						}
-					}
-				}
-			}
-		}
+	if ((o->data[sector] == NULL) && ((o->data[sector] = malloc(len)) == NULL))
+		return -1;
 
-		iodesc[handle].fppos += iodesc[handle].fpread;
+	memcpy(o->data[sector], buf, len);
+	if (o->sgen[sector] != g)
+		o->held++;
+	o->sgen[sector] = g;
 
-		if (device[devno][cunit].status.err == 1)
-		{
-			if (iodesc[handle].eof)
-				device[devno][cunit].status.err = 136;
-			else if (iodesc[handle].fppos == iodesc[handle].fpstat.st_size)
-				device[devno][cunit].status.err = 3;
-		}
+	return 0;
+}
 
-		set_status_size(devno, cunit, iodesc[handle].fpread);
+/* Format: a new generation in which the unwritten sectors read as zeros */
+static void
+ovl_format(OVERLAY *o)
+{
+	ovl_reset(o);
+	o->fmt = o->gen;
+}
 
-		printf("FREAD: send $%04lx (%ld), status $%02x\n", blk_size, blk_size, device[devno][cunit].status.err);
+/* ============== Storage worker ================= */
 
-		sck = calc_checksum((void *)mem, blk_size);
-		mem[blk_size] = sck;
-		sio_ack(devno, cunit, 'C');
-		com_write(mem, blk_size + 1);
+/* File I/O runs on a worker thread of the port, so that a slow disk
+ * never holds up the SIO timing: the protocol thread acks the command at
+ * once, posts the operation and sends 'C' when the result is back, or
+ * 'E' when the Atari would give up waiting anyway.
+ *
+ * The queue is a single-producer single-consumer ring: head is written
+ * only by the protocol thread, done only by the worker, and the state of
+ * a request changes by compare-and-swap. The pipes are there only to
+ * sleep on. A request given up on still runs on its file, so the files
+ * are closed only when the queue is empty (io_drain()).
+ */
 
-		free(mem);
+# define IO_MARGIN_MS	250	/* answer that much before the Atari times out */
+# define IO_SECTOR_S	7	/* the OS timeout for sector I/O, in seconds */
 
-		goto exit;
-	}
+static __thread IOQUEUE *ioq = NULL;
+static __thread IOREQ io_local;		/* used when there is no worker */
 
-	if (fno == 0x01)	/* FWRITE */
-	{
-		uchar *mem;
-		ulong blk_size = (faux & 0x0000FFFFL);
+static void
+io_run(IOREQ *rq)
+{
+	errno = 0;
 
-		if (ccom == 'P')
+	switch (rq->op)
+	{
+		case IO_PREAD:
+		{
+			if (rq->img)
+				rq->r = image_read(rq->img, rq->buf, rq->len, rq->off, &rq->zero);
+			else
+				rq->r = pread(rq->fd, rq->buf, rq->len, rq->off);
+			break;
+		}
+		case IO_PWRITE:
 		{
-			if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+			if (rq->img)
+				rq->r = image_write(rq->img, rq->buf, rq->len, rq->off);
+			else
+				rq->r = pwrite(rq->fd, rq->buf, rq->len, rq->off);
+			break;
+		}
+		case IO_FORMAT:		/* header of len bytes in buf, off is the new size */
+		{
+			struct stat sb;
+
+			if (rq->img)
 			{
-				printf("bad handle %d\n", handle);
-				device[devno][cunit].status.err = 134;	/* bad file handle */
-				goto complete;
+				pthread_rwlock_wrlock(&rq->img->lock);
+				/* what the journal holds is overwritten now */
+				if (rq->img->jpath)
+				{
+					jnl_commit(rq->img);
+					if ((fdatasync(rq->fd) == 0) && (ftruncate(rq->img->jfd, 0) == 0))
+						rq->img->jbytes = 0;
+				}
+				image_drop(rq->img);
 			}
-
-			if (blk_size == 0)
+			/* the sectors are a hole: they read as zeros and take
+			 * no room until written, however large the disk
+			 */
+			rq->r = -1;
+			if ((ftruncate(rq->fd, 0) == 0) && \
+				((rq->len == 0) || (pwrite(rq->fd, rq->buf, rq->len, 0) == (long)rq->len)) && \
+				(ftruncate(rq->fd, rq->off) == 0))
+				rq->r = 0;
+			if (rq->img)
 			{
-				printf("bad size $0000 (0)\n");
-				device[devno][cunit].status.err = 176;
-				set_status_size(devno, cunit, 0);
-				goto complete;
+				if (fstat(rq->fd, &sb) == 0)
+					rq->img->size = sb.st_size;
+				image_holes(rq->img);
+				pthread_rwlock_unlock(&rq->img->lock);
 			}
-
-			device[devno][cunit].status.err = 1;
-
-			printf("size $%04lx (%ld)\n", blk_size, blk_size);
-			set_status_size(devno, cunit, (ushort)blk_size);
-			goto complete;
+			break;
 		}
-
-		if ((ccom == 'R') && (old_ccom == 'R'))
+		case IO_FREAD:		/* r = -2 if the seek fails */
 		{
-			sio_ack(devno, cunit, 'N');
-			printf("serial communication error, abort\n");
-			return;
+			rq->r = -2;
+			if (fseek(rq->fp, rq->off, SEEK_SET))
+				break;
+			rq->r = fread(rq->buf, sizeof(char), rq->len, rq->fp);
+			rq->eof = feof(rq->fp);
+			break;
 		}
-
-		sio_ack(devno, cunit, 'A');	/* ack the command */
-
-		printf("handle %d\n", handle);
-
-		if ((iodesc[handle].fpmode & 0x10) == 0)
+		case IO_FWRITE:
 		{
-			if (fseek(iodesc[handle].fps.file, iodesc[handle].fppos, SEEK_SET))
-			{
-				printf("FWRITE: cannot seek to $%06lx (%ld)\n", iodesc[handle].fppos, iodesc[handle].fppos);
-				device[devno][cunit].status.err = 166;
-			}
+			rq->r = -2;
+			if (fseek(rq->fp, rq->off, SEEK_SET))
+				break;
+			rq->r = fwrite(rq->buf, sizeof(char), rq->len, rq->fp);
+			break;
 		}
+		case IO_RENAME:
+		{
+			rq->r = rename(rq->path, rq->path2);
+			break;
+		}
+	}
 
-		mem = malloc(blk_size + 1);
-
-		com_read(mem, blk_size, COM_DATA);
-		com_read(&sck, sizeof(uchar), COM_DATA);
+	rq->err = errno;
+}
 
-		sio_ack(devno, cunit, 'A'); 	/* ack the block of data */
+static void *
+io_worker(void *arg)
+{
+	IOQUEUE *q = arg;
+	struct pollfd pfd;
+	ulong tail = 0;
+	uchar c;
 
-		ck = calc_checksum(mem, blk_size);
+	for (;;)
+	{
+		/* quiet for journal_ms with writes waiting: commit them */
+		pfd.fd = q->bell[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
-		if (ck != sck)
+		if (poll(&pfd, 1, __atomic_load_n(&jnl_dirty, __ATOMIC_RELAXED) ? journal_ms : -1) == 0)
 		{
-			printf("FWRITE: block CRC mismatch\n");
-			device[devno][cunit].status.err = 143;
-			free(mem);
-			goto complete;
+			jnl_flush(0);
+			continue;
 		}
 
-		if (device[devno][cunit].status.err == 1)
+		if ((read(q->bell[0], &c, 1) < 0) && (errno != EINTR))
+			break;
+
+		while (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
 		{
-			long rdata;
+			IOREQ *rq = &q->req[tail % IO_SLOTS];
+			int st = IO_PENDING;
 
-			iodesc[handle].fpread = blk_size;
+			io_run(rq);
 
-			if (iodesc[handle].fpmode & 0x10)
+			/* nobody waits for it anymore: clean up after it */
+			if (!__atomic_compare_exchange_n(&rq->state, &st, IO_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
 			{
-				/* ignore raw dir writes */
+				if (rq->buf != rq->data)
+					free(rq->buf);
 			}
-			else
-			{
-				rdata = fwrite(mem, sizeof(char), blk_size, iodesc[handle].fps.file);
 
-				if ((ulong)rdata != blk_size)
-				{
-					printf("FWRITE: cannot write %ld bytes to file\n", blk_size);
-					iodesc[handle].fpread = rdata;
-					device[devno][cunit].status.err = 255;
-				}
-			}
+			tail++;
+			__atomic_store_n(&q->done, tail, __ATOMIC_RELEASE);
+
+			c = 0;
+			if (write(q->ack[1], &c, 1) < 0)
+				break;
 		}
+	}
 
-		iodesc[handle].fppos += iodesc[handle].fpread;
+	printf("FATAL: storage worker: %s (%d)\n", strerror(errno), errno);
 
-		set_status_size(devno, cunit, iodesc[handle].fpread);
+	return NULL;
+}
 
-		printf("FWRITE: received $%04lx (%ld), status $%02x\n", blk_size, blk_size, device[devno][cunit].status.err);
+static int
+io_start(void)
+{
+	IOQUEUE *q;
 
-		free(mem);
-		goto complete;
-	}
+	q = calloc(1, sizeof(IOQUEUE));
 
-	if (fno == 0x02)	/* FSEEK */
-	{
-		ulong newpos = faux;
+	if (q == NULL)
+		return -1;
 
-		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
-		{
-			printf("bad handle %d\n", handle);
-			device[devno][cunit].status.err = 134;	/* bad file handle */
-			goto complete;
-		}
+	q->bell[0] = q->bell[1] = q->ack[0] = q->ack[1] = -1;
 
-		if (ccom == 'R')
-		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			printf("bad exec\n");
-			device[devno][cunit].status.err = 176;
-			goto complete;
-		}
+	if ((pipe(q->bell) < 0) || (pipe(q->ack) < 0))
+	{
+		printf("Storage: pipe() failed, %s (%d)\n", strerror(errno), errno);
+		goto fail;
+	}
 
-		device[devno][cunit].status.err = 1;
+	(void)fcntl(q->ack[0], F_SETFL, O_NONBLOCK);
 
-		printf("handle %d, newpos $%06lx (%ld)\n", handle, newpos, newpos);
+	if (pthread_create(&q->tid, NULL, io_worker, q))
+	{
+		printf("Storage: cannot start the worker thread\n");
+		goto fail;
+	}
 
-		if (iodesc[handle].fpmode & 0x08)
-			iodesc[handle].fppos = newpos;
-		else
-		{
-			if (newpos <= (ulong)iodesc[handle].fpstat.st_size)
-				iodesc[handle].fppos = newpos;
-			else
-				device[devno][cunit].status.err = 166;
-		}
+	ioq = q;
 
-		goto complete;
-	}
+	return 0;
 
-	if ((fno == 0x03) || (fno == 0x04))	/* FTELL/FLEN */
-	{
-		ulong outval = 0;
-		uchar out[4];
+fail:
+	if (q->bell[0] > -1) close(q->bell[0]);
+	if (q->bell[1] > -1) close(q->bell[1]);
+	if (q->ack[0] > -1) close(q->ack[0]);
+	if (q->ack[1] > -1) close(q->ack[1]);
+	free(q);
 
-		if (ccom == 'P')
-		{
-			if ((handle > 15) || (iodesc[handle].fps.file == NULL))
-			{
-				printf("bad handle %d\n", handle);
-				device[devno][cunit].status.err = 134;	/* bad file handle */
-				goto complete;
-			}
+	return -1;
+}
 
-			device[devno][cunit].status.err = 1;
+/* Sleep until the worker finishes something, or ms pass */
+static void
+io_sleep(long ms)
+{
+	struct pollfd pfd;
+	uchar junk[64];
 
-			printf("device $%02x\n", cunit);
-			goto complete;
-		}
+	pfd.fd = ioq->ack[0];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
 
-		sio_ack(devno, cunit, 'A');	/* ack the command */
+	if (poll(&pfd, 1, ms) > 0)
+		while (read(ioq->ack[0], junk, sizeof(junk)) > 0)
+			;
+}
 
-		if (fno == 0x03)
-			outval = iodesc[handle].fppos;
-		else
-			outval = iodesc[handle].fpstat.st_size;
+/* Wait for the requests given up on to finish. A file they use is not
+ * closed before, or the worker could run them on another file which got
+ * the descriptor, or on an image already freed.
+ */
+static void
+io_drain(void)
+{
+	while (ioq && (__atomic_load_n(&ioq->done, __ATOMIC_ACQUIRE) != ioq->head))
+		io_sleep(-1);
+}
 
-		printf("handle %d, send $%06lx (%ld)\n", handle, outval, outval);
+/* A free request, with buf set for len bytes of data */
+static IOREQ *
+io_slot(int op, ulong len)
+{
+	IOREQ *rq = &io_local;
 
-		out[0] = (uchar)(outval & 0x000000ffL);
-		out[1] = (uchar)((outval & 0x0000ff00L) >> 8);
-		out[2] = (uchar)((outval & 0x00ff0000L) >> 16);
+	if (ioq)
+	{
+		/* full only with IO_SLOTS abandoned requests still running */
+		while ((ioq->head - __atomic_load_n(&ioq->done, __ATOMIC_ACQUIRE)) >= IO_SLOTS)
+			io_sleep(-1);
 
-		out[3] = calc_checksum((void *)out, sizeof(out)-1);
-		sio_ack(devno, cunit, 'C');
-		com_write(out, sizeof(out));
-		goto exit;
+		rq = &ioq->req[ioq->head % IO_SLOTS];
 	}
 
-	if (fno == 0x06)	/* FNEXT */
-	{
-		if (ccom == 'P')
-		{
-			device[devno][cunit].status.err = 1;
+	rq->op = op;
+	rq->img = NULL;
+	rq->zero = 0;
+	rq->len = len;
+	rq->buf = rq->data;
+	rq->state = IO_PENDING;
 
-			printf("device $%02x\n", cunit);
-			goto complete;
-		}
+	if ((len > sizeof(rq->data)) && ((rq->buf = malloc(len)) == NULL))
+		rq->buf = NULL;
 
-		if ((ccom == 'R') && (old_ccom == 'R'))
+	return rq;
+}
+
+/* Run the request, giving it ms milliseconds. Returns 0 when the result
+ * is there, -1 when the time is up; the request is then abandoned and
+ * the worker disposes of it.
+ */
+static int
+io_call(IOREQ *rq, long ms)
+{
+	uint64_t deadline = mono_ns() + (uint64_t)ms * 1000000ULL, now;
+	ulong seq;
+	uchar c = 0;
+	int st = IO_PENDING;
+
+	if (rq->buf == NULL)
+	{
+		rq->r = -1;
+		rq->err = ENOMEM;
+		return 0;
+	}
+
+	if (ioq == NULL)
+	{
+		io_run(rq);
+		return 0;
+	}
+
+	seq = ioq->head;
+	__atomic_store_n(&ioq->head, seq + 1, __ATOMIC_RELEASE);
+
+	if (write(ioq->bell[1], &c, 1) < 0)
+		printf("Storage: cannot wake the worker, %s (%d)\n", strerror(errno), errno);
+
+	while (__atomic_load_n(&ioq->done, __ATOMIC_ACQUIRE) <= seq)
+	{
+		now = mono_ns();
+		if (now >= deadline)
+		{
+			if (__atomic_compare_exchange_n(&rq->state, &st, IO_ABANDONED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				metrics->io_timeouts++;
+				printf("Storage: operation %d timed out after %ld ms\n", rq->op, ms);
+				return -1;
+			}
+			break;		/* finished just now */
+		}
+		io_sleep((long)((deadline - now + 999999ULL) / 1000000ULL));
+	}
+
+	return 0;
+}
+
+/* The request's heap buffer, if any, once the caller is done with it */
+static void
+io_release(IOREQ *rq)
+{
+	if (rq->buf && (rq->buf != rq->data))
+		free(rq->buf);
+	rq->buf = NULL;
+}
+
+/* How long the Atari waits for a device which set tmot in its status,
+ * in seconds, less a margin for the transfer.
+ */
+static long
+io_timeout(uchar tmot)
+{
+	long ms = (long)tmot * 1000 - IO_MARGIN_MS;
+
+	return (ms < IO_MARGIN_MS) ? IO_MARGIN_MS : ms;
+}
+
+/* ================ ATR file ================= */
+static off_t
+dev_offset(const DEVICE *dv, long sector)
+{
+	off_t off;
+	ushort bps = dv->bps;
+
+	/* See the info about boot sectors in DD above.
+	 */
+	off = (sector - 1) * bps;
+
+	if (bps == 256)
+	{
+		if (dv->full13)
+		{
+			if (sector < 4)
+				off = (sector - 1) * 128;
+		}
+		else
+		{
+			if (sector < 4)
+				off = (sector - 1) * 128;
+			else
+				off = ((sector - 4) * bps) + 384;
+		}
+	}
+
+	if (!dv->raw)
+		off += 16;
+
+	return off;
+}
+
+/* RAM disks. A drive given as ram:SECTORSxBPS[:fname] is an ATR image
+ * held in memory, and served from there on the port thread: no file,
+ * no storage worker. With fname it is loaded from the file, if there is
+ * one, and written back to it when it is unmounted or sio2bsd ends; the
+ * control socket saves it at any time.
+ */
+
+static void
+ram_header(uchar *h, ulong size, ushort bps)
+{
+	ulong pars = size / 16;
+
+	bzero(h, 16);
+	h[0] = 0x96;
+	h[1] = 0x02;
+	h[2] = pars & 0xff;
+	h[3] = (pars >> 8) & 0xff;
+	h[4] = bps & 0xff;
+	h[5] = bps >> 8;
+	h[6] = (pars >> 16) & 0xff;
+}
+
+/* Write the disk to fname, through a new file */
+static int
+ram_save(DEVICE *dv, ushort d, const char *fname)
+{
+	char tmp[1024 + 8];
+	int fd, r;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
+
+	if ((fd = mkstemp(tmp)) < 0)
+		goto error;
+
+	(void)fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+
+	r = (write(fd, dv->ram, dv->ramsize) == (long)dv->ramsize);
+
+	if ((close(fd) < 0) || !r || (rename(tmp, fname) < 0))
+	{
+		(void)unlink(tmp);
+		goto error;
+	}
+
+	/* a copy elsewhere leaves the disk's own file behind */
+	if (strcmp(fname, dv->dirname) == 0)
+		dv->ramchg = 0;
+	printf("D%d: RAM disk written to %s\n", d, fname);
+
+	return 0;
+
+error:
+	printf("Error: cannot write the RAM disk D%d: to %s, %s (%d)\n", d, fname, strerror(errno), errno);
+
+	return -1;
+}
+
+/* Mount ram:SECTORSxBPS[:fname] on Dd: */
+static int
+ram_mount(ushort d, const char *spec)
+{
+	DEVICE *dv = &device[3][d];
+	const char *file = NULL;
+	char *e;
+	struct stat sb;
+	ulong sectors, bps, size;
+	int fd;
+	uchar *h;
+
+	sectors = strtoul(spec + 4, &e, 10);
+	bps = (*e == 'x') ? strtoul(e + 1, &e, 10) : 0;
+
+	if (*e == ':')
+		file = e + 1;
+	else if (*e)
+		bps = 0;
+
+	if (((bps != 128) && (bps != 256) && (bps != 512)) || (sectors < 4) || (sectors > 65535))
+	{
+		printf("Error: bad RAM disk '%s', ram:SECTORSxBPS[:fname], BPS 128, 256 or 512\n", spec);
+		return -1;
+	}
+
+	size = (bps == 256) ? (((sectors - 3) * bps) + 384) : (sectors * bps);
+
+	/* the saved disk is taken as it is */
+	if (file && (stat(file, &sb) == 0))
+	{
+		if ((sb.st_size <= 16) || ((fd = open(file, O_RDONLY)) < 0))
+			goto bad;
+		size = sb.st_size - 16;
+		dv->ram = malloc(sb.st_size);
+		if (dv->ram && (read(fd, dv->ram, sb.st_size) != (long)sb.st_size))
+		{
+			free(dv->ram);
+			dv->ram = NULL;
+		}
+		close(fd);
+		if (dv->ram == NULL)
+			goto bad;
+
+		h = dv->ram;
+		bps = h[4] | (h[5] << 8);
+		if ((h[0] != 0x96) || (h[1] != 0x02) || ((bps != 128) && (bps != 256) && (bps != 512)) || \
+			(((h[2] | (h[3] << 8) | (h[6] << 16)) * 16UL) != size))
+			goto bad;
+	}
+	else
+	{
+		if ((dv->ram = calloc(1, size + 16)) == NULL)
+			goto bad;
+		ram_header(dv->ram, size, bps);
+	}
+
+	dv->ramsize = size + 16;
+	dv->persist = (file != NULL);
+	dv->atr.sig = 0x0296;
+	dv->atr.bps = bps;
+	dv->atr.wpars = (size / 16) % 65536;
+	dv->atr.hipars = (size / 16) / 65536;
+
+	if (drive_setup(d, size, bps) < 0)
+		goto bad;
+
+	snprintf(dv->dirname, sizeof(dv->dirname), "%s", file ? file : spec);
+
+	printf("D%d: %ld sectors, %ld bytes total, RAM disk%s%s\n", d, dv->maxsec, size, \
+		file ? " saved to " : "", file ? file : "");
+
+	report_percom(d);
+
+	setup_status(d);
+
+	return 0;
+
+bad:
+	printf("Error: cannot set up the RAM disk '%s'\n", spec);
+	free(dv->ram);
+	device_reset(3, d);
+
+	return -1;
+}
+
+/* Format: the disk in memory gets the new geometry, all zeros */
+static int
+ram_format(ushort d, ulong size)
+{
+	DEVICE *dv = &device[3][d];
+	uchar *r;
+
+	if ((r = realloc(dv->ram, size)) == NULL)
+		return -1;
+
+	bzero(r, size);
+	ram_header(r, size - 16, dv->bps);
+
+	dv->ram = r;
+	dv->ramsize = size;
+	dv->ramchg = 1;
+
+	return 0;
+}
+
+/* Change tracking. Every drive keeps a bit per sector written since the
+ * last delta was taken, set by the writes and by a format. A delta holds
+ * just those sectors; it is taken by SIGUSR2 for all the drives which
+ * have any, or by the control socket, and merged back by the latter.
+ *
+ * Delta: DELTA_MAGIC, version (1), a zero byte, bytes per sector (2),
+ * the last sector (4), the number of sectors in it (4), the digest of the
+ * disk it was taken from (4), 8 zeros; then every sector: its number
+ * (4) and the data. Little endian.
+ *
+ * With -H the unused CRC field of the ATR header holds a digest of the
+ * disk: the sum of a hash of each sector with its number. It's computed
+ * at mount and kept up by each write with the sector's hash alone, so a
+ * change shows in the header without reading the image. The writes only
+ * change it in memory; the header gets it when a delta is taken and when
+ * the disk goes, so a sector write costs no second write (nor a second
+ * journal record).
+ */
+
+static volatile sig_atomic_t delta_epoch = 0;	/* bumped by SIGUSR2 */
+static volatile sig_atomic_t port_wake = 0;	/* the ports have their pipes */
+static __thread sig_atomic_t delta_seen = 0;
+static int image_digest = 0;			/* -H */
+
+/* FNV-1a over the sector number and the data */
+static uint32_t
+sector_hash(ulong s, const uchar *buf, ushort len)
+{
+	uint32_t h = 2166136261U;
+	ushort i;
+
+	for (i = 0; i < 4; i++)
+	{
+		h ^= (s >> (i * 8)) & 0xff;
+		h *= 16777619U;
+	}
+	for (i = 0; i < len; i++)
+	{
+		h ^= buf[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/* Read or write sector s of Dd: the way the SIO commands do, for the
+ * deltas and the digest.
+ */
+static int
+dev_rw(ushort d, ulong s, uchar *buf, ushort len, int wr)
+{
+	DEVICE *dv = &device[3][d];
+	off_t off = dev_offset(dv, s);
+	IOREQ *rq;
+
+	if (dv->ovl)
+	{
+		if (wr)
+			return ovl_write(dv->ovl, s, buf, len);
+		if (ovl_read(dv->ovl, s, buf, len))
+			return 0;
+	}
+
+	if (dv->ram)
+	{
+		if ((off + len) > (off_t)dv->ramsize)
+			return -1;
+		if (wr)
+		{
+			memcpy(dv->ram + off, buf, len);
+			dv->ramchg = 1;
+		}
+		else
+			memcpy(buf, dv->ram + off, len);
+		return 0;
+	}
+
+	if (dv->fd < 0)
+		return -1;
+
+	rq = io_slot(wr ? IO_PWRITE : IO_PREAD, len);
+	rq->fd = dv->fd;
+	rq->img = dv->img;
+	rq->off = off;
+	if (wr)
+		memcpy(rq->buf, buf, len);
+
+	if ((io_call(rq, io_timeout(IO_SECTOR_S)) < 0) || (rq->r != len))
+		return -1;
+
+	if (!wr)
+		memcpy(buf, rq->buf, len);
+
+	return 0;
+}
+
+static void
+dirty_mark(DEVICE *dv, ulong s)
+{
+	if (dv->dirty == NULL)
+	{
+		if ((dv->dirty = calloc((dv->maxsec >> 3) + 1, 1)) == NULL)
+			return;
+		dv->dmax = dv->maxsec;
+	}
+
+	if ((s > dv->dmax) || (dv->dirty[s >> 3] & (1 << (s & 7))))
+		return;
+
+	dv->dirty[s >> 3] |= (1 << (s & 7));
+	dv->ndirty++;
+}
+
+/* A format: every sector is new, the geometry may be too */
+static void
+dirty_all(DEVICE *dv)
+{
+	ulong s;
+
+	free(dv->dirty);
+	dv->dirty = NULL;
+	dv->ndirty = 0;
+
+	for (s = 1; s <= dv->maxsec; s++)
+		dirty_mark(dv, s);
+}
+
+/* Put the digest into the ATR header */
+static void
+digest_store(DEVICE *dv, ushort d)
+{
+	uchar v[4];
+	IOREQ *rq;
+
+	v[0] = dv->digest & 0xff;
+	v[1] = (dv->digest >> 8) & 0xff;
+	v[2] = (dv->digest >> 16) & 0xff;
+	v[3] = (dv->digest >> 24) & 0xff;
+
+	dv->atr.crc = dv->digest;
+	dv->digchg = 0;
+
+	if (dv->ram)
+	{
+		memcpy(dv->ram + ATR_DIGEST, v, 4);
+		return;
+	}
+
+	rq = io_slot(IO_PWRITE, 4);
+	rq->fd = dv->fd;
+	rq->img = dv->img;
+	rq->off = ATR_DIGEST;
+	memcpy(rq->buf, v, 4);
+
+	if ((io_call(rq, io_timeout(IO_SECTOR_S)) == 0) && (rq->r != 4))
+		printf("D%d: cannot write the digest, %s\n", d, strerror(rq->err));
+}
+
+/* Hash every sector of Dd: and store the digest, at mount and after a
+ * format, when they are all zeros. Only an ATR image of its own has the
+ * header for it.
+ */
+static void
+digest_build(ushort d, int zero)
+{
+	DEVICE *dv = &device[3][d];
+	uchar buf[1024];
+	ushort len;
+	ulong s;
+
+	free(dv->shash);
+	dv->shash = NULL;
+	dv->digest = 0;
+
+	if (!image_digest || dv->wp || dv->raw || dv->ovl || dv->atx || ((dv->fd < 0) && (dv->ram == NULL)))
+		return;
+
+	if ((dv->shash = calloc(dv->maxsec + 1, sizeof(uint32_t))) == NULL)
+		return;
+	dv->hmax = dv->maxsec;
+
+	for (s = 1; s <= dv->maxsec; s++)
+	{
+		len = ((dv->bps == 256) && (s < 4)) ? 128 : dv->bps;
+		if (zero || (dev_rw(d, s, buf, len, 0) < 0))
+			bzero(buf, len);
+		dv->shash[s] = sector_hash(s, buf, len);
+		dv->digest += dv->shash[s];
+	}
+
+	digest_store(dv, d);
+}
+
+/* Sector s of Dd: was written: mark it, and update the digest */
+static void
+dev_changed(ushort d, ulong s, const uchar *buf, ushort len)
+{
+	DEVICE *dv = &device[3][d];
+	uint32_t h;
+
+	dirty_mark(dv, s);
+
+	if ((dv->shash == NULL) || (s > dv->hmax))
+		return;
+
+	h = sector_hash(s, buf, len);
+	dv->digest += h - dv->shash[s];
+	dv->shash[s] = h;
+	dv->digchg = 1;
+}
+
+/* Write the sectors of Dd: changed since the last delta to fname */
+static int
+delta_export(ushort d, const char *fname)
+{
+	DEVICE *dv = &device[3][d];
+	uchar h[DELTA_HDRSIZE], buf[4 + 1024];
+	char tmp[1024 + 8];
+	ushort len;
+	ulong s, n = 0;
+	FILE *f;
+	int fd;
+
+	if (dv->digchg)
+		digest_store(dv, d);
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fname);
+
+	if (((fd = mkstemp(tmp)) < 0) || ((f = fdopen(fd, "wb")) == NULL))
+	{
+		if (fd > -1)
+			close(fd);
+		goto error;
+	}
+
+	bzero(h, sizeof(h));
+	memcpy(h, DELTA_MAGIC, 8);
+	h[8] = 1;
+	jnl_put(h + 10, dv->bps, 2);
+	jnl_put(h + 12, dv->maxsec, 4);
+	jnl_put(h + 16, dv->ndirty, 4);
+	jnl_put(h + 20, dv->digest, 4);
+
+	if (fwrite(h, sizeof(h), 1, f) != 1)
+		goto fail;
+
+	for (s = 1; dv->dirty && (s <= dv->dmax) && (s <= dv->maxsec); s++)
+	{
+		if (!(dv->dirty[s >> 3] & (1 << (s & 7))))
+			continue;
+
+		len = ((dv->bps == 256) && (s < 4)) ? 128 : dv->bps;
+		jnl_put(buf, s, 4);
+
+		if ((dev_rw(d, s, buf + 4, len, 0) < 0) || (fwrite(buf, 4 + len, 1, f) != 1))
+			goto fail;
+		n++;
+	}
+
+	/* a format may have left fewer sectors than were marked */
+	if (n != dv->ndirty)
+	{
+		jnl_put(h + 16, n, 4);
+		if ((fseek(f, 0, SEEK_SET) < 0) || (fwrite(h, sizeof(h), 1, f) != 1))
+			goto fail;
+	}
+
+	(void)fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+
+	if ((fclose(f) != 0) || (rename(tmp, fname) < 0))
+	{
+		(void)unlink(tmp);
+		goto error;
+	}
+
+	free(dv->dirty);
+	dv->dirty = NULL;
+	dv->ndirty = 0;
+
+	printf("D%d: %lu sectors changed, written to %s\n", d, n, fname);
+
+	return 0;
+
+fail:
+	fclose(f);
+	(void)unlink(tmp);
+error:
+	printf("Error: cannot write the delta of D%d: to %s, %s (%d)\n", d, fname, strerror(errno), errno);
+
+	return -1;
+}
+
+/* Write the sectors of the delta in fname to Dd: */
+static int
+delta_merge(ushort d, const char *fname)
+{
+	DEVICE *dv = &device[3][d];
+	uchar h[DELTA_HDRSIZE], buf[4 + 1024];
+	ushort len;
+	ulong s, i, n;
+	FILE *f;
+
+	if (dv->wp || dv->atx)
+	{
+		printf("D%d: is write protected\n", d);
+		return -1;
+	}
+
+	if ((f = fopen(fname, "rb")) == NULL)
+	{
+		printf("Error: cannot open '%s', %s (%d)\n", fname, strerror(errno), errno);
+		return -1;
+	}
+
+	if ((fread(h, sizeof(h), 1, f) != 1) || memcmp(h, DELTA_MAGIC, 8) || (h[8] != 1) || \
+		(jnl_get(h + 10, 2) != dv->bps) || (jnl_get(h + 12, 4) != dv->maxsec))
+	{
+		printf("Error: %s is not a delta of a disk like D%d:\n", fname, d);
+		fclose(f);
+		return -1;
+	}
+
+	n = jnl_get(h + 16, 4);
+
+	for (i = 0; i < n; i++)
+	{
+		if (fread(buf, 4, 1, f) != 1)
+			break;
+		s = jnl_get(buf, 4);
+		if ((s == 0) || (s > dv->maxsec))
+			break;
+		len = ((dv->bps == 256) && (s < 4)) ? 128 : dv->bps;
+		if ((fread(buf + 4, len, 1, f) != 1) || (dev_rw(d, s, buf + 4, len, 1) < 0))
+			break;
+		dev_changed(d, s, buf + 4, len);
+	}
+
+	fclose(f);
+
+	if (dv->shash)
+		digest_store(dv, d);
+
+	printf("D%d: %lu of %lu sectors merged from %s\n", d, i, n, fname);
+
+	if (dv->shash && (i == n) && (dv->digest != (uint32_t)jnl_get(h + 20, 4)))
+		printf("D%d: the digest differs from the disk the delta was taken of\n", d);
+
+	return (i == n) ? 0 : -1;
+}
+
+/* The name of a delta taken now */
+static void
+delta_name(ushort d, char *name, size_t size)
+{
+	struct tm tm;
+	time_t now = time(NULL);
+
+	localtime_r(&now, &tm);
+	snprintf(name, size, "%s.%04d%02d%02d-%02d%02d%02d.delta", device[3][d].dirname, \
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/* SIGUSR2 */
+static void
+delta_signal(int s)
+{
+	int i, e = errno;
+
+	(void)s;
+
+	delta_epoch++;
+
+	/* wake the ports waiting for a command */
+	for (i = 0; port_wake && (i < nports); i++)
+		if ((write(ports[i].ctl[1], "", 1) < 0) && (errno != EAGAIN))
+			break;
+
+	errno = e;
+}
+
+/* Runs on the port thread between two commands */
+static void
+delta_check(void)
+{
+	char name[1024 + 32];
+	ushort d;
+
+	if (delta_seen == delta_epoch)
+		return;
+
+	delta_seen = delta_epoch;
+
+	for (d = 1; d < 16; d++)
+	{
+		if (device[3][d].ndirty == 0)
+			continue;
+		delta_name(d, name, sizeof(name));
+		(void)delta_export(d, name);
+	}
+}
+
+/* Write the changes to a compressed image back: the disk is inflated,
+ * patched with the overlay and deflated to a new file, which then takes
+ * the place of the old one. Drives still reading the old one keep it.
+ * A converted image goes to fname.atr as it is.
+ */
+static void
+atr_commit(DEVICE *dv, ushort d)
+{
+	OVERLAY *o = dv->ovl;
+	char tmp[1024 + 8], dst[1024 + 4];
+	struct stat sb;
+	uchar *buf = NULL;
+	gzFile gf;
+	ushort len;
+	ulong s, size;
+	int fd, z;
+
+	if (dv->ram)
+	{
+		if (dv->persist && dv->ramchg)
+			(void)ram_save(dv, d, dv->dirname);
+		return;
+	}
+
+	if (overlay_mode || (o == NULL) || (dv->img == NULL) || ((dv->img->gz == NULL) && !dv->conv))
+		return;
+
+	if ((o->held == 0) && (o->fmt != o->gen))
+		return;		/* nothing written */
+
+	tmp[0] = 0;
+	size = dv->img->size;
+	snprintf(dst, sizeof(dst), dv->conv ? "%s.atr" : "%s", dv->dirname);
+
+	if ((buf = malloc(size)) == NULL)
+		goto error;
+
+	if (image_read(dv->img, buf, size, 0, &z) != (long)size)
+		goto error;
+
+	for (s = 1; s <= dv->maxsec; s++)
+	{
+		len = ((dv->bps == 256) && (s < 4)) ? 128 : dv->bps;
+
+		if ((dev_offset(dv, s) + len) <= (off_t)size)
+			(void)ovl_read(o, s, buf + dev_offset(dv, s), len);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dv->dirname);
+
+	if ((fd = mkstemp(tmp)) < 0)
+	{
+		tmp[0] = 0;
+		goto error;
+	}
+
+	if (stat(dv->dirname, &sb) == 0)
+		(void)fchmod(fd, sb.st_mode & 07777);
+
+	if (dv->conv)
+	{
+		z = (write(fd, buf, size) == (long)size);
+
+		if ((close(fd) < 0) || !z || (rename(tmp, dst) < 0))
+			goto error;
+	}
+	else
+	{
+		if ((gf = gzdopen(fd, "wb")) == NULL)
+		{
+			close(fd);
+			goto error;
+		}
+
+		z = (gzwrite(gf, buf, size) == (int)size);
+
+		if ((gzclose(gf) != Z_OK) || !z || (rename(tmp, dst) < 0))
+			goto error;
+	}
+
+	ovl_reset(o);
+	free(buf);
+
+	printf("D%d: changes written to %s\n", d, dst);
+
+	return;
+
+error:
+	printf("Error: cannot write the changes to %s, %s (%d)\n", dst, strerror(errno), errno);
+	if (tmp[0])
+		(void)unlink(tmp);
+	free(buf);
+}
+
+static void
+atr_close(ushort d)
+{
+	if (device[3][d].digchg)
+		digest_store(&device[3][d], d);
+	io_drain();
+	atr_commit(&device[3][d], d);
+	if (device[3][d].writer)
+		__atomic_store_n(&device[3][d].img->writer, 0, __ATOMIC_RELEASE);
+	ovl_free(device[3][d].ovl);
+	atx_free(device[3][d].atx);
+	free(device[3][d].ram);
+	free(device[3][d].dirty);
+	free(device[3][d].shash);
+
+	if (device[3][d].img)
+		image_put(device[3][d].img);
+	else if (device[3][d].fd > -1)
+		close(device[3][d].fd);
+
+	device_reset(3, d);
+}
+
+/* Open the silly ATR file */
+static int
+atr_create(ushort d, const char *fname)
+{
+	int fd;
+
+	fd = creat(fname, S_IRUSR|S_IWUSR);
+
+	if (fd < 0)
+		return fd;
+
+	close(fd);
+
+	fd = open(fname, O_RDWR|O_EXCL);
+
+	if (fd < 0)
+		return fd;
+
+	device[3][d].fd = fd;
+	device[3][d].atr.sig = SSWAP(0x0296);
+
+	return fd;
+}
+
+/* The boot loader of the XEX disks, at $0700-$08FF. It asks the drive
+ * for its high speed index with '?', then reads the sectors from 5 on
+ * with a polled SIO routine of its own at that speed: POKEY channels 3
+ * and 4 joined at 1.79 MHz with AUDF3 set to the index, the interrupts
+ * masked and RTCLOK for the timeout. A sector which fails three times,
+ * or a drive which doesn't answer '?', sends it back to SIOV for the
+ * rest. It parses the segments as they come, calls INITAD after each one
+ * and jumps to RUNAD at the end, or to the start of the first segment if
+ * none was given. rem0-2 hold the file length, set when the disk is made.
+ * The source:
+ *
+ *	ZPLO	= $43
+ *	ZPHI	= $44
+ *	POKMSK	= $10
+ *	RTCLOK	= $14
+ *	SIOV	= $E459
+ *	RUNAD	= $02E0
+ *	INITAD	= $02E2
+ *	SSKCTL	= $0232
+ *	DDEVIC	= $0300
+ *	BUF	= $0400
+ *	AUDF3	= $D204
+ *	AUDF4	= $D206
+ *	AUDCTL	= $D208
+ *	SEROUT	= $D20D
+ *	SERIN	= $D20D
+ *	IRQEN	= $D20E
+ *	IRQST	= $D20E
+ *	SKCTL	= $D20F
+ *	PBCTL	= $D303
+ *		.byte 0, 4
+ *		.word $0700, done
+ *	start:	LDA #0
+ *		STA RUNAD
+ *		STA RUNAD+1
+ *		LDX #dcbq-dcbr+11
+ *		JSR sio
+ *		BMI seg
+ *		INC hson
+ *	seg:	JSR getb
+ *		STA ZPLO
+ *		JSR getb
+ *		STA ZPHI
+ *		AND ZPLO
+ *		CMP #$FF
+ *		BNE hdr
+ *		JSR getb
+ *		STA ZPLO
+ *		JSR getb
+ *		STA ZPHI
+ *	hdr:	LDA first
+ *		BNE hdr2
+ *		LDA ZPLO
+ *		STA runlo
+ *		LDA ZPHI
+ *		STA runhi
+ *		INC first
+ *	hdr2:	JSR getb
+ *		STA endlo
+ *		JSR getb
+ *		STA endhi
+ *		LDA #<done
+ *		STA INITAD
+ *		LDA #>done
+ *		STA INITAD+1
+ *	copy:	JSR getb
+ *		LDY #0
+ *		STA (ZPLO),Y
+ *		LDA ZPLO
+ *		CMP endlo
+ *		BNE next
+ *		LDA ZPHI
+ *		CMP endhi
+ *		BEQ segend
+ *	next:	INC ZPLO
+ *		BNE copy
+ *		INC ZPHI
+ *		JMP copy
+ *	segend:	JSR init
+ *		JMP seg
+ *	init:	JMP (INITAD)
+ *	getb:	LDA rem0
+ *		ORA rem1
+ *		ORA rem2
+ *		BNE have
+ *		PLA
+ *		PLA
+ *	run:	LDA RUNAD
+ *		ORA RUNAD+1
+ *		BNE go
+ *		LDA runlo
+ *		STA RUNAD
+ *		LDA runhi
+ *		STA RUNAD+1
+ *	go:	JMP (RUNAD)
+ *	have:	LDA rem0
+ *		BNE dec0
+ *		LDA rem1
+ *		BNE dec1
+ *		DEC rem2
+ *	dec1:	DEC rem1
+ *	dec0:	DEC rem0
+ *		LDX bidx
+ *		BPL inbuf
+ *		LDA hson
+ *		BEQ slow
+ *		LDA #3
+ *		STA tries
+ *	fast:	JSR hsread
+ *		BCC rd0
+ *		DEC tries
+ *		BNE fast
+ *		DEC hson
+ *	slow:	LDX #11
+ *		JSR sio
+ *		BMI slow
+ *	rd0:	INC seclo
+ *		BNE rd1
+ *		INC sechi
+ *	rd1:	LDX #0
+ *	inbuf:	LDA BUF,X
+ *		INX
+ *		STX bidx
+ *	done:	RTS
+ *	sio:	LDY #11
+ *	sio1:	LDA dcbr,X
+ *		STA DDEVIC,Y
+ *		DEX
+ *		DEY
+ *		BPL sio1
+ *		JMP SIOV
+ *	hsread:	LDA seclo
+ *		STA cmd+2
+ *		LDA sechi
+ *		STA cmd+3
+ *		LDX #3
+ *		LDA #0
+ *		CLC
+ *	hs1:	ADC cmd,X
+ *		ADC #0
+ *		DEX
+ *		BPL hs1
+ *		STA cmd+4
+ *		SEI
+ *		LDA #$28
+ *		STA AUDCTL
+ *		LDA hsidx
+ *		STA AUDF3
+ *		LDA #0
+ *		STA AUDF4
+ *		LDA #$34
+ *		STA PBCTL
+ *		LDA #$23
+ *		STA SKCTL
+ *		LDA RTCLOK
+ *		ADC #50
+ *		STA tend
+ *		LDA #$10
+ *		INX
+ *	hs2:	LDY #0
+ *		STY IRQEN
+ *		STA IRQEN
+ *		LDY cmd,X
+ *		STY SEROUT
+ *	hs3:	BIT IRQST
+ *		BNE hs3
+ *		INX
+ *		CPX #5
+ *		BNE hs2
+ *		LDA #$08
+ *		STA IRQEN
+ *	hs4:	BIT IRQST
+ *		BNE hs4
+ *		LDA #$13
+ *		STA SKCTL
+ *		LDY #0
+ *		STY IRQEN
+ *		LDA #$20
+ *		STA IRQEN
+ *		LDA #$3C
+ *		STA PBCTL
+ *		JSR getc
+ *		CMP #'A'
+ *		BNE hsbad
+ *		JSR getc
+ *		CMP #'C'
+ *		BNE hsbad
+ *		LDX #0
+ *	hs5:	JSR getc
+ *		STA BUF,X
+ *		INX
+ *		BPL hs5
+ *		JSR getc
+ *		STA cmd+4
+ *		LDX #127
+ *		LDA #0
+ *		CLC
+ *	hs6:	ADC BUF,X
+ *		ADC #0
+ *		DEX
+ *		BPL hs6
+ *		EOR cmd+4
+ *		BEQ hsend
+ *	hsbad:	JSR getc
+ *		JMP hsbad
+ *	hsend:	LDA POKMSK
+ *		STA IRQEN
+ *		LDA SSKCTL
+ *		STA SKCTL
+ *		CLI
+ *		RTS
+ *	getc:	LDA #$20
+ *	gc1:	BIT IRQST
+ *		BEQ gc2
+ *		LDY RTCLOK
+ *		CPY tend
+ *		BNE gc1
+ *		PLA
+ *		PLA
+ *		BCS hsend
+ *	gc2:	LDY #0
+ *		STY IRQEN
+ *		STA IRQEN
+ *		LDA SERIN
+ *		RTS
+ *	rem0:	.byte 0
+ *	rem1:	.byte 0
+ *	rem2:	.byte 0
+ *	bidx:	.byte 128
+ *	first:	.byte 0
+ *	runlo:	.byte 0
+ *	runhi:	.byte 0
+ *	endlo:	.byte 0
+ *	endhi:	.byte 0
+ *	hson:	.byte 0
+ *	tries:	.byte 0
+ *	tend:	.byte 0
+ *	cmd:	.byte $31, $52, 0, 0, 0
+ *	dcbr:	.byte $31, 1, $52, $40, <BUF, >BUF, 7, 0, 128, 0
+ *	seclo:	.byte 5
+ *	sechi:	.byte 0
+ *	dcbq:	.byte $31, 1, '?', $40, <hsidx, >hsidx, 7, 0, 1, 0, 0, 0
+ *	hsidx:	.byte 0
+ */
+
+# define XEX_REM	0x1d5	/* offset of rem0-2 in the loader */
+
+static const uchar xex_loader[] =
+{
+	0x00, 0x04, 0x00, 0x07, 0xec, 0x07, 0xa9, 0x00, 0x8d, 0xe0, 0x02, 0x8d,
+	0xe1, 0x02, 0xa2, 0x17, 0x20, 0xed, 0x07, 0x30, 0x03, 0xee, 0xde, 0x08,
+	0x20, 0x81, 0x07, 0x85, 0x43, 0x20, 0x81, 0x07, 0x85, 0x44, 0x25, 0x43,
+	0xc9, 0xff, 0xd0, 0x0a, 0x20, 0x81, 0x07, 0x85, 0x43, 0x20, 0x81, 0x07,
+	0x85, 0x44, 0xad, 0xd9, 0x08, 0xd0, 0x0d, 0xa5, 0x43, 0x8d, 0xda, 0x08,
+	0xa5, 0x44, 0x8d, 0xdb, 0x08, 0xee, 0xd9, 0x08, 0x20, 0x81, 0x07, 0x8d,
+	0xdc, 0x08, 0x20, 0x81, 0x07, 0x8d, 0xdd, 0x08, 0xa9, 0xec, 0x8d, 0xe2,
+	0x02, 0xa9, 0x07, 0x8d, 0xe3, 0x02, 0x20, 0x81, 0x07, 0xa0, 0x00, 0x91,
+	0x43, 0xa5, 0x43, 0xcd, 0xdc, 0x08, 0xd0, 0x07, 0xa5, 0x44, 0xcd, 0xdd,
+	0x08, 0xf0, 0x09, 0xe6, 0x43, 0xd0, 0xe7, 0xe6, 0x44, 0x4c, 0x5a, 0x07,
+	0x20, 0x7e, 0x07, 0x4c, 0x18, 0x07, 0x6c, 0xe2, 0x02, 0xad, 0xd5, 0x08,
+	0x0d, 0xd6, 0x08, 0x0d, 0xd7, 0x08, 0xd0, 0x19, 0x68, 0x68, 0xad, 0xe0,
+	0x02, 0x0d, 0xe1, 0x02, 0xd0, 0x0c, 0xad, 0xda, 0x08, 0x8d, 0xe0, 0x02,
+	0xad, 0xdb, 0x08, 0x8d, 0xe1, 0x02, 0x6c, 0xe0, 0x02, 0xad, 0xd5, 0x08,
+	0xd0, 0x0b, 0xad, 0xd6, 0x08, 0xd0, 0x03, 0xce, 0xd7, 0x08, 0xce, 0xd6,
+	0x08, 0xce, 0xd5, 0x08, 0xae, 0xd8, 0x08, 0x10, 0x28, 0xad, 0xde, 0x08,
+	0xf0, 0x12, 0xa9, 0x03, 0x8d, 0xdf, 0x08, 0x20, 0xfc, 0x07, 0x90, 0x0f,
+	0xce, 0xdf, 0x08, 0xd0, 0xf6, 0xce, 0xde, 0x08, 0xa2, 0x0b, 0x20, 0xed,
+	0x07, 0x30, 0xf9, 0xee, 0xf0, 0x08, 0xd0, 0x03, 0xee, 0xf1, 0x08, 0xa2,
+	0x00, 0xbd, 0x00, 0x04, 0xe8, 0x8e, 0xd8, 0x08, 0x60, 0xa0, 0x0b, 0xbd,
+	0xe6, 0x08, 0x99, 0x00, 0x03, 0xca, 0x88, 0x10, 0xf6, 0x4c, 0x59, 0xe4,
+	0xad, 0xf0, 0x08, 0x8d, 0xe3, 0x08, 0xad, 0xf1, 0x08, 0x8d, 0xe4, 0x08,
+	0xa2, 0x03, 0xa9, 0x00, 0x18, 0x7d, 0xe1, 0x08, 0x69, 0x00, 0xca, 0x10,
+	0xf8, 0x8d, 0xe5, 0x08, 0x78, 0xa9, 0x28, 0x8d, 0x08, 0xd2, 0xad, 0xfe,
+	0x08, 0x8d, 0x04, 0xd2, 0xa9, 0x00, 0x8d, 0x06, 0xd2, 0xa9, 0x34, 0x8d,
+	0x03, 0xd3, 0xa9, 0x23, 0x8d, 0x0f, 0xd2, 0xa5, 0x14, 0x69, 0x32, 0x8d,
+	0xe0, 0x08, 0xa9, 0x10, 0xe8, 0xa0, 0x00, 0x8c, 0x0e, 0xd2, 0x8d, 0x0e,
+	0xd2, 0xbc, 0xe1, 0x08, 0x8c, 0x0d, 0xd2, 0x2c, 0x0e, 0xd2, 0xd0, 0xfb,
+	0xe8, 0xe0, 0x05, 0xd0, 0xe8, 0xa9, 0x08, 0x8d, 0x0e, 0xd2, 0x2c, 0x0e,
+	0xd2, 0xd0, 0xfb, 0xa9, 0x13, 0x8d, 0x0f, 0xd2, 0xa0, 0x00, 0x8c, 0x0e,
+	0xd2, 0xa9, 0x20, 0x8d, 0x0e, 0xd2, 0xa9, 0x3c, 0x8d, 0x03, 0xd3, 0x20,
+	0xb7, 0x08, 0xc9, 0x41, 0xd0, 0x2a, 0x20, 0xb7, 0x08, 0xc9, 0x43, 0xd0,
+	0x23, 0xa2, 0x00, 0x20, 0xb7, 0x08, 0x9d, 0x00, 0x04, 0xe8, 0x10, 0xf7,
+	0x20, 0xb7, 0x08, 0x8d, 0xe5, 0x08, 0xa2, 0x7f, 0xa9, 0x00, 0x18, 0x7d,
+	0x00, 0x04, 0x69, 0x00, 0xca, 0x10, 0xf8, 0x4d, 0xe5, 0x08, 0xf0, 0x06,
+	0x20, 0xb7, 0x08, 0x4c, 0xa4, 0x08, 0xa5, 0x10, 0x8d, 0x0e, 0xd2, 0xad,
+	0x32, 0x02, 0x8d, 0x0f, 0xd2, 0x58, 0x60, 0xa9, 0x20, 0x2c, 0x0e, 0xd2,
+	0xf0, 0x0b, 0xa4, 0x14, 0xcc, 0xe0, 0x08, 0xd0, 0xf4, 0x68, 0x68, 0xb0,
+	0xe1, 0xa0, 0x00, 0x8c, 0x0e, 0xd2, 0x8d, 0x0e, 0xd2, 0xad, 0x0d, 0xd2,
+	0x60, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x31, 0x52, 0x00, 0x00, 0x00, 0x31, 0x01, 0x52, 0x40, 0x00, 0x04,
+	0x07, 0x00, 0x80, 0x00, 0x05, 0x00, 0x31, 0x01, 0x3f, 0x40, 0xfe, 0x08,
+	0x07, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00
+};
+
+/* True if fd holds an Atari executable: it starts with $FF $FF */
+static int
+xex_probe(int fd)
+{
+	uchar h[2];
+
+	return ((pread(fd, h, 2, 0) == 2) && (h[0] == 0xff) && (h[1] == 0xff));
+}
+
+/* An unlinked temporary file holding size bytes of buf; its fd, or -1 */
+static int
+tmp_disk(const uchar *buf, ulong size)
+{
+	FILE *tf;
+	int r = -1;
+
+	if ((tf = tmpfile()) == NULL)
+		return -1;
+
+	if ((fwrite(buf, 1, size, tf) == size) && (fflush(tf) == 0) && \
+		((r = dup(fileno(tf))) >= 0))
+		lseek(r, 0, SEEK_SET);
+
+	fclose(tf);
+
+	return r;
+}
+
+/* Make up a boot disk for the executable in fd: an ATR image with the
+ * loader in sectors 1-4 and the file as it is from sector 5 on, so that
+ * the loader streams it in order. The disk is an unlinked temporary
+ * file; fd is closed, the disk's fd returned, -1 on error.
+ */
+static int
+xex_disk(int fd, const char *fname)
+{
+	struct stat sb;
+	uchar *buf = NULL;
+	ulong len, size;
+	int r = -1;
+
+	if (fstat(fd, &sb) < 0)
+		goto exit;
+
+	len = (ulong)sb.st_size;
+	size = 16 + XEX_BOOT + ((len + 127) / 128) * 128;
+
+	if ((len > 0x00ffffffUL) || (((size - 16) / 128) > 65535))
+	{
+		printf("Error: %s is too large to boot\n", fname);
+		goto exit;
+	}
+
+	if ((buf = calloc(1, size)) == NULL)
+		goto exit;
+
+	if (pread(fd, buf + 16 + XEX_BOOT, len, 0) != (ssize_t)len)
+		goto exit;
+
+	buf[0] = 0x96;				/* the ATR header */
+	buf[1] = 0x02;
+	buf[2] = ((size - 16) >> 4) & 0xff;
+	buf[3] = ((size - 16) >> 12) & 0xff;
+	buf[4] = 0x80;
+	buf[5] = 0x00;
+	buf[6] = ((size - 16) >> 20) & 0xff;
+
+	memcpy(buf + 16, xex_loader, sizeof(xex_loader));
+	buf[16 + XEX_REM] = len & 0xff;
+	buf[16 + XEX_REM + 1] = (len >> 8) & 0xff;
+	buf[16 + XEX_REM + 2] = (len >> 16) & 0xff;
+
+	r = tmp_disk(buf, size);
+
+exit:
+	if (r < 0)
+		printf("Error: cannot make a boot disk for %s, %s (%d)\n", fname, strerror(errno), errno);
+	free(buf);
+	close(fd);
+
+	return r;
+}
+
+/* True if fname is an XFD image: the sectors as they are, no header */
+static int
+xfd_probe(const char *fname, int fd)
+{
+	struct stat sb;
+	size_t l = strlen(fname);
+
+	return ((l > 4) && (strcasecmp(fname + l - 4, ".xfd") == 0) && (fstat(fd, &sb) == 0) && \
+		(sb.st_size > 0) && ((sb.st_size % 128) == 0));
+}
+
+static int
+xfd_mount(ushort d, int fd, ulong *size)
+{
+	struct stat sb;
+
+	if (device[3][d].img || (fstat(fd, &sb) < 0))
+		return -1;
+
+	device[3][d].raw = 1;
+	device[3][d].atr.bps = ((sb.st_size == 183936) || (sb.st_size == 184320)) ? 256 : 128;
+
+	*size = sb.st_size;
+
+	return 0;
+}
+
+/* DiskComm (DCM) archives hold a disk in one or more passes. A pass
+ * starts with $F9 or $FA, a byte with the last pass flag (bit 7), the
+ * density (bits 5-6: SD, DD, ED) and the pass number, and the first
+ * sector number. Then come the sectors, each one a type byte and its
+ * data, built on the sector before:
+ *
+ *	$41	the bytes up to an offset, given last to first
+ *	$42	a DOS sector: 123 times one byte, then 5 bytes
+ *	$43	literal bytes and runs of one byte, up to offsets in turn
+ *	$44	the bytes from an offset to the end
+ *	$46	the same as the sector before
+ *	$47	the whole sector
+ *	$45	the end of the pass
+ *
+ * With bit 7 of the type set the next sector follows, else its number
+ * comes after the data. An offset of 0 beyond the start means 256.
+ */
+
+# define DCM_BYTE(p, end, bad)	(((p) < (end)) ? *(p)++ : ((bad) = 1, 0))
+
+/* True if fd holds a DCM archive: the header of the first pass */
+static int
+dcm_probe(int fd)
+{
+	uchar h[2];
+
+	return ((pread(fd, h, 2, 0) == 2) && ((h[0] == 0xf9) || (h[0] == 0xfa)) && ((h[1] & 0x1f) == 1));
+}
+
+/* Expand the archive in fd into an ATR image in a temporary file; its fd,
+ * or -1. fd is closed.
+ */
+static int
+dcm_disk(int fd, const char *fname)
+{
+	uchar *in = NULL, *out = NULL, sec[256], type, c;
+	const uchar *p, *end;
+	ulong nsec = 0, bps = 128, size = 0, sn, len, o, e, pars;
+	struct stat sb;
+	int bad = 0, last = 0, r = -1;
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size > 0x200000) || ((in = malloc(sb.st_size)) == NULL) || \
+		(pread(fd, in, sb.st_size, 0) != (long)sb.st_size))
+		goto exit;
+
+	p = in;
+	end = in + sb.st_size;
+	bzero(sec, sizeof(sec));
+
+	while (!last && !bad)
+	{
+		type = DCM_BYTE(p, end, bad);
+		c = DCM_BYTE(p, end, bad);
+		sn = DCM_BYTE(p, end, bad);
+		sn |= DCM_BYTE(p, end, bad) << 8;
+
+		if (bad || ((type != 0xf9) && (type != 0xfa)))
+			goto exit;
+
+		last = c & 0x80;
+
+		if (out == NULL)
+		{
+			nsec = (((c >> 5) & 3) == 2) ? 1040 : 720;
+			bps = (((c >> 5) & 3) == 1) ? 256 : 128;
+			size = 16 + ((bps == 256) ? (384 + (nsec - 3) * 256) : (nsec * 128));
+
+			if ((out = calloc(1, size)) == NULL)
+				goto exit;
+
+			pars = (size - 16) / 16;
+			out[0] = 0x96;
+			out[1] = 0x02;
+			out[2] = pars & 0xff;
+			out[3] = (pars >> 8) & 0xff;
+			out[4] = bps & 0xff;
+			out[5] = bps >> 8;
+			out[6] = (pars >> 16) & 0xff;
+		}
+
+		while (!bad && ((type = DCM_BYTE(p, end, bad)) & 0x7f) != 0x45)
+		{
+			len = ((bps == 256) && (sn > 3)) ? 256 : 128;
+
+			switch (type & 0x7f)
+			{
+				case 0x41:
+				{
+					o = DCM_BYTE(p, end, bad);
+					if (o >= len)
+						goto exit;
+					for (e = o + 1; e > 0; e--)
+						sec[e - 1] = DCM_BYTE(p, end, bad);
+					break;
+				}
+				case 0x42:
+				{
+					c = DCM_BYTE(p, end, bad);
+					memset(sec, c, 123);
+					for (o = 123; o < 128; o++)
+						sec[o] = DCM_BYTE(p, end, bad);
+					break;
+				}
+				case 0x43:
+				{
+					for (o = 0; o < len; )
+					{
+						e = DCM_BYTE(p, end, bad);
+						if ((e == 0) && o)
+							e = 256;
+						if ((e < o) || (e > len))
+							goto exit;
+						for (; o < e; o++)
+							sec[o] = DCM_BYTE(p, end, bad);
+						if (o >= len)
+							break;
+
+						e = DCM_BYTE(p, end, bad);
+						if ((e == 0) && o)
+							e = 256;
+						if ((e < o) || (e > len))
+							goto exit;
+						c = DCM_BYTE(p, end, bad);
+						for (; o < e; o++)
+							sec[o] = c;
+					}
+					break;
+				}
+				case 0x44:
+				{
+					o = DCM_BYTE(p, end, bad);
+					if (o >= len)
+						goto exit;
+					for (; o < len; o++)
+						sec[o] = DCM_BYTE(p, end, bad);
+					break;
+				}
+				case 0x46:
+					break;
+				case 0x47:
+				{
+					for (o = 0; o < len; o++)
+						sec[o] = DCM_BYTE(p, end, bad);
+					break;
+				}
+				default:
+					goto exit;
+			}
+
+			if (bad || (sn == 0) || (sn > nsec))
+				goto exit;
+
+			o = ((bps == 256) && (sn > 3)) ? (384 + (sn - 4) * 256) : ((sn - 1) * 128);
+			memcpy(out + 16 + o, sec, len);
+
+			if (type & 0x80)
+				sn++;
+			else
+			{
+				sn = DCM_BYTE(p, end, bad);
+				sn |= DCM_BYTE(p, end, bad) << 8;
+			}
+		}
+	}
+
+	if (!bad)
+		r = tmp_disk(out, size);
+
+exit:
+	if (r < 0)
+		printf("Error: cannot expand %s, not a valid DCM archive\n", fname);
+	free(in);
+	free(out);
+	close(fd);
+
+	return r;
+}
+
+/* Read the ATR header of the image on Dd:, and the size it gives */
+static int
+atr_header(ushort d, int fd, ulong *size)
+{
+	ATR atr;
+	long r;
+	int z;
+
+	bzero(&atr, sizeof(ATR));
+
+	if (device[3][d].img)
+		r = image_read(device[3][d].img, (uchar *)&atr, sizeof(ATR), 0, &z);
+	else
+		r = read(fd, &atr, sizeof(ATR));
+
+	if ((r < (long)sizeof(ATR)) || (atr.sig != SSWAP(0x0296)))
+		return -1;
+
+	if ((atr.bps != SSWAP(0x0080)) && \
+		(atr.bps != SSWAP(0x0100)) && \
+			(atr.bps != SSWAP(0x0200)) && \
+				(atr.bps != SSWAP(0x0400)))
+	{
+		return -1;
+	}
+
+	device[3][d].atr.sig = SSWAP(atr.sig);
+	device[3][d].atr.wpars = SSWAP(atr.wpars);
+	device[3][d].atr.bps = SSWAP(atr.bps);
+	device[3][d].atr.hipars = atr.hipars;
+	device[3][d].atr.crc = LSWAP(atr.crc);
+	device[3][d].atr.costam = LSWAP(atr.costam);
+	device[3][d].atr.prot = atr.prot;
+
+	*size = device[3][d].atr.wpars + (device[3][d].atr.hipars * 65536);
+	*size *= 16;
+
+	return 0;
+}
+
+/* Load the ATX or PRO image on Dd:; it is only read */
+static int
+atx_mount(ushort d, int fd, ulong *size, int pro)
+{
+	ATXDISK *ax;
+
+	if (device[3][d].img || ((ax = pro ? pro_load(fd) : atx_load(fd)) == NULL))
+		return -1;
+
+	device[3][d].atx = ax;
+	device[3][d].wp = 1;
+	device[3][d].atr.bps = ax->bps;
+
+	*size = ATX_TRACKS * ax->spt * ax->bps;
+
+	return 0;
+}
+
+/* Mount the image fname on Dd: */
+static int
+atr_mount(ushort d, char *fname, int full13force)
+{
+	char side[1024 + 4];
+	int fd, packed;
+	long r;
+	ulong size;
+
+	atr_close(d);
+
+	if (strncmp(fname, "ram:", 4) == 0)
+	{
+		if (ram_mount(d, fname) < 0)
+			return -1;
+		digest_build(d, 0);
+		return 0;
+	}
+
+	if ((fd = open(fname, overlay_mode ? O_RDONLY : O_RDWR)) < 0 &&
+		( (errno != EACCES && errno != EROFS) ||
+		  (fd = open(fname, O_RDONLY)) < 0 ) )
+		return -1;
+
+# if 0
+	if (flock(fd, LOCK_EX|LOCK_NB) < 0)
+		goto error;
+# endif
+
+	/* an executable boots through a disk made up for it */
+	if (xex_probe(fd))
+	{
+		if ((fd = xex_disk(fd, fname)) < 0)
+			return -1;
+		device[3][d].wp = 1;
+	}
+
+	/* a DCM archive is expanded; the changes made go to fname.atr, and
+	 * once it is there that is mounted instead
+	 */
+	if (dcm_probe(fd))
+	{
+		snprintf(side, sizeof(side), "%s.atr", fname);
+
+		if (access(side, F_OK) == 0)
+		{
+			close(fd);
+			printf("D%d: the changes to %s are in %s\n", d, fname, side);
+			return atr_mount(d, side, full13force);
+		}
+
+		if ((fd = dcm_disk(fd, fname)) < 0)
+			return -1;
+		device[3][d].conv = 1;
+	}
+
+	/* a compressed image is read through its index */
+	if (gz_probe(fd))
+	{
+		if ((device[3][d].img = image_get(fd)) == NULL)
+		{
+			printf("Error: too many images open\n");
+			goto error;
+		}
+		fd = device[3][d].img->fd;
+		if (image_gz(device[3][d].img) < 0)
+			goto error;
+	}
+
+	device[3][d].fd = fd;
+	device[3][d].full13force = full13force;
+	if (log_flag)
+		printf("Disk %ld will be forced to %s after format\n", (long)d, full13force? "FULL13": "NORMAL");
+
+	if (!overlay_mode && ((fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY))
+		device[3][d].wp = 1;
+
+	/* copy-protected originals are served by their sector timing */
+	if (atx_probe(fd))
+		r = atx_mount(d, fd, &size, 0);
+	else if (pro_probe(fd))
+		r = atx_mount(d, fd, &size, 1);
+	else if (xfd_probe(fname, fd))
+		r = xfd_mount(d, fd, &size);
+	else
+		r = atr_header(d, fd, &size);
+
+	if ((r < 0) || (drive_setup(d, size, device[3][d].atr.bps) < 0))
+		goto error;
+
+	packed = (device[3][d].img != NULL) || device[3][d].conv;
+
+	/* the file is rebuilt from one overlay at unmount, so while a drive
+	 * writes a compressed image the others only read it
+	 */
+	if (device[3][d].img && !overlay_mode && !device[3][d].wp)
+	{
+		int none = 0;
+
+		if (__atomic_compare_exchange_n(&device[3][d].img->writer, &none, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			device[3][d].writer = 1;
+		else
+		{
+			printf("D%d: %s is written through another drive\n", d, fname);
+			device[3][d].wp = 1;
+		}
+	}
+
+	/* the writes to a compressed or converted image wait in an overlay */
+	if ((overlay_mode || packed) && !device[3][d].wp)
+	{
+		if ((device[3][d].ovl = ovl_new(d, size)) == NULL)
+			goto error;
+		device[3][d].ovl->keep = !overlay_mode;
+	}
+
+	printf("D%d: %ld sectors, %ld bytes total, mounted on %s%s\n", d, device[3][d].maxsec, size, fname, \
+		device[3][d].wp ? " (read-only)" : overlay_mode ? " (overlay)" : device[3][d].conv ? " (converted)" : \
+		packed ? " (compressed)" : "");
+
+	report_percom(d);
+
+	setup_status(d);
+
+	/* from now on the file is the registry's; an ATX image is in memory */
+	if (device[3][d].atx == NULL)
+	{
+		if ((device[3][d].img == NULL) && ((device[3][d].img = image_get(fd)) == NULL))
+		{
+			printf("Error: too many images open\n");
+			goto error;
+		}
+		device[3][d].fd = device[3][d].img->fd;
+
+		if (!device[3][d].wp && (device[3][d].ovl == NULL) && ((r = jnl_open(device[3][d].img, fname)) > 0))
+			printf("D%d: %ld sectors written again from %s.jnl\n", d, r, fname);
+	}
+	snprintf(device[3][d].dirname, sizeof(device[3][d].dirname), "%s", fname);
+
+	digest_build(d, 0);
+
+	return 0;
+
+error:	atr_close(d);
+
+	printf("Error: %s is not a valid ATR file\n", fname);
+
+	return -1;
+}
+
+/* Mount the directory fname on PCLu: */
+static int
+pcl_mount(ushort u, char *fname)
+{
+	char newpath[1024];
+
+	if (dir_realpath(fname, newpath, sizeof(newpath)) < 0)
+		return -1;
+
+# if 0
+	sl = strlen(newpath);
+
+	if (sl && (newpath[sl-1] != '/'))
+		strcat(newpath, "/");
+# endif
+
+	device_reset(6, u);
+	strcpy(device[6][u].dirname, newpath);
+	device[6][u].on = 1;
+
+	printf("PCL%d: mounted on %s\n", u, newpath);
+
+	return 0;
+}
+
+static int
+atr_open(char *fname, int full13force)
+{
+	int r;
+	long sl;
+	struct stat sb;
+
+	atr_close(drvcnt);
+
+	if ((strncmp(fname, "ram:", 4) == 0) && (drvcnt < 16))
+	{
+		if (atr_mount(drvcnt, fname, full13force) < 0)
+			return -1;
+
+		drvcnt++;
+
+		return 0;
+	}
+
+	sl = strlen(fname);
+
+	if (fname[sl - 1] == '/')
+		fname[sl - 1] = 0;
+
+	if ((r = stat(fname, &sb)) < 0)
+	{
+		printf("Error: %s() cannot stat() '%s', %s (%d)\n", __extension__ __FUNCTION__, fname, strerror(errno), errno);
+		return -1;
+	}
+
+	if ((sb.st_mode & S_IFMT) == S_IFREG)
+	{
+		if (drvcnt > 15)
+			return -1;
+
+		if (atr_mount(drvcnt, fname, full13force) < 0)
+			return -1;
+
+		drvcnt++;
+	}
+	else
+	{
+		if ((sb.st_mode & S_IFMT) == S_IFDIR)
+		{
+			if (pclcnt > 15)
+				return -1;
+
+			if (pcl_mount(pclcnt, fname) < 0)
+				return -1;
+		}
+		else
+			return -1;
+
+		pclcnt++;
+	}
+
+	return 0;
+}
+
+static off_t
+atr_offset(ushort i, long sector)
+{
+	return dev_offset(&device[3][i], sector);
+}
+
+/* ============== Image catalogue ================= */
+
+/* With -L the directory tree is scanned once at startup, and the images
+ * in it are listed with their format and geometry, nothing is kept open.
+ * A menu program on the Atari reads the list from $70 and has a title
+ * mounted in a drive when it is picked; the image is opened then, and
+ * kept warm by the registry after it is taken out.
+ *
+ * $7u 'S'	4 bytes: the number of titles, LE, and 2 zeros
+ * $7u 'R'	128 bytes for title DAUX: sectors, bytes per sector (LE),
+ *		the format letter, then its path under the directory,
+ *		ended by an EOL
+ * $7u 'M'	mount title DAUX in Du:
+ */
+
+# define CAT_DEPTH	8	/* directory levels scanned */
+# define CAT_MAX	65535	/* titles, DAUX can't address more */
+# define CAT_RECORD	128
+
+static CATENTRY *catalogue = NULL;	/* sorted by path, read-only once built */
+static ulong catcnt = 0, catsize = 0;
+static ulong catskip = 0;		/* the root's length, with the slash */
+
+/* Sectors of an image of size bytes, as drive_setup() counts them */
+static ulong
+cat_sectors(ulong size, ushort bps)
+{
+	if ((size % bps) == 0)
+		return size / bps;
+
+	return (size > 384) ? (((size - 384) / bps) + 3) : 0;
+}
+
+/* The geometry from an ATR header; -1 if it isn't one */
+static int
+cat_atr(const uchar *h, CATENTRY *e)
+{
+	ulong size;
+
+	if ((h[0] != 0x96) || (h[1] != 0x02))
+		return -1;
+
+	e->bps = h[4] | (h[5] << 8);
+	if ((e->bps != 128) && (e->bps != 256) && (e->bps != 512) && (e->bps != 1024))
+		return -1;
+
+	size = (h[2] | (h[3] << 8) | (h[6] << 16)) * 16UL;
+	e->sectors = cat_sectors(size, e->bps);
+
+	return 0;
+}
+
+/* Tell the format of the file in fd the way atr_mount() does; -1 if it
+ * isn't an image
+ */
+static int
+cat_probe(const char *path, int fd, CATENTRY *e)
+{
+	uchar h[32];
+	struct stat sb;
+	gzFile gz;
+	int n;
+
+	bzero(h, sizeof(h));
+
+	if ((fstat(fd, &sb) < 0) || (pread(fd, h, sizeof(h), 0) < 2))
+		return -1;
+
+	e->bps = 128;
+
+	if (xex_probe(fd))
+	{
+		e->fmt = 'E';
+		e->sectors = (XEX_BOOT / 128) + ((sb.st_size + 127) / 128);
+	}
+	else if (dcm_probe(fd))
+	{
+		/* the density of the first pass: SD, DD, ED */
+		e->fmt = 'D';
+		e->bps = (((h[1] >> 5) & 3) == 1) ? 256 : 128;
+		e->sectors = (((h[1] >> 5) & 3) == 2) ? 1040 : 720;
+	}
+	else if (gz_probe(fd))
+	{
+		/* just the header is inflated */
+		e->fmt = 'Z';
+		if ((n = dup(fd)) < 0)
+			return -1;
+		if ((gz = gzdopen(n, "rb")) == NULL)
+		{
+			close(n);
+			return -1;
+		}
+		n = gzread(gz, h, 16);
+		gzclose(gz);
+		if ((n < 16) || (cat_atr(h, e) < 0))
+			return -1;
+	}
+	else if (atx_probe(fd))
+	{
+		e->fmt = 'X';
+		e->bps = (h[18] == 2) ? 256 : 128;
+		e->sectors = ATX_TRACKS * ((h[18] == 1) ? 26 : 18);
+	}
+	else if (pro_probe(fd))
+	{
+		e->fmt = 'P';
+		e->sectors = 720;
+	}
+	else if (xfd_probe(path, fd))
+	{
+		e->fmt = 'F';
+		e->bps = ((sb.st_size == 183936) || (sb.st_size == 184320)) ? 256 : 128;
+		e->sectors = cat_sectors(sb.st_size, e->bps);
+	}
+	else
+	{
+		e->fmt = 'A';
+		if (cat_atr(h, e) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void
+cat_scan(const char *dir, int depth)
+{
+	char path[1024];
+	struct dirent *de;
+	struct stat sb;
+	CATENTRY e, *c;
+	DIR *dh;
+	int fd;
+
+	if ((depth > CAT_DEPTH) || ((dh = opendir(dir)) == NULL))
+		return;
+
+	while ((catcnt < CAT_MAX) && ((de = readdir(dh)) != NULL))
+	{
+		if (de->d_name[0] == '.')
+			continue;
+
+		if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path))
+			continue;
+
+		if (stat(path, &sb) < 0)
+			continue;
+
+		if (S_ISDIR(sb.st_mode))
+		{
+			cat_scan(path, depth + 1);
+			continue;
+		}
+
+		if (!S_ISREG(sb.st_mode) || ((fd = open(path, O_RDONLY)) < 0))
+			continue;
+
+		bzero(&e, sizeof(e));
+		if ((cat_probe(path, fd, &e) == 0) && ((e.path = strdup(path)) != NULL))
+		{
+			if (catcnt == catsize)
+			{
+				catsize = catsize ? (catsize * 2) : 256;
+				if ((c = realloc(catalogue, catsize * sizeof(CATENTRY))) == NULL)
+				{
+					free(e.path);
+					close(fd);
+					break;
+				}
+				catalogue = c;
+			}
+			catalogue[catcnt++] = e;
+		}
+		close(fd);
+	}
+
+	closedir(dh);
+}
+
+static int
+cat_cmp(const void *a, const void *b)
+{
+	return strcmp(((const CATENTRY *)a)->path, ((const CATENTRY *)b)->path);
+}
+
+/* Build the catalogue of the images under dir (-L) */
+static int
+cat_open(const char *dir)
+{
+	char root[1024];
+
+	if (dir_realpath(dir, root, sizeof(root)) < 0)
+	{
+		printf("Error: cannot open the catalogue directory '%s'\n", dir);
+		return -1;
+	}
+
+	catskip = strlen(root) + 1;
+	cat_scan(root, 0);
+
+	if (catcnt)
+		qsort(catalogue, catcnt, sizeof(CATENTRY), cat_cmp);
+
+	printf("Catalogue: %lu images in %s%s\n", catcnt, root, (catcnt == CAT_MAX) ? " (full)" : "");
+
+	return 0;
+}
+
+/* Put the image fname into Du:, the old disk stays in if it won't mount.
+ * Runs on the port thread.
+ */
+static int
+drive_replace(ushort u, char *fname)
+{
+	DEVICE old;
+
+	memcpy(&old, &device[3][u], sizeof(DEVICE));
+	device_reset(3, u);
+
+	if (atr_mount(u, fname, old.full13force) < 0)
+	{
+		memcpy(&device[3][u], &old, sizeof(DEVICE));
+		return -1;
+	}
+
+	if (old.digchg)
+		digest_store(&old, u);
+	io_drain();
+	atr_commit(&old, u);
+	if (old.writer)
+		__atomic_store_n(&old.img->writer, 0, __ATOMIC_RELEASE);
+	ovl_free(old.ovl);
+	atx_free(old.atx);
+	free(old.ram);
+	free(old.dirty);
+	free(old.shash);
+	if (old.img)
+		image_put(old.img);
+	else if (old.fd > -1)
+		close(old.fd);
+
+	return 0;
+}
+
+/* Format timing profiles (-F), the time a track takes. The image is
+ * formatted at once anyway, this is for the software which expects the
+ * format to take a while. The times of the drives are approximate.
+ */
+static const struct
+{
+	const char *name;
+	long ms;
+} format_profile[] =
+{
+	{ "none", 0 },
+	{ "sio2bsd", 12 },		/* what rev. 19 did */
+	{ "1050", 600 },
+	{ "xf551", 250 },
+	{ NULL, 0 }
+};
+
+static long format_ms = 0;
+
+static int
+format_profile_set(const char *arg)
+{
+	char *e;
+	int x;
+
+	for (x = 0; format_profile[x].name; x++)
+	{
+		if (strcmp(arg, format_profile[x].name) == 0)
+		{
+			format_ms = format_profile[x].ms;
+			return 0;
+		}
+	}
+
+	format_ms = strtol(arg, &e, 10);
+
+	return ((e == arg) || *e || (format_ms < 0)) ? -1 : 0;
+}
+
+/* Take the time of the profile, but never as long as the Atari waits */
+static void
+format_delay(ushort d)
+{
+	ulong tracks = device[3][d].percom.trk * (device[3][d].percom.heads + 1);
+	long ms = (long)tracks * format_ms, max = io_timeout(device[3][d].status.tmot) / 2;
+
+	if (ms > max)
+		ms = max;
+
+	if (ms > 0)
+		usleep(ms * 1000L);
+}
+
+/* Format */
+static void
+format_atr(ushort d, int no_delay)
+{
+	int pars;
+	ulong spt = device[3][d].percom.spt_hi * 256 + device[3][d].percom.spt_lo;
+	ushort trk = device[3][d].percom.trk, bps = device[3][d].bps;
+	long nsec;
+	uchar ck;
+	ATR atr;
+	IOREQ *rq;
+
+	/* these should be suppressed when calling from make_atr() */
+	if (d)
+	{
+		if (device[3][d].percom.trk == 1)
+		{
+			sio_ack(3, d, 'N');
+			return;
+		}
+		sio_ack(3, d, 'A');
+	}
+
+	if (device[3][d].wp)
+	{
+		printf("D%d: is write protected\n", d);
+		goto error;
+	}
+	
+	bzero(outbuf, sizeof(outbuf));
+
+	if (device[3][d].ovl)
+	{
+		OVERLAY *o = device[3][d].ovl;
+
+		/* the image file keeps its size, and so does the disk */
+		if ((device[3][d].maxsec != o->maxsec) || (device[3][d].bps != o->bps))
+		{
+			printf("D%d: an overlay disk cannot change its density\n", d);
+			drive_setup(d, o->size, o->bps);
+			device[3][d].full13 = o->full13;
+			setup_status(d);
+			goto error;
+		}
+		ovl_format(o);
+		if (no_delay == 0)
+			format_delay(d);
+		goto formatted;
+	}
+
+	if (device[3][d].percom.flags & 0x08)
+		spt += (device[3][d].percom.heads * 65536);
+	else
+	{
+		if (trk == 40 || trk == 80 || trk == 77)
+			trk *= (device[3][d].percom.heads + 1);
+	}
+
+	device[3][d].full13 = device[3][d].full13force;
+
+	pars = !device[3][d].full13force && device[3][d].bps == 256?
+		device[3][d].maxsec * device[3][d].bps - 3 * 128:
+		device[3][d].maxsec * device[3][d].bps;
+
+	pars /= 16;
+
+	device[3][d].atr.wpars = pars % 65536;
+	device[3][d].atr.bps = device[3][d].bps;
+	device[3][d].atr.hipars = pars / 65536;
+	device[3][d].atr.crc = 0;			/* XXX */
+
+	bzero(&atr, sizeof(ATR));
+
+	atr.sig = SSWAP(device[3][d].atr.sig);
+	atr.wpars = SSWAP(device[3][d].atr.wpars);
+	atr.bps = SSWAP(device[3][d].atr.bps);
+	atr.hipars = device[3][d].atr.hipars;
+	atr.crc = LSWAP(device[3][d].atr.crc);
+	atr.costam = LSWAP(device[3][d].atr.costam);
+	atr.prot = device[3][d].atr.prot;
+
+	/* the storage worker writes the header and the zeroed sectors */
+	nsec = (long)trk * spt;
+	if ((nsec < 4) && (bps == 256) && !device[3][d].full13force)
+		bps = 128;
+
+	if (device[3][d].ram)
+	{
+		if (ram_format(d, atr_offset(d, nsec) + bps) < 0)
+			goto error;
+		if (no_delay == 0)
+			format_delay(d);
+		goto formatted;
+	}
+
+	rq = io_slot(IO_FORMAT, device[3][d].raw ? 0 : sizeof(ATR));
+	rq->fd = device[3][d].fd;
+	rq->img = device[3][d].img;
+	rq->off = atr_offset(d, nsec) + bps;
+	memcpy(rq->buf, &atr, rq->len);
+
+	if (no_delay == 0)
+		format_delay(d);
+
+	if (io_call(rq, io_timeout(device[3][d].status.tmot)) < 0)
+		goto error;
+
+	if (rq->r < 0)
+	{
+		printf("SIO write error: format failed, %s\n", strerror(rq->err));
+		goto error;
+	}
+
+formatted:
+	setup_status(d);
+
+	outbuf[0] = 0xff;
+	outbuf[1] = 0xff;
+
+	bps = device[3][d].bps;
+	ck = calc_checksum(outbuf, bps);
+
+	if (d)
+	{
+		sio_ack(3, d, 'C');
+		com_write(outbuf, bps);
+		com_write(&ck, 1);
+	}
+
+	dirty_all(&device[3][d]);
+	digest_build(d, 1);
+
+	return;
+
+error:
+	
+	if (d)
+		sio_ack(3, d, 'E');
+
+	printf("Error: %s() failed\n", __extension__ __FUNCTION__);
+}
+
+static int
+make_atr(char *newname, int ch, int trk, int spt, int hds, int bps, int full13force)
+{
+	int r;
+	uchar lpc[8];
+
+	bzero(lpc, sizeof(lpc));
+
+	printf("\nCreating an ATR image `%s'\n\n", newname);
+
+	if (port_mem(NULL) < 0)
+		return -1;
+
+	device_reset(3, 0);
+	device[3][0].full13force = full13force;
+
+	r = atr_create(0, newname);
+	if (r < 0)
+		return r;
+
+	memcpy(lpc, percom_ed, 8UL);
+
+	if (ch == 1)
+	{
+		lpc[3] = 0x12;
+		lpc[5] = 0x00;
+	}
+	//else if (ch == 2)
+	//	;
+	else if (ch == 3)
+	{
+		memcpy(lpc, percom_qd, 8);
+		lpc[4] = 0x00;
+	}
+	else if (ch == 4)
+		memcpy(lpc, percom_qd, 8);
+	else if (ch == 5)
+	{
+		memcpy(lpc, percom_qd, 8);
+		lpc[0] = 80;
+	}
+	else if (ch == 6)
+	{
+		memcpy(lpc, percom_qd, 8);
+		lpc[0] = 80;
+		lpc[3] = 36;
+	}
+	else if (ch == 7)
+		memcpy(lpc, percom_hd, 8);
+	else if (ch == 8)
+		memcpy(lpc, percom_hd32, 8);
+	else if (ch == 9)
+	{
+		long flg = 0;
+
+		lpc[1] = 3;
+
+		if (spt < 65536)
+		{
+			if (hds > 0)
+				hds--;
+		}
+		else
+		{
+			hds = (spt * trk) / 65536;
+			spt -= (hds * 65536);
+			flg = 0x0c;
+		}
+
+		if (bps > 128 || spt > 18)
+			flg |= 0x04;			
+
+		if (bps != 128)
+		{
+			if (bps & 0x00ff || bps > 0x8000)
+			{
+				printf("Invalid BPS value %ld\n", (long)bps);
+				return -1;
+			}
+		}
+
+		lpc[0] = trk;
+		lpc[2] = spt / 256;
+		lpc[3] = spt % 256;
+		lpc[4] = hds;
+		lpc[5] = flg;
+		lpc[6] = bps / 256;
+		lpc[7] = bps % 256;
+	}
+
+	setup_percom(0, lpc);
+
+	format_atr(0, 1);
+
+	atr_close(0);
+
+	return 0;
+}
+
+/* mkatr -z: punch out the all-zero blocks of an existing image */
+static int
+compact_atr(char *fname)
+{
+	uchar blk[HOLE_BLOCK];
+	struct stat sb;
+	ulong before;
+	off_t off;
+	long r;
+	int fd;
+
+	printf("\nCompacting the ATR image `%s'\n\n", fname);
+
+	fd = open(fname, O_RDWR);
+
+	if ((fd < 0) || (fstat(fd, &sb) < 0))
+	{
+		if (fd >= 0)
+			close(fd);
+		return -errno;
+	}
+
+	before = sb.st_blocks;
+
+	for (off = 0; (r = pread(fd, blk, HOLE_BLOCK, off)) > 0; off += r)
+	{
+		if (is_zero(blk, r) && (hole_punch(fd, off, r) < 0))
+		{
+			printf("The file system cannot punch holes\n");
+			close(fd);
+			return -1;
+		}
+	}
+
+	r = (r < 0) ? -errno : fstat(fd, &sb);
+
+	close(fd);
+
+	if (r < 0)
+		return r;
+
+	printf("%lu kbytes freed, %lu kbytes used\n", ((before > (ulong)sb.st_blocks) ? (before - sb.st_blocks) : 0) / 2, \
+		(ulong)sb.st_blocks / 2);
+
+	return 0;
+}
+
+
+/* ============== Printer spooler ================= */
+
+/* P: records are translated through a table and queued; a writer thread
+ * of the port drains the queue into the printer file or command, so a
+ * slow filter never holds up the SIO. A job starts with the first record
+ * and, with -j secs, ends after secs of silence: each job then goes to a
+ * file of its own (fname.1, fname.2, ...) or to a new run of the command.
+ */
+
+static uchar atascii[256];	/* ATASCII -> ASCII for the printer (-t) */
+
+static void
+atascii_init(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		atascii[i] = i;
+
+	atascii[0x1c] = '.';	/* cursor up, down, right */
+	atascii[0x1d] = '.';
+	atascii[0x1e] = '\b';	/* cursor left */
+	atascii[0x1f] = '.';
+	atascii[0x7d] = '\f';	/* clear screen */
+	atascii[0x7e] = '\b';	/* backspace */
+	atascii[0x7f] = '\t';	/* tabulate */
+	atascii[0x9b] = '\n';	/* EOL */
+	atascii[0x9c] = '.';	/* delete line */
+	atascii[0x9d] = '.';	/* insert line */
+	atascii[0x9e] = '.';	/* clear tab */
+	atascii[0x9f] = '.';	/* set tab */
+	atascii[0xfd] = '\a';	/* bell */
+	atascii[0xfe] = '.';	/* delete char */
+	atascii[0xff] = '.';	/* insert char */
+}
+
+static int
+spool_begin(SPOOL *sp)
+{
+	char fname[1100];
+
+	if (sp->target[0] == '|')
+	{
+		sp->job++;
+		sp->pipe = popen(sp->target + 1, "w");
+		if (sp->pipe)
+			sp->fd = fileno(sp->pipe);
+		snprintf(fname, sizeof(fname), "%s", sp->target);
+	}
+	else if (sp->idle)
+	{
+		do
+		{
+			sp->job++;
+			snprintf(fname, sizeof(fname), "%s.%lu", sp->target, sp->job);
+			sp->fd = open(fname, O_WRONLY|O_CREAT|O_EXCL, S_IWUSR|S_IRUSR);
+		} while ((sp->fd < 0) && (errno == EEXIST));
+	}
+	else
+	{
+		sp->job++;
+		snprintf(fname, sizeof(fname), "%s", sp->target);
+		sp->fd = open(fname, O_WRONLY|O_CREAT, S_IWUSR|S_IRUSR);
+	}
+
+	if (sp->fd < 0)
+	{
+		printf("Printer: cannot open '%s', %s (%d)\n", fname, strerror(errno), errno);
+		return -1;
+	}
+
+	if (sp->idle)
+		printf("Printer: job %lu to %s\n", sp->job, fname);
+
+	return 0;
+}
+
+static void
+spool_end(SPOOL *sp)
+{
+	if (sp->pipe)
+		(void)pclose(sp->pipe);
+	else if (sp->fd > -1)
+		close(sp->fd);
+	else
+		return;
+
+	sp->pipe = NULL;
+	sp->fd = -1;
+
+	if (sp->idle)
+		printf("Printer: job %lu done\n", sp->job);
+}
+
+static void *
+spool_thread(void *arg)
+{
+	SPOOL *sp = arg;
+	struct timespec ts;
+	sigset_t set;
+	ulong n, off;
+	long r, w;
+
+	/* a filter which quits early must not kill the process */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&sp->lock);
+
+	for (;;)
+	{
+		if (sp->head == sp->tail)
+		{
+			if ((sp->fd > -1) && sp->idle)
+			{
+				ts.tv_sec = sp->last + sp->idle;
+				ts.tv_nsec = 0;
+				if ((pthread_cond_timedwait(&sp->cond, &sp->lock, &ts) == ETIMEDOUT) && (sp->head == sp->tail))
+				{
+					pthread_mutex_unlock(&sp->lock);
+					spool_end(sp);
+					pthread_mutex_lock(&sp->lock);
+				}
+			}
+			else
+				pthread_cond_wait(&sp->cond, &sp->lock);
+			continue;
+		}
+
+		n = sp->head - sp->tail;
+		off = sp->tail % SPOOL_SIZE;
+		if (n > (SPOOL_SIZE - off))
+			n = SPOOL_SIZE - off;
+
+		pthread_mutex_unlock(&sp->lock);
+
+		if (sp->fd < 0)
+			(void)spool_begin(sp);
+
+		for (r = 0; (sp->fd > -1) && (r < (long)n); r += w)
+		{
+			w = write(sp->fd, sp->buf + off + r, n - r);
+			if (w <= 0)
+			{
+				printf("Printer: write failed, %s (%d)\n", strerror(errno), errno);
+				spool_end(sp);
+				break;
+			}
+		}
+
+		/* what could not be written is lost */
+		pthread_mutex_lock(&sp->lock);
+		sp->tail += n;
+		pthread_cond_broadcast(&sp->cond);
+	}
+
+	return NULL;
+}
+
+static int
+spool_open(PORT *p)
+{
+	SPOOL *sp;
+
+	sp = calloc(1, sizeof(SPOOL));
+
+	if (sp == NULL)
+		return -1;
+
+	sp->fd = -1;
+	sp->idle = spool_idle;
+	snprintf(sp->target, sizeof(sp->target), "%s", p->printer);
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->cond, NULL);
+
+	/* a single file for the whole session is opened at once, as always */
+	if ((sp->target[0] != '|') && (sp->idle == 0) && (spool_begin(sp) < 0))
+	{
+		free(sp);
+		return -1;
+	}
+
+	if (pthread_create(&sp->tid, NULL, spool_thread, sp))
+	{
+		printf("Printer: cannot start the writer thread\n");
+		spool_end(sp);
+		free(sp);
+		return -1;
+	}
+
+	spool = p->spool = sp;
+
+	return 0;
+}
+
+/* Queue len bytes, waiting for room no longer than the Atari would */
+static int
+spool_put(const uchar *data, ulong len)
+{
+	struct timespec ts;
+	ulong off, n;
+	long ms = io_timeout(IO_SECTOR_S);
+	int r = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&spool->lock);
+
+	while ((SPOOL_SIZE - (spool->head - spool->tail)) < len)
+	{
+		if (pthread_cond_timedwait(&spool->cond, &spool->lock, &ts) == ETIMEDOUT)
+		{
+			r = -1;
+			break;
+		}
+	}
+
+	if (r == 0)
+	{
+		off = spool->head % SPOOL_SIZE;
+		n = (len > (SPOOL_SIZE - off)) ? (SPOOL_SIZE - off) : len;
+		memcpy(spool->buf + off, data, n);
+		memcpy(spool->buf, data + n, len - n);
+		spool->head += len;
+		spool->last = time(NULL);
+		pthread_cond_broadcast(&spool->cond);
+	}
+
+	pthread_mutex_unlock(&spool->lock);
+
+	return r;
+}
+
+/* Write out what is left, at exit */
+static void
+spool_flush(SPOOL *sp)
+{
+	ulong off;
+
+	while (sp->head != sp->tail)
+	{
+		if ((sp->fd < 0) && (spool_begin(sp) < 0))
+			break;
+		off = sp->tail % SPOOL_SIZE;
+		if (write(sp->fd, sp->buf + off, 1) != 1)
+			break;
+		sp->tail++;
+	}
+
+	spool_end(sp);
+}
+
+/* One P: record: read it, translate up to the EOL, queue */
+static void
+print_record(ushort devno, ushort cunit, ushort len, int translate)
+{
+	uchar ck, sck, c;
+	ushort i;
+
+	sio_ack(devno, cunit, 'A');
+
+	com_read(inpbuf, len, COM_DATA);
+	com_read(&sck, 1, COM_DATA);
+
+	ck = calc_checksum(inpbuf, len);
+
+	if (ck != sck)
+	{
+		metrics->cksum_err[CK_SECTOR]++;
+		printf("Printer: CRC fail, Atari: $%02x, PC: $%02x\n", sck, ck);
+		sio_ack(devno, cunit, 'E');
+		return;
+	}
+
+	sio_ack(devno, cunit, 'A');
+
+	for (i = 0; i < len; )
+	{
+		c = inpbuf[i];
+		if (translate)
+			inpbuf[i] = atascii[c];
+		i++;
+		if (c == 0x9b)		/* EOL */
+			break;
+	}
+
+	if (spool_put(inpbuf, i) < 0)
+	{
+		printf("Printer: the spool is full\n");
+		sio_ack(devno, cunit, 'E');
+	}
+	else
+		sio_ack(devno, cunit, 'C');
+}
+
+/* ============= SIO COMMANDS =============== */
+
+/* Status */
+static void
+sio_send_status(ushort devno, ushort d)
+{
+	usleep((BASIC_DELAY*1000)/((useconds_t)(POKEY_AVG_HZ/1000)));
+
+	sio_ack(devno, d, 'A');
+
+	setup_status(d);
+
+	outbuf[0] = device[devno][d].status.stat;
+	outbuf[1] = device[devno][d].status.err;
+	outbuf[2] = device[devno][d].status.tmot;
+	outbuf[3] = device[devno][d].status.none;
+	outbuf[4] = calc_checksum(outbuf, 4);
+
+	usleep((BASIC_DELAY*1000)/((useconds_t)(POKEY_AVG_HZ/1000)));
+
+	sio_ack(devno, d, 'C');
+
+	usleep((BASIC_DELAY*1000)/((useconds_t)(POKEY_AVG_HZ/1000)));
+
+	com_write(outbuf, 5);
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("<- STATUS $%02x $%02x $%02x $%02x\n", outbuf[0], outbuf[1], outbuf[2], outbuf[3]);
+# endif
+}
+
+/* PERCOM block */
+static void
+send_percom(ushort d)
+{
+	sio_ack(3, d, 'A');
+
+	outbuf[0] = device[3][d].percom.trk;
+	outbuf[1] = device[3][d].percom.step;
+	outbuf[2] = device[3][d].percom.spt_hi;
+	outbuf[3] = device[3][d].percom.spt_lo;
+	outbuf[4] = device[3][d].percom.heads;
+	outbuf[5] = device[3][d].percom.flags;
+	outbuf[6] = device[3][d].percom.bps_hi;
+	outbuf[7] = device[3][d].percom.bps_lo;
+	outbuf[8] = 0xff;
+	outbuf[9] = 0x00;
+	outbuf[10] = 0x00;
+	outbuf[11] = 0x00;
+
+	outbuf[12] = calc_checksum(outbuf, 12);
+
+	sio_ack(3, d, 'C');
+
+	com_write(outbuf, 13);
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("<- PERCOM\n");
+# endif
+}
+
+static void
+receive_percom(ushort d)
+{
+	uchar ck;
+	int r;
+
+# if 0
+	if (device[3][d].percom.trk == 1)
+	{
+		sio_ack(3, d, 'N');
+		return;
+	}
+# endif
+	
+	sio_ack(3, d, 'A');
+
+	device[3][d].status.stat &= ~0x02;
+
+	com_read(inpbuf, 13, COM_DATA);
+
+	ck = calc_checksum(inpbuf, 12);
+
+	if (ck != inpbuf[12])
+	{
+		metrics->cksum_err[CK_PERCOM]++;
+		device[3][d].status.stat |= 0x02;
+		return;
+	}
+
+	if (device[3][d].percom.trk == 1)
+		r = 0;
+	else
+		r = setup_percom(d, inpbuf);
+
+	if (r == 0)
+	{
+		sio_ack(3, d, 'A');
+
+		setup_status(d);
+
+		sio_ack(3, d, 'C');
+
+# ifdef SIOTRACE
+		if (log_flag)
+		{
+			printf("-> PERCOM: %02x, %02x, %02x, %02x, %02x, %02x, %02x, %02x\n", \
+				device[3][d].percom.trk, device[3][d].percom.step,
+				device[3][d].percom.spt_hi, device[3][d].percom.spt_lo,
+				device[3][d].percom.heads, device[3][d].percom.flags,
+				device[3][d].percom.bps_hi, device[3][d].percom.bps_lo);
+		}
+# endif
+	}
+	else
+		sio_ack(3, d, 'E');
+}
+
+/* Sectors */
+static void
+send_sector(uchar devno, int i, uchar ccom, long sector)
+{
+	uchar ck = 0, ack = 'C', fdc;
+	ushort bps = device[devno][i].bps;
+	int zero = 0;
+	IOREQ *rq;
+
+	if ((devno == 3) && ((sector == 0) || (sector > (long)device[3][i].maxsec)))
+	{
+		sio_ack(devno, i, 'N');
+		return;
+	}
+
+	sio_ack(devno, i, 'A');
+
+	if ((devno == 3) && (bps == 256) && (sector < 4))
+		bps = 128;
+
+	if (device[devno][i].atx)
+	{
+		ack = atx_read(device[devno][i].atx, sector, outbuf, bps, &fdc);
+		device[devno][i].status.err = ~fdc;
+		goto done;
+	}
+
+	if (device[devno][i].ovl && ovl_read(device[devno][i].ovl, sector, outbuf, bps))
+		goto done;
+
+	if (device[devno][i].ram)
+	{
+		/* a PERCOM change without a format leaves it smaller */
+		if ((atr_offset(i, sector) + bps) > (off_t)device[devno][i].ramsize)
+			goto error;
+		memcpy(outbuf, device[devno][i].ram + atr_offset(i, sector), bps);
+		goto done;
+	}
+
+	rq = io_slot(IO_PREAD, bps);
+	rq->fd = device[devno][i].fd;
+	rq->img = device[devno][i].img;
+	rq->off = atr_offset(i, sector);
+
+	if (io_call(rq, io_timeout(IO_SECTOR_S)) < 0)
+		goto error;
+	if (rq->r < bps)
+		goto error;
+
+	memcpy(outbuf, rq->buf, bps);
+	zero = rq->zero;
+
+done:
+	device[devno][i].reads++;
+
+	sio_ack(devno, i, ack);
+
+	if (ccom != 'V')
+	{
+		/* a sector of zeros sums to zero */
+		ck = outbuf[bps] = zero ? 0 : calc_checksum(outbuf, bps);
+		com_write(outbuf, (bps + 1));
+	}
+
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("<- SECTOR $%04lx (%5ld), bps: %d, CRC: $%02x\n", sector, sector, bps, ck);
+# endif
+
+	return;
+
+error:
+	sio_ack(devno, i, 'E');
+	device[devno][i].errors++;
+
+	/* SIO expects the transfer even after Error was signalized */
+	bzero(outbuf, bps);
+
+	if (ccom != 'V')
+	{
+		outbuf[bps] = calc_checksum(outbuf, bps);
+		com_write(outbuf, (bps + 1));
+	}
+
+	printf("SIO read error: D%d:, sector $%04lx (%5ld), bps: %d\n", i, sector, sector, bps);
+}
+
+static void
+receive_sector(ushort devno, ushort i, long sector)
+{
+	ushort bps = device[devno][i].bps;
+	uchar ck, sck;
+	IOREQ *rq;
+
+	if ((devno == 3) && i && ((sector == 0) || (sector > (long)device[3][i].maxsec)))
+	{
+		sio_ack(devno, i, 'N');
+		return;
+	}
+
+	sio_ack(devno, i, 'A');
+
+	if ((devno == 3) && (bps == 256) && (sector < 4))
+		bps = 128;
+
+	com_read(inpbuf, bps, COM_DATA);
+
+	ck = calc_checksum(inpbuf, bps);
+
+	device[devno][i].status.stat &= ~0x02;
+
+	com_read(&sck, 1, COM_DATA);
+
+	if (ck != sck)
+	{
+		metrics->cksum_err[CK_SECTOR]++;
+		device[devno][i].status.stat |= 0x02;
+		printf("SIO write: CRC fail, Atari: $%02x, PC: $%02x\n", sck, ck);
+		goto error;
+	}
+
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("-> SECTOR $%04lx (%5ld), bps: %d, CRC: $%02x\n", sector, sector, bps, ck);
+# endif
+
+	sio_ack(devno, i, 'A');
+
+	if (device[devno][i].wp)
+	{
+		printf("SIO write: D%d: is write protected\n", i);
+		goto error;
+	}
+
+	if (device[devno][i].ovl)
+	{
+		if (ovl_write(device[devno][i].ovl, sector, inpbuf, bps) < 0)
+			goto error;
+	}
+	else if (device[devno][i].ram)
+	{
+		if ((atr_offset(i, sector) + bps) > (off_t)device[devno][i].ramsize)
+			goto error;
+		memcpy(device[devno][i].ram + atr_offset(i, sector), inpbuf, bps);
+		device[devno][i].ramchg = 1;
+	}
+	else if (device[devno][i].fd > -1)
+	{
+		rq = io_slot(IO_PWRITE, bps);
+		rq->fd = device[devno][i].fd;
+		rq->img = device[devno][i].img;
+		rq->off = atr_offset(i, sector);
+		memcpy(rq->buf, inpbuf, bps);
+
+		if (io_call(rq, io_timeout(IO_SECTOR_S)) < 0)
+			goto error;
+		if (rq->r != bps)
+			goto error;
+	}
+
+	device[devno][i].writes++;
+	sio_ack(devno, i, 'C');
+
+	if (devno == 3)
+		dev_changed(i, sector, inpbuf, bps);
+
+	return;
+
+error:	sio_ack(devno, i, 'E');
+	device[devno][i].errors++;
+
+	printf("SIO write error: D%d:, sector $%04lx (%5ld), bps: %d\n", i, sector, sector, bps);
+}
+
+/* Ends the program: on the main thread for a signal, or on the last port
+ * to end. The ports are told to quit, and each writes back and closes
+ * its own drives between two SIO commands; a port still busy after
+ * QUIT_WAIT_S only gets its line set back.
+ */
+static void
+sig(int s)
+{
+	struct timespec ts;
+	int i;
+
+	pthread_mutex_lock(&quit_lock);
+
+	/* the other one on its way out ends the program */
+	if (port_quit)
+	{
+		pthread_mutex_unlock(&quit_lock);
+		for (;;)
+			pause();
+	}
+
+	__atomic_store_n(&port_quit, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&quit_lock);
+
+	if (s)
+	{
+# ifdef __CYGWIN__
+		printf("Caught signal %d\n", s);
+# else
+		psignal(s, NULL);
+# endif
+	}
+
+	if (metrics_fd > -1)
+	{
+		close(metrics_fd);
+		(void)unlink(metrics_path);
+	}
+
+	if (ctl_fd > -1)
+	{
+		close(ctl_fd);
+		(void)unlink(ctl_path);
+	}
+
+	for (i = 0; port_wake && (i < nports); i++)
+		if ((write(ports[i].ctl[1], "", 1) < 0) && (errno != EAGAIN))
+			break;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += QUIT_WAIT_S;
+
+	pthread_mutex_lock(&quit_lock);
+	while (ports_live > 0)
+		if (pthread_cond_timedwait(&quit_cond, &quit_lock, &ts) == ETIMEDOUT)
+			break;
+	pthread_mutex_unlock(&quit_lock);
+
+	for (i = 0; i < nports; i++)
+	{
+		PORT *p = &ports[i];
+
+		if (p->spool)
+			spool_flush(p->spool);
+
+		if (p->gone || (p->serial_fd == NULL))
+			continue;
+
+		printf("Port %s: busy, its disks are left as they are\n", p->serial);
+
+		if (*p->serial_fd > -1)
+			(void)tcsetattr(*p->serial_fd, TCSANOW, p->dflt);
+
+		if (p->lock[0])
+			(void)unlink(p->lock);
+	}
+
+	jnl_flush(1);
+
+	exit(s);
+}
+
+/* The signals which end the program: sig() takes locks, waits for the
+ * ports and writes files, so it runs on the main thread, never inside
+ * the handler.
+ */
+static void
+sig_post(int s)
+{
+	uchar c = s;
+	int e = errno;
+
+	if (write(sig_pipe[1], &c, 1) < 0)
+		c = 0;
+
+	errno = e;
+}
+
+/* A fault: the state can't be trusted, so nothing is written back. The
+ * lines are set back and the files of the program removed, then the
+ * signal does what it does.
+ */
+static void
+sig_fault(int s)
+{
+	int i;
+
+	for (i = 0; i < nports; i++)
+	{
+		PORT *p = &ports[i];
+
+		if (p->serial_fd && (*p->serial_fd > -1))
+			(void)tcsetattr(*p->serial_fd, TCSANOW, p->dflt);
+
+		if (p->lock[0])
+			(void)unlink(p->lock);
+	}
+
+	if (metrics_fd > -1)
+		(void)unlink(metrics_path);
+	if (ctl_fd > -1)
+		(void)unlink(ctl_path);
+
+	signal(s, SIG_DFL);
+	raise(s);
+}
+
+/* PCLink part */
+
+# define SDX_MAXLEN 16777215L
+
+/* SDX required attribute mask */
+# define RA_PROTECT	0x01
+# define RA_HIDDEN	0x02
+# define RA_ARCHIVED	0x04
+# define RA_SUBDIR	0x08
+# define RA_NO_PROTECT	0x10
+# define RA_NO_HIDDEN	0x20
+# define RA_NO_ARCHIVED	0x40
+# define RA_NO_SUBDIR	0x80
+
+/* SDX set attribute mask */
+# define SA_PROTECT	0x01
+# define SA_UNPROTECT	0x10
+# define SA_HIDE	0x02
+# define SA_UNHIDE	0x20
+# define SA_ARCHIVE	0x04
+# define SA_UNARCHIVE	0x40
+# define SA_SUBDIR	0x08	/* illegal mode */
+# define SA_UNSUBDIR	0x80	/* illegal mode */
+
+# define DEVICE_LABEL	".PCLINK.VOLUME.LABEL"
+
+# define PCL_MAX_FNO	0x14
+
+static const char *fun[] =
+{
+	"FREAD", "FWRITE", "FSEEK", "FTELL", "FLEN", "(none)", "FNEXT", "FCLOSE",
+	"INIT", "FOPEN", "FFIRST", "RENAME", "REMOVE", "CHMOD", "MKDIR", "RMDIR",
+	"CHDIR", "GETCWD", "SETBOOT", "DFREE", "CHVOL"
+};
+
+typedef struct
+{
+	uchar status;
+	uchar map_l, map_h;
+	uchar len_l, len_m, len_h;
+	char fname[11];
+	uchar stamp[6];
+} DIRENTRY;
+
+static __thread struct
+{
+	union
+	{
+		FILE *file;
+		DIR *dir;
+	} fps;
+
+	DIRENTRY *dir_cache;	/* used only for directories */
+
+	uchar devno;
+	uchar cunit;
+	uchar fpmode;
+	uchar fatr1;
+	uchar fatr2;
+	uchar t1,t2,t3;
+	uchar d1,d2,d3;
+	struct stat fpstat;
+	char fpname[12];
+	long fppos;
+	long fpread;
+	int eof;
+	char pathname[1024];
+} iodesc[16];
+
+static __thread struct
+{
+	uchar handle;
+	uchar dirbuf[23];
+} pcl_dbf;
+
+static ulong upper_dir = UPPER_DIR;
+
+static long
+dos_2_allowed(uchar c)
+{
+# ifndef __CYGWIN__
+	if (upper_dir)
+		return (isupper(c) || isdigit(c) || (c == '_') || (c == '@'));
+
+	return (islower(c) || isdigit(c) || (c == '_') || (c == '@'));
+# else
+	return (isalpha(c) || isdigit(c) || (c == '_') || (c == '@'));
+# endif
+}
+
+static long
+dos_2_term(uchar c)
+{
+	return ((c == 0) || (c == 0x20));
+}
+
+static long
+validate_fn(uchar *name, int len)
+{
+	int x;
+
+	for (x = 0; x < len; x++)
+	{
+		if (dos_2_term(name[x]))
+			return (x != 0);
+		if (name[x] == '.')
+			return 1;
+		if (!dos_2_allowed(name[x]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+ugefina(char *src, char *out)
+{
+	char *dot;
+	ushort i;
+
+	memset(out, 0x20, 8+3);
+
+	dot = strchr(src, '.');
+
+	if (dot)
+	{
+		i = 1;
+		while (dot[i] && (i < 4))
+		{
+			out[i+7] = toupper((uchar)dot[i]);
+			i++;
+		}
+	}
+
+	i = 0;
+	while ((src[i] != '.') && !dos_2_term(src[i]) && (i < 8))
+	{
+		out[i] = toupper((uchar)src[i]);
+		i++;
+	}
+}
+
+static void
+uexpand(uchar *rawname, char *name83)
+{
+	ushort x, y;
+	uchar t;
+
+	name83[0] = 0;
+
+	for (x = 0; x < 8; x++)
+	{
+		t = rawname[x];
+		if (t && (t != 0x20))
+			name83[x] = upper_dir ? toupper(t) : tolower(t);
+		else
+			break;
+	}
+
+	y = 8;
+
+	if (rawname[y] && (rawname[y] != 0x20))
+	{
+		name83[x] = '.';
+		x++;
+
+		while ((y < 11) && rawname[y] && (rawname[y] != 0x20))
+		{
+			name83[x] = upper_dir ? toupper(rawname[y]) : tolower(rawname[y]);
+			x++;
+			y++;
+		}
+	}
+
+	name83[x] = 0;
+}
+
+static int
+match_dos_names(char *name, char *mask, uchar fatr1, struct stat *sb)
+{
+	ushort i;
+
+	if (log_flag)
+	{
+		printf("match: %c%c%c%c%c%c%c%c%c%c%c with %c%c%c%c%c%c%c%c%c%c%c: ",
+		name[0], name[1], name[2], name[3], name[4], name[5], name[6], name[7], \
+		name[8], name[9], name[10], \
+		mask[0], mask[1], mask[2], mask[3], mask[4], mask[5], mask[6], mask[7], \
+		mask[8], mask[9], mask[10]);
+	}
+
+	for (i = 0; i < 11; i++)
+	{
+		if (mask[i] != '?')
+			if (toupper((uchar)name[i]) != toupper((uchar)mask[i]))
+			{
+				if (log_flag)
+					printf("no match\n");
+				return 1;
+			}
+	}
+
+	/* There are no such attributes in Unix */
+	fatr1 &= ~(RA_NO_HIDDEN|RA_NO_ARCHIVED);
+
+	/* Now check the attributes */
+	if (fatr1 & (RA_HIDDEN | RA_ARCHIVED))
+	{
+		if (log_flag)
+			printf("atr mismatch: not HIDDEN or ARCHIVED\n");
+		return 1;
+	}
+
+	if (fatr1 & RA_PROTECT)
+	{
+		if (sb->st_mode & S_IWUSR)
+		{
+			if (log_flag)
+				printf("atr mismatch: not PROTECTED\n");
+
+			return 1;
+		}
+	}
+
+	if (fatr1 & RA_NO_PROTECT)
+	{
+		if ((sb->st_mode & S_IWUSR) == 0)
+		{
+			if (log_flag)
+				printf("atr mismatch: not UNPROTECTED\n");
+
+			return 1;
+		}
+	}
+
+	if (fatr1 & RA_SUBDIR)
+	{
+		if (!S_ISDIR(sb->st_mode))
+		{
+			if (log_flag)
+				printf("atr mismatch: not SUBDIR\n");
+
+			return 1;
+		}
+	}
+
+	if (fatr1 & RA_NO_SUBDIR)
+	{
+		if (S_ISDIR(sb->st_mode))
+		{
+			if (log_flag)
+				printf("atr mismatch: not FILE\n");
+
+			return 1;
+		}
+	}
+
+	if (log_flag)
+		printf("match\n");
+
+	return 0;
+}
+
+static int
+validate_dos_name(char *fname)
+{
+	char *dot = strchr(fname, '.');
+	long valid_fn, valid_xx;
+			
+	if ((dot == NULL) && (strlen(fname) > 8))
+		return 1;
+	if (dot)
+	{
+		long dd = strlen(dot);
+
+		if (dd > 4)
+			return 1;
+		if ((dot - fname) > 8)
+			return 1;
+		if ((dot == fname) && (dd == 1))
+			return 1;
+		if ((dd == 2) && (dot[1] == '.'))
+			return 1;
+		if ((dd == 3) && ((dot[1] == '.') || (dot[2] == '.')))
+			return 1;
+		if ((dd == 4) && ((dot[1] == '.') || (dot[2] == '.') || (dot[3] == '.')))
+			return 1;
+	}
+
+	valid_fn = validate_fn((uchar *)fname, 8);
+	if (dot != NULL)
+		valid_xx = validate_fn((uchar *)(dot + 1), 3);
+	else
+		valid_xx = 1;
+
+	if (!valid_fn || !valid_xx)
+		return 1;
+
+	return 0;
+}
+
+static int
+check_dos_name(char *newpath, struct dirent *dp, struct stat *sb)
+{
+	char temp_fspec[1024], fname[256];
+
+	strcpy(fname, dp->d_name);
+
+	if (log_flag)
+		printf("%s: got fname '%s'\n", __extension__ __FUNCTION__, fname); 
+
+	if (validate_dos_name(fname))
+		return 1;
+
+	/* stat() the file (fetches the length) */
+	sprintf(temp_fspec, "%s/%s", newpath, fname);
+
+	if (log_flag)
+		printf("%s: stat '%s'\n", __extension__ __FUNCTION__, temp_fspec);
+
+	if (stat(temp_fspec, sb))
+		return 1;
+
+	if (!S_ISREG(sb->st_mode) && !S_ISDIR(sb->st_mode))
+		return 1;
+
+	if (sb->st_uid != our_uid)		/* belongs to us? */
+		return 1;
+
+	if ((sb->st_mode & S_IRUSR) == 0)	/* unreadable? */
+		return 1;
+
+	if (S_ISDIR(sb->st_mode) && ((sb->st_mode & S_IXUSR) == 0))
+		return 1;
+
+	return 0;
+}
+
+static void
+fps_close(int i)
+{
+	io_drain();
+
+	if (iodesc[i].fps.file != NULL)
+	{
+		if (iodesc[i].fpmode & 0x10)
+			closedir(iodesc[i].fps.dir);
+		else
+			fclose(iodesc[i].fps.file);
+	}
+
+	if (iodesc[i].dir_cache != NULL)
+	{
+		free(iodesc[i].dir_cache);
+		iodesc[i].dir_cache = NULL;
+	}
+
+	iodesc[i].fps.file = NULL;
+
+	iodesc[i].devno = 0;
+	iodesc[i].cunit = 0;
+	iodesc[i].fpmode = 0;
+	iodesc[i].fatr1 = 0;
+	iodesc[i].fatr2 = 0;
+	iodesc[i].t1 = 0;
+	iodesc[i].t2 = 0;
+	iodesc[i].t3 = 0;
+	iodesc[i].d1 = 0;
+	iodesc[i].d2 = 0;
+	iodesc[i].d3 = 0;
+	iodesc[i].fpname[0] = 0;
+	iodesc[i].fppos = 0;
+	iodesc[i].fpread = 0;
+	iodesc[i].eof = 0;
+	iodesc[i].pathname[0] = 0;
+	bzero(&iodesc[i].fpstat, sizeof(struct stat));
+}
+
+static ulong
+get_file_len(uchar handle)
+{
+	ulong filelen;
+	struct dirent *dp;
+	struct stat sb;
+
+	if (iodesc[handle].fpmode & 0x10)	/* directory */
+	{
+		rewinddir(iodesc[handle].fps.dir);
+		filelen = sizeof(DIRENTRY);
+
+		while ((dp = readdir(iodesc[handle].fps.dir)) != NULL)
+		{
+			if (check_dos_name(iodesc[handle].pathname, dp, &sb))
+				continue;
+			filelen += sizeof(DIRENTRY);
+		}
+		rewinddir(iodesc[handle].fps.dir);
+	}
+	else
+		filelen = iodesc[handle].fpstat.st_size;
+
+	if (filelen > SDX_MAXLEN)
+		filelen = SDX_MAXLEN;
+
+	return filelen;
+}
+
+static DIRENTRY *
+cache_dir(uchar handle)
+{
+	char *bs, *cwd;
+	uchar dirnode = 0x00;
+	ushort node;
+	ulong dlen, flen, sl, dirlen = iodesc[handle].fpstat.st_size;
+	DIRENTRY *dbuf, *dir;
+	struct dirent *dp;
+	struct stat sb;
+
+	if (iodesc[handle].dir_cache != NULL)
+	{
+		printf("Internal error: dir_cache should be NULL!\n");
+		port_exit();
+	}
+
+	dir = dbuf = malloc(dirlen + sizeof(DIRENTRY));
+	bzero(dbuf, dirlen + sizeof(DIRENTRY));
+
+	dir->status = 0x28;
+	dir->map_l = 0x00;			/* low 11 bits: file number, high 5 bits: dir number */
+	dir->map_h = dirnode;
+	dir->len_l = dirlen & 0x000000ffL;
+	dir->len_m = (dirlen & 0x0000ff00L) >> 8;
+	dir->len_h = (dirlen & 0x00ff0000L) >> 16;
+
+	memset(dir->fname, 0x20, 11);
+
+	sl = strlen(device[iodesc[handle].devno][iodesc[handle].cunit].dirname);
+
+	cwd = iodesc[handle].pathname + sl;
+
+	bs = strrchr(cwd, '/');
+
+	if (bs == NULL)
+		memcpy(dir->fname, "MAIN", 4);
+	else
+	{
+		char *cp = cwd;
+
+		ugefina(bs+1, (char *)dir->fname);
+
+		node = 0;
+
+		while (cp <= bs)
+		{
+			if (*cp == '/')
+				dirnode++;
+			cp++;
+		}
+
+		dir->map_h = (dirnode & 0x1f) << 3;
+	}
+
+	unix_time_2_sdx(&iodesc[handle].fpstat.st_mtime, dir->stamp);
+
+	dir++;
+	flen = sizeof(DIRENTRY);
+
+	node = 1;
+
+	while ((dp = readdir(iodesc[handle].fps.dir)) != NULL)
+	{
+		ushort map;
+
+		if (check_dos_name(iodesc[handle].pathname, dp, &sb))
+			continue;
+
+		dlen = sb.st_size;
+		if (dlen > SDX_MAXLEN)
+			dlen = SDX_MAXLEN;
+
+		dir->status = (sb.st_mode & S_IWUSR) ? 0x08 : 0x09;
+
+		if (S_ISDIR(sb.st_mode))
+		{
+			dir->status |= 0x20;		/* directory */
+			dlen = sizeof(DIRENTRY);
+		}
+
+		map = dirnode << 11;
+		map |= (node & 0x07ff);
+
+		dir->map_l = map & 0x00ff;
+		dir->map_h = ((map & 0xff00) >> 8);
+		dir->len_l = dlen & 0x000000ffL;
+		dir->len_m = (dlen & 0x0000ff00L) >> 8;
+		dir->len_h = (dlen & 0x00ff0000L) >> 16;
+
+		ugefina(dp->d_name, (char *)dir->fname);
+
+		unix_time_2_sdx(&sb.st_mtime, dir->stamp);
+
+		node++;
+		dir++;
+		flen += sizeof(DIRENTRY);
+
+		if (flen >= dirlen)
+			break;
+	}
+
+	return dbuf;
+}
+
+static ulong
+dir_read(uchar *mem, ulong blk_size, uchar handle, int *eof_sig)
+{
+	uchar *db = (uchar *)iodesc[handle].dir_cache;
+	ulong dirlen = iodesc[handle].fpstat.st_size, newblk;
+
+	eof_sig[0] = 0;
+
+	newblk = dirlen - iodesc[handle].fppos;
+
+	if (newblk < blk_size)
+	{
+		blk_size = newblk; 
+		eof_sig[0] = 1;
+	}
+
+	if (blk_size)
+		memcpy(mem, db+iodesc[handle].fppos, blk_size);
+
+	return blk_size;
+}
+
+static void
+do_pclink_init(int force)
+{
+	uchar handle;
+
+	if (force == 0)
+		printf("closing all files\n");
+
+	for (handle = 0; handle < 16; handle++)
+	{
+		if (force)
+			iodesc[handle].fps.file = NULL;
+		fps_close(handle);
+		bzero(&device[6][handle].parbuf, sizeof(PARBUF));
+	}
+}
+
+static void
+set_status_size(uchar devno, uchar cunit, ushort size)
+{
+	device[devno][cunit].status.tmot = (size & 0x00ff);
+	device[devno][cunit].status.none = (size & 0xff00) >> 8;
+}
+
+static int
+validate_user_path(char *defwd, char *newpath)
+{
+	char *d, newwd[1024];
+
+	if (dir_realpath(newpath, newwd, sizeof(newwd)) < 0)
+		return 0;
+
+	d = strstr(newwd, defwd);
+
+	if (d == NULL)
+		return 0;
+	if (d != newwd)
+		return 0;
+
+	return 1;
+}
+
+static int
+ispathsep(uchar c)
+{
+	return ((c == '>') || (c == '\\'));
+}
+
+static void
+path_copy(uchar *dst, uchar *src)
+{
+	uchar a;
+
+	while (*src)
+	{
+		a = *src;
+		if (ispathsep(a))
+		{
+			while (ispathsep(*src))
+				src++;
+			src--;
+		}
+		*dst = a;
+		src++;
+		dst++;
+	}
+
+	*dst = 0;
+}
+
+static void
+path2unix(uchar *out, uchar *path)
+{
+	int i, y = 0;
+
+	for (i = 0; path[i] && (i < 64); i++)
+	{
+		char a;
+
+		a = upper_dir ? toupper(path[i]) : tolower(path[i]);
+
+		if (ispathsep(a))
+			a = '/';
+		else if (a == '<')
+		{
+			a = '.';
+			out[y++] = '.';
+		}
+		out[y++] = a;
+	}
+
+	if (y && (out[y-1] != '/'))
+		out[y++] = '/';
+
+	out[y] = 0;
+}
+
+static void
+create_user_path(uchar devno, uchar cunit, char *newpath)
+{
+	long sl, cwdo = 0;
+	uchar lpath[128], upath[128];
+
+	strcpy(newpath, device[devno][cunit].dirname);
+
+	/* this is user-requested new path */
+	path_copy(lpath, device[devno][cunit].parbuf.path);
+	path2unix(upath, lpath);
+
+	if (upath[0] != '/')
+	{
+		sl = strlen(newpath);
+		if (sl && (newpath[sl-1] != '/'))
+			strcat(newpath, "/");
+		if (device[devno][cunit].cwd[0] == '/')
+			cwdo++;
+		strcat(newpath, (char *)device[devno][cunit].cwd + cwdo);
+		sl = strlen(newpath);
+		if (sl && (newpath[sl-1] != '/'))
+			strcat(newpath, "/");
+	}
+	strcat(newpath, (char *)upath);
+	sl = strlen(newpath);
+	if (sl && (newpath[sl-1] == '/'))
+		newpath[sl-1] = 0;
+}
+
+static time_t
+timestamp2mtime(uchar *stamp)
+{
+	struct tm sdx_tm;
+
+	bzero(&sdx_tm, sizeof(struct tm));
+
+	sdx_tm.tm_sec = stamp[5];
+	sdx_tm.tm_min = stamp[4];
+	sdx_tm.tm_hour = stamp[3];
+	sdx_tm.tm_mday = stamp[0];
+	sdx_tm.tm_mon = stamp[1];
+	sdx_tm.tm_year = stamp[2];
+
+	if ((sdx_tm.tm_mday == 0) || (sdx_tm.tm_mon == 0))
+		return 0;
+
+	if (sdx_tm.tm_mon)
+		sdx_tm.tm_mon--;
+
+	if (sdx_tm.tm_year < 80)
+		sdx_tm.tm_year += 2000;
+	else
+		sdx_tm.tm_year += 1900;
+
+	sdx_tm.tm_year -= 1900;
+
+	return mktime(&sdx_tm);
+}
+
+static __thread uchar old_ccom = 0;	/* the previous PCLink command */
+
+/* PCLink functions, one per fno. They return PCL_COMPLETE for do_pclink()
+ * to send the 'C' with the status set, PCL_DONE if they have answered
+ * the Atari themselves, PCL_ABORT to drop the command silently.
+ */
+
+/* FREAD */
+static int
+pcl_fread(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar handle = pc->handle;
+	ulong faux = pc->faux;
+	uchar sck;
+	uchar *mem;
+	ulong blk_size = (faux & 0x0000FFFFL), buffer;
+
+	if (ccom == 'P')
+	{
+		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+		{
+			printf("bad handle %d\n", handle);
+			device[devno][cunit].status.err = 134;	/* bad file handle */
+			return PCL_COMPLETE;
+		}
+
+		if (blk_size == 0)
+		{
+			printf("bad size $0000 (0)\n");
+			device[devno][cunit].status.err = 176;
+			set_status_size(devno, cunit, 0);
+			return PCL_COMPLETE;
+		}
+
+		device[devno][cunit].status.err = 1;
+		iodesc[handle].eof = 0;
+
+		buffer = iodesc[handle].fpstat.st_size - iodesc[handle].fppos;
+
+		if (buffer < blk_size)
+		{
+			blk_size = buffer;
+			device[devno][cunit].parbuf.f1 = (buffer & 0x00ff);
+			device[devno][cunit].parbuf.f2 = (buffer & 0xff00) >> 8;
+			iodesc[handle].eof = 1;
+			if (blk_size == 0)
+				device[devno][cunit].status.err = 136;
+		}
+
+		printf("size $%04lx (%ld), buffer $%04lx (%ld)\n", blk_size, blk_size, buffer, buffer);
+
+		set_status_size(devno, cunit, (ushort)blk_size);
+		return PCL_COMPLETE;
+	}
+
+	if ((ccom == 'R') && (old_ccom == 'R'))
+	{
+		sio_ack(devno, cunit, 'N');
+		printf("serial communication error, abort\n");
+		return PCL_ABORT;
+	}
+
+	sio_ack(devno, cunit, 'A');	/* ack the command */
+
+	printf("handle %d\n", handle);
+
+	mem = malloc(blk_size + 1);
+
+	if ((device[devno][cunit].status.err == 1))
+	{
+		iodesc[handle].fpread = blk_size;
+
+		if (iodesc[handle].fpmode & 0x10)
+		{
+			ulong rdata;
+			int eof_sig;
+
+			rdata = dir_read(mem, blk_size, handle, &eof_sig);
+
+			if (rdata != blk_size)
+			{
+				printf("FREAD: cannot read %ld bytes from dir\n", blk_size);
+				if (eof_sig)
+				{
+					iodesc[handle].fpread = rdata;
+					device[devno][cunit].status.err = 136;
+				}
+				else
+				{
+					iodesc[handle].fpread = 0;
+					device[devno][cunit].status.err = 255;
+				}
+			}
+		}
+		else
+		{
+			IOREQ *rq = io_slot(IO_FREAD, blk_size);
+
+			rq->fp = iodesc[handle].fps.file;
+			rq->off = iodesc[handle].fppos;
+
+			if (io_call(rq, io_timeout(IO_SECTOR_S)) < 0)
+			{
+				iodesc[handle].fpread = 0;
+				device[devno][cunit].status.err = 255;
+			}
+			else if (rq->r == -2)
+			{
+				printf("FREAD: cannot seek to $%04lx (%ld)\n", iodesc[handle].fppos, iodesc[handle].fppos);
+				device[devno][cunit].status.err = 166;
+				io_release(rq);
+			}
+			else
+			{
+				long fdata = (rq->r > 0) ? rq->r : 0;
+
+				memcpy(mem, rq->buf, fdata);
+
+				if ((ulong)fdata != blk_size)
+				{
+					printf("FREAD: cannot read %ld bytes from file\n", blk_size);
+					if (rq->eof)
+					{
+						iodesc[handle].fpread = fdata;
+						device[devno][cunit].status.err = 136;
+					}
+					else
+					{
+						iodesc[handle].fpread = 0;
+						device[devno][cunit].status.err = 255;
+					}
+				}
+				io_release(rq);
+			}
+		}
+	}
+
+	iodesc[handle].fppos += iodesc[handle].fpread;
+
+	if (device[devno][cunit].status.err == 1)
+	{
+		if (iodesc[handle].eof)
+			device[devno][cunit].status.err = 136;
+		else if (iodesc[handle].fppos == iodesc[handle].fpstat.st_size)
+			device[devno][cunit].status.err = 3;
+	}
+
+	set_status_size(devno, cunit, iodesc[handle].fpread);
+
+	printf("FREAD: send $%04lx (%ld), status $%02x\n", blk_size, blk_size, device[devno][cunit].status.err);
+
+	sck = calc_checksum((void *)mem, blk_size);
+	mem[blk_size] = sck;
+	sio_ack(devno, cunit, 'C');
+	com_write(mem, blk_size + 1);
+
+	free(mem);
+
+	return PCL_DONE;
+}
+
+/* FWRITE */
+static int
+pcl_fwrite(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar handle = pc->handle;
+	ulong faux = pc->faux;
+	uchar ck;
+	uchar sck;
+	uchar *mem;
+	ulong blk_size = (faux & 0x0000FFFFL);
+
+	if (ccom == 'P')
+	{
+		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+		{
+			printf("bad handle %d\n", handle);
+			device[devno][cunit].status.err = 134;	/* bad file handle */
+			return PCL_COMPLETE;
+		}
+
+		if (blk_size == 0)
+		{
+			printf("bad size $0000 (0)\n");
+			device[devno][cunit].status.err = 176;
+			set_status_size(devno, cunit, 0);
+			return PCL_COMPLETE;
+		}
+
+		device[devno][cunit].status.err = 1;
+
+		printf("size $%04lx (%ld)\n", blk_size, blk_size);
+		set_status_size(devno, cunit, (ushort)blk_size);
+		return PCL_COMPLETE;
+	}
+
+	if ((ccom == 'R') && (old_ccom == 'R'))
+	{
+		sio_ack(devno, cunit, 'N');
+		printf("serial communication error, abort\n");
+		return PCL_ABORT;
+	}
+
+	sio_ack(devno, cunit, 'A');	/* ack the command */
+
+	printf("handle %d\n", handle);
+
+	mem = malloc(blk_size + 1);
+
+	com_read(mem, blk_size, COM_DATA);
+	com_read(&sck, sizeof(uchar), COM_DATA);
+
+	sio_ack(devno, cunit, 'A'); 	/* ack the block of data */
+
+	ck = calc_checksum(mem, blk_size);
+
+	if (ck != sck)
+	{
+		metrics->cksum_err[CK_FWRITE]++;
+		printf("FWRITE: block CRC mismatch\n");
+		device[devno][cunit].status.err = 143;
+		free(mem);
+		return PCL_COMPLETE;
+	}
+
+	if (device[devno][cunit].status.err == 1)
+	{
+		long rdata;
+
+		iodesc[handle].fpread = blk_size;
+
+		if (iodesc[handle].fpmode & 0x10)
+		{
+			/* ignore raw dir writes */
+		}
+		else
+		{
+			IOREQ *rq = io_slot(IO_FWRITE, blk_size);
+
+			rq->fp = iodesc[handle].fps.file;
+			rq->off = iodesc[handle].fppos;
+			if (rq->buf)
+				memcpy(rq->buf, mem, blk_size);
+
+			if (io_call(rq, io_timeout(IO_SECTOR_S)) < 0)
+			{
+				iodesc[handle].fpread = 0;
+				device[devno][cunit].status.err = 255;
+			}
+			else if (rq->r == -2)
+			{
+				printf("FWRITE: cannot seek to $%06lx (%ld)\n", iodesc[handle].fppos, iodesc[handle].fppos);
+				iodesc[handle].fpread = 0;
+				device[devno][cunit].status.err = 166;
+				io_release(rq);
+			}
+			else
+			{
+				rdata = rq->r;
+
+				if ((ulong)rdata != blk_size)
+				{
+					printf("FWRITE: cannot write %ld bytes to file\n", blk_size);
+					iodesc[handle].fpread = (rdata > 0) ? rdata : 0;
+					device[devno][cunit].status.err = 255;
+				}
+				io_release(rq);
+			}
+		}
+	}
+
+	iodesc[handle].fppos += iodesc[handle].fpread;
+
+	set_status_size(devno, cunit, iodesc[handle].fpread);
+
+	printf("FWRITE: received $%04lx (%ld), status $%02x\n", blk_size, blk_size, device[devno][cunit].status.err);
+
+	free(mem);
+	return PCL_COMPLETE;
+}
+
+/* FSEEK */
+static int
+pcl_fseek(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar handle = pc->handle;
+	ulong faux = pc->faux;
+	ulong newpos = faux;
+
+	if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+	{
+		printf("bad handle %d\n", handle);
+		device[devno][cunit].status.err = 134;	/* bad file handle */
+		return PCL_COMPLETE;
+	}
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		printf("bad exec\n");
+		device[devno][cunit].status.err = 176;
+		return PCL_COMPLETE;
+	}
+
+	device[devno][cunit].status.err = 1;
+
+	printf("handle %d, newpos $%06lx (%ld)\n", handle, newpos, newpos);
+
+	if (iodesc[handle].fpmode & 0x08)
+		iodesc[handle].fppos = newpos;
+	else
+	{
+		if (newpos <= (ulong)iodesc[handle].fpstat.st_size)
+			iodesc[handle].fppos = newpos;
+		else
+			device[devno][cunit].status.err = 166;
+	}
+
+	return PCL_COMPLETE;
+}
+
+/* FTELL/FLEN */
+static int
+pcl_ftell(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar fno = pc->fno;
+	uchar handle = pc->handle;
+	ulong outval = 0;
+	uchar out[4];
+
+	if (ccom == 'P')
+	{
+		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+		{
+			printf("bad handle %d\n", handle);
+			device[devno][cunit].status.err = 134;	/* bad file handle */
+			return PCL_COMPLETE;
+		}
+
+		device[devno][cunit].status.err = 1;
+
+		printf("device $%02x\n", cunit);
+		return PCL_COMPLETE;
+	}
+
+	sio_ack(devno, cunit, 'A');	/* ack the command */
+
+	if (fno == 0x03)
+		outval = iodesc[handle].fppos;
+	else
+		outval = iodesc[handle].fpstat.st_size;
+
+	printf("handle %d, send $%06lx (%ld)\n", handle, outval, outval);
+
+	out[0] = (uchar)(outval & 0x000000ffL);
+	out[1] = (uchar)((outval & 0x0000ff00L) >> 8);
+	out[2] = (uchar)((outval & 0x00ff0000L) >> 16);
+
+	out[3] = calc_checksum((void *)out, sizeof(out)-1);
+	sio_ack(devno, cunit, 'C');
+	com_write(out, sizeof(out));
+	return PCL_DONE;
+}
+
+/* FNEXT */
+static int
+pcl_fnext(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar handle = pc->handle;
+	uchar sck;
+
+	if (ccom == 'P')
+	{
+		device[devno][cunit].status.err = 1;
+
+		printf("device $%02x\n", cunit);
+		return PCL_COMPLETE;
+	}
+
+	if ((ccom == 'R') && (old_ccom == 'R'))
+	{
+		sio_ack(devno, cunit, 'N');
+		printf("serial communication error, abort\n");
+		return PCL_ABORT;
+	}
+
+	sio_ack(devno, cunit, 'A');	/* ack the command */
+
+	bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+
+	if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+	{
+		printf("bad handle %d\n", handle);
+		device[devno][cunit].status.err = 134;	/* bad file handle */
+	}
+	else
+	{
+		int eof_flg, match = 0;
+
+		printf("handle %d\n", handle);
+
+		do
+		{
+			struct stat ts;
+
+			bzero(&ts, sizeof(ts));
+			bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+			iodesc[handle].fppos += dir_read(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf), handle, &eof_flg);
+
+			if (!eof_flg)
+			{
+				/* fake stat to satisfy match_dos_names() */
+				if ((pcl_dbf.dirbuf[0] & 0x01) == 0)
+					ts.st_mode |= S_IWUSR;
+				if (pcl_dbf.dirbuf[0] & 0x20)
+					ts.st_mode |= S_IFDIR;
+				else
+					ts.st_mode |= S_IFREG;
+
+				match = !match_dos_names((char *)pcl_dbf.dirbuf+6, iodesc[handle].fpname, iodesc[handle].fatr1, &ts);
+			}
+
+		} while (!eof_flg && !match);
+
+		if (eof_flg)
+		{
+			printf("FNEXT: EOF\n");
+			device[devno][cunit].status.err = 136;
+		}
+		else if (iodesc[handle].fppos == iodesc[handle].fpstat.st_size)
+			device[devno][cunit].status.err = 3;
+	}
+
+	/* avoid the 4th execution stage */
+	pcl_dbf.handle = device[devno][cunit].status.err;
+
+	printf("FNEXT: status %d, send $%02x $%02x%02x $%02x%02x%02x %c%c%c%c%c%c%c%c%c%c%c %02d-%02d-%02d %02d:%02d:%02d\n", \
+		pcl_dbf.handle,
+		pcl_dbf.dirbuf[0],
+		pcl_dbf.dirbuf[2], pcl_dbf.dirbuf[1],
+		pcl_dbf.dirbuf[5], pcl_dbf.dirbuf[4], pcl_dbf.dirbuf[3],
+		pcl_dbf.dirbuf[6], pcl_dbf.dirbuf[7], pcl_dbf.dirbuf[8], pcl_dbf.dirbuf[9],
+		pcl_dbf.dirbuf[10], pcl_dbf.dirbuf[11], pcl_dbf.dirbuf[12], pcl_dbf.dirbuf[13],
+		pcl_dbf.dirbuf[14], pcl_dbf.dirbuf[15], pcl_dbf.dirbuf[16],
+		pcl_dbf.dirbuf[17], pcl_dbf.dirbuf[18], pcl_dbf.dirbuf[19],
+		pcl_dbf.dirbuf[20], pcl_dbf.dirbuf[21], pcl_dbf.dirbuf[22]);
+	
+	sck = calc_checksum((void *)&pcl_dbf, sizeof(pcl_dbf));
+	sio_ack(devno, cunit, 'C');
+	com_write((uchar *)&pcl_dbf, sizeof(pcl_dbf));
+	com_write(&sck, 1);
+	return PCL_DONE;
+}
+
+/* FCLOSE */
+static int
+pcl_fclose(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar handle = pc->handle;
+	uchar fpmode;
+	time_t mtime;
+	char pathname[1024];
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+	{
+		printf("bad handle %d\n", handle);
+		device[devno][cunit].status.err = 134;	/* bad file handle */
+		return PCL_COMPLETE;
+	}
+
+	printf("handle %d\n", handle);
+
+	device[devno][cunit].status.err = 1;
+
+	fpmode = iodesc[handle].fpmode;
+	mtime = iodesc[handle].fpstat.st_mtime;
+# if 0
+	printf("FCLOSE: mtime $%08x\n", mtime);
+# endif
+	strcpy(pathname, iodesc[handle].pathname);
+
+	fps_close(handle);	/* this clears out iodesc[handle] */
+
+	if (mtime && (fpmode & 0x08))
+	{
+		struct timeval tv[2];
+
+		tv[0].tv_usec = 0;
+		tv[0].tv_sec = mtime;
+		tv[1].tv_usec = 0;
+		tv[1].tv_sec = mtime;
+
+# if 0
+		printf("FCLOSE: setting timestamp in '%s'\n", pathname);
+# endif
+
+		(void)utimes(pathname, (void *)&tv);
+	}
+	return PCL_COMPLETE;
+}
+
+/* INIT */
+static int
+pcl_init(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	do_pclink_init(0);
+
+	device[devno][cunit].parbuf.handle = 0xff;
+	device[devno][cunit].status.none = PCLSIO;
+	device[devno][cunit].status.err = 1;
+	return PCL_COMPLETE;
+}
+
+/* FOPEN/FFIRST */
+static int
+pcl_fopen(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar fno = pc->fno;
+	uchar handle = pc->handle;
+	uchar sck;
+	uchar ob[7];
+	struct stat sb;
+	struct dirent *dp;
+
+	if (ccom == 'P')
+	{
+		printf("mode: $%02x, atr1: $%02x, atr2: $%02x, path: '%s', name: '%s'\n", \
+			device[devno][cunit].parbuf.fmode, device[devno][cunit].parbuf.fatr1, \
+			device[devno][cunit].parbuf.fatr2, device[devno][cunit].parbuf.path, \
+			device[devno][cunit].parbuf.name);
+# if 0
+		printf("date: %02d-%02d-%02d time: %02d:%02d:%02d\n", \
+			device[devno][cunit].parbuf.f1, device[devno][cunit].parbuf.f2, \
+			device[devno][cunit].parbuf.f3, device[devno][cunit].parbuf.f4, \
+			device[devno][cunit].parbuf.f5, device[devno][cunit].parbuf.f6);
+# endif
+
+		device[devno][cunit].status.err = 1;
+
+		if (fno == 0x0a)
+			device[devno][cunit].parbuf.fmode |= 0x10;
+		return PCL_COMPLETE;
+	}
+	else	/* ccom not 'P', execution stage */
+	{
+		DIR *dh;
+		uchar i;
+		long sl;
+		struct stat tempstat;
+		char newpath[1024], raw_name[12];
+
+		if ((ccom == 'R') && (old_ccom == 'R'))
+		{
+			sio_ack(devno, cunit, 'N');
+			printf("serial communication error, abort\n");
+			return PCL_ABORT;
+		}
+
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+
+		bzero(raw_name, sizeof(raw_name));
+		memcpy(raw_name, device[devno][cunit].parbuf.name, 8+3);
+
+		if (((device[devno][cunit].parbuf.fmode & 0x0c) == 0) || \
+			((device[devno][cunit].parbuf.fmode & 0x18) == 0x18)) 
+		{
+			printf("unsupported fmode ($%02x)\n", device[devno][cunit].parbuf.fmode);
+			device[devno][cunit].status.err = 146;
+			goto complete_fopen;
+		}
+
+		create_user_path(devno, cunit, newpath);
+
+		if (!validate_user_path(device[devno][cunit].dirname, newpath))
+		{
+			printf("invalid path '%s'\n", newpath);
+			device[devno][cunit].status.err = 150;
+			goto complete_fopen;
+		}
+
+		printf("local path '%s'\n", newpath);
+
+		for (i = 0; i < 16; i++)
+		{
+# if 0
+			printf("FOPEN: find handle: %d is $%08lx\n", i, (ulong)iodesc[i].fps.file);
+# endif
+			if (iodesc[i].fps.file == NULL)
+# if 1
+				break;
+# else
+			{
+				printf("FOPEN: find handle: found %d\n", i);
+				break;
+			}
+# endif
+		}
+		if (i > 15)
+		{
+			printf("FOPEN: too many channels open\n");
+			device[devno][cunit].status.err = 161;
+			goto complete_fopen;
+		}
+
+		if (stat(newpath, &tempstat) < 0)
+		{
+			printf("FOPEN: cannot stat '%s'\n", newpath);
+			device[devno][cunit].status.err = 150;
+			goto complete_fopen;
+		}
+
+		dh = opendir(newpath);
+
+		if (device[devno][cunit].parbuf.fmode & 0x10)
+		{
+			iodesc[i].fps.dir = dh;
+			memcpy(&sb, &tempstat, sizeof(sb));
+		}
+		else
+		{
+			while ((dp = readdir(dh)) != NULL)
+			{
+				if (check_dos_name(newpath, dp, &sb))
+					continue;
+	
+				/* convert 8+3 to NNNNNNNNXXX */
+				ugefina(dp->d_name, raw_name);
+
+				/* match */
+				if (match_dos_names(raw_name, \
+					(char *)device[devno][cunit].parbuf.name, \
+						device[devno][cunit].parbuf.fatr1, &sb) == 0)
+					break;
+			}
+
+			sl = strlen(newpath);
+			if (sl && (newpath[sl-1] != '/'))
+				strcat(newpath, "/");
+
+			if (dp)
+			{
+				strcat(newpath, dp->d_name);
+				ugefina(dp->d_name, raw_name);
+				if ((device[devno][cunit].parbuf.fmode & 0x0c) == 0x08)
+					sb.st_mtime = timestamp2mtime(&device[devno][cunit].parbuf.f1);
+			}
+			else
+			{
+				if ((device[devno][cunit].parbuf.fmode & 0x0c) == 0x04)
+				{
+					printf("FOPEN: file not found\n");
+					device[devno][cunit].status.err = 170;
+					closedir(dh);
+					dp = NULL;
+					goto complete_fopen;
+				}
+				else
+				{
+					char name83[12];
+
+					printf("FOPEN: creating file\n");
+
+					uexpand(device[devno][cunit].parbuf.name, name83);
+
+					if (validate_dos_name(name83))
+					{
+						printf("FOPEN: bad filename '%s'\n", name83);
+						device[devno][cunit].status.err = 165; /* bad filename */
+						goto complete_fopen;
+					}
+
+					strcat(newpath, name83);
+					ugefina(name83, raw_name);
+
+					bzero(&sb, sizeof(struct stat));
+					sb.st_mode = S_IFREG|S_IRUSR|S_IWUSR;
+
+					sb.st_mtime = timestamp2mtime(&device[devno][cunit].parbuf.f1);
+				}
+			}
+
+			printf("FOPEN: full local path '%s'\n", newpath);
+
+			if (stat(newpath, &tempstat) < 0)
+			{
+				if ((device[devno][cunit].parbuf.fmode & 0x0c) == 0x04)
+				{
+					printf("FOPEN: cannot stat '%s'\n", newpath);
+					device[devno][cunit].status.err = 170;
+					goto complete_fopen;
+				}
+			}
+			else
+			{
+				if (device[devno][cunit].parbuf.fmode & 0x08)
+				{
+					if ((tempstat.st_mode & S_IWUSR) == 0)
+					{
+						printf("FOPEN: '%s' is read-only\n", newpath);
+						device[devno][cunit].status.err = 151;
+						goto complete_fopen;
+					}
+				}
+# if 0
+				if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x08)
+				{
+					if (!S_ISDIR(tempstat.st_mode))
+					{
+						printf("FOPEN: delete '%s'\n", newpath);
+						if (unlink(newpath))
+						{
+							printf("FOPEN: cannot delete '%s'\n", newpath);
+							device[devno][cunit].status.err = 255;
+						}
+					}
+				}
+# endif
+			}
+
+			if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x04)
+				iodesc[i].fps.file = fopen(newpath, "r");
+			else if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x08)
+			{
+				iodesc[i].fps.file = fopen(newpath, "w");
+				if (iodesc[i].fps.file)
+					sb.st_size = 0;
+			}
+			else if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x09)
+			{
+				iodesc[i].fps.file = fopen(newpath, "r+");
+				if (iodesc[i].fps.file)
+					fseek(iodesc[i].fps.file, sb.st_size, SEEK_SET);
+			}
+			else if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x0c)
+				iodesc[i].fps.file = fopen(newpath, "r+");
+
+			closedir(dh);
+			dp = NULL;
+		}
+
+		if (iodesc[i].fps.file == NULL)
+		{
+			printf("FOPEN: cannot open '%s', %s (%d)\n", newpath, strerror(errno), errno);
+			if (device[devno][cunit].parbuf.fmode & 0x04)
+				device[devno][cunit].status.err = 170;
+			else
+				device[devno][cunit].status.err = 151;
+			goto complete_fopen;
+		}
+
+# if 0
+		printf("FOPEN: handle %d is $%08lx\n", i, (ulong)iodesc[i].fps.file);
+# endif
+		handle = device[devno][cunit].parbuf.handle = i;
+
+		iodesc[handle].devno = devno;
+		iodesc[handle].cunit = cunit;
+		iodesc[handle].fpmode = device[devno][cunit].parbuf.fmode;
+		iodesc[handle].fatr1 = device[devno][cunit].parbuf.fatr1;
+		iodesc[handle].fatr2 = device[devno][cunit].parbuf.fatr2;
+		iodesc[handle].t1 = device[devno][cunit].parbuf.f1;
+		iodesc[handle].t2 = device[devno][cunit].parbuf.f2;
+		iodesc[handle].t3 = device[devno][cunit].parbuf.f3;
+		iodesc[handle].d1 = device[devno][cunit].parbuf.f4;
+		iodesc[handle].d2 = device[devno][cunit].parbuf.f5;
+		iodesc[handle].d3 = device[devno][cunit].parbuf.f6;
+		iodesc[handle].fppos = 0L;
+		strcpy(iodesc[handle].pathname, newpath);
+		memcpy((void *)&iodesc[handle].fpstat, (void *)&sb, sizeof(struct stat));
+		if (iodesc[handle].fpmode & 0x10)
+			memcpy(iodesc[handle].fpname, device[devno][cunit].parbuf.name, sizeof(iodesc[i].fpname));
+		else
+			memcpy(iodesc[handle].fpname, raw_name, sizeof(iodesc[handle].fpname));
+
+		iodesc[handle].fpstat.st_size = get_file_len(handle);
+
+		if ((iodesc[handle].fpmode & 0x1d) == 0x09)
+			iodesc[handle].fppos = iodesc[handle].fpstat.st_size;
+
+		bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+
+		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
+		{
+			printf("FOPEN: bad handle %d\n", handle);
+			device[devno][cunit].status.err = 134;	/* bad file handle */
+			pcl_dbf.handle = 134;
+		}
+		else
+		{
+			pcl_dbf.handle = handle;
+
+			unix_time_2_sdx(&iodesc[handle].fpstat.st_mtime, ob);
+
+# if 0
+			printf("FOPEN: time %02d-%02d-%02d %02d:%02d.%02d\n", ob[0], ob[1], ob[2], ob[3], ob[4], ob[5]);
+# endif
+
+			printf("FOPEN: %s handle %d\n", (iodesc[handle].fpmode & 0x08) ? "write" : "read", handle);
+
+			bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+
+			if (iodesc[handle].fpmode & 0x10)
+			{
+				int eof_sig;
+
+				iodesc[handle].dir_cache = cache_dir(handle);
+				iodesc[handle].fppos += dir_read(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf), handle, &eof_sig);
+
+				if (eof_sig)
+				{
+					printf("FOPEN: dir EOF?\n");
+					device[devno][cunit].status.err = 136;
+				}
+				else if (iodesc[handle].fppos == iodesc[handle].fpstat.st_size)
+						device[devno][cunit].status.err = 3;
+			}
+			else
+			{
+				int x;
+				ulong dlen = iodesc[handle].fpstat.st_size;
+
+				memset(pcl_dbf.dirbuf+6, 0x20, 11);
+				pcl_dbf.dirbuf[3] = (uchar)(dlen & 0x000000ffL);
+				pcl_dbf.dirbuf[4] = (uchar)((dlen & 0x0000ff00L) >> 8);
+				pcl_dbf.dirbuf[5] = (uchar)((dlen & 0x00ff0000L) >> 16);
+				memcpy(pcl_dbf.dirbuf+17, ob, 6);
+
+				pcl_dbf.dirbuf[0] = 0x08;
+
+				if ((iodesc[handle].fpstat.st_mode & S_IWUSR) == 0)
+					pcl_dbf.dirbuf[0] |= 0x01;	/* protected */
+				if (S_ISDIR(iodesc[handle].fpstat.st_mode))
+					pcl_dbf.dirbuf[0] |= 0x20;	/* directory */
+
+				x = 0;
+				while (iodesc[handle].fpname[x] && (x < 11))
+				{
+					pcl_dbf.dirbuf[6+x] = iodesc[handle].fpname[x];
+					x++;
+				}
+			}
+
+			printf("FOPEN: send $%02x $%02x%02x $%02x%02x%02x %c%c%c%c%c%c%c%c%c%c%c %02d-%02d-%02d %02d:%02d:%02d\n", \
+			pcl_dbf.dirbuf[0],
+			pcl_dbf.dirbuf[2], pcl_dbf.dirbuf[1],
+			pcl_dbf.dirbuf[5], pcl_dbf.dirbuf[4], pcl_dbf.dirbuf[3],
+			pcl_dbf.dirbuf[6], pcl_dbf.dirbuf[7], pcl_dbf.dirbuf[8], pcl_dbf.dirbuf[9],
+			pcl_dbf.dirbuf[10], pcl_dbf.dirbuf[11], pcl_dbf.dirbuf[12], pcl_dbf.dirbuf[13],
+			pcl_dbf.dirbuf[14], pcl_dbf.dirbuf[15], pcl_dbf.dirbuf[16],
+			pcl_dbf.dirbuf[17], pcl_dbf.dirbuf[18], pcl_dbf.dirbuf[19],
+			pcl_dbf.dirbuf[20], pcl_dbf.dirbuf[21], pcl_dbf.dirbuf[22]);
+		}
+
+complete_fopen:
+		sck = calc_checksum((void *)&pcl_dbf, sizeof(pcl_dbf));
+		sio_ack(devno, cunit, 'C');
+		com_write((uchar *)&pcl_dbf, sizeof(pcl_dbf));
+		com_write(&sck, 1);
+		return PCL_DONE;
+	}
+}
+
+/* RENAME/RENDIR */
+static int
+pcl_rename(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	struct stat sb;
+	struct dirent *dp;
+	char newpath[1024];
+	DIR *renamedir;
+	ulong fcnt = 0;
+	IOREQ *rq;
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	create_user_path(devno, cunit, newpath);
+
+	if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	{
+		printf("invalid path '%s'\n", newpath);
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+	renamedir = opendir(newpath);
+
+	if (renamedir == NULL)
+	{
+		printf("cannot open dir '%s'\n", newpath);
+		device[devno][cunit].status.err = 255;
+		return PCL_COMPLETE;
+	}
+
+	printf("local path '%s', fatr1 $%02x\n", newpath, \
+		device[devno][cunit].parbuf.fatr1 | RA_NO_PROTECT);
+
+	device[devno][cunit].status.err = 1;
+
+	while ((dp = readdir(renamedir)) != NULL)
+	{
+		char raw_name[12];
+ 
+		if (check_dos_name(newpath, dp, &sb))
+			continue;
+
+		/* convert 8+3 to NNNNNNNNXXX */
+		ugefina(dp->d_name, raw_name);
+
+		/* match */
+		if (match_dos_names(raw_name, (char *)device[devno][cunit].parbuf.name, \
+			device[devno][cunit].parbuf.fatr1 | RA_NO_PROTECT, &sb) == 0)
+		{
+			char xpath[1024], xpath2[1024], newname[16];
+			uchar names[12];
+			struct stat dummy;
+			ushort x;
+
+			fcnt++;
+
+			strcpy(xpath, newpath);
+			strcat(xpath, "/");
+			strcat(xpath, dp->d_name);
+
+			memcpy(names, device[devno][cunit].parbuf.names, 12);
+
+			for (x = 0; x < 12; x++)
+			{
+				if (names[x] == '?')
+					names[x] = raw_name[x];
+			}
+
+			uexpand(names, newname);
+
+			strcpy(xpath2, newpath);
+			strcat(xpath2, "/");
+			strcat(xpath2, newname);
+
+			printf("RENAME: renaming '%s' -> '%s'\n", dp->d_name, newname);
+
+			if (stat(xpath2, &dummy) == 0)
+			{
+				printf("RENAME: '%s' already exists\n", xpath2);
+				device[devno][cunit].status.err = 151;
+				break;
+			}
+
+			rq = io_slot(IO_RENAME, 0);
+			strcpy(rq->path, xpath);
+			strcpy(rq->path2, xpath2);
+
+			if (io_call(rq, io_timeout(IO_SECTOR_S)) < 0)
+			{
+				device[devno][cunit].status.err = 255;
+				break;
+			}
+
+			if (rq->r)
+			{
+				printf("RENAME: %s\n", strerror(rq->err));
+				device[devno][cunit].status.err = 255;
+			}
+		}
+	}
+
+	closedir(renamedir);
+
+	if ((fcnt == 0) && (device[devno][cunit].status.err == 1))
+		device[devno][cunit].status.err = 170;
+	return PCL_COMPLETE;
+}
+
+/* REMOVE */
+static int
+pcl_remove(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	struct stat sb;
+	struct dirent *dp;
+	char newpath[1024];
+	DIR *deldir;
+	ulong delcnt = 0;
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	create_user_path(devno, cunit, newpath);
+
+	if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	{
+		printf("invalid path '%s'\n", newpath);
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+	printf("local path '%s'\n", newpath);
+
+	deldir = opendir(newpath);
+
+	if (deldir == NULL)
+	{
+		printf("cannot open dir '%s'\n", newpath);
+		device[devno][cunit].status.err = 255;
+		return PCL_COMPLETE;
+	}
+
+	device[devno][cunit].status.err = 1;
+
+	while ((dp = readdir(deldir)) != NULL)
+	{
+		char raw_name[12];
+ 
+		if (check_dos_name(newpath, dp, &sb))
+			continue;
+
+		/* convert 8+3 to NNNNNNNNXXX */
+		ugefina(dp->d_name, raw_name);
+
+		/* match */
+		if (match_dos_names(raw_name, (char *)device[devno][cunit].parbuf.name, \
+			RA_NO_PROTECT | RA_NO_SUBDIR | RA_NO_HIDDEN, &sb) == 0)
+		{
+			char xpath[1024];
+
+			strcpy(xpath, newpath);
+			strcat(xpath, "/");
+			strcat(xpath, dp->d_name);
+
+			if (!S_ISDIR(sb.st_mode))
+			{				
+				printf("REMOVE: delete '%s'\n", xpath);
+				if (unlink(xpath))
+				{
+					printf("REMOVE: cannot delete '%s'\n", xpath);
+					device[devno][cunit].status.err = 255;
+				}
+				delcnt++;
+			}
+		}
+	}
+	closedir(deldir);
+	if (delcnt == 0)
+		device[devno][cunit].status.err = 170;
+	return PCL_COMPLETE;
+}
+
+/* CHMOD */
+static int
+pcl_chmod(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	struct stat sb;
+	struct dirent *dp;
+	char newpath[1024];
+	DIR *chmdir;
+	ulong fcnt = 0;
+	uchar fatr2 = device[devno][cunit].parbuf.fatr2;
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	if (fatr2 & (SA_SUBDIR | SA_UNSUBDIR))
+	{
+		printf("illegal fatr2 $%02x\n", fatr2);
+		device[devno][cunit].status.err = 146;
+		return PCL_COMPLETE;
+	}
+
+	create_user_path(devno, cunit, newpath);
+
+	if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	{
+		printf("invalid path '%s'\n", newpath);
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+	printf("local path '%s', fatr1 $%02x fatr2 $%02x\n", newpath, \
+			device[devno][cunit].parbuf.fatr1, fatr2);
+
+	chmdir = opendir(newpath);
+
+	if (chmdir == NULL)
+	{
+		printf("CHMOD: cannot open dir '%s'\n", newpath);
+		device[devno][cunit].status.err = 255;
+		return PCL_COMPLETE;
+	}
+
+
+	device[devno][cunit].status.err = 1;
+
+	while ((dp = readdir(chmdir)) != NULL)
+	{
+		char raw_name[12];
+ 
+		if (check_dos_name(newpath, dp, &sb))
+			continue;
+
+		/* convert 8+3 to NNNNNNNNXXX */
+		ugefina(dp->d_name, raw_name);
+
+		/* match */
+		if (match_dos_names(raw_name, (char *)device[devno][cunit].parbuf.name, \
+			device[devno][cunit].parbuf.fatr1, &sb) == 0)
+		{
+			char xpath[1024];
+			mode_t newmode = sb.st_mode;
+
+			strcpy(xpath, newpath);
+			strcat(xpath, "/");
+			strcat(xpath, dp->d_name);
+			printf("CHMOD: change atrs in '%s'\n", xpath);
+
+			/* On Unix, ignore Hidden and Archive bits */
+			if (fatr2 & SA_UNPROTECT)
+				newmode |= S_IWUSR;
+			if (fatr2 & SA_PROTECT)
+				newmode &= ~S_IWUSR;
+			if (chmod(xpath, newmode))
+			{
+				printf("CHMOD: failed on '%s'\n", xpath);
+				device[devno][cunit].status.err |= 255;
+			}
+			fcnt++;
+		}
+	}
+	closedir(chmdir);
+	if (fcnt == 0)
+		device[devno][cunit].status.err = 170;
+	return PCL_COMPLETE;
+}
+
+/* MKDIR - warning, fatr2 is bogus */
+static int
+pcl_mkdir(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	char newpath[1024], fname[12];
+	uchar dt[6];
+	struct stat dummy;
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	create_user_path(devno, cunit, newpath);
+
+	if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	{
+		printf("invalid path '%s'\n", newpath);
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+	uexpand(device[devno][cunit].parbuf.name, fname);
+
+	if (validate_dos_name(fname))
+	{
+		printf("bad dir name '%s'\n", fname);
+		device[devno][cunit].status.err = 165;
+		return PCL_COMPLETE;
+	}
+
+	strcat(newpath, "/");
+	strcat(newpath, fname);
+
+	memcpy(dt, &device[devno][cunit].parbuf.f1, sizeof(dt));
+
+	printf("making dir '%s', time %2d-%02d-%02d %2d:%02d:%02d\n", newpath, \
+		dt[0], dt[1], dt[2], dt[3], dt[4], dt[5]);
+
+	if (stat(newpath, &dummy) == 0)
+	{
+		printf("MKDIR: '%s' already exists\n", newpath);
+		device[devno][cunit].status.err = 151;
+		return PCL_COMPLETE;
+	}
+
+	if (mkdir(newpath, S_IRWXU|S_IRWXG|S_IRWXO))
+	{
+		printf("MKDIR: cannot make dir '%s'\n", newpath);
+		device[devno][cunit].status.err = 255;
+	}
+	else
+	{
+		struct timeval tv[2];
+		time_t mtime = timestamp2mtime(dt);
+
+		device[devno][cunit].status.err = 1;
+
+		if (mtime)
+		{
+			tv[0].tv_usec = 0;
+			tv[0].tv_sec = mtime;
+			tv[1].tv_usec = 0;
+			tv[1].tv_sec = mtime;
+
+# if 0
+			printf("MKDIR: setting timestamp in '%s'\n", newpath);
+# endif
+
+			(void)utimes(newpath, (void *)&tv);
+		}
+	}
+	return PCL_COMPLETE;
+}
+
+/* RMDIR */
+static int
+pcl_rmdir(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	struct stat sb;
+	char newpath[1024], fname[12];
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	create_user_path(devno, cunit, newpath);
+
+	if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	{
+		printf("invalid path '%s'\n", newpath);
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+	uexpand(device[devno][cunit].parbuf.name, fname);
+
+	if (validate_dos_name(fname))
+	{
+		printf("bad dir name '%s'\n", fname);
+		device[devno][cunit].status.err = 165;
+		return PCL_COMPLETE;
+	}
+
+	strcat(newpath, "/");
+	strcat(newpath, fname);
+
+	if (stat(newpath, &sb) < 0)
+	{
+		printf("cannot stat '%s'\n", newpath);
+		device[devno][cunit].status.err = 170;
+		return PCL_COMPLETE;
+	}
+
+	if (sb.st_uid != our_uid)
+	{
+		printf("'%s' wrong uid\n", newpath);
+		device[devno][cunit].status.err = 170;
+		return PCL_COMPLETE;
+	}
+
+	if (!S_ISDIR(sb.st_mode))
+	{
+		printf("'%s' is not a directory\n", newpath);
+		device[devno][cunit].status.err = 170;
+		return PCL_COMPLETE;
+	}
+
+	if ((sb.st_mode & S_IWUSR) == 0)
+	{
+		printf("dir '%s' is write-protected\n", newpath);
+		device[devno][cunit].status.err = 170;
+		return PCL_COMPLETE;
+	}
+
+	printf("delete dir '%s'\n", newpath);
+
+	device[devno][cunit].status.err = 1;
+
+	if (rmdir(newpath))
+	{
+		printf("RMDIR: cannot del '%s', %s (%d)\n", newpath, strerror(errno), errno);
+		if (errno == ENOTEMPTY)
+			device[devno][cunit].status.err = 167;
+		else
+			device[devno][cunit].status.err = 255;
+	}
+	return PCL_COMPLETE;
+}
+
+/* CHDIR */
+static int
+pcl_chdir(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	ulong i;
+	char newpath[1024], newwd[1024];
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+//		printf("req. path '%s'\n", device[devno][cunit].parbuf.path);
+
+	create_user_path(devno, cunit, newpath);
+
+	if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	{
+		printf("invalid path '%s'\n", newpath);
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+	if (dir_realpath(newpath, newwd, sizeof(newwd)) < 0)
+	{
+		printf("cannot access '%s', %s\n", newpath, strerror(errno));
+		device[devno][cunit].status.err = 150;
+		return PCL_COMPLETE;
+	}
+
+# if 0
+	printf("newwd %s\n", newwd);
+# endif
+	/* validate_user_path() guarantees that .dirname is part of newwd */
+	i = strlen(device[devno][cunit].dirname);
+	strcpy((char *)device[devno][cunit].cwd, newwd + i);
+	printf("new current dir '%s'\n", (char *)device[devno][cunit].cwd);
+
+	device[devno][cunit].status.err = 1;
+
+	return PCL_COMPLETE;
+}
+
+/* GETCWD */
+static int
+pcl_getcwd(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	uchar sck;
+	int i;
+	uchar tempcwd[65];
+
+	device[devno][cunit].status.err = 1;
+
+	if (ccom == 'P')
+	{
+		printf("device $%02x\n", cunit);
+		return PCL_COMPLETE;
+	}
+
+	sio_ack(devno, cunit, 'A');	/* ack the command */
+
+	tempcwd[0] = 0;
+
+	for (i = 0; device[devno][cunit].cwd[i] && (i < 64); i++)
+	{
+		uchar a;
+
+		a = toupper(device[devno][cunit].cwd[i]);
+		if (a == '/')
+			a = '>';
+		tempcwd[i] = a;
+	}
+
+	tempcwd[i] = 0;
+
+	printf("send '%s'\n", tempcwd);
+
+	sck = calc_checksum(tempcwd, sizeof(tempcwd)-1);
+	sio_ack(devno, cunit, 'C');
+	com_write(tempcwd, sizeof(tempcwd)-1);
+	com_write(&sck, sizeof(sck));
+	return PCL_DONE;
+}
+
+/* DFREE */
+static int
+pcl_dfree(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	FILE *vf;
+	int x;
+	uchar c = 0, volname[8];
+	char lpath[1024];
+	static uchar dfree[65] =
+	{
+		0x21,		/* data format version */
+		0x00, 0x00,	/* main directory ptr */
+		0xff, 0xff, 	/* total sectors */
+		0xff, 0xff,	/* free sectors */
+		0x00,		/* bitmap length */
+		0x00, 0x00,	/* bitmap begin */
+		0x00, 0x00,	/* filef */
+		0x00, 0x00,	/* dirf */
+		0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,	/* volume name */
+		0x00,		/* number of tracks */
+		0x01,		/* bytes per sector, encoded */
+		0x80,		/* version number */
+		0x00, 0x02,	/* real bps */
+		0x00, 0x00,	/* fmapen */
+		0x01,		/* sectors per cluster */
+		0x00, 0x00,	/* nr seq and rnd */
+		0x00, 0x00,	/* bootp */
+		0x00,		/* lock */
+
+		0,0,0,0,0,0,0,0,
+		0,0,0,0,0,0,0,0,
+		0,0,0,0,0,0,0,0,
+		0,0,0,0,0,
+		0		/* CRC */
+	};
+
+	device[devno][cunit].status.err = 1;
+
+	if (ccom == 'P')
+	{
+		printf("device $%02x\n", cunit);
+		return PCL_COMPLETE;
+	}
+
+	sio_ack(devno, cunit, 'A');	/* ack the command */
+
+	memset(dfree + 0x0e, 0x020, 8);
+
+	strcpy(lpath, (char *)device[devno][cunit].dirname);
+	strcat(lpath, "/");
+	strcat(lpath, DEVICE_LABEL);
+
+	printf("reading '%s'\n", lpath);
+
+	vf = fopen(lpath, "r");
+
+	if (vf)
+	{
+		int r;
+		uchar a;
+
+		r = fread(volname, sizeof (uchar), 8, vf);
+
+		fclose(vf);
+
+		for (x = 0; x < r; x++)
+		{
+			a = volname[x];
+			if (a == 0x9b)
+				break;
+			dfree[14+x] = a;
+		}
+	}
+
+	x = 0;
+	while (x < 8)
+	{
+		c |= dfree[14+x];
+		x++;
+	}
+
+	if (c == 0x20)
+	{
+		memcpy(dfree + 14, "PCLink  ", 8);
+		dfree[21] = cunit + 0x40;
+	}
+
+	printf("DFREE: send info (%d bytes)\n", (int)sizeof(dfree)-1);
+
+	dfree[64] = calc_checksum(dfree, sizeof(dfree)-1);
+	sio_ack(devno, cunit, 'C');
+	com_write(dfree, sizeof(dfree));
+	return PCL_DONE;
+}
+
+/* CHVOL */
+static int
+pcl_chvol(PCLCMD *pc)
+{
+	uchar devno = pc->devno;
+	uchar ccom = pc->ccom;
+	ushort cunit = pc->cunit;
+	FILE *vf;
+	ulong nl;
+	char lpath[1024];
+
+	device[devno][cunit].status.err = 1;
+
+	if (ccom == 'R')
+	{
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+		device[devno][cunit].status.err = 176;
+		printf("bad exec\n");
+		return PCL_COMPLETE;
+	}
+
+	nl = strlen((char *)device[devno][cunit].parbuf.name);
+
+	if (nl == 0)
+	{
+		printf("invalid name\n");
+		device[devno][cunit].status.err = 156;
+		return PCL_COMPLETE;
+	}
+
+	strcpy(lpath, device[devno][cunit].dirname);
+	strcat(lpath, "/");
+	strcat(lpath, DEVICE_LABEL);
+
+	printf("writing '%s'\n", lpath);
+
+	vf = fopen(lpath, "w");
+
+	if (vf)
+	{
+		int x;
+		uchar a;
+
+		for (x = 0; x < 8; x++)
+		{
+			a = device[devno][cunit].parbuf.name[x];
+			if (!a || (a == 0x9b))
+				a = 0x20;
+			(void)fwrite(&a, sizeof(uchar), 1, vf);
+		}
+		fclose(vf);
+	}
+	else
+	{
+		printf("CHVOL: %s\n", strerror(errno));
+		device[devno][cunit].status.err = 255;
+	}
+	return PCL_COMPLETE;
+}
+
+static const PCLFN pcl_fno[PCL_MAX_FNO + 1] =
+{
+	pcl_fread,	/* $00 */
+	pcl_fwrite,	/* $01 */
+	pcl_fseek,	/* $02 */
+	pcl_ftell,	/* $03 */
+	pcl_ftell,	/* $04 */
+	NULL,		/* $05 */
+	pcl_fnext,	/* $06 */
+	pcl_fclose,	/* $07 */
+	pcl_init,	/* $08 */
+	pcl_fopen,	/* $09 */
+	pcl_fopen,	/* $0a */
+	pcl_rename,	/* $0b */
+	pcl_remove,	/* $0c */
+	pcl_chmod,	/* $0d */
+	pcl_mkdir,	/* $0e */
+	pcl_rmdir,	/* $0f */
+	pcl_chdir,	/* $10 */
+	pcl_getcwd,	/* $11 */
+	NULL,		/* $12 */
+	pcl_dfree,	/* $13 */
+	pcl_chvol	/* $14 */
+};
+
+/* Command: DDEVIC+DUNIT-1 = $6f, DAUX1 = parbuf size, DAUX2 = %vvvvuuuu
+ * where: v - protocol version number (0), u - unit number
+ */
+
+static void
+do_pclink(uchar devno, uchar ccom, uchar caux1, uchar caux2)
+{
+	uchar ck, sck, fno, handle;
+	ushort cunit = caux2 & 0x0f, parsize;
+	ulong faux;
+	PCLCMD pc;
+
+	parsize = caux1 ? caux1 : 256;
+
+	if (caux2 & 0xf0)	/* protocol version number must be 0 */
+	{
+		sio_ack(devno, cunit, 'N');
+		return;
+	}
+
+	if (parsize > sizeof(PARBUF))	/* and not more than fits in parbuf */
+	{
+		sio_ack(devno, cunit, 'N');
+		return;
+	}
+
+	if (ccom == 'P')
+	{
+		PARBUF pbuf;
+
+		sio_ack(devno, cunit, 'A');	/* ack the command */
+
+		bzero(&pbuf, sizeof(PARBUF));
+
+		com_read((uchar *)&pbuf, parsize, COM_DATA);
+		com_read(&sck, 1, COM_DATA);
+
+		ck = calc_checksum((uchar *)&pbuf, parsize);
+
+		device[devno][cunit].status.stat &= ~0x02;
+
+		sio_ack(devno, cunit, 'A');	/* ack the received block */
+
+		if (ck != sck)
+		{
+			metrics->cksum_err[CK_PARBLK]++;
+			device[devno][cunit].status.stat |= 0x02;
+			printf("PARBLK CRC error, Atari: $%02x, PC: $%02x\n", sck, ck);
+			device[devno][cunit].status.err = 143;
+			goto complete;
+		}
+
+		device[devno][cunit].status.stat &= ~0x04;
+
+# if 0
+		/* True if Atari didn't catch the ACK above and retried the command */
+		if (pbuf.fno > PCL_MAX_FNO)
+		{
+			device[devno][cunit].status.stat |= 0x04;
+			printf("PARBLK error, invalid fno $%02x\n", pbuf.fno);
+			device[devno][cunit].status.err = 144;
+			goto complete;
+		}
+# endif
+
+		if (memcmp(&pbuf, &device[devno][cunit].parbuf, sizeof(PARBUF)) == 0)
+		{
+			/* this is a retry of P-block. Most commands don't like that */
+			if ((pbuf.fno != 0x00) && (pbuf.fno != 0x01) && (pbuf.fno != 0x03) \
+				&& (pbuf.fno != 0x04) && (pbuf.fno != 0x06) && \
+					(pbuf.fno != 0x11) && (pbuf.fno != 0x13))
+			{
+				printf("PARBLK retry, ignored\n");
+				goto complete;
+			}
+		}
+
+		memcpy(&device[devno][cunit].parbuf, &pbuf, sizeof(PARBUF));
+	}
+
+//	device[devno][cunit].status.err = 1;
+//	set_status_size(devno, cunit, 0);
+
+	fno = device[devno][cunit].parbuf.fno;
+	faux = device[devno][cunit].parbuf.f1 + device[devno][cunit].parbuf.f2 * 256 + \
+		device[devno][cunit].parbuf.f3 * 65536;
+
+	if (fno < (PCL_MAX_FNO+1))
+		printf("%s (fno $%02x): ", fun[fno], fno);
+
+	handle = device[devno][cunit].parbuf.handle;
+
+	if ((fno <= PCL_MAX_FNO) && pcl_fno[fno])
+	{
+		pc.devno = devno;
+		pc.ccom = ccom;
+		pc.cunit = cunit;
+		pc.fno = fno;
+		pc.handle = handle;
+		pc.faux = faux;
+
+		switch (pcl_fno[fno](&pc))
+		{
+			case PCL_ABORT:
+				return;
+			case PCL_DONE:
+				goto exit;
+		}
+
+		goto complete;
+	}
+
+	printf("fno $%02x: not implemented\n", fno);
+	device[devno][cunit].status.err = 146;
+
+complete:
+	sio_ack(devno, cunit, 'C');
+
+exit:
+	old_ccom = ccom;
+
+	return;
+}
+
+/* Device classes. Each device ID on the bus maps to a class, which
+ * decides whether it answers the frame at all, then the command byte
+ * picks the handler straight from the class table. The classes are
+ * registered by dev_setup() when a port starts; a new emulation is a
+ * DEVCLASS and a dev_register() call, the frame loop stays as it is.
+ */
+
+static __thread DEVCLASS *devmap[256];		/* the class of each device ID */
+static __thread uchar sdxtime[8];		/* $ff + 6 bytes time + checksum */
+static __thread int toff = 0;			/* next sdxtime byte for the status */
+
+static void
+dev_register(DEVCLASS *cls, ushort first, ushort last)
+{
+	ushort c;
+
+	for (c = first; c <= last; c++)
+		devmap[c] = cls;
+}
+
+static void
+dev_nak(SIOCMD *sc)
+{
+	sio_ack(sc->devno, sc->cunit, 'N');
+}
+
+# ifdef ULTRA
+static void
+dev_hsindex(SIOCMD *sc)			/* send hi-speed index */
+{
+	wait_for_command_drop();
+	if (siospeed[turbo_ix].idx != 40)
+		sio_send_data_byte(sc->devno, sc->cunit, siospeed[turbo_ix].idx);
+	else
+		sio_ack(sc->devno, sc->cunit, 'N');
+}
+# endif
+
+/* Disk drives D1: to D15: */
+
+static int
+disk_accept(SIOCMD *sc)
+{
+	return ((device[sc->devno][sc->cunit].fd > -1) || device[sc->devno][sc->cunit].ram);
+}
+
+static void
+disk_read(SIOCMD *sc)			/* read sector */
+{
+	send_sector(sc->devno, sc->cunit, sc->ccom, sc->sec);
+}
+
+static int
+burst_pread(DEVICE *dv, off_t off, uchar *dst, ulong len)
+{
+	IOREQ *rq;
+	int r = -1;
+
+	if (dv->ram)
+	{
+		if ((off + len) > dv->ramsize)
+			return -1;
+		memcpy(dst, dv->ram + off, len);
+		return 0;
+	}
+
+	rq = io_slot(IO_PREAD, len);
+
+	rq->fd = dv->fd;
+	rq->img = dv->img;
+	rq->off = off;
+
+	if (io_call(rq, io_timeout(IO_SECTOR_S)) < 0)
+		return -1;
+
+	if (rq->r == (long)len)
+	{
+		memcpy(dst, rq->buf, len);
+		r = 0;
+	}
+	io_release(rq);
+
+	return r;
+}
+
+/* Burst read, a vendor extension enabled with -x. DAUX holds the first
+ * sector in bits 0-10 and the count less one in bits 11-15, so a run of
+ * up to 32 sectors among the first 2047 comes back for one command
+ * frame: 'B' sends each sector followed by its own checksum, 'b' all of
+ * them with one checksum at the end. A run which is contiguous in the
+ * image is fetched with one request, and it goes out with one write.
+ */
+static void
+disk_burst(SIOCMD *sc)
+{
+	static __thread uchar data[BURST_MAX * 256], out[BURST_MAX * 257 + 1];
+	DEVICE *dv = &device[3][sc->cunit];
+	ulong first = sc->sec & 0x07ff, count = (sc->sec >> 11) + 1, n, len = 0, o = 0;
+	ushort bps[BURST_MAX];
+	off_t off0 = 0;
+	int split = 0, err = 0;
+
+	/* the buffers hold BURST_MAX sectors of 256 bytes, fewer of larger ones */
+	if (!burst_read || dv->atx || (first == 0) || ((first + count - 1) > dv->maxsec) || \
+		((count * dv->bps) > sizeof(data)))
+	{
+		sio_ack(sc->devno, sc->cunit, 'N');
+		return;
+	}
+
+	sio_ack(sc->devno, sc->cunit, 'A');
+
+	for (n = 0; n < count; n++)
+	{
+		bps[n] = ((dv->bps == 256) && ((first + n) < 4)) ? 128 : dv->bps;
+		if (n == 0)
+			off0 = atr_offset(sc->cunit, first);
+		else if (atr_offset(sc->cunit, first + n) != (off0 + (off_t)len))
+			split = 1;
+		len += bps[n];
+	}
+
+	if (split || dv->ovl)
+	{
+		for (n = 0, o = 0; (n < count) && !err; o += bps[n], n++)
+			if (!dv->ovl || !ovl_read(dv->ovl, first + n, data + o, bps[n]))
+				err = burst_pread(dv, atr_offset(sc->cunit, first + n), data + o, bps[n]);
+		o = 0;
+	}
+	else
+		err = burst_pread(dv, off0, data, len);
+
+	if (err)
+		bzero(data, sizeof(data));
+
+	for (n = 0, len = 0; n < count; n++)
+	{
+		memcpy(out + o, data + len, bps[n]);
+		if (sc->ccom == 'B')
+		{
+			out[o + bps[n]] = calc_checksum(out + o, bps[n]);
+			o++;
+		}
+		o += bps[n];
+		len += bps[n];
+	}
+	if (sc->ccom == 'b')
+	{
+		out[o] = calc_checksum(out, o);
+		o++;
+	}
+
+	if (err)
+	{
+		sio_ack(sc->devno, sc->cunit, 'E');
+		dv->errors++;
+		printf("SIO read error: D%d:, burst of %lu at sector $%04lx\n", sc->cunit, count, first);
+	}
+	else
+	{
+		sio_ack(sc->devno, sc->cunit, 'C');
+		dv->reads += count;
+	}
+
+	com_write(out, o);
+
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("<- BURST $%04lx (%5ld), %lu sectors, %lu bytes\n", first, first, count, o);
+# endif
+}
+
+static void
+disk_write(SIOCMD *sc)			/* put/write sector */
+{
+# ifdef SIOTRACE
+	static __thread uchar l_cunit = 0;
+	static __thread ulong l_sec = 0;
+
+	if (sc->cunit == l_cunit)
+	{
+		if (l_sec == sc->sec)
+			printf("SIO warning: dup write, sector $%04lx\n", sc->sec);
+	}
+# endif
+	receive_sector(sc->devno, sc->cunit, sc->sec);
+# ifdef SIOTRACE
+	l_cunit = sc->cunit;
+	l_sec = sc->sec;
+# endif
+}
+
+static void
+disk_status(SIOCMD *sc)
+{
+	if (toff == 0)
+		get_sdx_time(sdxtime);
+	device[sc->devno][sc->cunit].status.none = sdxtime[toff++];
+	wait_for_command_drop();
+	sio_send_status(sc->devno, sc->cunit);
+	if (toff > 6) toff = 0;
+}
+
+static void
+disk_percom_read(SIOCMD *sc)
+{
+	if (block_percom == 0)
+		send_percom(sc->cunit);
+	else
+		sio_ack(sc->devno, sc->cunit, 'N');
+}
+
+static void
+disk_percom_write(SIOCMD *sc)
+{
+	if (block_percom == 0)
+		receive_percom(sc->cunit);
+	else
+		sio_ack(sc->devno, sc->cunit, 'N');
+}
+
+static void
+disk_format(SIOCMD *sc)
+{
+	ushort cunit = sc->cunit;
+	PERCOM *pc = &device[sc->devno][cunit].percom;
+	ushort spt = pc->spt_hi * 256 + pc->spt_lo;
+	ushort bps = pc->bps_hi * 256 + pc->bps_lo;
+
+	if (block_percom && (spt == 26) && (pc->trk == 40) && (bps == 128) && (pc->flags & 0x04))
+	{
+		drive_setup(cunit, 720*128, 128);
+
+		setup_status(cunit);
+
+		report_percom(cunit);
+	}
+
+	format_atr(cunit, 0);
+}
+
+static void
+disk_format_ed(SIOCMD *sc)		/* format 1050 */
+{
+	if (device[sc->devno][sc->cunit].percom.trk == 1)
+	{
+		sio_ack(sc->devno, sc->cunit, 'N');
+		return;
+	}
+	setup_percom(sc->cunit, percom_ed);
+	format_atr(sc->cunit, 0);
+}
+
+# ifdef ULTRA
+static DEVCLASS dev_disk;
+
+/* XF551 high speed: a command with bit 7 set is the plain one, with the
+ * rest of the exchange at 38400 bits/sec. The frame comes at the speed
+ * the line is at, which is restored when the answer is out.
+ */
+static void
+disk_xf551(SIOCMD *sc)
+{
+	ushort ix = line_ix;
+
+	sc->ccom &= 0x7f;
+	sio_setspeed(sc->com, 2);
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("SIO notice: XF551 '%c' at %d bits/sec.\n", sc->ccom, siospeed[2].baud);
+# endif
+	dev_disk.cmd[sc->ccom](sc);
+	tcdrain(serial_fd);
+	sio_setspeed(sc->com, ix);
+}
+# endif
+
+/* The profiles differ only in the commands they take */
+
+static DEVCLASS dev_disk =		/* US Doubler */
+{
+	.name = "usdoubler",
+	.mclass = MC_DISK,
+	.accept = disk_accept,
+	.cmd =
+	{
+		['R'] = disk_read,
+		['V'] = disk_read,
+		['P'] = disk_write,
+		['W'] = disk_write,
+		['S'] = disk_status,
+		['N'] = disk_percom_read,
+		['O'] = disk_percom_write,
+# ifdef ULTRA
+		['?'] = dev_hsindex,
+# endif
+		['"'] = disk_format_ed,
+		['!'] = disk_format,
+		['B'] = disk_burst,
+		['b'] = disk_burst
+	}
+};
+
+static DEVCLASS dev_disk_1050 =
+{
+	.name = "1050",
+	.mclass = MC_DISK,
+	.accept = disk_accept,
+	.cmd =
+	{
+		['R'] = disk_read,
+		['V'] = disk_read,
+		['P'] = disk_write,
+		['W'] = disk_write,
+		['S'] = disk_status,
+		['"'] = disk_format_ed,
+		['!'] = disk_format
+	}
+};
+
+static DEVCLASS dev_disk_xf551 =
+{
+	.name = "xf551",
+	.mclass = MC_DISK,
+	.accept = disk_accept,
+	.cmd =
+	{
+		['R'] = disk_read,
+		['V'] = disk_read,
+		['P'] = disk_write,
+		['W'] = disk_write,
+		['S'] = disk_status,
+		['N'] = disk_percom_read,
+		['O'] = disk_percom_write,
+		['"'] = disk_format_ed,
+		['!'] = disk_format,
+		['B'] = disk_burst,
+		['b'] = disk_burst,
+# ifdef ULTRA
+		[0x80|'R'] = disk_xf551,
+		[0x80|'P'] = disk_xf551,
+		[0x80|'W'] = disk_xf551,
+		[0x80|'S'] = disk_xf551,
+		[0x80|'N'] = disk_xf551,
+		[0x80|'O'] = disk_xf551,
+		[0x80|'"'] = disk_xf551,
+		[0x80|'!'] = disk_xf551
+# endif
+	}
+};
+
+static DEVCLASS dev_disk_happy =
+{
+	.name = "happy",
+	.mclass = MC_DISK,
+	.accept = disk_accept,
+	.cmd =
+	{
+		['R'] = disk_read,
+		['V'] = disk_read,
+		['P'] = disk_write,
+		['W'] = disk_write,
+		['S'] = disk_status,
+		['N'] = disk_percom_read,
+		['O'] = disk_percom_write,
+		['"'] = disk_format_ed,
+		['!'] = disk_format,
+		['B'] = disk_burst,
+		['b'] = disk_burst,
+# ifdef ULTRA
+		['?'] = dev_hsindex,
+		[0x80|'R'] = disk_xf551,
+		[0x80|'P'] = disk_xf551,
+		[0x80|'W'] = disk_xf551,
+		[0x80|'S'] = disk_xf551,
+		[0x80|'N'] = disk_xf551,
+		[0x80|'O'] = disk_xf551,
+		[0x80|'"'] = disk_xf551,
+		[0x80|'!'] = disk_xf551
+# endif
+	}
+};
+
+static DEVCLASS *drive_class[DP_MAX] = { &dev_disk, &dev_disk_1050, &dev_disk_xf551, &dev_disk_happy };
+static __thread uchar drive_prof[16];		/* DP_* of each drive, set by -e */
+
+static int
+profile_find(const char *name)
+{
+	int x;
+
+	for (x = 0; x < DP_MAX; x++)
+		if (strcmp(name, drive_class[x]->name) == 0)
+			return x;
+
+	return -1;
+}
+
+/* The devinfo device on $21 */
+
+static int
+devinfo_accept(SIOCMD *sc)
+{
+	return (sc->cunit == 1);
+}
+
+static void
+devinfo_status(SIOCMD *sc)
+{
+	sio_send_status(sc->devno, 0);
+}
+
+# ifdef ULTRA
+static void
+devinfo_hsindex(SIOCMD *sc)
+{
+	sio_send_data_byte(sc->devno, sc->cunit, siospeed[turbo_ix].idx);
+}
+# endif
+
+static void
+devinfo_read(SIOCMD *sc)		/* 'n' devinfo, 'R' bogus read */
+{
+	uchar devbuf[512], cksum;
+
+	bzero(devbuf, sizeof(devbuf));
+
+	sio_ack(sc->devno, sc->cunit, 'A');
+
+	if (sc->ccom == 'n')
+	{
+		devbuf[2] = sc->cunit;
+		devbuf[7] = sizeof(devbuf) / 256;	/* sector size */
+		devbuf[8] = 0xff;
+		devbuf[9] = 0xff;			/* sector count */
+
+		sprintf((char *)devbuf+16, "SIO2BSD unit %d", (int)sc->cunit);
+	}
+
+	cksum = calc_checksum(devbuf, sizeof(devbuf));
+
+	sio_ack(sc->devno, sc->cunit, 'C');
+	com_write(devbuf, sizeof(devbuf));
+	com_write(&cksum, sizeof(cksum));
+}
+
+static DEVCLASS dev_devinfo =
+{
+	.name = "devinfo",
+	.mclass = MC_DEVINFO,
+	.accept = devinfo_accept,
+	.cmd =
+	{
+		['S'] = devinfo_status,
+# ifdef ULTRA
+		['?'] = devinfo_hsindex,
+# endif
+		['n'] = devinfo_read,
+		['R'] = devinfo_read
+	}
+};
+
+/* Printer P1: */
+
+static int
+printer_accept(SIOCMD *sc)
+{
+	return (spool && (sc->cdev == 0x40));
+}
+
+static void
+printer_status(SIOCMD *sc)
+{
+	sio_send_status(sc->devno, 0);
+}
+
+static void
+printer_write(SIOCMD *sc)
+{
+	DEVICE *dv = &device[sc->devno][0];
+
+	switch (sc->caux1)
+	{
+		case 0x44:
+		{
+			dv->bps = 0x14;
+			break;
+		}
+		case 0x53:
+		{
+			dv->bps = 0x1d;
+			break;
+		}
+		default:
+		{
+			dv->bps = 0x28;
+			break;
+		}
+	}
+
+	print_record(sc->devno, sc->cunit, dv->bps, port_self->ascii_translation);
+}
+
+static DEVCLASS dev_printer =
+{
+	.name = "printer",
+	.mclass = MC_PRINTER,
+	.accept = printer_accept,
+	.cmd =
+	{
+		['S'] = printer_status,
+		['W'] = printer_write
+	}
+};
+
+/* APE time protocol on $45 */
+
+static int
+apetime_accept(SIOCMD *sc)
+{
+	(void)sc;
+
+	return 1;
+}
+
+static void
+apetime_read(SIOCMD *sc)
+{
+	if (sc->sec != 0x000a0eeUL)
+	{
+		sio_ack(sc->devno, sc->cunit, 'N');
+		return;
+	}
+
+	sio_ack(sc->devno, sc->cunit, 'A');
+	get_sdx_time(sdxtime);
+	sdxtime[7] = calc_checksum(sdxtime+1, 6);
+	sio_ack(sc->devno, sc->cunit, 'C');
+	com_write(sdxtime+1, 7);
+# ifdef SIOTRACE
+	if (log_flag)
+		printf("<- APE TIME\n");
+# endif
+}
+
+static DEVCLASS dev_apetime =
+{
+	.name = "apetime",
+	.mclass = MC_APETIME,
+	.accept = apetime_accept,
+	.cmd =
+	{
+		[0x93] = apetime_read
+	}
+};
+
+/* The image catalogue on $70-$7F, with -L */
+
+static int
+catalogue_accept(SIOCMD *sc)
+{
+	(void)sc;
+
+	return (catcnt > 0);
+}
+
+static void
+catalogue_send(SIOCMD *sc, uchar *buf, ulong len)
+{
+	uchar cksum = calc_checksum(buf, len);
+
+	sio_ack(sc->devno, sc->cunit, 'C');
+	com_write(buf, len);
+	com_write(&cksum, sizeof(cksum));
+}
+
+static void
+catalogue_status(SIOCMD *sc)
+{
+	uchar buf[4];
+
+	sio_ack(sc->devno, sc->cunit, 'A');
+
+	buf[0] = catcnt & 0xff;
+	buf[1] = (catcnt >> 8) & 0xff;
+	buf[2] = buf[3] = 0;
+
+	catalogue_send(sc, buf, sizeof(buf));
+}
+
+static void
+catalogue_read(SIOCMD *sc)
+{
+	uchar buf[CAT_RECORD];
+	const CATENTRY *e;
+	const char *name;
+	ulong n;
+
+	if (sc->sec >= catcnt)
+	{
+		sio_ack(sc->devno, sc->cunit, 'N');
+		return;
+	}
+
+	sio_ack(sc->devno, sc->cunit, 'A');
+
+	e = &catalogue[sc->sec];
+	name = e->path + catskip;
+
+	bzero(buf, sizeof(buf));
+	buf[0] = e->sectors & 0xff;
+	buf[1] = (e->sectors >> 8) & 0xff;
+	buf[2] = e->bps & 0xff;
+	buf[3] = (e->bps >> 8) & 0xff;
+	buf[4] = e->fmt;
+
+	for (n = 0; name[n] && (n < (CAT_RECORD - 6)); n++)
+		buf[5 + n] = name[n];
+	buf[5 + n] = 0x9b;
+
+	catalogue_send(sc, buf, sizeof(buf));
+}
+
+static void
+catalogue_mount(SIOCMD *sc)
+{
+	if ((sc->sec >= catcnt) || (sc->cunit == 0))
+	{
+		sio_ack(sc->devno, sc->cunit, 'N');
+		return;
+	}
+
+	sio_ack(sc->devno, sc->cunit, 'A');
+
+	if (drive_replace(sc->cunit, catalogue[sc->sec].path) < 0)
+		sio_ack(sc->devno, sc->cunit, 'E');
+	else
+		sio_ack(sc->devno, sc->cunit, 'C');
+}
+
+static DEVCLASS dev_catalogue =
+{
+	.name = "catalogue",
+	.mclass = MC_CATALOGUE,
+	.accept = catalogue_accept,
+	.cmd =
+	{
+		['S'] = catalogue_status,
+		['R'] = catalogue_read,
+		['M'] = catalogue_mount
+	}
+};
+
+/* PCLink. It ignores DUNIT, the unit is in DAUX2 */
+
+static int
+pclink_accept(SIOCMD *sc)
+{
+	if (pclcnt < 2)
+		return 0;
+
+	sc->cunit = sc->caux2 & 0x0f;
+	sc->cdev = 0x6f;
+	sc->devno = sc->cdev >> 4;
+
+	/* cunit == 0 is init during warm reset */
+	return ((sc->cunit == 0) || device[sc->devno][sc->cunit].on);
+}
+
+static void
+pclink_call(SIOCMD *sc)
+{
+	do_pclink(sc->devno, sc->ccom, sc->caux1, sc->caux2);
+}
+
+static void
+pclink_status(SIOCMD *sc)
+{
+	sio_send_status(sc->devno, sc->cunit);
+}
+
+static DEVCLASS dev_pclink =
+{
+	.name = "pclink",
+	.mclass = MC_PCLINK,
+	.accept = pclink_accept,
+	.cmd =
+	{
+		['P'] = pclink_call,
+		['R'] = pclink_call,
+		['S'] = pclink_status,
+# ifdef ULTRA
+		['?'] = dev_hsindex
+# endif
+	}
+};
+
+/* R: and the rest of $5x: known on the bus, not emulated. The frames
+ * are in sync, so they are let through and not answered.
+ */
+
+static int
+none_accept(SIOCMD *sc)
+{
+	(void)sc;
+
+	return 0;
+}
+
+static DEVCLASS dev_none =
+{
+	.name = "none",
+	.mclass = MC_OTHER,
+	.accept = none_accept,
+	.cmd = { NULL }
+};
+
+/* Build the device map of the port after the drives are mounted.
+ * PCLink goes last: it has a priority over all other devices.
+ */
+static void
+dev_setup(void)
+{
+	ushort d;
+
+	bzero(devmap, sizeof(devmap));
+
+	dev_register(&dev_devinfo, 0x20, 0x2f);
+	for (d = 0; d < 16; d++)
+		dev_register(drive_class[drive_prof[d]], 0x30 + d, 0x30 + d);
+	dev_register(&dev_printer, 0x40, 0x4f);
+	dev_register(&dev_apetime, 0x45, 0x45);
+	dev_register(&dev_none, 0x50, 0x5f);
+	if (catcnt)
+		dev_register(&dev_catalogue, 0x70, 0x7f);
+	dev_register(&dev_pclink, 0x6f, 0x6f);
+	if (pclcnt > 1)
+		dev_register(&dev_pclink, PCLSIO, PCLSIO);
+}
+
+/* One command frame: find the class, let it check the frame, run the
+ * handler for the command or NAK it.
+ */
+static int
+dev_dispatch(SIOCMD *sc)
+{
+	DEVCLASS *cls = devmap[sc->cdev];
+
+	if (cls == NULL)
+		return MC_OTHER;
+
+	if (cls->accept(sc))
+	{
+		if (cls->cmd[sc->ccom])
+			cls->cmd[sc->ccom](sc);
+		else
+			dev_nak(sc);
+	}
+
+	return cls->mclass;
+}
+
+static ushort
+check_desync(uchar *cmd, uchar cksum, uchar cka)
+{
+	uchar ccom, cdev;
+
+	/* According to the Atari docs, the drive should discard the command
+	 * if there's CRC error in it, and take no action.
+	 */
+	if (cksum != cka)
+	{
+		metrics->desync[DS_CHECKSUM]++;
+		if (log_flag)
+			printf("Bad CRC in cmd: Atari = $%02x, PC = $%02x\n", cka, (uchar)cksum);
+		return 1;
+	}
+
+	ccom = cmd[1];
+
+	if (ccom < 0x21)
+	{
+		metrics->desync[DS_COMMAND]++;
+		return 1;
+	}
+
+	cdev = cmd[0];
+
+	if (devmap[cdev] == NULL)
+	{
+		metrics->desync[DS_DEVICE]++;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* A marked byte means that the Atari talks at the other speed. Let the
+ * rest of its frame go by, throw it away and switch right now, so that
+ * the Atari's first retry of the command is read at the right speed.
+ */
+static void
+speed_mismatch(struct termios *com)
+{
+	struct pollfd pfd;
+	uchar junk[64];
+
+	pfd.fd = serial_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	while ((poll(&pfd, 1, 3) > 0) && (read(serial_fd, junk, sizeof(junk)) > 0))
+		;
+	tcflush(serial_fd, TCIFLUSH);
+
+	metrics->desync[DS_LINE]++;
+	if (log_flag)
+		printf("Line errors: %lu at %d bits/sec.\n", line_errors, siospeed[line_ix].baud);
+	line_errors = 0;
+
+# ifdef ULTRA
+	cal_desync();
+	turbo(com, turbo_on ? 0 : 1);
+# else
+	(void)com;
+# endif
+}
+
+/* ============== Metrics ================= */
+
+static const char *mc_name[MC_MAX] = { "other", "disk", "printer", "pclink", "apetime", "devinfo", "catalogue" };
+static const char *ck_name[CK_MAX] = { "sector", "percom", "parblk", "fwrite" };
+static const char *ds_name[DS_MAX] = { "checksum", "command", "device", "line" };
+
+static struct
+{
+	char *buf;
+	size_t len, size;
+} mtext;
+
+static void
+mprintf(const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	for (;;)
+	{
+		va_start(ap, fmt);
+		r = vsnprintf(mtext.buf + mtext.len, mtext.size - mtext.len, fmt, ap);
+		va_end(ap);
+
+		if (r < 0)
+			return;
+
+		if ((size_t)r < (mtext.size - mtext.len))
+		{
+			mtext.len += r;
+			return;
+		}
+		else
+		{
+			size_t ns = mtext.size ? mtext.size * 2 : 16384;
+			char *nb = realloc(mtext.buf, ns);
+
+			if (nb == NULL)
+				return;
+			mtext.buf = nb;
+			mtext.size = ns;
+		}
+	}
+}
+
+static int
+lat_cmp(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* One block per metric family, with a line per port in each */
+static void
+metrics_format(void)
+{
+	static float lat[LAT_SAMPLES];
+	static const double q[] = { 0.5, 0.9, 0.99 };
+	const char *port;
+	METRICS *m;
+	ulong n, x, y, c, r, h, u, e;
+	int i;
+
+	mprintf("# HELP sio2bsd_commands_total SIO commands served, by device class and command byte.\n");
+	mprintf("# TYPE sio2bsd_commands_total counter\n");
+	for (i = 0; i < nports; i++)
+	{
+		if ((m = ports[i].metrics) == NULL)
+			continue;
+		port = ports[i].serial;
+		for (x = 0; x < MC_MAX; x++)
+			for (y = 0; y < 256; y++)
+				if (m->cmds[x][y])
+					mprintf("sio2bsd_commands_total{port=\"%s\",device=\"%s\",command=\"0x%02lx\"} %lu\n", \
+						port, mc_name[x], y, m->cmds[x][y]);
+	}
+
+	mprintf("# HELP sio2bsd_bytes_total Bytes moved over SIO; in is Atari to PC.\n");
+	mprintf("# TYPE sio2bsd_bytes_total counter\n");
+	for (i = 0; i < nports; i++)
+	{
+		if ((m = ports[i].metrics) == NULL)
+			continue;
+		port = ports[i].serial;
+		mprintf("sio2bsd_bytes_total{port=\"%s\",direction=\"in\"} %lu\n", port, m->bytes_in);
+		mprintf("sio2bsd_bytes_total{port=\"%s\",direction=\"out\"} %lu\n", port, m->bytes_out);
+	}
+
+	mprintf("# HELP sio2bsd_checksum_errors_total Data frames from the Atari with a bad checksum.\n");
+	mprintf("# TYPE sio2bsd_checksum_errors_total counter\n");
+	for (i = 0; i < nports; i++)
+	{
+		if ((m = ports[i].metrics) == NULL)
+			continue;
+		port = ports[i].serial;
+		for (x = 0; x < CK_MAX; x++)
+			mprintf("sio2bsd_checksum_errors_total{port=\"%s\",frame=\"%s\"} %lu\n", port, ck_name[x], m->cksum_err[x]);
+	}
+
+	mprintf("# HELP sio2bsd_desyncs_total Command frames rejected as out of sync.\n");
+	mprintf("# TYPE sio2bsd_desyncs_total counter\n");
+	for (i = 0; i < nports; i++)
+	{
+		if ((m = ports[i].metrics) == NULL)
+			continue;
+		port = ports[i].serial;
+		for (x = 0; x < DS_MAX; x++)
+			mprintf("sio2bsd_desyncs_total{port=\"%s\",reason=\"%s\"} %lu\n", port, ds_name[x], m->desync[x]);
+	}
+
+	mprintf("# HELP sio2bsd_line_errors_total Bytes received with a framing or parity error, or BREAKs, by port speed.\n");
+	mprintf("# TYPE sio2bsd_line_errors_total counter\n");
+	for (i = 0; i < nports; i++)
+	{
+		if ((m = ports[i].metrics) == NULL)
+			continue;
+		port = ports[i].serial;
+		for (x = 0; x < 256; x++)
+		{
+			if ((x != m->line_idx) && (m->line_ferr[x] == 0) && (m->line_break[x] == 0))
+				continue;
+			mprintf("sio2bsd_line_errors_total{port=\"%s\",hsindex=\"%d\",kind=\"framing\"} %lu\n", \
+				port, (int)x, m->line_ferr[x]);
+			mprintf("sio2bsd_line_errors_total{port=\"%s\",hsindex=\"%d\",kind=\"break\"} %lu\n", \
+				port, (int)x, m->line_break[x]);
+		}
+	}
+
+# ifdef ULTRA
+	mprintf("# HELP sio2bsd_turbo_toggles_total Switches between standard and turbo speed.\n");
+	mprintf("# TYPE sio2bsd_turbo_toggles_total counter\n");
+	for (i = 0; i < nports; i++)
+		if ((m = ports[i].metrics) != NULL)
+			mprintf("sio2bsd_turbo_toggles_total{port=\"%s\"} %lu\n", ports[i].serial, m->turbo_toggles);
+
+	mprintf("# HELP sio2bsd_turbo 1 if the port currently runs at turbo speed.\n");
+	mprintf("# TYPE sio2bsd_turbo gauge\n");
+	for (i = 0; i < nports; i++)
+		if ((m = ports[i].metrics) != NULL)
+			mprintf("sio2bsd_turbo{port=\"%s\"} %d\n", ports[i].serial, m->turbo);
+# endif
+
+	mprintf("# HELP sio2bsd_pclink_open_handles Open PCLink file handles.\n");
+	mprintf("# TYPE sio2bsd_pclink_open_handles gauge\n");
+	for (i = 0; i < nports; i++)
+		if ((m = ports[i].metrics) != NULL)
+			mprintf("sio2bsd_pclink_open_handles{port=\"%s\"} %lu\n", ports[i].serial, m->handles);
+
+	mprintf("# HELP sio2bsd_storage_timeouts_total Storage requests that took longer than the Atari waits.\n");
+	mprintf("# TYPE sio2bsd_storage_timeouts_total counter\n");
+	for (i = 0; i < nports; i++)
+		if ((m = ports[i].metrics) != NULL)
+			mprintf("sio2bsd_storage_timeouts_total{port=\"%s\"} %lu\n", ports[i].serial, m->io_timeouts);
+
+	pthread_mutex_lock(&image_lock);
+	n = image_bytes;
+	c = chunk_count;
+	r = chunk_refs;
+	e = image_evictions;
+	pthread_mutex_unlock(&image_lock);
+	h = __atomic_load_n(&image_hits, __ATOMIC_RELAXED);
+	u = __atomic_load_n(&image_misses, __ATOMIC_RELAXED);
+
+	mprintf("# HELP sio2bsd_image_cache_bytes Image data held in memory, for all ports.\n");
+	mprintf("# TYPE sio2bsd_image_cache_bytes gauge\n");
+	mprintf("sio2bsd_image_cache_bytes %lu\n", n);
+
+	mprintf("# HELP sio2bsd_image_cache_hits_total Image reads served from the copy in memory.\n");
+	mprintf("# TYPE sio2bsd_image_cache_hits_total counter\n");
+	mprintf("sio2bsd_image_cache_hits_total %lu\n", h);
+
+	mprintf("# HELP sio2bsd_image_cache_misses_total Image reads which found no copy in memory.\n");
+	mprintf("# TYPE sio2bsd_image_cache_misses_total counter\n");
+	mprintf("sio2bsd_image_cache_misses_total %lu\n", u);
+
+	mprintf("# HELP sio2bsd_image_cache_evictions_total Image copies dropped to stay within -C.\n");
+	mprintf("# TYPE sio2bsd_image_cache_evictions_total counter\n");
+	mprintf("sio2bsd_image_cache_evictions_total %lu\n", e);
+
+	if (image_dedup)
+	{
+		mprintf("# HELP sio2bsd_image_chunks Distinct chunks in the shared store.\n");
+		mprintf("# TYPE sio2bsd_image_chunks gauge\n");
+		mprintf("sio2bsd_image_chunks %lu\n", c);
+		mprintf("# HELP sio2bsd_image_chunk_refs Chunks of the cached images, shared ones counted each time.\n");
+		mprintf("# TYPE sio2bsd_image_chunk_refs gauge\n");
+		mprintf("sio2bsd_image_chunk_refs %lu\n", r);
+	}
+
+	mprintf("# HELP sio2bsd_command_latency_seconds Time from a command frame to the end of its response.\n");
+	mprintf("# TYPE sio2bsd_command_latency_seconds summary\n");
+	for (i = 0; i < nports; i++)
+	{
+		if ((m = ports[i].metrics) == NULL)
+			continue;
+		port = ports[i].serial;
+
+		n = m->lat_count;
+		if (n > LAT_SAMPLES)
+			n = LAT_SAMPLES;
+		memcpy(lat, m->lat, n * sizeof(float));
+		qsort(lat, n, sizeof(float), lat_cmp);
+
+		for (x = 0; x < sizeof(q) / sizeof(q[0]); x++)
+			mprintf("sio2bsd_command_latency_seconds{port=\"%s\",quantile=\"%g\"} %g\n", \
+				port, q[x], n ? lat[(ulong)(q[x] * (n - 1))] : 0.0);
+		mprintf("sio2bsd_command_latency_seconds_sum{port=\"%s\"} %g\n", port, m->lat_sum);
+		mprintf("sio2bsd_command_latency_seconds_count{port=\"%s\"} %lu\n", port, m->lat_count);
+	}
+}
+
+static void
+metrics_command(int mclass, uchar ccom, uint64_t start)
+{
+	double t = (double)(mono_ns() - start) / 1e9;
+	ushort c;
+
+	metrics->handles = 0;
+	for (c = 0; c < 16; c++)
+		if (iodesc[c].fps.file != NULL)
+			metrics->handles++;
+
+	metrics->cmds[mclass][ccom]++;
+	metrics->lat[metrics->lat_count % LAT_SAMPLES] = (float)t;
+	metrics->lat_sum += t;
+	metrics->lat_count++;
+}
+
+/* The scrapes are served by a thread of their own, so a slow or
+ * stuck client can never hold up the SIO loop. A client which sends
+ * an HTTP request (curl --unix-socket) gets an HTTP answer, one that
+ * sends nothing (socat) gets the bare text.
+ */
+static void *
+metrics_thread(void *arg)
+{
+	int ls = metrics_fd, cs;
+
+	(void)arg;
+
+	for (;;)
+	{
+		char req[1024];
+		struct pollfd pfd;
+		struct timeval tv;
+		long r = 0;
+		size_t off = 0;
+		int http = 0;
+
+		cs = accept(ls, NULL, NULL);
+
+		if (cs < 0)
 		{
-			sio_ack(devno, cunit, 'N');
-			printf("serial communication error, abort\n");
+			if (errno == EINTR)
+				continue;
+			printf("Metrics: accept() failed, %s (%d)\n", strerror(errno), errno);
+			break;
+		}
+
+		tv.tv_sec = 2;
+		tv.tv_usec = 0;
+		(void)setsockopt(cs, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		pfd.fd = cs;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 100) > 0)
+			r = read(cs, req, sizeof(req) - 1);
+
+		if ((r > 4) && (memcmp(req, "GET ", 4) == 0))
+			http = 1;
+
+		mtext.len = 0;
+		metrics_format();
+
+		if (http)
+		{
+			char hdr[256];
+			int hl;
+
+			hl = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n" \
+				"Content-Type: text/plain; version=0.0.4\r\n" \
+				"Content-Length: %lu\r\n\r\n", (ulong)mtext.len);
+			if (write(cs, hdr, hl) != hl)
+				mtext.len = 0;
+		}
+
+		while (off < mtext.len)
+		{
+			r = write(cs, mtext.buf + off, mtext.len - off);
+			if (r <= 0)
+				break;
+			off += r;
+		}
+
+		close(cs);
+	}
+
+	return NULL;
+}
+
+static int
+metrics_open(const char *path)
+{
+	struct sockaddr_un sa;
+	pthread_t tid;
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+	{
+		printf("Metrics: socket path '%s' too long\n", path);
+		return -1;
+	}
+
+	metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (metrics_fd < 0)
+	{
+		printf("Metrics: socket() failed, %s (%d)\n", strerror(errno), errno);
+		return -1;
+	}
+
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+
+	(void)unlink(path);
+
+	if ((bind(metrics_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(metrics_fd, 4) < 0))
+	{
+		printf("Metrics: cannot listen on '%s', %s (%d)\n", path, strerror(errno), errno);
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+
+	strcpy(metrics_path, path);
+	if (pthread_create(&tid, NULL, metrics_thread, NULL))
+	{
+		printf("Metrics: cannot start the server thread\n");
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+
+	(void)pthread_detach(tid);
+
+	printf("Metrics: %s\n", path);
+
+	return 0;
+}
+
+/* ============== Control socket ================= */
+
+/* Drives are mounted, unmounted, swapped and write protected by the
+ * port thread itself, between two commands: the control thread posts the
+ * request to the port and wakes it through a pipe, which is polled along
+ * with the serial port while waiting for the next command frame. One
+ * request per port is in flight at a time.
+ */
+
+# define CTL_WAIT_S	10	/* how long a busy port may keep a client waiting */
+
+/* "D3" or "PCL1" */
+static int
+ctl_unit(const char *s, ushort *devno, ushort *u)
+{
+	char *e;
+	long n;
+
+	if ((strncmp(s, "PCL", 3) == 0) || (strncmp(s, "pcl", 3) == 0))
+	{
+		*devno = 6;
+		s += 3;
+	}
+	else if ((s[0] == 'D') || (s[0] == 'd'))
+	{
+		*devno = 3;
+		s++;
+	}
+	else
+		return -1;
+
+	n = strtol(s, &e, 10);
+
+	if ((e == s) || *e || (n < 1) || (n > 15))
+		return -1;
+
+	*u = n;
+
+	return 0;
+}
+
+static void
+ctl_pcl_close(ushort u)
+{
+	int h;
+
+	for (h = 0; h < 16; h++)
+		if ((iodesc[h].fps.file != NULL) && (iodesc[h].devno == 6) && (iodesc[h].cunit == u))
+			fps_close(h);
+}
+
+static void
+ctl_stats(char *reply, size_t size)
+{
+	size_t n;
+	ushort d;
+	int h, x;
+
+	n = snprintf(reply, size, "port %ld %s %d bits/sec.%s\n", (long)(port_self - ports), port_self->serial, \
+		(int)siospeed[line_ix].baud, line_marks ? "" : ", no line error marking");
+
+	for (d = 1; (d < 16) && (n < size); d++)
+	{
+		if ((device[3][d].fd < 0) && (device[3][d].ram == NULL))
+			continue;
+
+		n += snprintf(reply + n, size - n, "D%d %s %s %lux%d reads %lu writes %lu errors %lu", d, \
+			device[3][d].dirname, device[3][d].wp ? "ro" : device[3][d].ovl ? "overlay" : device[3][d].ram ? "ram" : "rw", \
+			device[3][d].maxsec, device[3][d].bps, \
+			device[3][d].reads, device[3][d].writes, device[3][d].errors);
+		if ((n < size) && device[3][d].ovl)
+		{
+			ovl_gen(device[3][d].ovl);
+			n += snprintf(reply + n, size - n, " changed %lu", device[3][d].ovl->held);
+		}
+		if ((n < size) && device[3][d].ndirty)
+			n += snprintf(reply + n, size - n, " dirty %lu", device[3][d].ndirty);
+		if ((n < size) && device[3][d].shash)
+			n += snprintf(reply + n, size - n, " digest %08x", (unsigned)device[3][d].digest);
+		if (n < size)
+			n += snprintf(reply + n, size - n, "\n");
+	}
+
+	for (d = 1; (d < 16) && (n < size); d++)
+	{
+		if (!device[6][d].on)
+			continue;
+
+		for (h = 0, x = 0; h < 16; h++)
+			if ((iodesc[h].fps.file != NULL) && (iodesc[h].devno == 6) && (iodesc[h].cunit == d))
+				x++;
+
+		n += snprintf(reply + n, size - n, "PCL%d %s handles %d\n", d, device[6][d].dirname, x);
+	}
+}
+
+/* Runs on the port thread */
+static void
+ctl_exec(char *cmd, char *reply, size_t size)
+{
+	char *verb, *unit, *arg, *save = NULL;
+	ushort devno = 0, u = 0, dn2, u2;
+	struct stat sb;
+	DEVICE old;
+	size_t n;
+
+	verb = strtok_r(cmd, " \t", &save);
+	unit = strtok_r(NULL, " \t", &save);
+	arg = strtok_r(NULL, "", &save);
+
+	while (arg && ((*arg == ' ') || (*arg == '\t')))
+		arg++;
+
+	if (verb == NULL)
+	{
+		snprintf(reply, size, "ERR empty request\n");
+		return;
+	}
+
+	if (strcmp(verb, "stats") == 0)
+	{
+		ctl_stats(reply, size - 4);
+		n = strlen(reply);
+		snprintf(reply + n, size - n, "OK\n");
+		return;
+	}
+
+	if ((unit == NULL) || (ctl_unit(unit, &devno, &u) < 0))
+	{
+		snprintf(reply, size, "ERR bad unit, D1-D15 or PCL1-PCL15\n");
+		return;
+	}
+
+	if (strcmp(verb, "mount") == 0)
+	{
+		/* #n is a title of the catalogue */
+		if (arg && (arg[0] == '#') && (devno == 3))
+		{
+			n = strtoul(arg + 1, NULL, 10);
+			if (n < catcnt)
+				arg = catalogue[n].path;
+		}
+
+		if (arg && (devno == 3) && (strncmp(arg, "ram:", 4) == 0))
+		{
+			if (drive_replace(u, arg) < 0)
+			{
+				snprintf(reply, size, "ERR cannot mount '%s'\n", arg);
+				return;
+			}
+		}
+		else if ((arg == NULL) || (*arg == 0) || (stat(arg, &sb) < 0))
+		{
+			snprintf(reply, size, "ERR cannot stat '%s'\n", arg ? arg : "");
+			return;
+		}
+		else if (devno == 6)
+		{
+			if (!S_ISDIR(sb.st_mode))
+			{
+				snprintf(reply, size, "ERR PCLink needs a directory\n");
+				return;
+			}
+			ctl_pcl_close(u);
+			if (pcl_mount(u, arg) < 0)
+			{
+				snprintf(reply, size, "ERR cannot mount '%s'\n", arg);
+				return;
+			}
+			if (pclcnt <= u)
+				pclcnt = u + 1;
+		}
+		else
+		{
+			if (!S_ISREG(sb.st_mode))
+			{
+				snprintf(reply, size, "ERR not an image file\n");
+				return;
+			}
+
+			if (drive_replace(u, arg) < 0)
+			{
+				snprintf(reply, size, "ERR cannot mount '%s'\n", arg);
+				return;
+			}
+		}
+	}
+	else if (strcmp(verb, "unmount") == 0)
+	{
+		if (devno == 6)
+		{
+			ctl_pcl_close(u);
+			device_reset(6, u);
+		}
+		else
+			atr_close(u);
+		printf("%s: unmounted\n", unit);
+	}
+	else if (strcmp(verb, "swap") == 0)
+	{
+		if ((arg == NULL) || (ctl_unit(arg, &dn2, &u2) < 0) || (devno != 3) || (dn2 != 3))
+		{
+			snprintf(reply, size, "ERR swap needs two drives\n");
+			return;
+		}
+		memcpy(&old, &device[3][u], sizeof(DEVICE));
+		memcpy(&device[3][u], &device[3][u2], sizeof(DEVICE));
+		memcpy(&device[3][u2], &old, sizeof(DEVICE));
+		printf("D%d: and D%d: swapped\n", u, u2);
+	}
+	else if (strcmp(verb, "wp") == 0)
+	{
+		if ((devno != 3) || ((device[3][u].fd < 0) && (device[3][u].ram == NULL)))
+		{
+			snprintf(reply, size, "ERR no disk in %s\n", unit);
+			return;
+		}
+		if (arg && (strcmp(arg, "on") == 0))
+			device[3][u].wp = 1;
+		else if (arg && (strcmp(arg, "off") == 0))
+		{
+			if ((fcntl(device[3][u].fd, F_GETFL) & O_ACCMODE) == O_RDONLY)
+			{
+				snprintf(reply, size, "ERR the image file is read-only\n");
+				return;
+			}
+			device[3][u].wp = 0;
+		}
+		else
+		{
+			snprintf(reply, size, "ERR wp on or off\n");
+			return;
+		}
+		setup_status(u);
+		printf("D%d: write protection %s\n", u, arg);
+	}
+	else if (strcmp(verb, "save") == 0)
+	{
+		if ((devno != 3) || (device[3][u].ram == NULL))
+		{
+			snprintf(reply, size, "ERR no RAM disk in %s\n", unit);
+			return;
+		}
+		if ((arg == NULL) && !device[3][u].persist)
+		{
+			snprintf(reply, size, "ERR save needs a file name\n");
+			return;
+		}
+		if (ram_save(&device[3][u], u, arg ? arg : device[3][u].dirname) < 0)
+		{
+			snprintf(reply, size, "ERR cannot write '%s'\n", arg ? arg : device[3][u].dirname);
+			return;
+		}
+	}
+	else if ((strcmp(verb, "delta") == 0) || (strcmp(verb, "merge") == 0))
+	{
+		char name[1024 + 32];
+
+		if ((devno != 3) || ((device[3][u].fd < 0) && (device[3][u].ram == NULL)))
+		{
+			snprintf(reply, size, "ERR no disk in %s\n", unit);
 			return;
 		}
+		if (verb[0] == 'd')
+		{
+			if (arg)
+				snprintf(name, sizeof(name), "%s", arg);
+			else
+				delta_name(u, name, sizeof(name));
+			if (delta_export(u, name) < 0)
+			{
+				snprintf(reply, size, "ERR cannot write '%s'\n", name);
+				return;
+			}
+		}
+		else if (arg == NULL)
+		{
+			snprintf(reply, size, "ERR merge needs a file name\n");
+			return;
+		}
+		else if (delta_merge(u, arg) < 0)
+		{
+			snprintf(reply, size, "ERR cannot merge '%s'\n", arg);
+			return;
+		}
+	}
+	else if (strcmp(verb, "reset") == 0)
+	{
+		if ((devno != 3) || (device[3][u].ovl == NULL))
+		{
+			snprintf(reply, size, "ERR no overlay in %s\n", unit);
+			return;
+		}
+		ovl_reset(device[3][u].ovl);
+		printf("D%d: overlay reset\n", u);
+	}
+	else
+	{
+		snprintf(reply, size, "ERR unknown command '%s'\n", verb);
+		return;
+	}
+
+	snprintf(reply, size, "OK\n");
+}
+
+static void
+ctl_serve(void)
+{
+	PORT *p = port_self;
+	char cmd[CTL_MAX], reply[CTL_MAX], junk[16];
+	ulong seq;
+
+	while (read(p->ctl[0], junk, sizeof(junk)) > 0)
+		;
+
+	pthread_mutex_lock(&p->ctl_lock);
+	seq = p->ctl_seq;
+	memcpy(cmd, p->ctl_cmd, sizeof(cmd));
+	pthread_mutex_unlock(&p->ctl_lock);
+
+	if (p->ctl_done == seq)
+		return;
+
+	ctl_exec(cmd, reply, sizeof(reply));
+
+	pthread_mutex_lock(&p->ctl_lock);
+	memcpy(p->ctl_reply, reply, sizeof(reply));
+	p->ctl_done = seq;
+	pthread_cond_broadcast(&p->ctl_cond);
+	pthread_mutex_unlock(&p->ctl_lock);
+}
+
+/* Serve control requests until the serial port has data, or ms pass */
+static void
+ctl_wait(int ms)
+{
+	struct pollfd pfd[2];
+	int r;
+
+	if (__atomic_load_n(&port_quit, __ATOMIC_ACQUIRE))
+		port_exit();
+
+	delta_check();
+
+	if (port_self == NULL)
+		return;
+
+	pfd[0].fd = serial_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = port_self->ctl[0];
+	pfd[1].events = POLLIN;
+
+	for (;;)
+	{
+		pfd[0].revents = pfd[1].revents = 0;
+
+		r = poll(pfd, 2, ms);
+
+		if ((r < 0) && (errno == EINTR))
+			continue;
+		if (r <= 0)
+			return;
+
+		if (pfd[1].revents & POLLIN)
+		{
+			if (__atomic_load_n(&port_quit, __ATOMIC_ACQUIRE))
+				port_exit();
+			ctl_serve();
+			delta_check();
+		}
+
+		if (pfd[0].revents || (ms == 0))
+			return;
+	}
+}
+
+/* Runs on the control thread: hand cmd to the port and wait for it */
+static void
+ctl_post(PORT *p, const char *cmd, char *reply, size_t size)
+{
+	struct timespec ts;
+	ulong seq;
+
+	pthread_mutex_lock(&p->ctl_lock);
+
+	if (p->gone)
+	{
+		pthread_mutex_unlock(&p->ctl_lock);
+		snprintf(reply, size, "ERR %s has ended\n", p->serial);
+		return;
+	}
 
-		sio_ack(devno, cunit, 'A');	/* ack the command */
+	if (p->ctl_done != p->ctl_seq)
+	{
+		pthread_mutex_unlock(&p->ctl_lock);
+		snprintf(reply, size, "ERR %s is busy\n", p->serial);
+		return;
+	}
 
-		bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+	snprintf(p->ctl_cmd, sizeof(p->ctl_cmd), "%s", cmd);
+	seq = ++p->ctl_seq;
 
-		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
-		{
-			printf("bad handle %d\n", handle);
-			device[devno][cunit].status.err = 134;	/* bad file handle */
-		}
-		else
-		{
-			int eof_flg, match = 0;
+	pthread_mutex_unlock(&p->ctl_lock);
 
-			printf("handle %d\n", handle);
+	/* a full pipe has woken the port already */
+	if ((write(p->ctl[1], "", 1) < 0) && (errno != EAGAIN))
+		printf("Control: write() failed, %s (%d)\n", strerror(errno), errno);
 
-			do
-			{
-				struct stat ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += CTL_WAIT_S;
 
-				bzero(&ts, sizeof(ts));
-				bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
-				iodesc[handle].fppos += dir_read(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf), handle, &eof_flg);
+	pthread_mutex_lock(&p->ctl_lock);
 
-				if (!eof_flg)
-				{
-					/* fake stat to satisfy match_dos_names() */
-					if ((pcl_dbf.dirbuf[0] & 0x01) == 0)
-						ts.st_mode |= S_IWUSR;
-					if (pcl_dbf.dirbuf[0] & 0x20)
-						ts.st_mode |= S_IFDIR;
-					else
-						ts.st_mode |= S_IFREG;
+	while (p->ctl_done != seq)
+		if (pthread_cond_timedwait(&p->ctl_cond, &p->ctl_lock, &ts) == ETIMEDOUT)
+			break;
 
-					match = !match_dos_names((char *)pcl_dbf.dirbuf+6, iodesc[handle].fpname, iodesc[handle].fatr1, &ts);
-				}
+	if (p->ctl_done == seq)
+		snprintf(reply, size, "%s", p->ctl_reply);
+	else
+		snprintf(reply, size, "ERR %s did not answer, the request is still pending\n", p->serial);
 
-			} while (!eof_flg && !match);
+	pthread_mutex_unlock(&p->ctl_lock);
+}
 
-			if (eof_flg)
-			{
-				printf("FNEXT: EOF\n");
-				device[devno][cunit].status.err = 136;
-			}
-			else if (iodesc[handle].fppos == iodesc[handle].fpstat.st_size)
-				device[devno][cunit].status.err = 3;
-		}
+/* "[port:]unit", the port by number or by device, 0 if not given */
+static PORT *
+ctl_port(char **unit)
+{
+	char *c = strrchr(*unit, ':');
+	char *e;
+	long n;
+	int i;
 
-		/* avoid the 4th execution stage */
-		pcl_dbf.handle = device[devno][cunit].status.err;
+	if (c == NULL)
+		return &ports[0];
 
-		printf("FNEXT: status %d, send $%02x $%02x%02x $%02x%02x%02x %c%c%c%c%c%c%c%c%c%c%c %02d-%02d-%02d %02d:%02d:%02d\n", \
-			pcl_dbf.handle,
-			pcl_dbf.dirbuf[0],
-			pcl_dbf.dirbuf[2], pcl_dbf.dirbuf[1],
-			pcl_dbf.dirbuf[5], pcl_dbf.dirbuf[4], pcl_dbf.dirbuf[3],
-			pcl_dbf.dirbuf[6], pcl_dbf.dirbuf[7], pcl_dbf.dirbuf[8], pcl_dbf.dirbuf[9],
-			pcl_dbf.dirbuf[10], pcl_dbf.dirbuf[11], pcl_dbf.dirbuf[12], pcl_dbf.dirbuf[13],
-			pcl_dbf.dirbuf[14], pcl_dbf.dirbuf[15], pcl_dbf.dirbuf[16],
-			pcl_dbf.dirbuf[17], pcl_dbf.dirbuf[18], pcl_dbf.dirbuf[19],
-			pcl_dbf.dirbuf[20], pcl_dbf.dirbuf[21], pcl_dbf.dirbuf[22]);
-		
-		sck = calc_checksum((void *)&pcl_dbf, sizeof(pcl_dbf));
-		sio_ack(devno, cunit, 'C');
-		com_write((uchar *)&pcl_dbf, sizeof(pcl_dbf));
-		com_write(&sck, 1);
-		goto exit;
-	}
+	*c = 0;
+	n = strtol(*unit, &e, 10);
 
-	if (fno == 0x07)	/* FCLOSE */
+	if ((e != *unit) && (*e == 0))
 	{
-		uchar fpmode;
-		time_t mtime;
-		char pathname[1024];
+		*unit = c + 1;
+		return ((n >= 0) && (n < nports)) ? &ports[n] : NULL;
+	}
 
-		if (ccom == 'R')
+	for (i = 0; i < nports; i++)
+	{
+		if (strcmp(ports[i].serial, *unit) == 0)
 		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+			*unit = c + 1;
+			return &ports[i];
 		}
+	}
 
-		if ((handle > 15) || (iodesc[handle].fps.file == NULL))
-		{
-			printf("bad handle %d\n", handle);
-			device[devno][cunit].status.err = 134;	/* bad file handle */
-			goto complete;
-		}
+	return NULL;
+}
 
-		printf("handle %d\n", handle);
+static void
+ctl_request(char *line, char *reply, size_t size)
+{
+	char *verb, *unit, *arg, *e, *save = NULL, cmd[CTL_MAX];
+	size_t n;
+	PORT *p;
+	int i;
 
-		device[devno][cunit].status.err = 1;
+	verb = strtok_r(line, " \t", &save);
+	unit = strtok_r(NULL, " \t", &save);
+	arg = strtok_r(NULL, "", &save);
 
-		fpmode = iodesc[handle].fpmode;
-		mtime = iodesc[handle].fpstat.st_mtime;
-# if 0
-		printf("FCLOSE: mtime $%08x\n", mtime);
-# endif
-		strcpy(pathname, iodesc[handle].pathname);
+	if (verb == NULL)
+	{
+		snprintf(reply, size, "ERR empty request\n");
+		return;
+	}
 
-		fps_close(handle);	/* this clears out iodesc[handle] */
+	if (strcmp(verb, "help") == 0)
+	{
+		snprintf(reply, size, "mount [port:]Dn|PCLn path\nunmount [port:]Dn|PCLn\n" \
+			"swap [port:]Dn Dm\nwp [port:]Dn on|off\nreset [port:]Dn\nstats [port]\nOK\n");
+		return;
+	}
 
-		if (mtime && (fpmode & 0x08))
+	if (strcmp(verb, "stats") == 0)
+	{
+		for (i = 0, n = 0; i < nports; i++)
 		{
-			struct timeval tv[2];
-
-			tv[0].tv_usec = 0;
-			tv[0].tv_sec = mtime;
-			tv[1].tv_usec = 0;
-			tv[1].tv_sec = mtime;
+			if (unit && strcmp(unit, ports[i].serial) && \
+				((strtol(unit, &e, 10) != i) || (e == unit) || *e))
+				continue;
 
-# if 0
-			printf("FCLOSE: setting timestamp in '%s'\n", pathname);
-# endif
+			ctl_post(&ports[i], "stats", reply + n, size - n - 4);
+			n += strlen(reply + n);
 
-			(void)utimes(pathname, (void *)&tv);
+			/* an ERR, or no room left */
+			if ((n < 3) || strcmp(reply + n - 3, "OK\n"))
+				return;
+			n -= 3;
 		}
-		goto complete;
+		snprintf(reply + n, size - n, n ? "OK\n" : "ERR no such port\n");
+		return;
 	}
 
-	if (fno == 0x08)	/* INIT */
+	if ((unit == NULL) || ((p = ctl_port(&unit)) == NULL))
 	{
-		if (ccom == 'R')
-		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
-		}
+		snprintf(reply, size, "ERR no such port\n");
+		return;
+	}
 
-		do_pclink_init(0);
+	snprintf(cmd, sizeof(cmd), "%s %s%s%s", verb, unit, arg ? " " : "", arg ? arg : "");
 
-		device[devno][cunit].parbuf.handle = 0xff;
-		device[devno][cunit].status.none = PCLSIO;
-		device[devno][cunit].status.err = 1;
-		goto complete;
-	}
+	ctl_post(p, cmd, reply, size);
+}
+
+/* Read one line of a request, without the newline */
+static long
+ctl_line(int cs, char *line, size_t size)
+{
+	size_t n = 0;
+	char c;
 
-	if ((fno == 0x09) || (fno == 0x0a))	/* FOPEN/FFIRST */
+	for (;;)
 	{
-		if (ccom == 'P')
-		{
-			printf("mode: $%02x, atr1: $%02x, atr2: $%02x, path: '%s', name: '%s'\n", \
-				device[devno][cunit].parbuf.fmode, device[devno][cunit].parbuf.fatr1, \
-				device[devno][cunit].parbuf.fatr2, device[devno][cunit].parbuf.path, \
-				device[devno][cunit].parbuf.name);
-# if 0
-			printf("date: %02d-%02d-%02d time: %02d:%02d:%02d\n", \
-				device[devno][cunit].parbuf.f1, device[devno][cunit].parbuf.f2, \
-				device[devno][cunit].parbuf.f3, device[devno][cunit].parbuf.f4, \
-				device[devno][cunit].parbuf.f5, device[devno][cunit].parbuf.f6);
-# endif
+		if (read(cs, &c, 1) != 1)
+			return -1;
 
-			device[devno][cunit].status.err = 1;
+		if (c == '\n')
+			break;
 
-			if (fno == 0x0a)
-				device[devno][cunit].parbuf.fmode |= 0x10;
-			goto complete;
-		}
-		else	/* ccom not 'P', execution stage */
-		{
-			DIR *dh;
-			uchar i;
-			long sl;
-			struct stat tempstat;
-			char newpath[1024], raw_name[12];
+		if ((c != '\r') && (n < (size - 1)))
+			line[n++] = c;
+	}
 
-			if ((ccom == 'R') && (old_ccom == 'R'))
-			{
-				sio_ack(devno, cunit, 'N');
-				printf("serial communication error, abort\n");
-				return;
-			}
+	line[n] = 0;
 
-			sio_ack(devno, cunit, 'A');	/* ack the command */
+	return n;
+}
 
-			bzero(raw_name, sizeof(raw_name));
-			memcpy(raw_name, device[devno][cunit].parbuf.name, 8+3);
+static void *
+ctl_thread(void *arg)
+{
+	char line[CTL_MAX], reply[CTL_MAX * 2];
+	struct timeval tv;
+	size_t off, len;
+	long r;
+	int cs;
 
-			if (((device[devno][cunit].parbuf.fmode & 0x0c) == 0) || \
-				((device[devno][cunit].parbuf.fmode & 0x18) == 0x18)) 
-			{
-				printf("unsupported fmode ($%02x)\n", device[devno][cunit].parbuf.fmode);
-				device[devno][cunit].status.err = 146;
-				goto complete_fopen;
-			}
+	(void)arg;
 
-			create_user_path(devno, cunit, newpath);
+	for (;;)
+	{
+		cs = accept(ctl_fd, NULL, NULL);
 
-			if (!validate_user_path(device[devno][cunit].dirname, newpath))
-			{
-				printf("invalid path '%s'\n", newpath);
-				device[devno][cunit].status.err = 150;
-				goto complete_fopen;
-			}
+		if (cs < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			printf("Control: accept() failed, %s (%d)\n", strerror(errno), errno);
+			break;
+		}
 
-			printf("local path '%s'\n", newpath);
+		/* an idle client must not lock the others out for long */
+		tv.tv_sec = 30;
+		tv.tv_usec = 0;
+		(void)setsockopt(cs, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		tv.tv_sec = 2;
+		(void)setsockopt(cs, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-			for (i = 0; i < 16; i++)
-			{
-# if 0
-				printf("FOPEN: find handle: %d is $%08lx\n", i, (ulong)iodesc[i].fps.file);
-# endif
-				if (iodesc[i].fps.file == NULL)
-# if 1
-					break;
-# else
-				{
-					printf("FOPEN: find handle: found %d\n", i);
-					break;
-				}
-# endif
-			}
-			if (i > 15)
-			{
-				printf("FOPEN: too many channels open\n");
-				device[devno][cunit].status.err = 161;
-				goto complete_fopen;
-			}
+		while (ctl_line(cs, line, sizeof(line)) >= 0)
+		{
+			ctl_request(line, reply, sizeof(reply));
 
-			if (stat(newpath, &tempstat) < 0)
+			len = strlen(reply);
+
+			for (off = 0; off < len; off += r)
 			{
-				printf("FOPEN: cannot stat '%s'\n", newpath);
-				device[devno][cunit].status.err = 150;
-				goto complete_fopen;
+				r = write(cs, reply + off, len - off);
+				if (r <= 0)
+					break;
 			}
 
-			dh = opendir(newpath);
+			if (off < len)
+				break;
+		}
 
-			if (device[devno][cunit].parbuf.fmode & 0x10)
-			{
-				iodesc[i].fps.dir = dh;
-				memcpy(&sb, &tempstat, sizeof(sb));
-			}
-			else
-			{
-				while ((dp = readdir(dh)) != NULL)
-				{
-					if (check_dos_name(newpath, dp, &sb))
-						continue;
-		
-					/* convert 8+3 to NNNNNNNNXXX */
-					ugefina(dp->d_name, raw_name);
-
-					/* match */
-					if (match_dos_names(raw_name, \
-						(char *)device[devno][cunit].parbuf.name, \
-							device[devno][cunit].parbuf.fatr1, &sb) == 0)
-						break;
-				}
+		close(cs);
+	}
 
-				sl = strlen(newpath);
-				if (sl && (newpath[sl-1] != '/'))
-					strcat(newpath, "/");
+	return NULL;
+}
 
-				if (dp)
-				{
-					strcat(newpath, dp->d_name);
-					ugefina(dp->d_name, raw_name);
-					if ((device[devno][cunit].parbuf.fmode & 0x0c) == 0x08)
-						sb.st_mtime = timestamp2mtime(&device[devno][cunit].parbuf.f1);
-				}
-				else
-				{
-					if ((device[devno][cunit].parbuf.fmode & 0x0c) == 0x04)
-					{
-						printf("FOPEN: file not found\n");
-						device[devno][cunit].status.err = 170;
-						closedir(dh);
-						dp = NULL;
-						goto complete_fopen;
-					}
-					else
-					{
-						char name83[12];
+static int
+ctl_open(const char *path)
+{
+	struct sockaddr_un sa;
+	pthread_t tid;
 
-						printf("FOPEN: creating file\n");
+	if (strlen(path) >= sizeof(sa.sun_path))
+	{
+		printf("Control: socket path '%s' too long\n", path);
+		return -1;
+	}
 
-						uexpand(device[devno][cunit].parbuf.name, name83);
+	ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-						if (validate_dos_name(name83))
-						{
-							printf("FOPEN: bad filename '%s'\n", name83);
-							device[devno][cunit].status.err = 165; /* bad filename */
-							goto complete_fopen;
-						}
+	if (ctl_fd < 0)
+	{
+		printf("Control: socket() failed, %s (%d)\n", strerror(errno), errno);
+		return -1;
+	}
 
-						strcat(newpath, name83);
-						ugefina(name83, raw_name);
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
 
-						bzero(&sb, sizeof(struct stat));
-						sb.st_mode = S_IFREG|S_IRUSR|S_IWUSR;
+	(void)unlink(path);
 
-						sb.st_mtime = timestamp2mtime(&device[devno][cunit].parbuf.f1);
-					}
-				}
+	if ((bind(ctl_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) || (listen(ctl_fd, 4) < 0))
+	{
+		printf("Control: cannot listen on '%s', %s (%d)\n", path, strerror(errno), errno);
+		close(ctl_fd);
+		ctl_fd = -1;
+		return -1;
+	}
 
-				printf("FOPEN: full local path '%s'\n", newpath);
+	/* mounting is as good as writing to the user's files */
+	(void)chmod(path, S_IRUSR|S_IWUSR);
 
-				if (stat(newpath, &tempstat) < 0)
-				{
-					if ((device[devno][cunit].parbuf.fmode & 0x0c) == 0x04)
-					{
-						printf("FOPEN: cannot stat '%s'\n", newpath);
-						device[devno][cunit].status.err = 170;
-						goto complete_fopen;
-					}
-				}
-				else
-				{
-					if (device[devno][cunit].parbuf.fmode & 0x08)
-					{
-						if ((tempstat.st_mode & S_IWUSR) == 0)
-						{
-							printf("FOPEN: '%s' is read-only\n", newpath);
-							device[devno][cunit].status.err = 151;
-							goto complete_fopen;
-						}
-					}
-# if 0
-					if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x08)
-					{
-						if (!S_ISDIR(tempstat.st_mode))
-						{
-							printf("FOPEN: delete '%s'\n", newpath);
-							if (unlink(newpath))
-							{
-								printf("FOPEN: cannot delete '%s'\n", newpath);
-								device[devno][cunit].status.err = 255;
-							}
-						}
-					}
-# endif
-				}
+	strcpy(ctl_path, path);
+	if (pthread_create(&tid, NULL, ctl_thread, NULL))
+	{
+		printf("Control: cannot start the server thread\n");
+		close(ctl_fd);
+		ctl_fd = -1;
+		return -1;
+	}
 
-				if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x04)
-					iodesc[i].fps.file = fopen(newpath, "r");
-				else if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x08)
-				{
-					iodesc[i].fps.file = fopen(newpath, "w");
-					if (iodesc[i].fps.file)
-						sb.st_size = 0;
-				}
-				else if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x09)
-				{
-					iodesc[i].fps.file = fopen(newpath, "r+");
-					if (iodesc[i].fps.file)
-						fseek(iodesc[i].fps.file, sb.st_size, SEEK_SET);
-				}
-				else if ((device[devno][cunit].parbuf.fmode & 0x0d) == 0x0c)
-					iodesc[i].fps.file = fopen(newpath, "r+");
+	(void)pthread_detach(tid);
 
-				closedir(dh);
-				dp = NULL;
-			}
+	printf("Control: %s\n", path);
 
-			if (iodesc[i].fps.file == NULL)
-			{
-				printf("FOPEN: cannot open '%s', %s (%d)\n", newpath, strerror(errno), errno);
-				if (device[devno][cunit].parbuf.fmode & 0x04)
-					device[devno][cunit].status.err = 170;
-				else
-					device[devno][cunit].status.err = 151;
-				goto complete_fopen;
-			}
+	return 0;
+}
 
-# if 0
-			printf("FOPEN: handle %d is $%08lx\n", i, (ulong)iodesc[i].fps.file);
-# endif
-			handle = device[devno][cunit].parbuf.handle = i;
-
-			iodesc[handle].devno = devno;
-			iodesc[handle].cunit = cunit;
-			iodesc[handle].fpmode = device[devno][cunit].parbuf.fmode;
-			iodesc[handle].fatr1 = device[devno][cunit].parbuf.fatr1;
-			iodesc[handle].fatr2 = device[devno][cunit].parbuf.fatr2;
-			iodesc[handle].t1 = device[devno][cunit].parbuf.f1;
-			iodesc[handle].t2 = device[devno][cunit].parbuf.f2;
-			iodesc[handle].t3 = device[devno][cunit].parbuf.f3;
-			iodesc[handle].d1 = device[devno][cunit].parbuf.f4;
-			iodesc[handle].d2 = device[devno][cunit].parbuf.f5;
-			iodesc[handle].d3 = device[devno][cunit].parbuf.f6;
-			iodesc[handle].fppos = 0L;
-			strcpy(iodesc[handle].pathname, newpath);
-			memcpy((void *)&iodesc[handle].fpstat, (void *)&sb, sizeof(struct stat));
-			if (iodesc[handle].fpmode & 0x10)
-				memcpy(iodesc[handle].fpname, device[devno][cunit].parbuf.name, sizeof(iodesc[i].fpname));
-			else
-				memcpy(iodesc[handle].fpname, raw_name, sizeof(iodesc[handle].fpname));
+/* ============== Real-time mode ================= */
 
-			iodesc[handle].fpstat.st_size = get_file_len(handle);
+# define RT_STACK	(256*1024)	/* stack to fault in before locking */
 
-			if ((iodesc[handle].fpmode & 0x1d) == 0x09)
-				iodesc[handle].fppos = iodesc[handle].fpstat.st_size;
+static void
+rt_prefault(void)
+{
+	volatile uchar stack[RT_STACK];
+	ulong i;
 
-			bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+	for (i = 0; i < sizeof(stack); i += 512)
+		stack[i] = 0;
+}
 
-			if ((handle > 15) || (iodesc[handle].fps.file == NULL))
-			{
-				printf("FOPEN: bad handle %d\n", handle);
-				device[devno][cunit].status.err = 134;	/* bad file handle */
-				pcl_dbf.handle = 134;
-			}
-			else
-			{
-				pcl_dbf.handle = handle;
+/* Called once the images are open and the buffers allocated: from now
+ * on nothing should page in, and the SIO loop should not wait for the
+ * CPU. Whatever can't be applied is reported and skipped.
+ */
+static void
+rt_setup(int prio, int cpu)
+{
+	struct sched_param sp;
+	int r;
 
-				unix_time_2_sdx(&iodesc[handle].fpstat.st_mtime, ob);
+	if (cpu >= 0)
+	{
+# if defined(__linux__)
+		cpu_set_t set;
 
-# if 0
-				printf("FOPEN: time %02d-%02d-%02d %02d:%02d.%02d\n", ob[0], ob[1], ob[2], ob[3], ob[4], ob[5]);
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			printf("RT: cannot pin to CPU %d, %s (%d)\n", cpu, strerror(errno), errno);
+		else
+			printf("RT: pinned to CPU %d\n", cpu);
+# elif !defined(NOT_FBSD)
+		cpuset_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(set), &set) < 0)
+			printf("RT: cannot pin to CPU %d, %s (%d)\n", cpu, strerror(errno), errno);
+		else
+			printf("RT: pinned to CPU %d\n", cpu);
+# else
+		printf("RT: CPU pinning not supported on this system\n");
 # endif
+	}
 
-				printf("FOPEN: %s handle %d\n", (iodesc[handle].fpmode & 0x08) ? "write" : "read", handle);
+	if (prio > 0)
+	{
+		rt_prefault();
 
-				bzero(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf));
+		if (mlockall(MCL_CURRENT|MCL_FUTURE) < 0)
+			printf("RT: cannot lock memory, %s (%d)\n", strerror(errno), errno);
+		else
+			printf("RT: memory locked\n");
 
-				if (iodesc[handle].fpmode & 0x10)
-				{
-					int eof_sig;
+		if (prio < sched_get_priority_min(SCHED_FIFO))
+			prio = sched_get_priority_min(SCHED_FIFO);
+		if (prio > sched_get_priority_max(SCHED_FIFO))
+			prio = sched_get_priority_max(SCHED_FIFO);
 
-					iodesc[handle].dir_cache = cache_dir(handle);
-					iodesc[handle].fppos += dir_read(pcl_dbf.dirbuf, sizeof(pcl_dbf.dirbuf), handle, &eof_sig);
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = prio;
 
-					if (eof_sig)
-					{
-						printf("FOPEN: dir EOF?\n");
-						device[devno][cunit].status.err = 136;
-					}
-					else if (iodesc[handle].fppos == iodesc[handle].fpstat.st_size)
-							device[devno][cunit].status.err = 3;
-				}
-				else
-				{
-					int x;
-					ulong dlen = iodesc[handle].fpstat.st_size;
+		/* it returns the error, errno is left alone */
+		if ((r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)) != 0)
+			printf("RT: cannot set SCHED_FIFO priority %d, %s (%d)\n", prio, strerror(r), r);
+		else
+			printf("RT: SCHED_FIFO priority %d\n", prio);
+	}
+}
 
-					memset(pcl_dbf.dirbuf+6, 0x20, 11);
-					pcl_dbf.dirbuf[3] = (uchar)(dlen & 0x000000ffL);
-					pcl_dbf.dirbuf[4] = (uchar)((dlen & 0x0000ff00L) >> 8);
-					pcl_dbf.dirbuf[5] = (uchar)((dlen & 0x00ff0000L) >> 16);
-					memcpy(pcl_dbf.dirbuf+17, ob, 6);
+/* ============== siotrace ================= */
 
-					pcl_dbf.dirbuf[0] = 0x08;
+static void
+siotrace_usage(void)
+{
+	sio2bsd_itsme();
+	printf("\nsiotrace [-d] trace\n");
+	printf("siotrace -r [opts] trace [-- command ...]\n");
+	printf("\nWhere 'opts' are:\n\n");
 
-					if ((iodesc[handle].fpstat.st_mode & S_IWUSR) == 0)
-						pcl_dbf.dirbuf[0] |= 0x01;	/* protected */
-					if (S_ISDIR(iodesc[handle].fpstat.st_mode))
-						pcl_dbf.dirbuf[0] |= 0x20;	/* directory */
+	printf("-d         - dump the trace as text (default)\n");
+	printf("-r         - replay the Atari side of the trace\n");
+	printf("-t tty     - replay into tty instead of a new pty\n");
+	printf("-x n       - play the Atari side n times faster (1.0)\n");
+	printf("-T ms      - wait for the drive's response at most ms (1000)\n");
+	printf("-S ms      - settle time after starting the command (1000)\n\n");
 
-					x = 0;
-					while (iodesc[handle].fpname[x] && (x < 11))
-					{
-						pcl_dbf.dirbuf[6+x] = iodesc[handle].fpname[x];
-						x++;
-					}
-				}
+	printf("command    - started with '-s pty' inserted after its name,\n");
+	printf("             e.g. siotrace -r foo.trc -- sio2bsd foo.atr\n\n");
+}
 
-				printf("FOPEN: send $%02x $%02x%02x $%02x%02x%02x %c%c%c%c%c%c%c%c%c%c%c %02d-%02d-%02d %02d:%02d:%02d\n", \
-				pcl_dbf.dirbuf[0],
-				pcl_dbf.dirbuf[2], pcl_dbf.dirbuf[1],
-				pcl_dbf.dirbuf[5], pcl_dbf.dirbuf[4], pcl_dbf.dirbuf[3],
-				pcl_dbf.dirbuf[6], pcl_dbf.dirbuf[7], pcl_dbf.dirbuf[8], pcl_dbf.dirbuf[9],
-				pcl_dbf.dirbuf[10], pcl_dbf.dirbuf[11], pcl_dbf.dirbuf[12], pcl_dbf.dirbuf[13],
-				pcl_dbf.dirbuf[14], pcl_dbf.dirbuf[15], pcl_dbf.dirbuf[16],
-				pcl_dbf.dirbuf[17], pcl_dbf.dirbuf[18], pcl_dbf.dirbuf[19],
-				pcl_dbf.dirbuf[20], pcl_dbf.dirbuf[21], pcl_dbf.dirbuf[22]);
-			}
+static TRACEREC *
+trace_load(const char *fname, ulong *nrec, uchar **image)
+{
+	int fd;
+	ulong off, n = 0, max = 0;
+	uint64_t t = 0, v;
+	uchar *buf;
+	TRACEREC *rec = NULL;
+	struct stat sb;
 
-complete_fopen:
-			sck = calc_checksum((void *)&pcl_dbf, sizeof(pcl_dbf));
-			sio_ack(devno, cunit, 'C');
-			com_write((uchar *)&pcl_dbf, sizeof(pcl_dbf));
-			com_write(&sck, 1);
-			goto exit;
-		}
+	fd = open(fname, O_RDONLY);
+
+	if ((fd < 0) || (fstat(fd, &sb) < 0))
+	{
+		printf("Cannot open '%s', %s (%d)\n", fname, strerror(errno), errno);
+		if (fd > -1)
+			close(fd);
+		return NULL;
+	}
+
+	buf = malloc(sb.st_size + 1);
+
+	if ((buf == NULL) || (read(fd, buf, sb.st_size) != sb.st_size))
+	{
+		printf("Cannot read '%s'\n", fname);
+		close(fd);
+		free(buf);
+		return NULL;
 	}
 
-	if (fno == 0x0b)	/* RENAME/RENDIR */
+	close(fd);
+
+	if ((sb.st_size < TRACE_HDRSIZE) || memcmp(buf, TRACE_MAGIC, 8) || (buf[8] != TRACE_VERSION))
 	{
-		char newpath[1024];
-		DIR *renamedir;
-		ulong fcnt = 0;
+		printf("Error: %s is not a valid SIO trace\n", fname);
+		free(buf);
+		return NULL;
+	}
 
-		if (ccom == 'R')
-		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
-		}
+	off = TRACE_HDRSIZE;
 
-		create_user_path(devno, cunit, newpath);
+	while (off < (ulong)sb.st_size)
+	{
+		ulong l, avail;
 
-		if (!validate_user_path(device[devno][cunit].dirname, newpath))
+		if (n == max)
 		{
-			printf("invalid path '%s'\n", newpath);
-			device[devno][cunit].status.err = 150;
-			goto complete;
-		}
+			TRACEREC *nr;
 
-		renamedir = opendir(newpath);
-
-		if (renamedir == NULL)
-		{
-			printf("cannot open dir '%s'\n", newpath);
-			device[devno][cunit].status.err = 255;
-			goto complete;
+			max = max ? max * 2 : 4096;
+			nr = realloc(rec, max * sizeof(TRACEREC));
+			if (nr == NULL)
+				break;
+			rec = nr;
 		}
 
-		printf("local path '%s', fatr1 $%02x\n", newpath, \
-			device[devno][cunit].parbuf.fatr1 | RA_NO_PROTECT);
+		rec[n].type = buf[off++];
 
-		device[devno][cunit].status.err = 1;
+		avail = sb.st_size - off;
+		l = get_varint(buf + off, avail, &v);
+		if (l == 0)
+			break;
+		off += l;
+		t += v;
 
-		while ((dp = readdir(renamedir)) != NULL)
-		{
-			char raw_name[12];
- 
-			if (check_dos_name(newpath, dp, &sb))
-				continue;
+		avail = sb.st_size - off;
+		l = get_varint(buf + off, avail, &v);
+		if ((l == 0) || (v > (avail - l)))
+			break;
+		off += l;
 
-			/* convert 8+3 to NNNNNNNNXXX */
-			ugefina(dp->d_name, raw_name);
+		rec[n].t = t;
+		rec[n].len = (ulong)v;
+		rec[n].data = buf + off;
 
-			/* match */
-			if (match_dos_names(raw_name, (char *)device[devno][cunit].parbuf.name, \
-				device[devno][cunit].parbuf.fatr1 | RA_NO_PROTECT, &sb) == 0)
-			{
-				char xpath[1024], xpath2[1024], newname[16];
-				uchar names[12];
-				struct stat dummy;
-				ushort x;
+		off += rec[n].len;
+		n++;
+	}
 
-				fcnt++;
+	if (off < (ulong)sb.st_size)
+		printf("Warning: %s is truncated after %ld records\n", fname, n);
 
-				strcpy(xpath, newpath);
-				strcat(xpath, "/");
-				strcat(xpath, dp->d_name);
+	*nrec = n;
+	*image = buf;
 
-				memcpy(names, device[devno][cunit].parbuf.names, 12);
+	return rec;
+}
 
-				for (x = 0; x < 12; x++)
-				{
-					if (names[x] == '?')
-						names[x] = raw_name[x];
-				}
+static ulong
+trace_le(const uchar *p, ushort n)
+{
+	ulong v = 0;
 
-				uexpand(names, newname);
+	while (n--)
+		v = (v << 8) | p[n];
+
+	return v;
+}
 
-				strcpy(xpath2, newpath);
-				strcat(xpath2, "/");
-				strcat(xpath2, newname);
+static void
+trace_dump(TRACEREC *rec, ulong nrec)
+{
+	ulong r, i;
 
-				printf("RENAME: renaming '%s' -> '%s'\n", dp->d_name, newname);
+	for (r = 0; r < nrec; r++)
+	{
+		printf("%14.6f ", (double)rec[r].t / 1e9);
 
-				if (stat(xpath2, &dummy) == 0)
-				{
-					printf("RENAME: '%s' already exists\n", xpath2);
-					device[devno][cunit].status.err = 151;
-					break;
-				}
+		switch (rec[r].type)
+		{
+			case TRACE_IN:
+			case TRACE_OUT:
+			{
+				printf("%s", (rec[r].type == TRACE_IN) ? "->" : "<-");
 
-				if (rename(xpath, xpath2))
+				for (i = 0; i < rec[r].len; i++)
 				{
-					printf("RENAME: %s\n", strerror(errno));
-					device[devno][cunit].status.err = 255;
+					if (i && ((i % 16) == 0))
+						printf("\n                 ");
+					printf(" %02x", rec[r].data[i]);
 				}
+				putchar('\n');
+				break;
+			}
+			case TRACE_LINE:
+			{
+				printf("LINE $%08lx\n", trace_le(rec[r].data, 4));
+				break;
+			}
+			case TRACE_SPEED:
+			{
+				printf("SPEED HSINDEX=%ld (%ld bits/sec.)\n", trace_le(rec[r].data + 4, 2), trace_le(rec[r].data, 4));
+				break;
+			}
+			default:
+			{
+				printf("??? type $%02x, %ld bytes\n", rec[r].type, rec[r].len);
+				break;
 			}
 		}
-
-		closedir(renamedir);
-
-		if ((fcnt == 0) && (device[devno][cunit].status.err == 1))
-			device[devno][cunit].status.err = 170;
-		goto complete;
 	}
+}
+
+static struct
+{
+	int fd;
+	TRACEREC *rec;
+	ulong nrec;
+	ulong oi, ooff;		/* next expected byte from the drive */
+	ulong released;		/* bytes the drive should have sent by now */
+	ulong received;
+	ulong mismatch, lost, extra;
+	uint64_t last;		/* time of the last byte sent or received */
+	uint64_t lat_start;
+	int lat_pending;
+	double *lat_orig, *lat_new;
+	ulong nlat;
+} replay;
 
-	if (fno == 0x0c)	/* REMOVE */
+static void
+replay_advance(ulong count)
+{
+	while (count && (replay.oi < replay.nrec))
 	{
-		char newpath[1024];
-		DIR *deldir;
-		ulong delcnt = 0;
+		TRACEREC *r = &replay.rec[replay.oi];
 
-		if (ccom == 'R')
+		if ((r->type != TRACE_OUT) || (replay.ooff >= r->len))
 		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+			replay.oi++;
+			replay.ooff = 0;
+			continue;
 		}
 
-		create_user_path(devno, cunit, newpath);
+		replay.ooff++;
+		count--;
+	}
+}
 
-		if (!validate_user_path(device[devno][cunit].dirname, newpath))
-		{
-			printf("invalid path '%s'\n", newpath);
-			device[devno][cunit].status.err = 150;
-			goto complete;
-		}
+/* Read whatever the drive sends until the deadline, and match it
+ * against the recorded responses. With 'until_done' return as soon
+ * as all the expected bytes are in.
+ */
+static void
+replay_pump(uint64_t deadline, int until_done)
+{
+	uchar b[4096];
+	struct pollfd pfd;
+	uint64_t now;
+	long r, i;
 
-		printf("local path '%s'\n", newpath);
+	pfd.fd = replay.fd;
+	pfd.events = POLLIN;
+
+	for (;;)
+	{
+		int ms = 0;
 
-		deldir = opendir(newpath);
+		if (until_done && (replay.received >= replay.released))
+			return;
 
-		if (deldir == NULL)
-		{
-			printf("cannot open dir '%s'\n", newpath);
-			device[devno][cunit].status.err = 255;
-			goto complete;
-		}
+		now = mono_ns();
 
-		device[devno][cunit].status.err = 1;
+		if ((deadline > now) && ((deadline - now) >= 1000000ULL))
+			ms = (int)((deadline - now) / 1000000ULL);
+
+		pfd.revents = 0;
 
-		while ((dp = readdir(deldir)) != NULL)
+		if (poll(&pfd, 1, ms) > 0)
 		{
-			char raw_name[12];
- 
-			if (check_dos_name(newpath, dp, &sb))
-				continue;
+			r = read(replay.fd, b, sizeof(b));
+			if (r <= 0)
+				return;
 
-			/* convert 8+3 to NNNNNNNNXXX */
-			ugefina(dp->d_name, raw_name);
+			now = mono_ns();
+			replay.last = now;
 
-			/* match */
-			if (match_dos_names(raw_name, (char *)device[devno][cunit].parbuf.name, \
-				RA_NO_PROTECT | RA_NO_SUBDIR | RA_NO_HIDDEN, &sb) == 0)
+			if (replay.lat_pending)
 			{
-				char xpath[1024];
+				replay.lat_new[replay.nlat++] = (double)(now - replay.lat_start) / 1e6;
+				replay.lat_pending = 0;
+			}
 
-				strcpy(xpath, newpath);
-				strcat(xpath, "/");
-				strcat(xpath, dp->d_name);
+			for (i = 0; i < r; i++)
+			{
+				while ((replay.oi < replay.nrec) && \
+					((replay.rec[replay.oi].type != TRACE_OUT) || \
+						(replay.ooff >= replay.rec[replay.oi].len)))
+				{
+					replay.oi++;
+					replay.ooff = 0;
+				}
 
-				if (!S_ISDIR(sb.st_mode))
-				{				
-					printf("REMOVE: delete '%s'\n", xpath);
-					if (unlink(xpath))
-					{
-						printf("REMOVE: cannot delete '%s'\n", xpath);
-						device[devno][cunit].status.err = 255;
-					}
-					delcnt++;
+				if (replay.oi >= replay.nrec)
+				{
+					replay.extra++;
+					continue;
 				}
-			}
-		}
-		closedir(deldir);
-		if (delcnt == 0)
-			device[devno][cunit].status.err = 170;
-		goto complete;
-	}
 
-	if (fno == 0x0d)	/* CHMOD */
-	{
-		char newpath[1024];
-		DIR *chmdir;
-		ulong fcnt = 0;
-		uchar fatr2 = device[devno][cunit].parbuf.fatr2;
+				if (replay.rec[replay.oi].data[replay.ooff] != b[i])
+					replay.mismatch++;
 
-		if (ccom == 'R')
-		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+				replay.ooff++;
+				replay.received++;
+			}
 		}
+		else if (now >= deadline)
+			return;
+	}
+}
 
-		if (fatr2 & (SA_SUBDIR | SA_UNSUBDIR))
-		{
-			printf("illegal fatr2 $%02x\n", fatr2);
-			device[devno][cunit].status.err = 146;
-			goto complete;
-		}
+static int
+replay_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
 
-		create_user_path(devno, cunit, newpath);
+	return (x > y) - (x < y);
+}
 
-		if (!validate_user_path(device[devno][cunit].dirname, newpath))
-		{
-			printf("invalid path '%s'\n", newpath);
-			device[devno][cunit].status.err = 150;
-			goto complete;
-		}
+static void
+replay_stats(const char *what, double *v, ulong n)
+{
+	double sum = 0;
+	ulong i;
 
-		printf("local path '%s', fatr1 $%02x fatr2 $%02x\n", newpath, \
-				device[devno][cunit].parbuf.fatr1, fatr2);
+	if (n == 0)
+		return;
 
-		chmdir = opendir(newpath);
+	qsort(v, n, sizeof(double), replay_cmp);
 
-		if (chmdir == NULL)
-		{
-			printf("CHMOD: cannot open dir '%s'\n", newpath);
-			device[devno][cunit].status.err = 255;
-			goto complete;
-		}
+	for (i = 0; i < n; i++)
+		sum += v[i];
 
+	printf("%-8s %10.3f %10.3f %10.3f %10.3f\n", what, v[n / 2], v[(n * 95) / 100], v[n - 1], sum / n);
+}
 
-		device[devno][cunit].status.err = 1;
+static int
+trace_replay(TRACEREC *rec, ulong nrec, double scale, uint64_t tmot)
+{
+	ulong r, sent = 0;
+	uint64_t orig_last = 0, start;
+	int first = 1;
 
-		while ((dp = readdir(chmdir)) != NULL)
-		{
-			char raw_name[12];
- 
-			if (check_dos_name(newpath, dp, &sb))
-				continue;
+	replay.rec = rec;
+	replay.nrec = nrec;
+	replay.lat_orig = malloc((nrec + 1) * sizeof(double));
+	replay.lat_new = malloc((nrec + 1) * sizeof(double));
 
-			/* convert 8+3 to NNNNNNNNXXX */
-			ugefina(dp->d_name, raw_name);
+	if ((replay.lat_orig == NULL) || (replay.lat_new == NULL))
+		return -1;
 
-			/* match */
-			if (match_dos_names(raw_name, (char *)device[devno][cunit].parbuf.name, \
-				device[devno][cunit].parbuf.fatr1, &sb) == 0)
-			{
-				char xpath[1024];
-				mode_t newmode = sb.st_mode;
-
-				strcpy(xpath, newpath);
-				strcat(xpath, "/");
-				strcat(xpath, dp->d_name);
-				printf("CHMOD: change atrs in '%s'\n", xpath);
-
-				/* On Unix, ignore Hidden and Archive bits */
-				if (fatr2 & SA_UNPROTECT)
-					newmode |= S_IWUSR;
-				if (fatr2 & SA_PROTECT)
-					newmode &= ~S_IWUSR;
-				if (chmod(xpath, newmode))
-				{
-					printf("CHMOD: failed on '%s'\n", xpath);
-					device[devno][cunit].status.err |= 255;
-				}
-				fcnt++;
-			}
-		}
-		closedir(chmdir);
-		if (fcnt == 0)
-			device[devno][cunit].status.err = 170;
-		goto complete;
-	}
+	start = replay.last = mono_ns();
 
-	if (fno == 0x0e)	/* MKDIR - warning, fatr2 is bogus */
+	for (r = 0; r < nrec; r++)
 	{
-		char newpath[1024], fname[12];
-		uchar dt[6];
-		struct stat dummy;
-
-		if (ccom == 'R')
+		if (rec[r].type == TRACE_OUT)
 		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+			replay.released += rec[r].len;
+			orig_last = rec[r].t;
+			continue;
 		}
 
-		create_user_path(devno, cunit, newpath);
+		if (rec[r].type != TRACE_IN)
+			continue;
 
-		if (!validate_user_path(device[devno][cunit].dirname, newpath))
+		/* The Atari waits for the drive, so must we */
+		if (replay.received < replay.released)
+			replay_pump(replay.last + tmot, 1);
+
+		if (replay.received < replay.released)
 		{
-			printf("invalid path '%s'\n", newpath);
-			device[devno][cunit].status.err = 150;
-			goto complete;
+			replay_advance(replay.released - replay.received);
+			replay.lost += replay.released - replay.received;
+			replay.received = replay.released;
+			replay.lat_pending = 0;
 		}
 
-		uexpand(device[devno][cunit].parbuf.name, fname);
+		if (!first)
+			replay_pump(replay.last + (uint64_t)((double)(rec[r].t - orig_last) / scale), 0);
+		first = 0;
 
-		if (validate_dos_name(fname))
+		if (write(replay.fd, rec[r].data, rec[r].len) != (long)rec[r].len)
 		{
-			printf("bad dir name '%s'\n", fname);
-			device[devno][cunit].status.err = 165;
-			goto complete;
+			printf("Replay write failed, %s (%d)\n", strerror(errno), errno);
+			break;
 		}
 
-		strcat(newpath, "/");
-		strcat(newpath, fname);
-
-		memcpy(dt, &device[devno][cunit].parbuf.f1, sizeof(dt));
-
-		printf("making dir '%s', time %2d-%02d-%02d %2d:%02d:%02d\n", newpath, \
-			dt[0], dt[1], dt[2], dt[3], dt[4], dt[5]);
+		sent += rec[r].len;
+		replay.last = mono_ns();
+		orig_last = rec[r].t;
 
-		if (stat(newpath, &dummy) == 0)
-		{
-			printf("MKDIR: '%s' already exists\n", newpath);
-			device[devno][cunit].status.err = 151;
-			goto complete;
-		}
+		/* the end of an Atari frame: time the drive's answer */
+		replay.lat_pending = 0;
 
-		if (mkdir(newpath, S_IRWXU|S_IRWXG|S_IRWXO))
-		{
-			printf("MKDIR: cannot make dir '%s'\n", newpath);
-			device[devno][cunit].status.err = 255;
-		}
-		else
+		if ((r + 1) < nrec)
 		{
-			struct timeval tv[2];
-			time_t mtime = timestamp2mtime(dt);
+			ulong n = r + 1;
 
-			device[devno][cunit].status.err = 1;
+			while ((n < nrec) && (rec[n].type != TRACE_IN) && (rec[n].type != TRACE_OUT))
+				n++;
 
-			if (mtime)
+			if ((n < nrec) && (rec[n].type == TRACE_OUT))
 			{
-				tv[0].tv_usec = 0;
-				tv[0].tv_sec = mtime;
-				tv[1].tv_usec = 0;
-				tv[1].tv_sec = mtime;
-
-# if 0
-				printf("MKDIR: setting timestamp in '%s'\n", newpath);
-# endif
-
-				(void)utimes(newpath, (void *)&tv);
+				replay.lat_orig[replay.nlat] = (double)(rec[n].t - rec[r].t) / 1e6;
+				replay.lat_start = replay.last;
+				replay.lat_pending = 1;
 			}
 		}
-		goto complete;
 	}
 
-	if (fno == 0x0f)	/* RMDIR */
+	if (replay.received < replay.released)
+		replay_pump(replay.last + tmot, 1);
+
+	if (replay.received < replay.released)
+		replay.lost += replay.released - replay.received;
+
+	printf("\nReplayed %ld records: %ld bytes sent, %ld of %ld bytes received\n", \
+		nrec, sent, replay.received, replay.released);
+	printf("Mismatched %ld, lost %ld, unexpected %ld bytes\n", replay.mismatch, replay.lost, replay.extra);
+
+	if (replay.nlat)
 	{
-		char newpath[1024], fname[12];
+		printf("\nResponse latency (ms)  median      95th       max      mean\n");
+		replay_stats("capture", replay.lat_orig, replay.nlat);
+		replay_stats("replay", replay.lat_new, replay.nlat);
+	}
 
-		if (ccom == 'R')
+	for (r = 0; r < nrec; r++)
+	{
+		if ((rec[r].type == TRACE_IN) || (rec[r].type == TRACE_OUT))
 		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+			printf("\nSession: capture %.3f s, replay %.3f s\n", (double)(rec[nrec - 1].t - rec[r].t) / 1e9, \
+				(double)(mono_ns() - start) / 1e9);
+			break;
 		}
+	}
 
-		create_user_path(devno, cunit, newpath);
+	free(replay.lat_orig);
+	free(replay.lat_new);
 
-		if (!validate_user_path(device[devno][cunit].dirname, newpath))
+	return (replay.mismatch || replay.lost || replay.extra) ? 1 : 0;
+}
+
+static int
+siotrace(int argc, char **argv)
+{
+	int ch, r, do_replay = 0, slave = -1;
+	ulong nrec;
+	long settle = 1000, tmot = 1000;
+	double scale = 1.0;
+	char *tty = NULL, pty[128];
+	uchar *image;
+	TRACEREC *rec;
+	pid_t child = -1;
+
+	while ((ch = getopt(argc, argv, "drt:x:T:S:?")) != -1)
+	{
+		switch (ch)
 		{
-			printf("invalid path '%s'\n", newpath);
-			device[devno][cunit].status.err = 150;
-			goto complete;
+			case 'd':
+			{
+				do_replay = 0;
+				break;
+			}
+			case 'r':
+			{
+				do_replay = 1;
+				break;
+			}
+			case 't':
+			{
+				tty = optarg;
+				break;
+			}
+			case 'x':
+			{
+				scale = atof(optarg);
+				break;
+			}
+			case 'T':
+			{
+				tmot = atol(optarg);
+				break;
+			}
+			case 'S':
+			{
+				settle = atol(optarg);
+				break;
+			}
+			case '?':
+			default:
+			{
+				siotrace_usage();
+				return -1;
+			}
 		}
+	}
 
-		uexpand(device[devno][cunit].parbuf.name, fname);
+	if ((optind >= argc) || (scale <= 0))
+	{
+		siotrace_usage();
+		return -1;
+	}
 
-		if (validate_dos_name(fname))
-		{
-			printf("bad dir name '%s'\n", fname);
-			device[devno][cunit].status.err = 165;
-			goto complete;
-		}
+	rec = trace_load(argv[optind], &nrec, &image);
 
-		strcat(newpath, "/");
-		strcat(newpath, fname);
+	if (rec == NULL)
+		return 1;
 
-		if (stat(newpath, &sb) < 0)
-		{
-			printf("cannot stat '%s'\n", newpath);
-			device[devno][cunit].status.err = 170;
-			goto complete;
-		}
+	if (do_replay == 0)
+	{
+		trace_dump(rec, nrec);
+		return 0;
+	}
 
-		if (sb.st_uid != our_uid)
-		{
-			printf("'%s' wrong uid\n", newpath);
-			device[devno][cunit].status.err = 170;
-			goto complete;
-		}
+	if (tty)
+	{
+		replay.fd = open(tty, O_RDWR|O_NOCTTY);
+		strncpy(pty, tty, sizeof(pty) - 1);
+		pty[sizeof(pty) - 1] = 0;
+	}
+	else
+	{
+		replay.fd = posix_openpt(O_RDWR|O_NOCTTY);
 
-		if (!S_ISDIR(sb.st_mode))
+		if ((replay.fd > -1) && ((grantpt(replay.fd) < 0) || (unlockpt(replay.fd) < 0) || (ptsname(replay.fd) == NULL)))
 		{
-			printf("'%s' is not a directory\n", newpath);
-			device[devno][cunit].status.err = 170;
-			goto complete;
+			close(replay.fd);
+			replay.fd = -1;
 		}
 
-		if ((sb.st_mode & S_IWUSR) == 0)
+		if (replay.fd > -1)
 		{
-			printf("dir '%s' is write-protected\n", newpath);
-			device[devno][cunit].status.err = 170;
-			goto complete;
+			strncpy(pty, ptsname(replay.fd), sizeof(pty) - 1);
+			pty[sizeof(pty) - 1] = 0;
+			/* keep the slave open, so the master doesn't see EIO between runs */
+			slave = open(pty, O_RDWR|O_NOCTTY);
 		}
+	}
 
-		printf("delete dir '%s'\n", newpath);
-
-		device[devno][cunit].status.err = 1;
-
-		if (rmdir(newpath))
-		{
-			printf("RMDIR: cannot del '%s', %s (%d)\n", newpath, strerror(errno), errno);
-			if (errno == ENOTEMPTY)
-				device[devno][cunit].status.err = 167;
-			else
-				device[devno][cunit].status.err = 255;
-		}
-		goto complete;
+	if (replay.fd < 0)
+	{
+		printf("Cannot open the replay tty, %s (%d)\n", strerror(errno), errno);
+		return 1;
 	}
 
-	if (fno == 0x10)	/* CHDIR */
 	{
-		ulong i;
-		char newpath[1024], newwd[1024], oldwd[1024];
+		struct termios t;
 
-		if (ccom == 'R')
+		if (tcgetattr(replay.fd, &t) == 0)
 		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+			cfmakeraw(&t);
+			(void)tcsetattr(replay.fd, TCSANOW, &t);
 		}
+	}
 
-//		printf("req. path '%s'\n", device[devno][cunit].parbuf.path);
+	printf("Replaying %s (%ld records) on %s\n", argv[optind], nrec, pty);
 
-		create_user_path(devno, cunit, newpath);
+	if ((optind + 1) < argc)
+	{
+		child = fork();
 
-		if (!validate_user_path(device[devno][cunit].dirname, newpath))
+		if (child == 0)
 		{
-			printf("invalid path '%s'\n", newpath);
-			device[devno][cunit].status.err = 150;
-			goto complete;
+			int n = argc - (optind + 1), x;
+			char **cargv = malloc((n + 3) * sizeof(char *)), sopt[] = "-s";
+
+			cargv[0] = argv[optind + 1];
+			cargv[1] = sopt;
+			cargv[2] = pty;
+			for (x = 1; x < n; x++)
+				cargv[x + 2] = argv[optind + 1 + x];
+			cargv[n + 2] = NULL;
+
+			execvp(cargv[0], cargv);
+			printf("Cannot execute '%s', %s (%d)\n", cargv[0], strerror(errno), errno);
+			_exit(127);
 		}
+	}
 
-		(void)getcwd(oldwd, sizeof(oldwd));
+	if (settle > 0)
+		usleep(settle * 1000);
 
-		if (chdir(newpath))
-		{
-			printf("cannot access '%s', %s\n", newpath, strerror(errno));
-			device[devno][cunit].status.err = 150;
-			goto complete;
-		}
+	r = trace_replay(rec, nrec, scale, (uint64_t)tmot * 1000000ULL);
 
-		(void)getcwd(newwd, sizeof(newwd));
+	if (child > 0)
+	{
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+	}
 
-# if 0
-		printf("newwd %s\n", newwd);
-# endif
-		/* validate_user_path() guarantees that .dirname is part of newwd */
-		i = strlen(device[devno][cunit].dirname);
-		strcpy((char *)device[devno][cunit].cwd, newwd + i);
-		printf("new current dir '%s'\n", (char *)device[devno][cunit].cwd);
+	if (slave > -1)
+		close(slave);
+	close(replay.fd);
 
-		device[devno][cunit].status.err = 1;
+	free(rec);
+	free(image);
 
-		(void)chdir(oldwd);
+	return r;
+}
 
-		goto complete;
-	}
+/* ============== sio2ctl ================= */
 
-	if (fno == 0x11)	/* GETCWD */
-	{
-		int i;
-		uchar tempcwd[65];
+static void
+sio2ctl_usage(void)
+{
+	sio2bsd_itsme();
+	printf("\nsio2ctl -S path command ...\n");
+	printf("\nWhere 'command' is one of:\n\n");
+
+	printf("mount [port:]Dn file    - put a disk into Dn: (n = 1..15)\n");
+	printf("mount [port:]PCLn dir   - mount a directory as PCLn:\n");
+	printf("unmount [port:]Dn|PCLn  - take it out\n");
+	printf("swap [port:]Dn Dm       - exchange the disks in two drives\n");
+	printf("wp [port:]Dn on|off     - write protect the disk, or not\n");
+	printf("reset [port:]Dn         - drop the sectors written to an overlay (-o)\n");
+	printf("save [port:]Dn [file]   - write a RAM disk to its file, or the one given\n");
+	printf("delta [port:]Dn [file]  - write the sectors changed since the last delta\n");
+	printf("merge [port:]Dn file    - write the sectors of a delta to the disk\n");
+	printf("stats [port]            - drives, files and their counters\n\n");
+
+	printf("path       - the socket given to sio2bsd -S\n");
+	printf("port       - the port number (0, 1, ...) or its device, 0 by default\n\n");
+}
 
-		device[devno][cunit].status.err = 1;
+static int
+sio2ctl(int argc, char **argv)
+{
+	struct sockaddr_un sa;
+	char line[CTL_MAX], full[1024], reply[1024], *sock = NULL;
+	size_t n = 0;
+	long r;
+	int ch, i, fd, err = 0;
 
-		if (ccom == 'P')
+	while ((ch = getopt(argc, argv, "S:?")) != -1)
+	{
+		switch (ch)
 		{
-			printf("device $%02x\n", cunit);
-			goto complete;
+			case 'S':
+			{
+				sock = optarg;
+				break;
+			}
+			case '?':
+			default:
+			{
+				sio2ctl_usage();
+				return 1;
+			}
 		}
+	}
 
-		sio_ack(devno, cunit, 'A');	/* ack the command */
+	if ((sock == NULL) || (optind >= argc) || (strlen(sock) >= sizeof(sa.sun_path)))
+	{
+		sio2ctl_usage();
+		return 1;
+	}
 
-		tempcwd[0] = 0;
+	/* the daemon may run elsewhere: pass the file names as absolute */
+	for (i = optind; (i < argc) && (n < sizeof(line)); i++)
+	{
+		const char *a = argv[i];
 
-		for (i = 0; device[devno][cunit].cwd[i] && (i < 64); i++)
-		{
-			uchar a;
+		if ((i == (optind + 2)) && ((strcmp(argv[optind], "mount") == 0) || (strcmp(argv[optind], "save") == 0) || \
+			(strcmp(argv[optind], "delta") == 0) || (strcmp(argv[optind], "merge") == 0)) && realpath(a, full))
+			a = full;
 
-			a = toupper(device[devno][cunit].cwd[i]);
-			if (a == '/')
-				a = '>';
-			tempcwd[i] = a;
-		}
+		n += snprintf(line + n, sizeof(line) - n, "%s%s", (i > optind) ? " " : "", a);
+	}
 
-		tempcwd[i] = 0;
+	if (n >= (sizeof(line) - 1))
+	{
+		printf("sio2ctl: the command is too long\n");
+		return 1;
+	}
 
-		printf("send '%s'\n", tempcwd);
+	line[n++] = '\n';
 
-		sck = calc_checksum(tempcwd, sizeof(tempcwd)-1);
-		sio_ack(devno, cunit, 'C');
-		com_write(tempcwd, sizeof(tempcwd)-1);
-		com_write(&sck, sizeof(sck));
-		goto exit;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, sock);
+
+	if ((fd < 0) || (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0))
+	{
+		printf("sio2ctl: cannot connect to '%s', %s (%d)\n", sock, strerror(errno), errno);
+		return 1;
 	}
 
-	if (fno == 0x13)	/* DFREE */
+	if (write(fd, line, n) != (long)n)
 	{
-		FILE *vf;
-		int x;
-		uchar c = 0, volname[8];
-		char lpath[1024];
-		static uchar dfree[65] =
-		{
-			0x21,		/* data format version */
-			0x00, 0x00,	/* main directory ptr */
-			0xff, 0xff, 	/* total sectors */
-			0xff, 0xff,	/* free sectors */
-			0x00,		/* bitmap length */
-			0x00, 0x00,	/* bitmap begin */
-			0x00, 0x00,	/* filef */
-			0x00, 0x00,	/* dirf */
-			0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,	/* volume name */
-			0x00,		/* number of tracks */
-			0x01,		/* bytes per sector, encoded */
-			0x80,		/* version number */
-			0x00, 0x02,	/* real bps */
-			0x00, 0x00,	/* fmapen */
-			0x01,		/* sectors per cluster */
-			0x00, 0x00,	/* nr seq and rnd */
-			0x00, 0x00,	/* bootp */
-			0x00,		/* lock */
-
-			0,0,0,0,0,0,0,0,
-			0,0,0,0,0,0,0,0,
-			0,0,0,0,0,0,0,0,
-			0,0,0,0,0,
-			0		/* CRC */
-		};
+		printf("sio2ctl: write() failed, %s (%d)\n", strerror(errno), errno);
+		return 1;
+	}
 
-		device[devno][cunit].status.err = 1;
+	(void)shutdown(fd, SHUT_WR);
 
-		if (ccom == 'P')
-		{
-			printf("device $%02x\n", cunit);
-			goto complete;
-		}
+	while ((r = read(fd, reply, sizeof(reply) - 1)) > 0)
+	{
+		reply[r] = 0;
+		fputs(reply, stdout);
+		if (strstr(reply, "ERR "))
+			err = 1;
+	}
 
-		sio_ack(devno, cunit, 'A');	/* ack the command */
+	close(fd);
+
+	return err;
+}
 
-		memset(dfree + 0x0e, 0x020, 8);
+/* ============== Ports ================= */
 
-		strcpy(lpath, (char *)device[devno][cunit].dirname);
-		strcat(lpath, "/");
-		strcat(lpath, DEVICE_LABEL);
+# define PORT_STACK	(4*1024*1024)	/* the TLS of the port comes out of it too */
 
-		printf("reading '%s'\n", lpath);
+/* Split the command line into ports. Every -s after the first one starts
+ * a new port; drives, -p and -w belong to the port they follow, -p and -w
+ * given before the first -s are the defaults for all ports.
+ */
+/* An option which takes no argument */
+static int
+opt_flag(int c)
+{
+	const char *o = strchr(OPTSTR, c);
 
-		vf = fopen(lpath, "r");
+	return (c != 0) && (c != ':') && (o != NULL) && (o[1] != ':');
+}
 
-		if (vf)
-		{
-			int r;
-			uchar a;
+static int
+port_split(int argc, char **argv, PORT *def)
+{
+	PORT *p = &ports[0];
+	int i;
+
+	*p = *def;
+	p->argv = argv + 1;
+	nports = 1;
 
-			r = fread(volname, sizeof (uchar), 8, vf);
+	for (i = 1; i < argc; i++)
+	{
+		char *a = argv[i];
 
-			fclose(vf);
+		if ((a[0] != '-') || (a[1] == 0) || opt_flag(a[1]) || ((i + 1) >= argc))
+			continue;
 
-			for (x = 0; x < r; x++)
+		if ((a[1] == 's') && p->serial[0])
+		{
+			if (nports == MAX_PORTS)
 			{
-				a = volname[x];
-				if (a == 0x9b)
-					break;
-				dfree[14+x] = a;
+				printf("Too many serial ports, %d allowed\n", MAX_PORTS);
+				return -1;
 			}
+			p->argc = i - (p->argv - argv);
+			p = &ports[nports++];
+			*p = *def;
+			p->argv = argv + i;
 		}
 
-		x = 0;
-		while (x < 8)
+		i++;
+
+		if (a[1] == 's')
+			snprintf(p->serial, sizeof(p->serial), "%s", argv[i]);
+		else if (a[1] == 'p')
 		{
-			c |= dfree[14+x];
-			x++;
+			snprintf(p->printer, sizeof(p->printer), "%s", argv[i]);
+			if (p->serial[0] == 0)
+				strcpy(def->printer, p->printer);
 		}
-
-		if (c == 0x20)
+		else if (a[1] == 'w')
 		{
-			memcpy(dfree + 14, "PCLink  ", 8);
-			dfree[21] = cunit + 0x40;
+			snprintf(p->trace, sizeof(p->trace), "%s", argv[i]);
+			if (p->serial[0] == 0)
+				strcpy(def->trace, p->trace);
 		}
+	}
 
-		printf("DFREE: send info (%d bytes)\n", (int)sizeof(dfree)-1);
+	p->argc = argc - (p->argv - argv);
 
-		dfree[64] = calc_checksum(dfree, sizeof(dfree)-1);
-		sio_ack(devno, cunit, 'C');
-		com_write(dfree, sizeof(dfree));
-		goto exit;
-	}
+	if (ports[0].serial[0] == 0)
+		strcpy(ports[0].serial, SERIAL);
 
-	if (fno == 0x14)	/* CHVOL */
+	/* the defaults would make the ports share a file: number them */
+	for (i = 0; (nports > 1) && (i < nports); i++)
 	{
-		FILE *vf;
-		ulong nl;
-		char lpath[1024];
-
-		device[devno][cunit].status.err = 1;
+		size_t l;
 
-		if (ccom == 'R')
+		if (def->printer[0] && (def->printer[0] != '|') && (strcmp(ports[i].printer, def->printer) == 0))
 		{
-			sio_ack(devno, cunit, 'A');	/* ack the command */
-			device[devno][cunit].status.err = 176;
-			printf("bad exec\n");
-			goto complete;
+			l = strlen(ports[i].printer);
+			snprintf(ports[i].printer + l, sizeof(ports[i].printer) - l, ".%d", i);
 		}
+		if (def->trace[0] && (strcmp(ports[i].trace, def->trace) == 0))
+		{
+			l = strlen(ports[i].trace);
+			snprintf(ports[i].trace + l, sizeof(ports[i].trace) - l, ".%d", i);
+		}
+	}
 
-		nl = strlen((char *)device[devno][cunit].parbuf.name);
-
-		if (nl == 0)
+	/* a port waiting for a command is woken through its pipe, by the
+	 * control socket and by SIGUSR2
+	 */
+	for (i = 0; i < nports; i++)
+	{
+		if (pipe(ports[i].ctl) < 0)
 		{
-			printf("invalid name\n");
-			device[devno][cunit].status.err = 156;
-			goto complete;
+			printf("pipe() failed, %s (%d)\n", strerror(errno), errno);
+			return -1;
 		}
+		(void)fcntl(ports[i].ctl[0], F_SETFL, O_NONBLOCK);
+		(void)fcntl(ports[i].ctl[1], F_SETFL, O_NONBLOCK);
+		pthread_mutex_init(&ports[i].ctl_lock, NULL);
+		pthread_cond_init(&ports[i].ctl_cond, NULL);
+	}
 
-		strcpy(lpath, device[devno][cunit].dirname);
-		strcat(lpath, "/");
-		strcat(lpath, DEVICE_LABEL);
+	port_wake = 1;
 
-		printf("writing '%s'\n", lpath);
+	return 0;
+}
 
-		vf = fopen(lpath, "w");
+/* The port is done with: its line or its files failed, or the program
+ * ends. Its drives and files are closed and its line is set back and let
+ * go; the other ports go on. The thread then only sleeps, so that its
+ * counters stay for the metrics. The last port to end ends the program.
+ */
+static void
+port_exit(void)
+{
+	PORT *p = port_self;
+	ushort d;
+	int left, quit;
+
+	for (d = 0; device && (d < 16); d++)
+		atr_close(d);
+	for (d = 0; device && (d < 16); d++)
+		if (iodesc[d].fps.file != NULL)
+			fps_close(d);
+
+	trace_flush();
+	if (trace_fd > -1)
+	{
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	free(trace_buf);
+	trace_buf = NULL;
 
-		if (vf)
-		{
-			int x;
-			uchar a;
+	if (serial_fd > -1)
+	{
+		(void)tcsetattr(serial_fd, TCSANOW, &dflt);
+		close(serial_fd);
+		serial_fd = -1;
+	}
 
-			for (x = 0; x < 8; x++)
-			{
-				a = device[devno][cunit].parbuf.name[x];
-				if (!a || (a == 0x9b))
-					a = 0x20;
-				(void)fwrite(&a, sizeof(uchar), 1, vf);
-			}
-			fclose(vf);
-		}
-		else
-		{
-			printf("CHVOL: %s\n", strerror(errno));
-			device[devno][cunit].status.err = 255;
-		}
-		goto complete;
+	if (p == NULL)
+		sig(0);
+
+	if (p->lock[0])
+	{
+		(void)unlink(p->lock);
+		p->lock[0] = 0;
 	}
 
-	printf("fno $%02x: not implemented\n", fno);
-	device[devno][cunit].status.err = 146;
+	pthread_mutex_lock(&p->ctl_lock);
+	p->gone = 1;
+	pthread_mutex_unlock(&p->ctl_lock);
 
-complete:
-	sio_ack(devno, cunit, 'C');
+	pthread_mutex_lock(&quit_lock);
+	left = --ports_live;
+	quit = port_quit;
+	pthread_cond_broadcast(&quit_cond);
+	pthread_mutex_unlock(&quit_lock);
 
-exit:
-	old_ccom = ccom;
+	if (left <= 0)
+		sig(0);
 
-	return;
+	if (!quit)
+		printf("Port %s: ended, %d left\n", p->serial, left);
+
+	for (;;)
+		pause();
 }
 
-static ushort
-check_desync(uchar *cmd, uchar cksum, uchar cka)
+static void *
+port_thread(void *arg)
 {
-	uchar ccom, cid, cdev;
-
-	/* According to the Atari docs, the drive should discard the command
-	 * if there's CRC error in it, and take no action.
-	 */
-	if (cksum != cka)
-	{
-		if (log_flag)
-			printf("Bad CRC in cmd: Atari = $%02x, PC = $%02x\n", cka, (uchar)cksum);
-		return 1;
-	}
-
-	ccom = cmd[1];
+	port_main(arg);
 
-	if (ccom < 0x21)
-		return 1;
+	return NULL;
+}
 
-	cdev = cmd[0];
+static int
+port_start(void)
+{
+	pthread_attr_t attr;
+	int x;
 
-//	if ((ccom > 0x80) && ((cdev != 0x45) && (ccom != 0x93)))
-//		return 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PORT_STACK);
 
-	cid = cmd[0] & 0xf0;
+	for (x = 0; x < nports; x++)
+	{
+		pthread_mutex_lock(&quit_lock);
+		if (pthread_create(&ports[x].tid, &attr, port_thread, &ports[x]))
+		{
+			pthread_mutex_unlock(&quit_lock);
+			printf("Cannot start the thread for %s\n", ports[x].serial);
+			return -1;
+		}
+		ports_live++;
+		pthread_mutex_unlock(&quit_lock);
+	}
 
-	if ((cid != 0x20) && (cid != 0x30) && (cid != 0x40) && (cid != 0x50) && (cdev != PCLSIO) && (cdev != 0x6f))
-		return 1;
+	pthread_attr_destroy(&attr);
 
 	return 0;
 }
@@ -3918,29 +11927,25 @@ check_desync(uchar *cmd, uchar cksum, uchar cka)
 int
 main(int argc, char **argv)
 {
-	struct termios com;
-	struct pollfd instat, *insp = &instat;
-	int d, ch, a, toff = 0, ascii_translation = 0;
-	ulong i, counter = 0;
-	char *pth, printer[1024], serial[128];	/* 128 bytes ought to be enough for everyone */
-
-	for (d = 0; d < 8; d++)
-		for (i = 0; i < 16; i++)
-			device_reset(d, i);
-
-	do_pclink_init(1);
+	int ch;
+	ulong i;
+	char *pth, msock[1024], csock[1024], **oargv;
+	uchar sc;
+	PORT def;
 
 	our_uid = getuid();
 
+	atascii_init();
+
 	pth = strstr(argv[0], "mkatr");
 
 	if (pth && (pth[5] == 0))
 	{
-		int r = 0, full13force = 0;
+		int r = 0, full13force = 0, compact = 0;
 		char newname[1024];
 		int c, s, t, h, b;
 		c = 9, s = 18, t = 40, h = 1, b = 128;
-		while ((ch = getopt(argc, argv, "d:t:s:h:b:f?")) != -1)
+		while ((ch = getopt(argc, argv, "d:t:s:h:b:fz?")) != -1)
 		{
 			switch (ch)
 			{
@@ -3949,6 +11954,11 @@ main(int argc, char **argv)
 					full13force = 1;
 					break;
 				}
+				case 'z':
+				{
+					compact = 1;
+					break;
+				}
 				case 'd':
 				{
 					if (strcmp(optarg, "90k")==0 || strcmp(optarg, "ss/sd")==0)
@@ -4020,7 +12030,7 @@ main(int argc, char **argv)
 			{
 				if (strlen(argv[i]) > 1)
 				{
-					if (strchr("f", argv[i][1]) != NULL)
+					if (strchr("fz", argv[i][1]) != NULL)
 						continue;
 					else
 						i++;
@@ -4039,6 +12049,16 @@ main(int argc, char **argv)
 			return -1;
 		}
 
+		if (compact)
+		{
+			r = compact_atr(newname);
+
+			if (r)
+				printf("Error %d compacting %s\n", r, newname);
+
+			return r;
+		}
+
 		r = make_atr(newname, c, t, s, h, b, full13force);
 
 		if (r)
@@ -4047,41 +12067,65 @@ main(int argc, char **argv)
 		return r;
 	}
 
+	pth = strstr(argv[0], "siotrace");
+
+	if (pth && (pth[8] == 0))
+		return siotrace(argc, argv);
+
+	pth = strstr(argv[0], "sio2ctl");
+
+	if (pth && (pth[7] == 0))
+		return sio2ctl(argc, argv);
+
 	if (argc < 2)
 	{
 		sio2bsd_usage();
 		return 0;
 	}
 
-	serial[0] = printer[0] = 0;
+	msock[0] = 0;
+	csock[0] = 0;
 
-	if (serlock() < 0)
+	bzero(&def, sizeof(def));
+	def.rt_cpu = -1;
+# ifdef ULTRA
+	def.turbo_ix = ULTRA;
+	def.hs_ix = HSIDX;
+# endif
+
+	/* getopt() may reorder argv, the ports are told apart by the order */
+	oargv = malloc((argc + 1) * sizeof(char *));
+	if (oargv == NULL)
+		return 1;
+	memcpy(oargv, argv, (argc + 1) * sizeof(char *));
+
+	if (pipe(sig_pipe) < 0)
 	{
-		printf("Another SIO2BSD instance is already running.\n");
+		printf("pipe() failed, %s (%d)\n", strerror(errno), errno);
 		return 1;
 	}
 
-	signal(SIGHUP, sig);	/* sigaction looks better :] */
-	signal(SIGINT, sig);
-	signal(SIGQUIT, sig);
-	signal(SIGILL, sig);
-	signal(SIGTRAP, sig);
-	signal(SIGABRT, sig);
+	signal(SIGHUP, sig_post);	/* sigaction looks better :] */
+	signal(SIGINT, sig_post);
+	signal(SIGQUIT, sig_post);
+	signal(SIGILL, sig_fault);
+	signal(SIGTRAP, sig_fault);
+	signal(SIGABRT, sig_fault);
 # ifndef NOT_FBSD
-	signal(SIGEMT, sig);
+	signal(SIGEMT, sig_fault);
 # endif
-	signal(SIGFPE, sig);
+	signal(SIGFPE, sig_fault);
 # if 0
 	signal(SIGKILL, sig);
 # endif
-	signal(SIGBUS, sig);
-	signal(SIGSEGV, sig);
-	signal(SIGSYS, sig);
-	signal(SIGPIPE, sig);
+	signal(SIGBUS, sig_fault);
+	signal(SIGSEGV, sig_fault);
+	signal(SIGSYS, sig_fault);
+	signal(SIGPIPE, SIG_IGN);	/* a client gone: write() fails, that's all */
 # if 0
 	signal(SIGALRM, sig);
 # endif
-	signal(SIGTERM, sig);
+	signal(SIGTERM, sig_post);
 # if 0
 	signal(SIGURG, sig);
 	signal(SIGSTOP, sig);
@@ -4092,25 +12136,16 @@ main(int argc, char **argv)
 	signal(SIGTTOU, sig);
 	signal(SIGIO, sig);
 # endif
-	signal(SIGXCPU, sig);
-	signal(SIGXFSZ, sig);
+	signal(SIGXCPU, sig_post);
+	signal(SIGXFSZ, sig_post);
 # if 0
 	signal(SIGVTALRM, sig);
 	signal(SIGPROF, sig);
 	signal(SIGWINCH, sig);
 	signal(SIGINFO, sig);
 # endif
-	signal(SIGUSR1, sig);
-	signal(SIGUSR2, sig);
-# ifndef NOT_FBSD
-	signal(SIGTHR, sig);
-# endif
-
-# ifdef ULTRA
-#   define OPTSTR "b:i:q:c:d:p:s:f:tmlu?8"
-# else
-#  define OPTSTR "d:p:s:f:tmlu?8"
-# endif
+	signal(SIGUSR1, ovl_signal);
+	signal(SIGUSR2, delta_signal);
 
 	while ((ch = getopt(argc, argv, OPTSTR)) != -1)
 	{
@@ -4118,43 +12153,132 @@ main(int argc, char **argv)
 		{
 			case '8':
 			{
-				block_percom = 1;
-
+				block_percom = 1;
+
+				break;
+			}
+			case 'm':
+			{
+				use_command = 1;
+
+				break;
+			}
+			case 'x':
+			{
+				burst_read = 1;
+
+				break;
+			}
+			case 'o':
+			{
+				overlay_mode = 1;
+
+				break;
+			}
+			case 'l':
+			{
+# ifdef SIOTRACE			
+				log_flag = 1;
+# else
+				printf("warning: -l option ignored\n"); 
+# endif
+				break;
+			}
+			case 'd':
+			{
+				bt_delay = atoi(optarg);
+				break;
+			}
+			case 'p':	/* see port_split() */
+			case 's':
+			case 'w':
+			{
+				break;
+			}
+			case 'M':
+			{
+				strcpy(msock, optarg);
+				break;
+			}
+			case 'S':
+			{
+				strcpy(csock, optarg);
+				break;
+			}
+			case 'r':
+			{
+				def.rt_prio = atoi(optarg);
+				break;
+			}
+			case 'a':
+			{
+				def.rt_cpu = atoi(optarg);
+				break;
+			}
+			case 'j':
+			{
+				spool_idle = atol(optarg);
+				break;
+			}
+			case 'C':
+			{
+				image_budget = strtoul(optarg, NULL, 0) * 1024UL;
+				break;
+			}
+			case 'D':
+			{
+				image_dedup = 1;
 				break;
 			}
-			case 'm':
+			case 'H':
 			{
-				use_command = 1;
-
+				image_digest = 1;
 				break;
 			}
-			case 'l':
+			case 'J':
 			{
-# ifdef SIOTRACE			
-				log_flag = 1;
-# else
-				printf("warning: -l option ignored\n"); 
-# endif
+				journal_ms = atol(optarg);
+				if (journal_ms < 1)
+					journal_ms = 1;
 				break;
 			}
-			case 'd':
+			case 'g':
 			{
-				bt_delay = atoi(optarg);
+				journal_group = strtoul(optarg, NULL, 0);
+				if ((journal_group < 1) || (journal_group > JNL_GROUP_MAX))
+				{
+					printf("The journal group is 1 to %d sectors\n", JNL_GROUP_MAX);
+					goto go_exit;
+				}
 				break;
 			}
-			case 'p':
+			case 'L':
 			{
-				strcpy(printer, optarg);
+				if (cat_open(optarg) < 0)
+					goto go_exit;
 				break;
 			}
-			case 's':
+			case 'F':
+			{
+				if (format_profile_set(optarg) < 0)
+				{
+					printf("Unknown format timing '%s'\n", optarg);
+					goto go_exit;
+				}
+				break;
+			}
+			case 'e':
 			{
-				strcpy(serial, optarg);
+				if (profile_find(optarg) < 0)
+				{
+					printf("Unknown drive profile '%s'\n", optarg);
+					goto go_exit;
+				}
 				break;
 			}
 			case 't':
 			{
-				ascii_translation = 1;
+				def.ascii_translation = 1;
 				break;
 			}
 			case 'u':
@@ -4165,12 +12289,24 @@ main(int argc, char **argv)
 # ifdef ULTRA
 			case 'b':
 			{
-				turbo_ix = atoi(optarg);
+				def.turbo_ix = atoi(optarg);
+				def.speed_given = 1;
 				break;
 			}
 			case 'i':
 			{
-				hs_ix = atoi(optarg);
+				def.hs_ix = atoi(optarg);
+				def.speed_given = 1;
+				break;
+			}
+			case 'k':
+			{
+				def.calibrate = 1;
+				break;
+			}
+			case 'K':
+			{
+				snprintf(profile_path, sizeof(profile_path), "%s", optarg);
 				break;
 			}
 			
@@ -4215,20 +12351,116 @@ main(int argc, char **argv)
 		}
 	}
 
-	for (i = 1; i < (ulong)argc; i++)
+# ifdef ULTRA
+	if ((profile_path[0] == 0) && getenv("HOME"))
+		snprintf(profile_path, sizeof(profile_path), "%s/.sio2bsd.profile", getenv("HOME"));
+# endif
+
+	if (port_split(argc, oargv, &def) < 0)
+		goto go_exit;
+
+	if (msock[0] && (metrics_open(msock) < 0))
+		goto go_exit;
+
+	if (csock[0] && (ctl_open(csock) < 0))
+		goto go_exit;
+
+	/* even a single port gets a thread: the main one takes the signals */
+	if (port_start() < 0)
+		goto go_exit;
+
+	for (;;)
+		if (read(sig_pipe[0], &sc, 1) == 1)
+			sig(sc);
+
+go_exit:
+
+	sig(0);		/* never returns */
+
+# ifndef __GNUC__
+	return 0;
+# endif
+}
+
+/* The drive table and the counters are too big for the TLS of every
+ * thread (it comes out of each stack, and -R locks it all), so only the
+ * thread which serves a port, or mkatr, gets them, from the heap. They
+ * stay until the program ends, for the metrics thread.
+ */
+static int
+port_mem(PORT *p)
+{
+	PORTMEM *m;
+	ushort d, i;
+
+	if ((m = calloc(1, sizeof(PORTMEM))) == NULL)
+	{
+		printf("Cannot allocate the port state\n");
+		return -1;
+	}
+
+	device = m->device;
+	metrics = &m->metrics;
+
+	for (d = 0; d < 8; d++)
+		for (i = 0; i < 16; i++)
+			device_reset(d, i);
+
+	do_pclink_init(1);
+
+	if (p != NULL)
+	{
+		p->mem = m;
+		p->metrics = metrics;
+	}
+
+	return 0;
+}
+
+/* Serve one serial port: its drives, printer, trace and the SIO loop */
+static void
+port_main(PORT *p)
+{
+	struct termios com;
+	struct pollfd instat, *insp = &instat;
+	int d, a, prof = DP_USD;
+	ulong i, counter = 0;
+
+	p->serial_fd = &serial_fd;
+	p->dflt = &dflt;
+	port_self = p;
+
+	if (port_mem(p) < 0)
+		goto go_exit;
+
+# ifdef ULTRA
+	turbo_ix = p->turbo_ix;
+	hs_ix = p->hs_ix;
+# endif
+
+	if (nports > 1)
+		printf("Port %ld: %s\n", (long)(p - ports), p->serial);
+
+	for (i = 0; i < (ulong)p->argc; i++)
 	{
+		char **argv = p->argv;
+
 		if (argv[i][0] == '-')
 		{
 			if (strlen(argv[i]) > 1)
 			{
-				if (strchr("tmlu8", argv[i][1]) != NULL)
+				if (opt_flag(argv[i][1]))
 					continue;
 				else
 				{
+					if (argv[i][1] == 'e')
+						prof = profile_find(argv[i+1]);
 					if (argv[i++][1] == 'f')
 					{
 						if ((drvcnt < 16) || (pclcnt < 16))
 						{
+							drive_prof[drvcnt & 0x0f] = prof;
+							prof = DP_USD;
 							a = atr_open(argv[i], 1);
 							if (a < 0)
 								printf("Error %d opening %s\n", a, argv[i]);
@@ -4237,40 +12469,46 @@ main(int argc, char **argv)
 				}
 			}
 			else
+			{
+				drive_prof[drvcnt & 0x0f] = prof;
+				prof = DP_USD;
 				drvcnt++;
+			}
 		}
 		else if ((drvcnt < 16) || (pclcnt < 16))
 		{
+			drive_prof[drvcnt & 0x0f] = prof;
+			prof = DP_USD;
 			a = atr_open(argv[i], 0);
 			if (a < 0)
 				printf("Error %d opening %s\n", a, argv[i]);
 		}
 	}
 
+	dev_setup();
+
 	printf("PCLink directory filter allows %s case names\n", upper_dir ? "UPPER" : "lower");
 
-	if (printer[0])
+	if (p->printer[0])
 	{
-		printer_fd = open(printer, O_WRONLY);
-		if (printer_fd < 0)
-		{
-			printer_fd = creat(printer, S_IWUSR|S_IRUSR);
-			if (printer_fd > -1)
-				close(printer_fd);
-			printer_fd = open(printer, O_WRONLY);
-		}
-		if (printer_fd > -1)
+		if (spool_open(p) == 0)
 		{
-			printf("Printer P1: %s\n", printer);
-			if (ascii_translation)
+			printf("Printer P1: %s\n", p->printer);
+			if (p->ascii_translation)
 				printf("ATASCII->ASCII translation enabled\n");
 		}
 	}
 
-	if (serial[0] == 0)
-		strcpy(serial, SERIAL);
+	if (p->trace[0] && (trace_open(p->trace) < 0))
+		goto go_exit;
+
+	printf("Serial port: %s\n", p->serial);
 
-	printf("Serial port: %s\n", serial);
+	if (serlock(p) < 0)
+	{
+		printf("Another SIO2BSD instance is already serving %s.\n", p->serial);
+		goto go_exit;
+	}
 
 # ifdef __linux__
 # define SERFLAGS O_RDWR|O_NOCTTY
@@ -4278,11 +12516,11 @@ main(int argc, char **argv)
 # define SERFLAGS O_RDWR|O_NOCTTY|O_DIRECT
 # endif
 
-	serial_fd = open(serial, SERFLAGS);
+	serial_fd = open(p->serial, SERFLAGS);
 
 	if (serial_fd < 0)
 	{
-		printf("%s (%d) opening %s\n", strerror(errno), errno, serial);
+		printf("%s (%d) opening %s\n", strerror(errno), errno, p->serial);
 		goto go_exit;
 	}
 
@@ -4350,6 +12588,29 @@ main(int argc, char **argv)
 	siospeed[0].idx = hs_ix;
 	siospeed[0].speed = siospeed[0].baud = make_baudrate(hs_ix);
 
+	strcpy(cal.serial, p->serial);
+
+	if (p->calibrate)
+	{
+		cal.on = 1;
+		cal.best = -1;
+		cal_set(&com, 0);
+	}
+	else if ((p->speed_given == 0) && profile_path[0])
+	{
+		a = profile_load(profile_path, p->serial);
+
+		if (a == siospeed[1].idx)
+			turbo_ix = 1;
+		else if ((a >= 0) && (a < siospeed[1].idx))
+		{
+			set_custom_speed(a);
+			turbo_ix = 0;
+		}
+		if (a >= 0)
+			printf("Profile: HSINDEX=%d for %s from %s\n", a, p->serial, profile_path);
+	}
+
 	while ((turbo_ix > 8) || (siospeed[turbo_ix].baud == 0))
 	{
 		printf("Invalid turbo baudrate selected, resetting to defaults.\n");
@@ -4376,7 +12637,8 @@ main(int argc, char **argv)
 	com.c_cflag &= ~CSIZE;
 	com.c_cflag |= (CREAD|CLOCAL|CS8);		/* enable receiver, ignore modem status lines, 8 bits */
 	com.c_cflag &= ~(CRTSCTS|PARENB|CSTOPB);	/* disable hw flow control, disable parity, use 1 stop bit */ 
-	com.c_iflag |= (IGNBRK|IGNPAR);			/* enable ignore break condition and parity errors */
+	com.c_iflag &= ~(IGNBRK|BRKINT|IGNPAR|ISTRIP);
+	com.c_iflag |= (INPCK|PARMRK);			/* mark framing/parity errors and BREAKs in the input */
 	com.c_iflag &= ~(IXON|IXOFF|IXANY);		/* disable I/O flow control */
 
 # ifndef NOT_FBSD
@@ -4388,8 +12650,17 @@ main(int argc, char **argv)
 		printf("warning: ioctl(TIOCMGET): %s\n", strerror(errno));
 # endif
 
+	/* Started before rt_setup(), so that the worker stays an ordinary
+	 * thread off the pinned CPU; without it the I/O is done inline.
+	 */
+	if (io_start() < 0)
+		printf("Storage: doing the file I/O in the SIO thread\n");
+
 	setpriority(PRIO_PROCESS, 0, -20);
 
+	if ((p->rt_prio > 0) || (p->rt_cpu >= 0))
+		rt_setup(p->rt_prio, p->rt_cpu);
+
 	if (tcsetattr(serial_fd, TCSAFLUSH, &com) == 0)
 	{
 # if 0
@@ -4397,15 +12668,27 @@ main(int argc, char **argv)
 		struct termios rcom;
 # endif
 # endif
-		uchar cksum, cmd[5], cka, cdev, cunit, cid, ccom, devno;
-		uchar sdxtime[8];		/* $ff + 6 bytes time + checksum */
+		uchar cksum, cmd[5], cka, cdev, cunit, cid, ccom;
 		int caux1, caux2, sync_attempts;
 		long sec;
+		uint64_t cmd_start;
+		struct termios chk;
+		SIOCMD sc;
+
+		/* Without PARMRK a $FF is not escaped, so read the bytes as they are */
+		if ((tcgetattr(serial_fd, &chk) == 0) && (chk.c_iflag & PARMRK))
+			line_marks = 1;
+		else
+			printf("warning: no framing error marking on %s\n", p->serial);
 
 		for (;;)
 		{
 			/* Read the command frame (4 bytes + CRC) */
-			com_read(cmd, sizeof(cmd), COM_COMD);
+			if (com_read(cmd, sizeof(cmd), COM_COMD) < 0)
+			{
+				speed_mismatch(&com);
+				continue;
+			}
 
 			sync_attempts = 0;
 retry:
@@ -4418,6 +12701,13 @@ retry:
 				if (log_flag)
 					printf("Desync: $%02x, $%02x, $%02x, $%02x Attempt: %d\n", cmd[0], cmd[1], cmd[2], cmd[3], sync_attempts);
 
+				/* Bytes lost to line errors: wrong speed, not a lost byte */
+				if (line_errors)
+				{
+					speed_mismatch(&com);
+					continue;
+				}
+
 				/* Apparent desynch */
 				if (sync_attempts < 4)
 				{
@@ -4431,11 +12721,14 @@ retry:
 					}
 				}
 # ifdef ULTRA
+				cal_desync();
 				turbo(&com, turbo_on ? 0 : 1);
 # endif
 				continue;
 			}
 
+			line_errors = 0;
+
 			/* Protocol scheme (according to JZ):
 			 *
 			 * Read data (the computer reads):
@@ -4459,6 +12752,11 @@ retry:
 			 *
 			 */
 
+			cmd_start = mono_ns();
+# ifdef ULTRA
+			cal_frame(cmd);
+# endif
+
 			cdev = cmd[0];
 			ccom = cmd[1];
 			caux1 = cmd[2];
@@ -4484,355 +12782,19 @@ retry:
 			counter++;
 # endif
 
-			devno = cid >> 4;
-
-			/* PCLink has a priority over all other devices */
-			if ((pclcnt > 1) && ((cdev == PCLSIO) || (cdev == 0x6f)))
-			{
-				cunit = caux2 & 0x0f;	/* PCLink ignores DUNIT */
-				cdev = 0x6f;
-				devno = cdev >> 4;
-
-				/* cunit == 0 is init during warm reset */
-				if ((cunit == 0) || device[devno][cunit].on)
-				{
-					switch (ccom)
-					{
-						case 'P':
-						case 'R':
-						{
-							do_pclink(devno, ccom, caux1, caux2);
-							break;
-						}
-						case 'S':	/* status */
-						{	
-							sio_send_status(devno, cunit);
-# if 0
-# if B19200==19200
-							tcgetattr(serial_fd, &rcom);
-							printf("I/O speed: %d/%d bits/sec.\n", rcom.c_ispeed, rcom.c_ospeed);
-# endif
-# endif
-							break;
-						}
-# ifdef ULTRA
-						case '?':	/* send hi-speed index */
-						{
-							wait_for_command_drop();
-							if (siospeed[turbo_ix].idx != 40)
-								sio_send_data_byte(devno, cunit, siospeed[turbo_ix].idx);
-							else
-								sio_ack(devno, cunit, 'N');
-							break;
-						}
-# endif
-						default:
-						{
-							sio_ack(devno, cunit, 'N');
-							break;
-						}
-					}
-				}
-			}
-
-			/* ordinary disk drive */
-			else if ((devno == 0x03) && (device[devno][cunit].fd > -1))
-			{
-				/* Execute commands */
-				switch (ccom)
-				{
-					/* standard commands */
-					case 'R':	/* read sector */
-					case 'V':
-					{
-						send_sector(devno, cunit, ccom, sec);
-						break;
-					}
-					case 'P':	/* put sector */
-					case 'W':	/* write sector */
-					{
-# ifdef SIOTRACE
-						static uchar l_cunit = 0;
-						static long l_sec = 0;
-	
-						if (cunit == l_cunit)
-						{
-							if (l_sec == sec)
-								printf("SIO warning: dup write, sector $%04lx\n", sec);
-						}
-# endif						
-						receive_sector(devno, cunit, sec);
-# ifdef SIOTRACE
-						l_cunit = cunit;
-						l_sec = sec;
-# endif
-						break;
-					}
-					case 'S':	/* status */
-					{
-						if (toff == 0)
-							get_sdx_time(sdxtime);
-						device[devno][cunit].status.none = sdxtime[toff++];
-						wait_for_command_drop();
-						sio_send_status(devno, cunit);
-						if (toff > 6) toff = 0;
-# if 0
-# if B19200==19200
-						tcgetattr(serial_fd, &rcom);
-						printf("I/O speed: %d/%d bits/sec.\n", rcom.c_ispeed, rcom.c_ospeed);
-# endif
-# endif
-						break;
-					}
-					case 'N':	/* read percom */
-					{
-						if (block_percom == 0)
-							send_percom(cunit);
-						else
-							sio_ack(devno, cunit, 'N');
-						break;
-					}
-					case 'O':	/* write percom */
-					{
-						if (block_percom == 0)
-							receive_percom(cunit);
-						else
-							sio_ack(devno, cunit, 'N');
-						break;
-					}
-# ifdef ULTRA
-					case '?':	/* send hi-speed index */
-					{
-						wait_for_command_drop();
-						if (siospeed[turbo_ix].idx != 40)
-							sio_send_data_byte(devno, cunit, siospeed[turbo_ix].idx);
-						else
-							sio_ack(devno, cunit, 'N');
-						break;
-					}
-# endif
-					case '"':	/* format 1050 */
-					{
-						if (device[devno][cunit].percom.trk == 1)
-						{
-							sio_ack(devno, cunit, 'N');
-							continue;
-						}
-						setup_percom(cunit, percom_ed);
-						/* fall through */
-					}
-					case '!':	/* format */
-					{
-						ushort spt = device[devno][cunit].percom.spt_hi * 256 + device[devno][cunit].percom.spt_lo;
-						ushort bps = device[devno][cunit].percom.bps_hi * 256 + device[devno][cunit].percom.bps_lo;
-						ushort trk = device[devno][cunit].percom.trk;
-
-						if ((ccom == '!') && block_percom && (spt == 26) && (trk == 40) && (bps == 128) && \
-							(device[devno][cunit].percom.flags & 0x04))
-						{
-							drive_setup(cunit, 720*128, 128);
-
-							setup_status(cunit);
-
-							report_percom(cunit);
-						}
-
-						format_atr(cunit, 0);
-						break;
-					}
-					default:
-					{
-						sio_ack(devno, cunit, 'N');
-						break;
-					}
-				}
-			}
-# if 1
-			else if ((devno == 0x02) && (cunit == 1))
-			{
-				uchar devbuf[512];
+			sc.cdev = cdev;
+			sc.ccom = ccom;
+			sc.caux1 = caux1;
+			sc.caux2 = caux2;
+			sc.devno = cid >> 4;
+			sc.cunit = cunit;
+			sc.sec = sec;
+			sc.com = &com;
 
-				switch (ccom)
-				{
-					case 'S':
-					{
-						sio_send_status(devno, 0);
-						break;
-					}
+			metrics_command(dev_dispatch(&sc), ccom, cmd_start);
 # ifdef ULTRA
-					case '?':	/* send hi-speed index */
-					{
-						sio_send_data_byte(devno, cunit, siospeed[turbo_ix].idx);
-						break;
-					}
-# endif
-					case 'n':	/* devinfo */
-					{
-						bzero(devbuf, sizeof(devbuf));
-
-						sio_ack(devno, d, 'A');
-
-						devbuf[2] = cunit;
-						devbuf[7] = sizeof(devbuf) / 256;	/* sector size */
-						devbuf[8] = 0xff;
-						devbuf[9] = 0xff;			/* sector count */
-
-						sprintf((char *)devbuf+16, "SIO2BSD unit %d", (int)cunit);
-
-						cksum = calc_checksum(devbuf, sizeof(devbuf));
-
-						sio_ack(devno, d, 'C');
-						com_write(devbuf, sizeof(devbuf));
-						com_write(&cksum, sizeof(cksum));
-
-						break;
-					}
-					case 'R':	/* bogus read */
-					{
-						bzero(devbuf, sizeof(devbuf));
-
-						sio_ack(devno, d, 'A');
-
-						cksum = calc_checksum(devbuf, sizeof(devbuf));
-
-						sio_ack(devno, d, 'C');
-						com_write(devbuf, sizeof(devbuf));
-						com_write(&cksum, sizeof(cksum));
-
-						break;
-					}
-					default:
-					{
-						sio_ack(devno, cunit, 'N');
-						break;
-					}
-				}
-			}
-# endif
-			/* Printer port */
-			else if ((printer_fd > -1) && (cdev == 0x40))
-			{
-				switch (ccom)
-				{
-					case 'S':
-					{
-						sio_send_status(devno, 0);
-# if 0
-# if B19200==19200
-						tcgetattr(serial_fd, &rcom);
-						printf("I/O speed: %d/%d bits/sec.\n", rcom.c_ispeed, rcom.c_ospeed);
-# endif
-# endif
-						break;
-					}
-					case 'W':
-					{
-						switch (sec & 0x00ff)
-						{
-							case 0x44:
-							{
-								device[devno][0].bps = 0x14;
-								break;
-							}
-							case 0x53:
-							{
-								device[devno][0].bps = 0x1d;
-								break;
-							}
-							default:
-							{
-								device[devno][0].bps = 0x28;
-								break;
-							}
-						}
-
-						receive_sector(devno, cunit, 0);
-
-						for (i = 0; i < device[devno][0].bps; i++)
-						{
-							if (inpbuf[i] == 0x9b)		/* EOL */
-							{
-								if (ascii_translation)
-									inpbuf[i] = '\n';
-								i++;
-								break;
-							}
-							if (ascii_translation)
-							{
-								if (inpbuf[i] == 0x1c)
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0x1d)
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0x1e)
-									inpbuf[i] = '\b';
-								else if (inpbuf[i] == 0x1f)
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0x7d)	/* clear screen */
-									inpbuf[i] = '\f';
-								else if (inpbuf[i] == 0x7e)	/* backspace */
-									inpbuf[i] = '\b';
-								else if (inpbuf[i] == 0x7f)	/* tabulate */
-									inpbuf[i] = '\t';
-								else if (inpbuf[i] == 0x9c)	/* delete line */
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0x9d)	/* insert line */
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0x9e)	/* clear tab */
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0x9f)	/* set tab */
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0xfd)	/* bell */
-									inpbuf[i] = '\a';
-								else if (inpbuf[i] == 0xfe)	/* delete char */
-									inpbuf[i] = '.';
-								else if (inpbuf[i] == 0xff)	/* insert char */
-									inpbuf[i] = '.';
-							}
-						}
-						if (write(printer_fd, inpbuf, i) != (long)i)
-							sio_ack(devno, cunit, 'E');
-						else
-							sio_ack(devno, cunit, 'C');
-
-						break;
-					}
-					default:
-					{
-						sio_ack(devno, cunit, 'N');
-						break;
-					}
-				}
-			}
-
-			/* APE time protocol */
-			else if (cdev == 0x45)
-			{
-				switch (ccom)
-				{
-					case 0x93:
-					{
-						if (sec == 0x000a0eeUL)
-						{
-							sio_ack(devno, cunit, 'A');
-							get_sdx_time(sdxtime);
-							sdxtime[7] = calc_checksum(sdxtime+1, 6);
-							sio_ack(devno, cunit, 'C');
-							com_write(sdxtime+1, 7);
-# ifdef SIOTRACE
-							if (log_flag)
-								printf("<- APE TIME\n");
+			cal_step(&com);
 # endif
-							break;
-						}
-						/* else fall through */
-					}
-					default:
-					{
-						sio_ack(devno, cunit, 'N');
-						break;
-					}
-				}
-			}
 		}
 	}
 	else
@@ -4840,11 +12802,7 @@ retry:
 
 go_exit:
 
-	sig(0);		/* never returns */
-
-# ifndef __GNUC__
-	return 0;
-# endif
+	port_exit();	/* never returns */
 }
 
 /* EOF */
@@ -36,6 +36,28 @@
 
 # define SERLOCK "sio2bsd.lock"
 
+/* getopt() takes these, and the port splitter goes by them too */
+# ifdef ULTRA
+#  define OPTSTR "b:i:q:c:d:p:j:s:f:e:w:M:S:K:r:a:C:F:L:J:g:ktmluxoDH?8"
+# else
+#  define OPTSTR "d:p:j:s:f:e:w:M:S:r:a:C:F:L:J:g:tmluxoDH?8"
+# endif
+
+/* Binary SIO trace file: a 16-byte header (magic, version, 3 bytes
+ * reserved, capture start time in seconds since the Epoch, LE), then
+ * records: type byte, varint ns since the previous record, varint
+ * payload length, payload. Varints are LEB128.
+ */
+# define TRACE_MAGIC	"SIO2BSDT"
+# define TRACE_VERSION	1
+# define TRACE_HDRSIZE	16
+# define TRACE_BUF	262144	/* records kept before a write() */
+
+# define TRACE_IN	0x01	/* bytes Atari -> PC */
+# define TRACE_OUT	0x02	/* bytes PC -> Atari */
+# define TRACE_LINE	0x03	/* TIOCMGET state, 4 bytes LE */
+# define TRACE_SPEED	0x04	/* bitrate 4 bytes LE, HS index 2 bytes LE */
+
 # ifndef uchar
 #  define uchar unsigned char
 # endif
@@ -104,25 +126,392 @@ typedef	struct			/* PCLink parameter buffer */
 	uchar path[65];		/* path */
 } PARBUF;
 
+# define PCL_COMPLETE	0	/* PCLink function results: send the status */
+# define PCL_DONE	1	/* the function has answered already */
+# define PCL_ABORT	2	/* drop the command, the Atari will retry */
+
+typedef struct			/* a PCLink function call */
+{
+	uchar devno;
+	uchar ccom;
+	ushort cunit;
+	uchar fno;
+	uchar handle;
+	ulong faux;
+} PCLCMD;
+
+typedef int (*PCLFN)(PCLCMD *);
+
+typedef struct			/* a decoded SIO command frame */
+{
+	uchar cdev;
+	uchar ccom;
+	uchar caux1;
+	uchar caux2;
+	uchar devno;		/* cdev >> 4, the class may change it */
+	uchar cunit;		/* cdev & 0x0f, likewise */
+	ulong sec;		/* caux1 | caux2 << 8 */
+	struct termios *com;	/* the line, for the classes which change its speed */
+} SIOCMD;
+
+typedef struct			/* a device class on the bus */
+{
+	const char *name;
+	int mclass;		/* metrics class, MC_* */
+	int (*accept)(SIOCMD *);	/* 0: not ours, stay silent */
+	void (*cmd[256])(SIOCMD *);	/* handlers by command, NULL: NAK */
+} DEVCLASS;
+
+# define MAX_IMAGES	256	/* distinct image files open in the process */
+# define IMAGE_IDLE	16	/* unmounted images kept open, warm for a remount */
+# define HOLE_BLOCK	4096	/* the unit of the hole map */
+# define DELTA_MAGIC	"SIODELTA"
+# define DELTA_HDRSIZE	32	/* then the sectors: number (4 bytes LE), data */
+# define ATR_DIGEST	7	/* where the digest goes in the ATR header */
+
+# define JNL_HDRSIZE	24	/* a journal record header */
+# define JNL_GROUP_MAX	64	/* sectors one commit may take */
+# define JNL_MAX	1048576	/* journal bytes before the image is synced */
+# define CHUNK_SIZE	128	/* the unit of the shared sector store */
+# define CHUNK_HASH	65536	/* its hash buckets, a power of 2 */
+
+# define GZ_SPAN	131072	/* inflated bytes between access points, about */
+# define GZ_WIN		32768	/* the deflate window */
+# define GZ_CACHE	8	/* spans kept inflated, per image */
+
+typedef struct			/* an access point into a gzip stream */
+{
+	off_t out;		/* offset in the inflated data */
+	off_t in;		/* offset of the first whole byte in the file */
+	int bits;		/* bits of the byte before in which belong here */
+	uchar *window;		/* the GZ_WIN bytes of data before out */
+} GZPOINT;
+
+typedef struct			/* the seek index of a compressed image */
+{
+	off_t size;		/* inflated */
+	ulong npts;
+	GZPOINT *pts;
+	uchar *span[GZ_CACHE];	/* the recently inflated spans */
+	ulong spix[GZ_CACHE];	/* the point each one starts at */
+	ulong sused[GZ_CACHE];	/* the clock at its latest use, 0 if free */
+	ulong clock;
+	pthread_mutex_t lock;	/* the readers share the image */
+} GZINDEX;
+
+# define ATX_TRACKS	40
+# define ATX_SPT	26	/* sectors per track at most, in ED */
+# define ATX_REV	26042	/* angular units (8 us) in a turn at 288 rpm */
+# define ATX_STRONG	0xffff	/* no weak bits in the sector */
+
+typedef struct			/* a sector header found on an ATX track */
+{
+	uchar track;
+	uchar num;		/* the sector number in the header */
+	uchar fdc;		/* the FDC status reading it gives */
+	ushort pos;		/* angular position from the index hole */
+	ushort len;		/* bytes of data, more in a long sector */
+	ushort weak;		/* the first weak byte, or ATX_STRONG */
+	ulong data;		/* offset in the file, 0 if there is none */
+	long next;		/* the next copy with the same number, or -1 */
+} ATXSECTOR;
+
+typedef struct			/* an ATX image, indexed at mount */
+{
+	uchar *file;		/* the whole file */
+	ulong size;
+	ATXSECTOR *sec;		/* the sector headers of all tracks */
+	ulong nsec;
+	long first[ATX_TRACKS * ATX_SPT];	/* [track * spt + num - 1] */
+	ushort spt;
+	ushort bps;
+	ushort byte_us;		/* the time a byte takes under the head */
+	uchar track;		/* where the head is */
+	uint64_t spin;		/* mono_ns() at an index pulse */
+	unsigned int seed;	/* for the weak bits */
+} ATXDISK;
+
+typedef struct chunk		/* a piece of image data in the shared store (-D) */
+{
+	struct chunk *next;	/* in its hash bucket */
+	uint64_t hash;
+	ulong refs;		/* places in the cached images holding it */
+	uchar data[CHUNK_SIZE];
+} CHUNK;
+
+typedef struct			/* a write journaled, not in the image yet */
+{
+	off_t off;
+	ulong len;
+	uchar *data;
+} JNLPEND;
+
+typedef struct			/* an image file, shared by the drives mounting it */
+{
+	dev_t dev;		/* the key */
+	ino_t ino;
+	int fd;
+	int refs;		/* drives mounting it, 0 if the slot is free */
+	int idle;		/* refs 0, but kept open for the next mount */
+	struct timespec mtime;	/* the file as it was left idle, to tell if it changed */
+	off_t fsize;
+	off_t size;
+	uchar *data;		/* the whole file, NULL while not cached */
+	CHUNK **map;		/* or, with -D, its chunks after the head */
+	ulong nchunk;
+	ulong base;		/* bytes before the first chunk: the header */
+	uchar head[CHUNK_SIZE];
+	ulong held;		/* bytes of data counted in the budget */
+	ulong used;		/* the registry clock at the latest access */
+	uchar *holes;		/* a bit per HOLE_BLOCK of the file in a hole */
+	ulong nblk;		/* blocks in the map */
+	GZINDEX *gz;		/* if the file is compressed */
+	int writer;		/* a drive writes it back: the only one which may */
+	char *jpath;		/* the write journal (-J), if any */
+	int jfd;
+	JNLPEND *jpend;		/* the writes waiting for the commit */
+	ulong npend;
+	ulong jbytes;		/* in the journal since the image was synced */
+	ulong jseq;
+	pthread_rwlock_t lock;	/* readers share it, a writer holds it alone */
+} IMAGE;
+
+typedef struct			/* an image found by the catalogue scan (-L) */
+{
+	char *path;
+	ulong sectors;		/* the geometry, as the header tells */
+	ushort bps;
+	char fmt;		/* A ATR, Z gzip, X ATX, P PRO, D DCM, F XFD, E XEX */
+} CATENTRY;
+
+typedef struct			/* the sectors a drive wrote in overlay mode */
+{
+	ulong gen;		/* the generation, a reset starts a new one */
+	ulong epoch;		/* the SIGUSR1 count gen was checked against */
+	ulong fmt;		/* the generation the disk was formatted in */
+	ulong nsec;		/* entries in sgen and data */
+	ulong *sgen;		/* the generation each sector was written in */
+	uchar **data;		/* the sectors, allocated on their first write */
+	ulong held;		/* sectors written in this generation */
+	ulong size;		/* the image's geometry, which a format keeps */
+	ulong maxsec;
+	ushort bps;
+	int full13;
+	int keep;		/* SIGUSR1 leaves it, it holds real changes */
+} OVERLAY;
+
 typedef struct
 {
 	ATR atr;		/* ATR file header */
 	int fd;			/* ATR file handle */
+	IMAGE *img;		/* and its registry entry, if any */
+	OVERLAY *ovl;		/* the written sectors, with -o or a compressed image */
+	ATXDISK *atx;		/* a copy-protected original, read by timing */
 	PERCOM percom;		/* the PERCOM data for the disk */
 	STATUS status;		/* the 4-byte status block */
 	ulong maxsec;		/* max. sector number */
 	ushort bps;		/* number of bytes per sector */
 	int full13;		/* if 1, the image has full-size bootsectors */
 	int full13force;	/* if 1, the dd image will be full13 after reformat */
+	int wp;			/* write protected */
+	int raw;		/* XFD: no header, the sectors start at 0 */
+	int conv;		/* DCM, converted at mount: the changes go to fname.atr */
+	int writer;		/* holds the compressed image's writer slot */
+	uchar *ram;		/* a RAM disk: the ATR image, in memory only */
+	ulong ramsize;
+	int ramchg;		/* written since it was saved */
+	int persist;		/* saved to the file in dirname when unmounted */
+	uchar *dirty;		/* a bit per sector written since the last delta */
+	ulong dmax;		/* the last sector in it */
+	ulong ndirty;
+	uint32_t *shash;	/* with -H, the hash of every sector */
+	ulong hmax;
+	uint32_t digest;	/* their sum, kept in the ATR header */
+	int digchg;		/* changed since it was put in the header */
+	ulong reads;		/* sectors served, for the control socket */
+	ulong writes;
+	ulong errors;
 	
 	int on;			/* PCLink mount flag */
-	char dirname[1024];	/* PCLink root directory path */
+	char dirname[1024];	/* PCLink root directory path, or the image file */
 	uchar cwd[65];		/* PCLink current working dir, relative to the above */
 	PARBUF parbuf;		/* PCLink parameter buffer */
 } DEVICE;
 
+# define DP_USD		0	/* drive profiles: US Doubler, the default */
+# define DP_1050	1	/* stock 1050: no PERCOM, no high speed */
+# define DP_XF551	2	/* XF551: high speed commands with bit 7 set */
+# define DP_HAPPY	3	/* all of the fast paths */
+# define DP_MAX		4
+
+# define BURST_MAX	32	/* sectors in one burst read */
+# define XEX_BOOT	512	/* boot sectors of an executable's disk */
+
+# define MC_OTHER	0	/* metrics device classes */
+# define MC_DISK	1
+# define MC_PRINTER	2
+# define MC_PCLINK	3
+# define MC_APETIME	4
+# define MC_DEVINFO	5
+# define MC_CATALOGUE	6
+# define MC_MAX		7
+
+# define CK_SECTOR	0	/* metrics checksum error sources */
+# define CK_PERCOM	1
+# define CK_PARBLK	2
+# define CK_FWRITE	3
+# define CK_MAX		4
+
+# define DS_CHECKSUM	0	/* metrics desync reasons */
+# define DS_COMMAND	1
+# define DS_DEVICE	2
+# define DS_LINE	3	/* framing errors or BREAK: speed mismatch */
+# define DS_MAX		4
+
+# define LAT_SAMPLES	4096	/* latency samples kept for the quantiles */
+
+typedef struct			/* per-port counters for the metrics socket */
+{
+	ulong cmds[MC_MAX][256];	/* commands served by class and command */
+	ulong bytes_in;
+	ulong bytes_out;
+	ulong cksum_err[CK_MAX];
+	ulong desync[DS_MAX];
+	ulong turbo_toggles;
+	int turbo;			/* 1 while at turbo speed */
+	ushort line_idx;		/* HS index the port is set to */
+	ulong line_ferr[256];		/* framing/parity errors by HS index */
+	ulong line_break[256];		/* BREAKs by HS index */
+	ulong handles;			/* open PCLink handles */
+	ulong io_timeouts;		/* storage requests given up on */
+	ulong lat_count;		/* commands timed so far */
+	double lat_sum;			/* their total time in seconds */
+	float lat[LAT_SAMPLES];		/* ring of the latest latencies */
+} METRICS;
+
+typedef struct			/* the bulk of a port's state, on the heap */
+{
+	DEVICE device[8][16];	/* 8 devices, 16 units each */
+	METRICS metrics;
+} PORTMEM;
+
+# define IO_SLOTS	16	/* storage requests in flight per port */
+
+# define IO_PREAD	1	/* pread() into buf */
+# define IO_PWRITE	2	/* pwrite() from buf */
+# define IO_FORMAT	3	/* truncate, write the header in buf, a hole up to off */
+# define IO_FREAD	4	/* fseek() and fread() on fp */
+# define IO_FWRITE	5	/* fseek() and fwrite() on fp */
+# define IO_RENAME	6	/* rename(path, path2) */
+
+# define IO_PENDING	0
+# define IO_DONE	1
+# define IO_ABANDONED	2	/* timed out, the worker frees it */
+
+typedef struct			/* one request for the storage worker */
+{
+	int op;
+	int fd;
+	IMAGE *img;		/* if set, I/O goes through the image cache */
+	FILE *fp;
+	off_t off;
+	ulong len;
+	uchar *buf;		/* data, or heap memory for larger blocks */
+	uchar data[1024];
+	char path[1024];
+	char path2[1024];
+	long r;			/* the result, as the call returned it */
+	int err;		/* and errno */
+	int eof;		/* feof() after IO_FREAD */
+	int zero;		/* IO_PREAD was served from a hole */
+	int state;		/* IO_PENDING, IO_DONE, IO_ABANDONED */
+} IOREQ;
+
+typedef struct			/* the ring between a port and its worker */
+{
+	IOREQ req[IO_SLOTS];
+	ulong head;		/* requests posted, written by the port thread */
+	ulong done;		/* requests finished, written by the worker */
+	int bell[2];		/* wakes the worker */
+	int ack[2];		/* wakes the port thread */
+	pthread_t tid;
+} IOQUEUE;
+
+# define SPOOL_SIZE	65536	/* printer data waiting for the writer thread */
+
+typedef struct			/* the printer spooler of a port */
+{
+	uchar buf[SPOOL_SIZE];
+	ulong head;		/* bytes queued */
+	ulong tail;		/* and written out */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* data queued, or room made */
+	time_t last;		/* when the latest record came */
+	int fd;			/* the job's file or pipe, -1 between jobs */
+	FILE *pipe;		/* if the printer is a command */
+	ulong job;		/* jobs started */
+	long idle;		/* seconds of silence which end a job, 0: never */
+	char target[1024];	/* file name, or |command */
+	pthread_t tid;
+} SPOOL;
+
+# define MAX_PORTS	16	/* serial ports served by one process */
+# define CTL_MAX	4096	/* control request or reply */
+# define QUIT_WAIT_S	10	/* how long the ports may take to end at exit */
+
+typedef struct			/* one serial port and its options */
+{
+	char serial[128];	/* the device, also the metrics label */
+	char printer[1024];
+	char trace[1024];
+	char lock[1024];	/* the lock file, if created */
+	int argc;		/* the command line part with its drives */
+	char **argv;
+	int ascii_translation;
+	ushort turbo_ix;
+	ushort hs_ix;
+	int calibrate;
+	int speed_given;
+	int rt_prio;
+	int rt_cpu;
+
+	int ctl[2];		/* wakes the port thread: a control request, SIGUSR2 */
+	pthread_mutex_t ctl_lock;
+	pthread_cond_t ctl_cond;
+	ulong ctl_seq;		/* control requests posted */
+	ulong ctl_done;		/* and answered by the port thread */
+	int gone;		/* the port has ended, after an error */
+	char ctl_cmd[CTL_MAX];
+	char ctl_reply[CTL_MAX];
+
+	pthread_t tid;
+	PORTMEM *mem;		/* allocated by the port thread */
+	METRICS *metrics;	/* the port thread's own state, for the */
+	int *serial_fd;		/* metrics thread and for sig() */
+	struct termios *dflt;
+	SPOOL *spool;
+} PORT;
+
+typedef struct			/* one decoded trace record */
+{
+	uchar type;		/* TRACE_IN, TRACE_OUT, ... */
+	uint64_t t;		/* ns since the capture start */
+	ulong len;		/* payload length */
+	const uchar *data;	/* payload, points into the loaded file */
+} TRACEREC;
+
 # ifdef __GNUC__
 static void sig (int) __attribute__ ((__noreturn__));
+static void port_main (PORT *) __attribute__ ((__noreturn__));
+static void port_exit (void) __attribute__ ((__noreturn__));
+static void mprintf (const char *, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
+# else
+static void port_main (PORT *);
+static void port_exit (void);
 # endif
 
+static int port_mem (PORT *);
+
+static void ctl_wait (int);
+
 /* EOF */